@@ -1,28 +1,49 @@
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// With PS1_GENERATED_TABLE, the table is filled when building, by table_generator.c.
+// It then defines TABLE_GENERATED, and the table is constant data that needs no setup
+#ifdef PS1_GENERATED_TABLE
+#include "table_generated.h"
+#else
 #include "table.c"
+#include "fast_table.c"
+#endif
 
 static_assert(START >= 0 && START < NSTATES, "START must be a valid state");
 static_assert(ACCEPT >= 0 && ACCEPT < NSTATES, "ACCEPT must be a valid state");
 static_assert(ERROR >= 0 && ERROR < NSTATES, "ERROR must be a valid state");
 
-// This program takes in lines from stdin and validates them line by line.
-// If a line is valid, it is ignored.
-// Otherwise, it is printed in full,
-// followed by a line indicating at which character the error occurs.
-int main() {
+// Prints the first length characters of the line, which include its newline if it has one,
+// followed by a line pointing at the character where the error occurs
+static void printError(FILE* out, size_t lineNum, const char* line, size_t length, size_t pos) {
+    fprintf(out, "line %4zu: error: %.*s", lineNum, (int)length, line);
+    fprintf(out, "~~~~~~~~~~~~~~~~~~");
+    for(size_t i = 0; i < pos; i++)
+        putc('~', out);
+    fprintf(out, "^\n");
+}
 
-    // Fill the table first. This function does no input processing only table creation.
-    fillTable();
-    printf("Table filled!\n");
+#ifndef TABLE_GENERATED
+// The original driver, reading one line at a time with fgets, and following the table directly.
+// Used when the table can not be compressed, such as when it leads to invalid states
+static int validateLinesSlow() {
 
     // Lines may not be more than 512 lines long
     char line[512];
-    int lineNum = 0;
+    size_t lineNum = 0;
 
     // For each line in input
     while (fgets(line, sizeof(line), stdin)) {
@@ -51,7 +72,7 @@ int main() {
             else if (state == ACCEPT) {
                 // Make sure statement is accepted at new line
                 if (c == '\n') {
-                    printf("line %4d: accepted: %.*s\n", lineNum, pos, line);
+                    printf("line %4zu: accepted: %.*s\n", lineNum, pos, line);
 
                     // Break inner loop
                     break;
@@ -68,11 +89,7 @@ int main() {
             // Provide the position we were at in the string when the DFS reached the ERROR state,
             // or when a fatal error occured. The latter can only happen if the DFS is broken.
             if (state == ERROR || fatalError) {
-                printf("line %4d: error: %s", lineNum, line);
-                printf("~~~~~~~~~~~~~~~~~~");
-                for(int i = 0; i < pos; i++)
-                    putc('~', stdout);
-                printf("^\n");
+                printError(stdout, lineNum, line, strlen(line), pos);
                 break;
             }
 
@@ -87,3 +104,383 @@ int main() {
 
     return 0;
 }
+#endif
+
+// ================================ Fast path ================================
+// The DFA follows the compressed table built in fast_table.c, or the generated table.
+// Input is read in large blocks, and lines can be of any length.
+// Newlines, and runs of characters that keep the DFA in the same state, are found 16 bytes at a
+// time using SSE2. This skips spaces in START and the text of comments in one go
+
+// Prints an accepted line like printf("line %4zu: accepted: %.*s\n") does.
+// Accepted lines make up most of the output, and formatting them by hand is a lot faster
+static void printAccepted(FILE* out, size_t lineNum, const char* line, size_t length) {
+    char number[24];
+    int digits = 0;
+    do {
+        number[sizeof(number) - 1 - digits++] = '0' + lineNum % 10;
+        lineNum /= 10;
+    } while (lineNum != 0);
+    while (digits < 4)
+        number[sizeof(number) - 1 - digits++] = ' ';
+
+    fwrite("line ", 1, 5, out);
+    fwrite(&number[sizeof(number) - digits], 1, digits, out);
+    fwrite(": accepted: ", 1, 12, out);
+    fwrite(line, 1, length, out);
+    putc('\n', out);
+}
+
+static int nextState(int state, unsigned char c) {
+#ifdef TABLE_GENERATED
+    return table[state][c];
+#else
+    return fastTable[state * numClasses + byteClass[c]];
+#endif
+}
+
+// Returns the position of the first of the bytes in text[pos..end), or end if there is none
+static size_t findAnyOf(const char* text, size_t pos, size_t end, const unsigned char* bytes, int n) {
+#ifdef __SSE2__
+    while (end - pos >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)&text[pos]);
+        __m128i found = _mm_setzero_si128();
+        for (int i = 0; i < n; i++)
+            found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(bytes[i])));
+        unsigned mask = _mm_movemask_epi8(found);
+        if (mask != 0)
+            return pos + __builtin_ctz(mask);
+        pos += 16;
+    }
+#endif
+    for (; pos < end; pos++)
+        for (int i = 0; i < n; i++)
+            if ((unsigned char)text[pos] == bytes[i])
+                return pos;
+    return end;
+}
+
+// Returns the position of the first byte in text[pos..end) that is not b, or end if there is none
+static size_t skipWhile(const char* text, size_t pos, size_t end, unsigned char b) {
+#ifdef __SSE2__
+    __m128i repeated = _mm_set1_epi8(b);
+    while (end - pos >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)&text[pos]);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, repeated));
+        if (mask != 0xffff)
+            return pos + __builtin_ctz(~mask);
+        pos += 16;
+    }
+#endif
+    while (pos < end && (unsigned char)text[pos] == b)
+        pos++;
+    return pos;
+}
+
+// Validates the line in text[0..length], printing the result to out.
+// text[length] is its newline, or '\0' for a last line without one. Returns false on fatal errors
+static bool validateLine(FILE* out, const char* line, size_t length, size_t lineNum) {
+    int state = START;
+    size_t pos = 0;
+    while (true) {
+        unsigned char c = line[pos];
+
+        // If the line ended without a newline, patch it in
+        if (c == '\0')
+            c = '\n';
+
+        state = nextState(state, c);
+
+        bool fatalError = false;
+        if (state == ACCEPT) {
+            // Make sure statement is accepted at new line
+            if (c == '\n') {
+                printAccepted(out, lineNum, line, pos);
+                return true;
+            }
+
+            fprintf(out, "fatal error: ACCEPT state reached before end of line:\n");
+            fatalError = true;
+        }
+        else if (c == '\n' && state != ERROR) {
+            fprintf(out, "fatal error: Line ended without reaching either ACCEPT or ERROR state: %d\n", state);
+            fatalError = true;
+        }
+
+        if (state == ERROR || fatalError) {
+            // The line is printed up to its first '\0', like the slow path does
+            printError(out, lineNum, line, strnlen(line, length + 1), pos);
+            return !fatalError;
+        }
+
+        pos++;
+
+        // Skip the characters that keep us in the same state. None of them end the line
+        if (numExitBytes[state] > 0)
+            pos = findAnyOf(line, pos, length, exitBytes[state], numExitBytes[state]);
+        else if (loopByte[state] >= 0 && (unsigned char)line[pos] == loopByte[state])
+            pos = skipWhile(line, pos, length, loopByte[state]);
+    }
+}
+
+#define BLOCK_SIZE (1 << 16)
+
+static int validateLinesFast() {
+    // The unprocessed input is text[start..length). A byte is always kept free at the end,
+    // for the '\0' patched in after the last line
+    size_t capacity = BLOCK_SIZE;
+    char* text = malloc(capacity);
+    size_t start = 0;
+    size_t length = 0;
+    bool endOfInput = false;
+    size_t lineNum = 0;
+    int result = 0;
+    const unsigned char newline = '\n';
+
+    while (result == 0) {
+        size_t end = findAnyOf(text, start, length, &newline, 1);
+        if (end == length) {
+            if (endOfInput) {
+                // The last line has no newline, so it ends with a '\0' instead
+                if (start < length) {
+                    text[length] = '\0';
+                    if (!validateLine(stdout, &text[start], length - start, ++lineNum))
+                        result = 1;
+                }
+                break;
+            }
+
+            // Move the unfinished line to the front, and read another block after it
+            memmove(text, &text[start], length - start);
+            length -= start;
+            start = 0;
+            if (capacity - length - 1 < BLOCK_SIZE / 2) {
+                capacity *= 2;
+                text = realloc(text, capacity);
+            }
+            size_t read = fread(&text[length], 1, capacity - length - 1, stdin);
+            length += read;
+            endOfInput = read == 0;
+            continue;
+        }
+
+        if (!validateLine(stdout, &text[start], end - start, ++lineNum))
+            result = 1; // Fatal errors means there is something wrong with the DFS table
+        start = end + 1;
+    }
+
+    free(text);
+    return result;
+}
+
+// ============================== Threaded mode ===============================
+// Enabled with -j <threads>, when stdin is a regular file. The file is mapped into memory, and split
+// into chunks ending at newlines. Since every line starts in START, the chunks are validated on
+// separate threads, each printing to a buffer of its own. The main thread writes the buffers in
+// order, so the output is the same as from the serial run.
+//
+// The first line number of a chunk is known once the newlines of all earlier chunks are counted.
+// Each thread counts the newlines in its chunk before validating it, and waits for the ones before.
+// At most a few chunks per thread are ahead of the one being written, which bounds the memory
+// used for output when the input is larger than memory
+
+#define CHUNK_SIZE (1 << 22)
+#define CHUNKS_PER_THREAD 4
+
+typedef struct {
+    const char* begin;
+    const char* end;
+    size_t lines;     // Newlines in the chunk, when counted
+    bool counted;
+    size_t firstLine; // The number of the first line, once the chunks before it are counted
+    char* output;     // What was printed while validating the chunk, when done
+    size_t outputSize;
+    bool fatalError;
+    bool done;
+} Chunk;
+
+static Chunk* chunks;
+static size_t numChunks;
+static size_t nextChunk;      // The next chunk to be taken by a thread
+static size_t numNumbered;    // Chunks with a known firstLine
+static size_t numWritten;     // Chunks written to stdout by the main thread
+static size_t maxAhead;       // How far ahead of numWritten threads may take chunks
+static bool stopping;         // Set after a fatal error, when the remaining chunks are skipped
+static pthread_mutex_t chunkLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t chunkChanged = PTHREAD_COND_INITIALIZER;
+
+static size_t countLines(const char* begin, const char* end) {
+    size_t lines = 0;
+    while ((begin = memchr(begin, '\n', end - begin)) != NULL) {
+        lines++;
+        begin++;
+    }
+    return lines;
+}
+
+// Validates the lines of the chunk, printing to the chunk's output buffer
+static void validateChunk(Chunk* chunk) {
+    FILE* out = open_memstream(&chunk->output, &chunk->outputSize);
+    size_t lineNum = chunk->firstLine;
+    const char* start = chunk->begin;
+    const unsigned char newline = '\n';
+    while (start < chunk->end && !chunk->fatalError) {
+        size_t length = findAnyOf(start, 0, chunk->end - start, &newline, 1);
+        if (&start[length] == chunk->end) {
+            // The last line of the input has no newline. It is copied to end it with a '\0'
+            char* line = malloc(length + 1);
+            memcpy(line, start, length);
+            line[length] = '\0';
+            chunk->fatalError = !validateLine(out, line, length, ++lineNum);
+            free(line);
+            break;
+        }
+        chunk->fatalError = !validateLine(out, start, length, ++lineNum);
+        start += length + 1;
+    }
+    fclose(out);
+}
+
+static void* validateChunks(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&chunkLock);
+    while (true) {
+        while (!stopping && nextChunk < numChunks && nextChunk >= numWritten + maxAhead)
+            pthread_cond_wait(&chunkChanged, &chunkLock);
+        if (stopping || nextChunk == numChunks)
+            break;
+        Chunk* chunk = &chunks[nextChunk++];
+        pthread_mutex_unlock(&chunkLock);
+
+        size_t lines = countLines(chunk->begin, chunk->end);
+
+        // Number the chunks after the last numbered one, for as long as they are counted
+        pthread_mutex_lock(&chunkLock);
+        chunk->lines = lines;
+        chunk->counted = true;
+        while (numNumbered < numChunks && chunks[numNumbered - 1].counted) {
+            Chunk* previous = &chunks[numNumbered - 1];
+            chunks[numNumbered++].firstLine = previous->firstLine + previous->lines;
+        }
+        pthread_cond_broadcast(&chunkChanged);
+        while (chunk >= &chunks[numNumbered])
+            pthread_cond_wait(&chunkChanged, &chunkLock);
+        pthread_mutex_unlock(&chunkLock);
+
+        validateChunk(chunk);
+
+        pthread_mutex_lock(&chunkLock);
+        chunk->done = true;
+        pthread_cond_broadcast(&chunkChanged);
+    }
+    pthread_mutex_unlock(&chunkLock);
+    return NULL;
+}
+
+// Validates a memory mapped file on the given number of threads.
+// Returns -1 if the file could not be mapped, so it can be read from the stream instead
+static int validateLinesThreaded(int fd, int numThreads) {
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+        return -1;
+    size_t size = info.st_size;
+    if (size == 0)
+        return 0;
+    const char* text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text == MAP_FAILED)
+        return -1;
+    madvise((void*)text, size, MADV_SEQUENTIAL);
+
+    // Split the file after the first newline following every CHUNK_SIZE bytes
+    chunks = malloc((size / CHUNK_SIZE + 1) * sizeof(Chunk));
+    numChunks = 0;
+    const char* begin = text;
+    const char* textEnd = text + size;
+    while (begin < textEnd) {
+        const char* end = begin + CHUNK_SIZE < textEnd ? begin + CHUNK_SIZE : textEnd;
+        const char* newline = memchr(end - 1, '\n', textEnd - (end - 1));
+        end = newline != NULL ? newline + 1 : textEnd;
+        chunks[numChunks++] = (Chunk){ .begin = begin, .end = end };
+        begin = end;
+    }
+
+    chunks[0].firstLine = 0;
+    numNumbered = 1;
+    nextChunk = 0;
+    numWritten = 0;
+    maxAhead = (size_t)numThreads * CHUNKS_PER_THREAD;
+    stopping = false;
+
+    pthread_t* threads = malloc(numThreads * sizeof(pthread_t));
+    for (int i = 0; i < numThreads; i++)
+        pthread_create(&threads[i], NULL, validateChunks, NULL);
+
+    // Write the chunks in order, until the first fatal error
+    int result = 0;
+    for (size_t i = 0; i < numChunks && result == 0; i++) {
+        pthread_mutex_lock(&chunkLock);
+        while (!chunks[i].done)
+            pthread_cond_wait(&chunkChanged, &chunkLock);
+        pthread_mutex_unlock(&chunkLock);
+
+        fwrite(chunks[i].output, 1, chunks[i].outputSize, stdout);
+        free(chunks[i].output);
+        if (chunks[i].fatalError)
+            result = 1; // Fatal errors means there is something wrong with the DFS table
+
+        pthread_mutex_lock(&chunkLock);
+        numWritten = i + 1;
+        stopping = result != 0;
+        pthread_cond_broadcast(&chunkChanged);
+        pthread_mutex_unlock(&chunkLock);
+    }
+
+    for (int i = 0; i < numThreads; i++)
+        pthread_join(threads[i], NULL);
+
+    // Chunks done after a fatal error are never written
+    for (size_t i = numWritten; i < numChunks; i++)
+        if (chunks[i].done)
+            free(chunks[i].output);
+
+    free(threads);
+    free(chunks);
+    munmap((void*)text, size);
+    return result;
+}
+
+// This program takes in lines from stdin and validates them line by line.
+// If a line is valid, it is ignored.
+// Otherwise, it is printed in full,
+// followed by a line indicating at which character the error occurs.
+//
+// With -j <threads>, lines are validated on several threads, if stdin is a regular file
+int main(int argc, char** argv) {
+    int numThreads = 1;
+    if (argc == 3 && strcmp(argv[1], "-j") == 0 && atoi(argv[2]) > 0)
+        numThreads = atoi(argv[2]);
+    else if (argc != 1) {
+        fprintf(stderr, "usage: %s [-j threads] < input\n", argv[0]);
+        return 1;
+    }
+
+#ifdef TABLE_GENERATED
+    // The table was filled when building
+    printf("Table filled!\n");
+#else
+    // Fill the table first. This function does no input processing only table creation.
+    fillTable();
+    printf("Table filled!\n");
+
+    if (!buildFastTable())
+        return validateLinesSlow();
+#endif
+
+    if (numThreads > 1) {
+        fflush(stdout);
+        int result = validateLinesThreaded(fileno(stdin), numThreads);
+        if (result >= 0)
+            return result;
+    }
+    return validateLinesFast();
+}
@@ -0,0 +1,82 @@
+// Compresses the table filled by table.c, for the fast path in driver.c.
+// Also used by table_generator.c, which stores the result in a header when building
+
+// The table is compressed into bytes, with one column per class of equivalent characters.
+// Two characters are equivalent when every state goes to the same state on both of them.
+// The classes and the compressed table together take a few hundred bytes, and fit in L1.
+
+static uint8_t byteClass[256];
+static int numClasses;
+static uint8_t fastTable[NSTATES * 256];
+
+// The characters that leave each state, or end the line. When a state has only a few of them,
+// all other characters can be skipped until one of them is found
+#define MAX_EXIT_BYTES 4
+static unsigned char exitBytes[NSTATES][MAX_EXIT_BYTES];
+static int numExitBytes[NSTATES]; // 0 if the state has too many exit bytes to skip runs
+
+// The character that keeps a state in the same state, when it is the only one.
+// Such runs are skipped while the character repeats, as with the spaces in START
+static int loopByte[NSTATES]; // -1 if the state has none, or more than one
+
+// Builds the compressed table. Returns false if the table has invalid states,
+// or too many states to be stored in bytes
+static bool buildFastTable() {
+    if (NSTATES > 256)
+        return false;
+    for (int s = 0; s < NSTATES; s++)
+        for (int c = 0; c < 256; c++)
+            if (table[s][c] < 0 || table[s][c] >= NSTATES)
+                return false;
+
+    // Give each character the class of the first earlier character with the same column
+    numClasses = 0;
+    int classRepresentative[256];
+    for (int c = 0; c < 256; c++) {
+        int cls = 0;
+        while (cls < numClasses) {
+            int other = classRepresentative[cls];
+            bool same = true;
+            for (int s = 0; s < NSTATES && same; s++)
+                same = table[s][c] == table[s][other];
+            if (same)
+                break;
+            cls++;
+        }
+        if (cls == numClasses)
+            classRepresentative[numClasses++] = c;
+        byteClass[c] = cls;
+    }
+
+    for (int s = 0; s < NSTATES; s++)
+        for (int cls = 0; cls < numClasses; cls++)
+            fastTable[s * numClasses + cls] = table[s][classRepresentative[cls]];
+
+    // Find the runs that can be skipped. The line ends at '\n', or at '\0' like in the slow path,
+    // so they always stop a run. ACCEPT and ERROR end the line, and are never skipped
+    for (int s = 0; s < NSTATES; s++) {
+        numExitBytes[s] = 0;
+        loopByte[s] = -1;
+        if (s == ACCEPT || s == ERROR)
+            continue;
+
+        int exits = 0;
+        int loops = 0;
+        for (int c = 0; c < 256; c++) {
+            if (table[s][c] != s || c == '\n' || c == '\0') {
+                if (exits < MAX_EXIT_BYTES)
+                    exitBytes[s][exits] = c;
+                exits++;
+            }
+            else {
+                loopByte[s] = c;
+                loops++;
+            }
+        }
+        if (exits <= MAX_EXIT_BYTES)
+            numExitBytes[s] = exits;
+        if (loops != 1)
+            loopByte[s] = -1;
+    }
+    return true;
+}
@@ -0,0 +1,76 @@
+// Fills and compresses the table when building, and writes it to a header as constant data.
+// driver.c includes the header when built with PS1_GENERATED_TABLE, which CMake does by default.
+// Run as: table_generator <header>
+//
+// If the table leads to invalid states, the header includes table.c instead,
+// so the driver fills the table when starting and reports the invalid states
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "table.c"
+#include "fast_table.c"
+
+// Writes an array with a row for each state
+static void writeBytes(FILE* out, const char* type, const char* name, const uint8_t* bytes, int columns) {
+    fprintf(out, "static const %s %s = {\n", type, name);
+    for (int s = 0; s < NSTATES; s++) {
+        fprintf(out, "    { // State %d", s);
+        for (int c = 0; c < columns; c++)
+            fprintf(out, "%s%d,", c % 16 == 0 ? "\n        " : " ", bytes[s * columns + c]);
+        fprintf(out, "\n    },\n");
+    }
+    fprintf(out, "};\n\n");
+}
+
+static void writeInts(FILE* out, const char* name, const int* values, int n) {
+    fprintf(out, "static const int %s[NSTATES] = {", name);
+    for (int i = 0; i < n; i++)
+        fprintf(out, "%s%d", i == 0 ? " " : ", ", values[i]);
+    fprintf(out, " };\n\n");
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <header>\n", argv[0]);
+        return 1;
+    }
+    FILE* out = fopen(argv[1], "w");
+    if (out == NULL) {
+        fprintf(stderr, "error: could not open '%s'\n", argv[1]);
+        return 1;
+    }
+
+    fprintf(out, "// Generated from table.c by table_generator.c. Do not edit\n\n");
+
+    fillTable();
+    if (!buildFastTable()) {
+        fprintf(out, "// The table leads to invalid states, so it is filled when starting\n");
+        fprintf(out, "#include \"table.c\"\n#include \"fast_table.c\"\n");
+        fclose(out);
+        return 0;
+    }
+    fprintf(out, "#define TABLE_GENERATED\n\n");
+    fprintf(out, "#define NSTATES %d\n#define START %d\n#define ACCEPT %d\n#define ERROR %d\n\n",
+            NSTATES, START, ACCEPT, ERROR);
+    fprintf(out, "#define MAX_EXIT_BYTES %d\n\n", MAX_EXIT_BYTES);
+
+    // The states all fit in bytes, since buildFastTable() succeeded. The table is small enough
+    // to be followed directly, so the compressed table is not needed
+    uint8_t filled[NSTATES * 256];
+    for (int s = 0; s < NSTATES; s++)
+        for (int c = 0; c < 256; c++)
+            filled[s * 256 + c] = table[s][c];
+    writeBytes(out, "uint8_t", "table[NSTATES][256]", filled, 256);
+
+    // The runs to skip, found by buildFastTable()
+    writeBytes(out, "unsigned char", "exitBytes[NSTATES][MAX_EXIT_BYTES]", &exitBytes[0][0],
+               MAX_EXIT_BYTES);
+    writeInts(out, "numExitBytes", numExitBytes, NSTATES);
+    writeInts(out, "loopByte", loopByte, NSTATES);
+
+    fclose(out);
+    return 0;
+}
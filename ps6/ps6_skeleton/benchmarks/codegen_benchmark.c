@@ -0,0 +1,224 @@
+// Measures the code generated by vslc, on the compute-heavy programs in benchmarks/workloads.
+// Every program is compiled into an object file by vslc, linked with cc, and run several times
+// with its output going to /dev/null. For each program, the median wall clock time of the runs,
+// the median number of user space instructions retired, and the size of the machine code in the
+// object file are reported, one program per line. The instructions are counted by the kernel
+// through perf_event_open(), and are shown as - where counting is not allowed.
+//
+// The report only depends on the generated code, so the reports of two commits can be diffed.
+// Options given after -n <runs> are passed on to vslc, to compare code generation features.
+//
+// Build with:
+// cmake -B build -DBUILD_BENCHMARKS=ON && cmake --build build
+// and run ./build/codegen_benchmark [-n <runs>] [vslc options...]
+
+#include <elf.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// The programs, and the argument that takes each of them about a tenth of a second
+static const struct
+{
+  const char* name;
+  const char* argument;
+} workloads[] = {
+    {"nested_loops", "300"},
+    {"array_sweep", "10000"},
+    {"recursion", "4000"},
+    {"print_heavy", "200000"},
+};
+#define N_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+#define DEFAULT_RUNS 11
+
+static double now(void)
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+  double lhs = *(const double*)a;
+  double rhs = *(const double*)b;
+  return (lhs > rhs) - (lhs < rhs);
+}
+
+// Runs the shell command, and exits if it fails
+static void run_command(const char* command)
+{
+  if (system(command) != 0)
+  {
+    fprintf(stderr, "error: command failed: %s\n", command);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Returns the total size of the sections holding machine code in the ELF object file
+static size_t code_size(const char* object_path)
+{
+  FILE* file = fopen(object_path, "rb");
+  if (file == NULL)
+  {
+    perror(object_path);
+    exit(EXIT_FAILURE);
+  }
+
+  Elf64_Ehdr header;
+  size_t size = 0;
+  if (fread(&header, sizeof(header), 1, file) == 1)
+  {
+    for (size_t i = 0; i < header.e_shnum; i++)
+    {
+      Elf64_Shdr section;
+      fseek(file, header.e_shoff + i * header.e_shentsize, SEEK_SET);
+      if (fread(&section, sizeof(section), 1, file) != 1)
+        break;
+      if (section.sh_flags & SHF_EXECINSTR)
+        size += section.sh_size;
+    }
+  }
+  fclose(file);
+  return size;
+}
+
+// Runs the program once with the given argument, and returns the seconds it took.
+// The user space instructions it retires are placed in instructions, or -1 if they can not be
+// counted
+static double run_once(const char* program, const char* argument, double* instructions)
+{
+  // The child waits for the parent to attach the counter before running the program
+  int start_pipe[2];
+  if (pipe(start_pipe) != 0)
+  {
+    perror("pipe");
+    exit(EXIT_FAILURE);
+  }
+
+  double start = now();
+  pid_t child = fork();
+  if (child == 0)
+  {
+    close(start_pipe[1]);
+    char go;
+    if (read(start_pipe[0], &go, 1) != 1)
+      _exit(EXIT_FAILURE);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    execl(program, program, argument, (char*)NULL);
+    _exit(EXIT_FAILURE);
+  }
+  close(start_pipe[0]);
+
+  // The counter only starts once the child calls exec, so the fork itself is not counted
+  struct perf_event_attr attr = {
+      .type = PERF_TYPE_HARDWARE,
+      .size = sizeof(struct perf_event_attr),
+      .config = PERF_COUNT_HW_INSTRUCTIONS,
+      .disabled = 1,
+      .enable_on_exec = 1,
+      .exclude_kernel = 1,
+      .exclude_hv = 1,
+  };
+  int counter = syscall(SYS_perf_event_open, &attr, child, -1, -1, 0);
+
+  if (write(start_pipe[1], "x", 1) != 1)
+  {
+    perror("write");
+    exit(EXIT_FAILURE);
+  }
+  close(start_pipe[1]);
+
+  int status;
+  waitpid(child, &status, 0);
+  double seconds = now() - start;
+  if (!WIFEXITED(status))
+  {
+    fprintf(stderr, "error: %s did not exit normally\n", program);
+    exit(EXIT_FAILURE);
+  }
+
+  uint64_t count;
+  *instructions = -1;
+  if (counter >= 0 && read(counter, &count, sizeof(count)) == sizeof(count))
+    *instructions = count;
+  if (counter >= 0)
+    close(counter);
+  return seconds;
+}
+
+int main(int argc, char** argv)
+{
+  size_t runs = DEFAULT_RUNS;
+  int first_option = 1;
+  if (argc > 2 && strcmp(argv[1], "-n") == 0)
+  {
+    runs = strtoul(argv[2], NULL, 10);
+    first_option = 3;
+  }
+  if (runs == 0)
+    runs = 1;
+
+  // The options for vslc, separated by spaces
+  char options[1024] = "";
+  for (int i = first_option; i < argc; i++)
+  {
+    strncat(options, argv[i], sizeof(options) - strlen(options) - 2);
+    strcat(options, " ");
+  }
+
+  char directory[] = "/tmp/vslc_benchmark_XXXXXX";
+  if (mkdtemp(directory) == NULL)
+  {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+
+  printf("%-14s %12s %16s %12s\n", "program", "median ms", "instructions", "code bytes");
+  double* times = malloc(runs * sizeof(double));
+  double* counts = malloc(runs * sizeof(double));
+  for (size_t w = 0; w < N_WORKLOADS; w++)
+  {
+    const char* name = workloads[w].name;
+    char object[512], program[512], command[4096];
+    snprintf(object, sizeof(object), "%s/%s.o", directory, name);
+    snprintf(program, sizeof(program), "%s/%s", directory, name);
+
+    snprintf(command, sizeof(command), "'%s' %s-o '%s' < '%s/%s.vsl'", VSLC_PATH, options,
+             object, WORKLOAD_DIR, name);
+    run_command(command);
+    snprintf(command, sizeof(command), "cc '%s' -o '%s'", object, program);
+    run_command(command);
+
+    for (size_t r = 0; r < runs; r++)
+      times[r] = run_once(program, workloads[w].argument, &counts[r]);
+    qsort(times, runs, sizeof(double), compare_doubles);
+    qsort(counts, runs, sizeof(double), compare_doubles);
+
+    printf("%-14s %12.2f ", name, times[runs / 2] * 1e3);
+    if (counts[0] < 0)
+      printf("%16s", "-");
+    else
+      printf("%16.0f", counts[runs / 2]);
+    printf(" %12zu\n", code_size(object));
+    fflush(stdout);
+
+    remove(object);
+    remove(program);
+  }
+  free(counts);
+  free(times);
+  rmdir(directory);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,256 @@
+// Measures how the time vslc spends in each pass scales with the size of the program.
+// Synthetic programs of 10^3 lines and up are generated in several shapes, each stressing a
+// different part of the compiler, and compiled by vslc -P -c -fno-fuse-passes, so that every
+// tree pass is timed on its own:
+//   statements   one long function, whose statement list is built by append_to_list_node()
+//   nesting      ifs and whiles nested 100 deep, for the recursive passes in tree.c
+//   expressions  assignments of 64 term expressions, for the recursive passes in tree.c
+//   globals      one global variable per line, for symbol_hashmap_resize()
+//   functions    many small functions calling each other, for the global symbol table
+//   strings      prints of distinct string literals, for add_string()
+// The time per line of each pass is printed for every size. When it grows more than
+// SUPERLINEAR_FACTOR times from the first size where the pass takes at least a millisecond to the
+// largest size, the pass is flagged as superlinear on that shape. Once compiling a shape takes
+// longer than MAX_COMPILE_MS, or vslc fails on it, its larger sizes are skipped, and the largest
+// size measured is used.
+//
+// Build with:
+// cmake -B build -DBUILD_BENCHMARKS=ON && cmake --build build
+// and run ./build/compiler_benchmark [largest power of 10, from 3 to 7, default 6]
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SMALLEST_POWER 3
+#define DEFAULT_LARGEST_POWER 6
+#define MAX_POWER 7
+
+#define NESTING_DEPTH 100
+#define EXPRESSION_TERMS 64
+#define SUPERLINEAR_FACTOR 3.0
+
+#define MAX_COMPILE_MS 5000.0
+
+// Noise in the time of a pass that takes less than this is too large to compare
+#define MIN_MEASURED_MS 1.0
+
+// The passes of vslc, in the order -P prints them
+#define MAX_PASSES 16
+#define MAX_PASS_NAME 64
+
+// Writes a program of about n_lines lines in the given shape
+static void generate_statements(FILE* out, size_t n_lines)
+{
+  fprintf(out, "func main() {\n    var x\n");
+  for (size_t i = 0; i < n_lines; i++)
+    fprintf(out, "    x = x + %zu\n", i % 7);
+  fprintf(out, "    return x\n}\n");
+}
+
+static void generate_nesting(FILE* out, size_t n_lines)
+{
+  fprintf(out, "func main(n) {\n    var x\n");
+  for (size_t line = 0; line < n_lines; line += 2 * NESTING_DEPTH)
+  {
+    for (size_t depth = 0; depth < NESTING_DEPTH; depth++)
+    {
+      if (depth % 2 == 0)
+        fprintf(out, "if x < n + %zu then {\n", depth);
+      else
+        fprintf(out, "while x < %zu do {\n", depth);
+    }
+    fprintf(out, "x = x + 1\n");
+    for (size_t depth = 0; depth < NESTING_DEPTH; depth++)
+      fprintf(out, "}\n");
+  }
+  fprintf(out, "    return x\n}\n");
+}
+
+static void generate_expressions(FILE* out, size_t n_lines)
+{
+  fprintf(out, "func main(n) {\n    var x, y\n");
+  for (size_t i = 0; i < n_lines; i++)
+  {
+    fprintf(out, "    x = y");
+    for (size_t term = 0; term < EXPRESSION_TERMS; term++)
+      fprintf(out, term % 3 == 0 ? " + %zu * n" : term % 3 == 1 ? " - (x + %zu)" : " + %zu", term);
+    fprintf(out, "\n    y = x\n");
+  }
+  fprintf(out, "    return y\n}\n");
+}
+
+static void generate_globals(FILE* out, size_t n_lines)
+{
+  for (size_t i = 0; i < n_lines; i++)
+    fprintf(out, "var global%zu\n", i);
+  fprintf(out, "func main() {\n    global0 = global%zu + 1\n    return global0\n}\n",
+          n_lines - 1);
+}
+
+static void generate_functions(FILE* out, size_t n_lines)
+{
+  size_t n_functions = n_lines / 3;
+  fprintf(out, "func main(n)\n    return f%zu(n)\n", n_functions - 1);
+  fprintf(out, "func f0(n)\n    return n\n");
+  for (size_t i = 1; i < n_functions; i++)
+    fprintf(out, "func f%zu(n)\n    return f%zu(n + %zu)\n\n", i, i - 1, i % 7);
+}
+
+static void generate_strings(FILE* out, size_t n_lines)
+{
+  fprintf(out, "func main() {\n");
+  for (size_t i = 0; i < n_lines; i++)
+    fprintf(out, "    print \"string number %zu\"\n", i);
+  fprintf(out, "}\n");
+}
+
+static const struct
+{
+  const char* name;
+  void (*generate)(FILE* out, size_t n_lines);
+} shapes[] = {
+    {"statements", generate_statements},
+    {"nesting", generate_nesting},
+    {"expressions", generate_expressions},
+    {"globals", generate_globals},
+    {"functions", generate_functions},
+    {"strings", generate_strings},
+};
+#define N_SHAPES (sizeof(shapes) / sizeof(shapes[0]))
+
+// The milliseconds of each pass, from one run of vslc -P
+typedef struct
+{
+  char names[MAX_PASSES][MAX_PASS_NAME];
+  double ms[MAX_PASSES];
+  size_t n_passes;
+  double total_ms;
+} pass_times_t;
+
+// Compiles the source file with -P, and reads the time of every pass from its report.
+// Returns false if vslc fails, such as by running out of memory
+static bool time_passes(const char* source_path, const char* report_path, pass_times_t* result)
+{
+  char command[4096];
+  snprintf(command, sizeof(command), "'%s' -P -c -fno-fuse-passes < '%s' > /dev/null 2> '%s'",
+           VSLC_PATH, source_path, report_path);
+  if (system(command) != 0)
+    return false;
+
+  *result = (pass_times_t){.n_passes = 0, .total_ms = 0};
+  FILE* report = fopen(report_path, "r");
+  char line[512];
+  while (fgets(line, sizeof(line), report) != NULL && result->n_passes < MAX_PASSES)
+  {
+    char name[MAX_PASS_NAME];
+    double ms;
+    // The header and warnings do not have a time in the second column
+    if (sscanf(line, "%63s %lf ms", name, &ms) != 2)
+      continue;
+    if (strcmp(name, "total") == 0)
+    {
+      result->total_ms = ms;
+      continue;
+    }
+    strcpy(result->names[result->n_passes], name);
+    result->ms[result->n_passes] = ms;
+    result->n_passes++;
+  }
+  fclose(report);
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  int largest_power = argc > 1 ? atoi(argv[1]) : DEFAULT_LARGEST_POWER;
+  if (largest_power < SMALLEST_POWER || largest_power > MAX_POWER)
+  {
+    fprintf(stderr, "usage: %s [largest power of 10, from %d to %d]\n", argv[0], SMALLEST_POWER,
+            MAX_POWER);
+    return EXIT_FAILURE;
+  }
+  size_t n_sizes = largest_power - SMALLEST_POWER + 1;
+
+  char directory[] = "/tmp/vslc_benchmark_XXXXXX";
+  if (mkdtemp(directory) == NULL)
+  {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  char source_path[512], report_path[512];
+  snprintf(source_path, sizeof(source_path), "%s/program.vsl", directory);
+  snprintf(report_path, sizeof(report_path), "%s/report.txt", directory);
+
+  size_t n_flagged = 0;
+  for (size_t s = 0; s < N_SHAPES; s++)
+  {
+    pass_times_t times[MAX_POWER - SMALLEST_POWER + 1];
+    size_t n_lines[MAX_POWER - SMALLEST_POWER + 1];
+    printf("%s\n%-28s", shapes[s].name, "ns per line");
+
+    size_t lines = 1;
+    for (int p = 0; p < SMALLEST_POWER; p++)
+      lines *= 10;
+    size_t n_measured = 0;
+    for (size_t i = 0; i < n_sizes; i++, lines *= 10)
+    {
+      if (i > 0 && times[i - 1].total_ms > MAX_COMPILE_MS)
+        break;
+      FILE* source = fopen(source_path, "w");
+      shapes[s].generate(source, lines);
+      fclose(source);
+      if (!time_passes(source_path, report_path, &times[i]))
+      {
+        printf(" %12s", "failed");
+        break;
+      }
+      n_lines[i] = lines;
+      n_measured++;
+      printf(" %12zu", lines);
+      fflush(stdout);
+    }
+    printf("\n");
+
+    if (n_measured == 0)
+    {
+      printf("\n");
+      continue;
+    }
+
+    // The passes are the same for every size, as they only depend on the options
+    for (size_t pass = 0; pass < times[0].n_passes; pass++)
+    {
+      printf("  %-26s", times[0].names[pass]);
+      for (size_t i = 0; i < n_measured; i++)
+        printf(" %12.1f", times[i].ms[pass] * 1e6 / n_lines[i]);
+
+      size_t first = 0;
+      while (first < n_measured && times[first].ms[pass] < MIN_MEASURED_MS)
+        first++;
+      size_t last = n_measured - 1;
+      if (first < last)
+      {
+        double first_per_line = times[first].ms[pass] / n_lines[first];
+        double last_per_line = times[last].ms[pass] / n_lines[last];
+        if (last_per_line > first_per_line * SUPERLINEAR_FACTOR)
+        {
+          printf("   superlinear, %.1fx per line", last_per_line / first_per_line);
+          n_flagged++;
+        }
+      }
+      printf("\n");
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+
+  remove(source_path);
+  remove(report_path);
+  rmdir(directory);
+  printf("%zu passes flagged as superlinear\n", n_flagged);
+  return n_flagged == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
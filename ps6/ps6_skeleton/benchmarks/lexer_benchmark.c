@@ -0,0 +1,138 @@
+// Measures how fast a scanner splits VSL source into tokens.
+// It is built once with the flex scanner, and once with the hand-written lexer in lexer.c,
+// as lexer_benchmark_flex and lexer_benchmark_handwritten.
+//
+// Build with:
+// cmake -B build -DBUILD_BENCHMARKS=ON && cmake --build build
+// and run ./build/lexer_benchmark_flex and ./build/lexer_benchmark_handwritten.
+// Both scan a generated program, or the VSL file given as the argument
+
+#include "vslc.h"
+
+#include "parser.h"
+#include <time.h>
+
+// How many functions the generated program has
+#define GENERATED_FUNCTIONS 20000
+
+// The input is scanned this many times, and the fastest round is reported
+#define ROUNDS 5
+
+int yylex(YYSTYPE* lvalp, yyscan_t scanner);
+
+static double now(void)
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Appends the formatted text to a growing buffer
+static void append(char** text, size_t* length, size_t* capacity, const char* format, ...)
+{
+  while (true)
+  {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(*text + *length, *capacity - *length, format, args);
+    va_end(args);
+    if (*length + n < *capacity)
+    {
+      *length += n;
+      return;
+    }
+    *capacity = *capacity * 2 + 4096;
+    *text = realloc(*text, *capacity);
+  }
+}
+
+// A program using every kind of token, with indentation and comments like handwritten code
+static char* generate_source(size_t* length)
+{
+  size_t capacity = 0;
+  char* text = NULL;
+  *length = 0;
+  append(&text, length, &capacity, "var counter, table[100]\n\n");
+  for (size_t i = 0; i < GENERATED_FUNCTIONS; i++)
+  {
+    append(&text, length, &capacity,
+           "// Function number %zu of the generated program\n"
+           "func function%zu(first, second) {\n"
+           "    var result, index\n"
+           "    index = 0\n"
+           "    while index < first + 10 do {\n"
+           "        if index / 2 * 2 == index then\n"
+           "            result = result + table[index] * second\n"
+           "        else\n"
+           "            result = result - (index - 1)\n"
+           "        index = index + 1 // Next element\n"
+           "    }\n"
+           "    print \"The result of function%zu is \", result\n"
+           "    return result\n"
+           "}\n\n",
+           i, i, i);
+  }
+  return text;
+}
+
+static char* read_file(const char* filename, size_t* length)
+{
+  FILE* file = fopen(filename, "r");
+  if (file == NULL)
+  {
+    fprintf(stderr, "error: could not open '%s'\n", filename);
+    exit(EXIT_FAILURE);
+  }
+  fseek(file, 0, SEEK_END);
+  *length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char* text = malloc(*length + 1);
+  *length = fread(text, 1, *length, file);
+  fclose(file);
+  return text;
+}
+
+// Scans a fresh copy of the source, ending with the two zero bytes yy_scan_buffer() needs.
+// Returns the number of tokens, and stores the time taken
+static size_t scan(const char* source, size_t length, double* seconds)
+{
+  char* buffer = malloc(length + 2);
+  memcpy(buffer, source, length);
+  buffer[length] = buffer[length + 1] = '\0';
+
+  double start = now();
+  yyscan_t scanner;
+  yylex_init(&scanner);
+  yy_scan_buffer(buffer, length + 2, scanner);
+
+  size_t n_tokens = 0;
+  YYSTYPE value;
+  while (yylex(&value, scanner) != 0)
+    n_tokens++;
+  yylex_destroy(scanner);
+  *seconds = now() - start;
+
+  free(buffer);
+  return n_tokens;
+}
+
+int main(int argc, char** argv)
+{
+  size_t length;
+  char* source = argc > 1 ? read_file(argv[1], &length) : generate_source(&length);
+
+  double fastest = 0;
+  size_t n_tokens = 0;
+  for (size_t round = 0; round < ROUNDS; round++)
+  {
+    double seconds;
+    n_tokens = scan(source, length, &seconds);
+    if (round == 0 || seconds < fastest)
+      fastest = seconds;
+  }
+
+  printf("%s: %zu bytes, %zu tokens in %.2f ms, %.1f MB/s\n", LEXER_NAME, length, n_tokens,
+         fastest * 1e3, length / fastest / 1e6);
+  free(source);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,129 @@
+// Measures how the simplification passes scale with the length of a function.
+// Functions of 125000 up to 1000000 statements are parsed, and then simplified both by
+// constant_fold_syntax_tree(), remove_unreachable_code_syntax_tree() and create_tables() one
+// after the other, and by the fused simplify_and_create_tables().
+// A quarter of the statements are ifs and whiles that are removed, which leave holes in the list
+// of statements. The time per statement stays the same as long as the passes are linear.
+//
+// Build with:
+// cmake -B build -DBUILD_BENCHMARKS=ON && cmake --build build
+// and run ./build/simplify_benchmark
+
+#include "vslc.h"
+
+#include <time.h>
+
+// The number of statements in the function of the smallest program, which is doubled until
+// the largest program has this many times more
+#define SMALLEST_FUNCTION 125000
+#define SIZE_STEPS 4
+
+static double now(void)
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Appends the formatted text to a growing buffer
+static void append(char** text, size_t* length, size_t* capacity, const char* format, ...)
+{
+  while (true)
+  {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(*text + *length, *capacity - *length, format, args);
+    va_end(args);
+    if (*length + n < *capacity)
+    {
+      *length += n;
+      return;
+    }
+    *capacity = *capacity * 2 + 4096;
+    *text = realloc(*text, *capacity);
+  }
+}
+
+// A program with a single function of the given number of statements.
+// Every fourth statement is an assignment that is kept, and the others are ifs and whiles with
+// constant conditions, of which one is replaced by its body and two are removed
+static char* generate_source(size_t n_statements, size_t* length)
+{
+  size_t capacity = 0;
+  char* text = NULL;
+  *length = 0;
+  append(&text, length, &capacity, "var global\n\nfunc main() {\n    var x\n    x = 1\n");
+  for (size_t i = 0; i < n_statements; i++)
+  {
+    switch (i % 4)
+    {
+    case 0:
+      append(&text, length, &capacity, "    x = x + %zu\n", i % 7);
+      break;
+    case 1:
+      append(&text, length, &capacity, "    if 0 then print x\n");
+      break;
+    case 2:
+      append(&text, length, &capacity, "    if 1 then global = x * 2 else global = 3\n");
+      break;
+    default:
+      append(&text, length, &capacity, "    while 0 do x = x - 1\n");
+      break;
+    }
+  }
+  append(&text, length, &capacity, "    print x, global\n}\n");
+  return text;
+}
+
+// Parses a fresh copy of the source, ending with the two zero bytes yy_scan_buffer() needs
+static void parse(const char* source, size_t length)
+{
+  char* buffer = malloc(length + 2);
+  memcpy(buffer, source, length);
+  buffer[length] = buffer[length + 1] = '\0';
+
+  yyscan_t scanner;
+  yylex_init(&scanner);
+  yy_scan_buffer(buffer, length + 2, scanner);
+  yyparse(scanner);
+  yylex_destroy(scanner);
+  free(buffer);
+}
+
+static void simplify_separately(void)
+{
+  constant_fold_syntax_tree();
+  remove_unreachable_code_syntax_tree();
+  create_tables();
+}
+
+// Parses the source, and returns the seconds taken to simplify it
+static double time_simplification(const char* source, size_t length, void (*simplify)(void))
+{
+  parse(source, length);
+  double start = now();
+  simplify();
+  double seconds = now() - start;
+  destroy_tables();
+  destroy_syntax_tree();
+  return seconds;
+}
+
+int main(void)
+{
+  printf("%12s %14s %14s %14s %14s\n", "statements", "separate", "per statement", "fused",
+         "per statement");
+  for (size_t step = 0; step < SIZE_STEPS; step++)
+  {
+    size_t n_statements = (size_t)SMALLEST_FUNCTION << step;
+    size_t length;
+    char* source = generate_source(n_statements, &length);
+
+    double separate = time_simplification(source, length, simplify_separately);
+    double fused = time_simplification(source, length, simplify_and_create_tables);
+    printf("%12zu %11.2f ms %11.1f ns %11.2f ms %11.1f ns\n", n_statements, separate * 1e3,
+           separate / n_statements * 1e9, fused * 1e3, fused / n_statements * 1e9);
+    free(source);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,190 @@
+// Compares the symbol hashmap against the hashmap it replaced, by inserting
+// and looking up a large number of distinct names in a single symbol table.
+//
+// Build with:
+// cmake -B build -DBUILD_BENCHMARKS=ON && cmake --build build
+// and run ./build/symbol_table_benchmark
+
+#include "symbol_table.h"
+#include "symbols.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// How many symbols are inserted in each round of the benchmark
+static const size_t SYMBOL_COUNTS[] = {100000, 1000000};
+
+// Every name is looked up this many times
+#define LOOKUP_ROUNDS 4
+
+// ============ The previous hashmap implementation ============
+// Names are plain strings, hashed with a naive hash and compared using strcmp.
+// The number of buckets is not a power of two, so finding a bucket needs a division
+
+typedef struct
+{
+  const char** buckets;
+  size_t n_buckets;
+  size_t n_entries;
+} baseline_hashmap_t;
+
+static uint64_t baseline_hash_string(const char* string)
+{
+  uint64_t hash = 31;
+  for (const char* c = string; *c != '\0'; c++)
+    hash = hash * 257 + *c;
+  return hash;
+}
+
+static bool baseline_insert(baseline_hashmap_t* hashmap, const char* name);
+
+static void baseline_resize(baseline_hashmap_t* hashmap, size_t new_capacity)
+{
+  const char** old_buckets = hashmap->buckets;
+  size_t old_capacity = hashmap->n_buckets;
+
+  hashmap->buckets = calloc(new_capacity, sizeof(const char*));
+  hashmap->n_buckets = new_capacity;
+  hashmap->n_entries = 0;
+
+  for (size_t i = 0; i < old_capacity; i++)
+    if (old_buckets[i] != NULL)
+      baseline_insert(hashmap, old_buckets[i]);
+
+  free(old_buckets);
+}
+
+static bool baseline_insert(baseline_hashmap_t* hashmap, const char* name)
+{
+  if ((hashmap->n_entries + 1) * 2 > hashmap->n_buckets)
+    baseline_resize(hashmap, hashmap->n_buckets * 2 + 8);
+
+  size_t bucket = baseline_hash_string(name) % hashmap->n_buckets;
+  while (hashmap->buckets[bucket] != NULL)
+  {
+    if (strcmp(hashmap->buckets[bucket], name) == 0)
+      return false;
+    bucket = (bucket + 1) % hashmap->n_buckets;
+  }
+
+  hashmap->buckets[bucket] = name;
+  hashmap->n_entries++;
+  return true;
+}
+
+static const char* baseline_lookup(baseline_hashmap_t* hashmap, const char* name)
+{
+  size_t bucket = baseline_hash_string(name) % hashmap->n_buckets;
+  while (hashmap->buckets[bucket] != NULL)
+  {
+    if (strcmp(hashmap->buckets[bucket], name) == 0)
+      return hashmap->buckets[bucket];
+    bucket = (bucket + 1) % hashmap->n_buckets;
+  }
+  return NULL;
+}
+
+// ======================== Benchmark ==========================
+
+static double now(void)
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Names look like the ones found in programs: short, and often only differing at the end
+static char** make_names(size_t count)
+{
+  char** names = malloc(count * sizeof(char*));
+  for (size_t i = 0; i < count; i++)
+  {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "var%zu", i);
+    names[i] = strdup(buffer);
+  }
+  return names;
+}
+
+static void benchmark_baseline(char** names, size_t count)
+{
+  baseline_hashmap_t hashmap = {.buckets = NULL, .n_buckets = 0, .n_entries = 0};
+
+  double start = now();
+  for (size_t i = 0; i < count; i++)
+    baseline_insert(&hashmap, names[i]);
+  double inserted = now();
+
+  size_t found = 0;
+  for (size_t round = 0; round < LOOKUP_ROUNDS; round++)
+    for (size_t i = 0; i < count; i++)
+      found += baseline_lookup(&hashmap, names[i]) != NULL;
+  double looked_up = now();
+
+  if (found != count * LOOKUP_ROUNDS)
+  {
+    fprintf(stderr, "error: baseline hashmap lost symbols\n");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("  baseline:     insert %8.2f ms   lookup %8.2f ms\n", (inserted - start) * 1e3,
+         (looked_up - inserted) * 1e3);
+  free(hashmap.buckets);
+}
+
+static void benchmark_symbol_table(char** names, size_t count)
+{
+  // Interning is done by the lexer when compiling, so it is not part of the timing
+  atom_t* atoms = malloc(count * sizeof(atom_t));
+  for (size_t i = 0; i < count; i++)
+    atoms[i] = atom_intern(names[i], strlen(names[i]));
+
+  symbol_table_t* table = symbol_table_init();
+
+  double start = now();
+  for (size_t i = 0; i < count; i++)
+  {
+    symbol_t* symbol = malloc(sizeof(symbol_t));
+    *symbol = (symbol_t){.name = atoms[i], .type = SYMBOL_GLOBAL_VAR};
+    symbol_table_insert(table, symbol);
+  }
+  double inserted = now();
+
+  size_t found = 0;
+  for (size_t round = 0; round < LOOKUP_ROUNDS; round++)
+    for (size_t i = 0; i < count; i++)
+      found += symbol_hashmap_lookup(table->hashmap, atoms[i]) != NULL;
+  double looked_up = now();
+
+  if (found != count * LOOKUP_ROUNDS)
+  {
+    fprintf(stderr, "error: symbol table lost symbols\n");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("  symbol table: insert %8.2f ms   lookup %8.2f ms\n", (inserted - start) * 1e3,
+         (looked_up - inserted) * 1e3);
+  symbol_table_destroy(table);
+  free(atoms);
+}
+
+int main(void)
+{
+  for (size_t i = 0; i < sizeof(SYMBOL_COUNTS) / sizeof(SYMBOL_COUNTS[0]); i++)
+  {
+    size_t count = SYMBOL_COUNTS[i];
+    char** names = make_names(count);
+
+    printf("%zu symbols, %d lookups each:\n", count, LOOKUP_ROUNDS);
+    benchmark_baseline(names, count);
+    benchmark_symbol_table(names, count);
+
+    for (size_t j = 0; j < count; j++)
+      free(names[j]);
+    free(names);
+  }
+
+  destroy_atoms();
+  return EXIT_SUCCESS;
+}
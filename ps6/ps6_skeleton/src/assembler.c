@@ -0,0 +1,1783 @@
+// MAP_ANONYMOUS is not part of POSIX, but is found on all systems we run on
+#define _DEFAULT_SOURCE 1
+
+#include "vslc.h"
+
+#include "emit.h"
+#include <errno.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// The assembler encodes the lines flushed by flush_assembly() into machine code, and writes it
+// as an ELF relocatable object, which is linked like the object gcc would make from the assembly.
+// Only the instructions and directives the generator emits are understood.
+//
+// Jumps to labels in .text are resolved here. A jump is first assumed to reach its target with
+// an 8-bit displacement, and is only made long if it does not, so the jumps are placed once all
+// code is encoded. References to the other sections and to the C library become relocations.
+//
+// With --run, the sections are instead loaded into memory of this process, where the calls into
+// the C library go to the functions the compiler itself is linked with
+
+_Thread_local FILE* object_output;
+bool run_in_memory = false;
+
+// The strings of the program keep the escapes of the source, which are the same as those of the GNU
+// assembler. Both the assembler and the interpreter decode them here
+char* decode_string_literal(const char* literal, size_t* length)
+{
+  const char* text = literal;
+  if (*text++ != '"')
+  {
+    fprintf(stderr, "error: expected a string in '%s'\n", literal);
+    exit(EXIT_FAILURE);
+  }
+
+  // The decoded string is never longer than the literal
+  char* characters = malloc(strlen(literal) + 1);
+  size_t n = 0;
+  while (*text != '"')
+  {
+    if (*text == '\0')
+    {
+      fprintf(stderr, "error: unterminated string in '%s'\n", literal);
+      exit(EXIT_FAILURE);
+    }
+    if (*text != '\\')
+    {
+      characters[n++] = *text++;
+      continue;
+    }
+
+    text++;
+    if (*text >= '0' && *text <= '7')
+    {
+      int value = 0;
+      for (int i = 0; i < 3 && *text >= '0' && *text <= '7'; i++)
+        value = value * 8 + *text++ - '0';
+      characters[n++] = (char)value;
+      continue;
+    }
+    if (*text == 'x' || *text == 'X')
+    {
+      char* end;
+      long value = strtol(text + 1, &end, 16);
+      characters[n++] = (char)value;
+      text = end;
+      continue;
+    }
+    const char* escapes = "b\bf\fn\nr\rt\tv\v";
+    const char* escape = *text != '\0' ? strchr(escapes, *text) : NULL;
+    if (escape != NULL && (escape - escapes) % 2 == 0)
+      characters[n++] = escape[1];
+    else if (*text != '\0')
+      characters[n++] = *text; // Such as \" and \\, and unknown escapes, which are kept as is
+    else
+      continue;
+    text++;
+  }
+  characters[n] = '\0';
+  *length = n;
+  return characters;
+}
+
+#ifdef __APPLE__
+
+// Mach-O objects are not supported, so -o, --run and -ftiered give an error in vslc.c
+void assemble_directive(const char* text)
+{
+  (void)text;
+}
+void assemble_label(const char* name)
+{
+  (void)name;
+}
+void assemble_instruction(const char* mnemonic, char* const* operands, size_t n_operands)
+{
+  (void)mnemonic, (void)operands, (void)n_operands;
+}
+void write_object(void) {}
+void load_program(void) {}
+void define_host_symbol(const char* name, void* address)
+{
+  (void)name, (void)address;
+}
+void* allocate_loaded_memory(size_t size)
+{
+  (void)size;
+  return NULL;
+}
+void* load_code(const char* label)
+{
+  (void)label;
+  return NULL;
+}
+void unload_code(void) {}
+int run_loaded_program(int argc, char** argv)
+{
+  (void)argc, (void)argv;
+  return EXIT_FAILURE;
+}
+
+#else
+
+#include <elf.h>
+
+typedef enum
+{
+  SECTION_TEXT,
+  SECTION_RODATA,
+  SECTION_BSS,
+  SECTION_COUNT
+} section_id_t;
+
+// The strings are in a section of zero terminated strings, which the linker merges with the
+// strings of other objects
+static const char* SECTION_NAMES[SECTION_COUNT] = {".text", ".rodata.str1.1", ".bss"};
+
+// The bytes of a section. The .bss has no bytes, only a length
+typedef struct
+{
+  uint8_t* bytes;
+  size_t length;
+  size_t capacity;
+  size_t alignment;
+} section_t;
+
+// A label, which is undefined until it is found in the assembly.
+// Labels in .text are placed after n_jumps_before jumps, whose sizes are added to the offset
+typedef struct
+{
+  atom_t name;
+  bool defined;
+  bool global;
+  section_id_t section;
+  size_t offset;
+  size_t n_jumps_before;
+} label_t;
+
+// A jmp or jcc to a label in .text, which is not in the bytes of .text until it is placed.
+// The condition is the condition code of jcc, or -1 for jmp
+typedef struct
+{
+  size_t position;
+  int condition;
+  size_t target;
+  bool long_form;
+} jump_t;
+
+// A 32-bit displacement to a label in the bytes of .text, counted from the end of the
+// instruction, which is distance bytes after the displacement starts.
+// Calls to labels that are never defined are calls into the C library
+typedef struct
+{
+  size_t position;
+  size_t n_jumps_before;
+  size_t distance;
+  size_t label;
+  bool call;
+} reference_t;
+
+static _Thread_local section_t sections[SECTION_COUNT];
+static _Thread_local section_id_t current_section = SECTION_TEXT;
+
+static _Thread_local label_t* labels;
+static _Thread_local size_t n_labels;
+static _Thread_local size_t labels_capacity;
+
+// Indices into labels + 1, by the hash of the name, using open addressing.
+// The number of buckets is always a power of two, and at most half of them are used
+static _Thread_local size_t* label_buckets;
+static _Thread_local size_t n_label_buckets;
+
+static _Thread_local jump_t* jumps;
+static _Thread_local size_t n_jumps;
+static _Thread_local size_t jumps_capacity;
+
+static _Thread_local reference_t* references;
+static _Thread_local size_t n_references;
+static _Thread_local size_t references_capacity;
+
+/* Sections and labels */
+
+static void append_bytes(section_id_t id, const void* bytes, size_t length)
+{
+  section_t* section = &sections[id];
+  if (section->length + length > section->capacity)
+  {
+    section->capacity = (section->length + length) * 2 + 256;
+    section->bytes = realloc(section->bytes, section->capacity);
+  }
+  memcpy(section->bytes + section->length, bytes, length);
+  section->length += length;
+}
+
+static void append_byte(uint8_t byte)
+{
+  append_bytes(current_section, &byte, 1);
+}
+
+// Appends the lowest size bytes of the value, in little endian order
+static void append_value(int64_t value, size_t size)
+{
+  for (size_t i = 0; i < size; i++)
+    append_byte((uint8_t)((uint64_t)value >> (8 * i)));
+}
+
+// Pads the current section with zeroes, or nops in .text, until it is aligned
+static void align_section(size_t alignment)
+{
+  section_t* section = &sections[current_section];
+  if (alignment > section->alignment)
+    section->alignment = alignment;
+  while (section->length % alignment != 0)
+  {
+    if (current_section == SECTION_BSS)
+      section->length++;
+    else
+      append_byte(current_section == SECTION_TEXT ? 0x90 : 0);
+  }
+}
+
+static void insert_label_bucket(size_t index)
+{
+  size_t bucket = atom_hash(labels[index].name) & (n_label_buckets - 1);
+  while (label_buckets[bucket] != 0)
+    bucket = (bucket + 1) & (n_label_buckets - 1);
+  label_buckets[bucket] = index + 1;
+}
+
+// Returns the index of the label with the given name, adding it as undefined the first time
+static size_t find_label(const char* name, size_t length)
+{
+  atom_t atom = atom_intern(name, length);
+  if (n_label_buckets != 0)
+  {
+    size_t bucket = atom_hash(atom) & (n_label_buckets - 1);
+    while (label_buckets[bucket] != 0)
+    {
+      if (labels[label_buckets[bucket] - 1].name == atom)
+        return label_buckets[bucket] - 1;
+      bucket = (bucket + 1) & (n_label_buckets - 1);
+    }
+  }
+
+  if (n_labels + 1 >= labels_capacity)
+  {
+    labels_capacity = labels_capacity * 2 + 64;
+    labels = realloc(labels, labels_capacity * sizeof(label_t));
+  }
+  labels[n_labels] = (label_t){.name = atom, .defined = false, .global = false};
+
+  if (2 * (n_labels + 1) > n_label_buckets)
+  {
+    free(label_buckets);
+    n_label_buckets = n_label_buckets == 0 ? 64 : n_label_buckets * 2;
+    label_buckets = calloc(n_label_buckets, sizeof(size_t));
+    for (size_t i = 0; i < n_labels; i++)
+      insert_label_bucket(i);
+  }
+  insert_label_bucket(n_labels);
+  return n_labels++;
+}
+
+static void define_label(const char* name, size_t length)
+{
+  // Finding the label may move the labels, so it is looked up first
+  size_t index = find_label(name, length);
+  label_t* label = &labels[index];
+  if (label->defined)
+  {
+    fprintf(stderr, "error: label '%.*s' is defined twice\n", (int)length, name);
+    exit(EXIT_FAILURE);
+  }
+  label->defined = true;
+  label->section = current_section;
+  label->offset = sections[current_section].length;
+  label->n_jumps_before = n_jumps;
+}
+
+static void add_reference(size_t label, size_t distance, bool call)
+{
+  if (n_references + 1 >= references_capacity)
+  {
+    references_capacity = references_capacity * 2 + 64;
+    references = realloc(references, references_capacity * sizeof(reference_t));
+  }
+  references[n_references++] = (reference_t){.position = sections[SECTION_TEXT].length,
+                                             .n_jumps_before = n_jumps,
+                                             .distance = distance,
+                                             .label = label,
+                                             .call = call};
+  append_value(0, 4);
+}
+
+static void add_jump(int condition, size_t target)
+{
+  if (n_jumps + 1 >= jumps_capacity)
+  {
+    jumps_capacity = jumps_capacity * 2 + 64;
+    jumps = realloc(jumps, jumps_capacity * sizeof(jump_t));
+  }
+  jumps[n_jumps++] = (jump_t){.position = sections[SECTION_TEXT].length,
+                              .condition = condition,
+                              .target = target,
+                              .long_form = false};
+}
+
+/* Operands */
+
+typedef enum
+{
+  OPERAND_REGISTER,
+  OPERAND_IMMEDIATE,
+  OPERAND_MEMORY,
+  OPERAND_LABEL,
+} operand_kind_t;
+
+// Memory operands without a base or index register have NO_REGISTER in their place
+#define NO_REGISTER (-1)
+#define RIP_REGISTER 16
+
+typedef struct
+{
+  operand_kind_t kind;
+  int reg;  // The number of the register, as used in the encoding
+  int size; // The size of the register in bytes, where 16 and 32 are %xmm and %ymm registers
+  int64_t value; // The immediate, or the displacement of a memory operand
+  int base;
+  int index;
+  int scale;
+  size_t label; // The label of %rip-relative memory operands, and of label operands
+} operand_t;
+
+// The registers of each size, in the order of their numbers
+static const char* REGISTERS_64[16] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                                       "r8",  "r9",  "r10", "r11", "r12", "r13", "r14", "r15"};
+static const char* REGISTERS_32[16] = {"eax",  "ecx",  "edx",  "ebx",  "esp",  "ebp",
+                                       "esi",  "edi",  "r8d",  "r9d",  "r10d", "r11d",
+                                       "r12d", "r13d", "r14d", "r15d"};
+static const char* REGISTERS_8[16] = {"al",  "cl",  "dl",   "bl",   "spl",  "bpl",  "sil",  "dil",
+                                      "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"};
+
+static void unsupported(const char* mnemonic, char* const* operands, size_t n_operands)
+{
+  fprintf(stderr, "error: the assembler can not encode '%s", mnemonic);
+  for (size_t i = 0; i < n_operands; i++)
+    fprintf(stderr, "%s%s", i == 0 ? " " : ", ", operands[i]);
+  fprintf(stderr, "'\n");
+  exit(EXIT_FAILURE);
+}
+
+// Parses the name of a register, starting with %. Returns false if there is no such register
+static bool parse_register(const char* text, size_t length, operand_t* operand)
+{
+  if (length < 2 || text[0] != '%')
+    return false;
+  text++;
+  length--;
+
+  if (strncmp(text, "rip", length) == 0 && length == 3)
+  {
+    *operand = (operand_t){.kind = OPERAND_REGISTER, .reg = RIP_REGISTER, .size = 8};
+    return true;
+  }
+  for (int i = 0; i < 16; i++)
+  {
+    const char* names[3] = {REGISTERS_64[i], REGISTERS_32[i], REGISTERS_8[i]};
+    const int sizes[3] = {8, 4, 1};
+    for (int j = 0; j < 3; j++)
+    {
+      if (strlen(names[j]) == length && strncmp(names[j], text, length) == 0)
+      {
+        *operand = (operand_t){.kind = OPERAND_REGISTER, .reg = i, .size = sizes[j]};
+        return true;
+      }
+    }
+  }
+
+  // %xmm0 to %xmm15 and %ymm0 to %ymm15
+  if (length >= 4 && (text[0] == 'x' || text[0] == 'y') && strncmp(&text[1], "mm", 2) == 0)
+  {
+    char* end;
+    long number = strtol(&text[3], &end, 10);
+    if (end == text + length && end != &text[3] && number >= 0 && number < 16)
+    {
+      *operand = (operand_t){
+          .kind = OPERAND_REGISTER, .reg = (int)number, .size = text[0] == 'x' ? 16 : 32};
+      return true;
+    }
+  }
+  return false;
+}
+
+// Parses a number, or a character literal such as '0'. Returns false if it is neither
+static bool parse_number(const char* text, int64_t* value)
+{
+  if (text[0] == '\'')
+  {
+    if (text[1] == '\\' && text[2] != '\0' && text[3] == '\'' && text[4] == '\0')
+    {
+      const char* escapes = "n\nt\tr\r0\0\\\\''";
+      const char* escape = strchr(escapes, text[2]);
+      if (escape == NULL || (escape - escapes) % 2 != 0)
+        return false;
+      *value = escape[1];
+      return true;
+    }
+    if (text[1] != '\0' && text[2] == '\'' && text[3] == '\0')
+    {
+      *value = (unsigned char)text[1];
+      return true;
+    }
+    return false;
+  }
+
+  if (text[0] == '\0')
+    return false;
+  char* end;
+  errno = 0;
+  *value = strtoll(text, &end, 0);
+  if (errno == ERANGE && text[0] != '-')
+  {
+    // Large unsigned constants, as movabsq may be given
+    errno = 0;
+    *value = (int64_t)strtoull(text, &end, 0);
+  }
+  return *end == '\0' && errno == 0;
+}
+
+// Parses a memory operand such as -8(%rbp), (%r8,%rax,8) or .x(%rip)
+static bool parse_memory(const char* text, operand_t* operand)
+{
+  *operand = (operand_t){.kind = OPERAND_MEMORY,
+                         .value = 0,
+                         .base = NO_REGISTER,
+                         .index = NO_REGISTER,
+                         .scale = 1};
+
+  const char* open = strchr(text, '(');
+  const char* close = open != NULL ? strchr(open, ')') : NULL;
+  if (open == NULL || close == NULL || close[1] != '\0')
+    return false;
+
+  // The displacement is a number, or a label for %rip-relative operands
+  char* displacement = strndup(text, open - text);
+  bool has_label = displacement[0] != '\0' && !parse_number(displacement, &operand->value);
+  if (has_label)
+    operand->label = find_label(displacement, open - text);
+  free(displacement);
+
+  // The registers and scale are separated by commas, and each may be left out
+  const char* part = open + 1;
+  for (int i = 0; i < 3; i++)
+  {
+    const char* end = part;
+    while (end != close && *end != ',')
+      end++;
+    size_t length = end - part;
+
+    if (length > 0)
+    {
+      operand_t reg;
+      if (i == 2)
+      {
+        char* scale = strndup(part, length);
+        int64_t value;
+        bool valid = parse_number(scale, &value);
+        free(scale);
+        if (!valid || (value != 1 && value != 2 && value != 4 && value != 8))
+          return false;
+        operand->scale = (int)value;
+      }
+      else if (!parse_register(part, length, &reg) || reg.size != 8)
+        return false;
+      else if (i == 0)
+        operand->base = reg.reg;
+      else if (reg.reg == RIP_REGISTER || reg.reg == 4)
+        return false;
+      else
+        operand->index = reg.reg;
+    }
+
+    if (end == close)
+      break;
+    part = end + 1;
+  }
+
+  // Labels can only be addressed relative to %rip, which can only be used alone
+  if (has_label != (operand->base == RIP_REGISTER))
+    return false;
+  if (operand->base == RIP_REGISTER && operand->index != NO_REGISTER)
+    return false;
+  return true;
+}
+
+static bool parse_operand(const char* text, operand_t* operand)
+{
+  if (text[0] == '$')
+  {
+    *operand = (operand_t){.kind = OPERAND_IMMEDIATE};
+    return parse_number(&text[1], &operand->value);
+  }
+  if (text[0] == '%')
+    return parse_register(text, strlen(text), operand);
+  if (strchr(text, '(') != NULL)
+    return parse_memory(text, operand);
+
+  // Anything else is the name of a label, as jumped to or called
+  *operand = (operand_t){.kind = OPERAND_LABEL, .label = find_label(text, strlen(text))};
+  return text[0] != '\0';
+}
+
+/* Encoding */
+
+static bool fits_int8(int64_t value)
+{
+  return value >= INT8_MIN && value <= INT8_MAX;
+}
+
+static bool fits_int32(int64_t value)
+{
+  return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+// Whether the operand is one of %spl, %bpl, %sil and %dil,
+// which can only be encoded with a REX prefix, as %ah, %ch, %dh and %bh take their place without
+static bool needs_rex(const operand_t* operand)
+{
+  return operand->kind == OPERAND_REGISTER && operand->size == 1 && operand->reg >= 4 &&
+         operand->reg < 8;
+}
+
+// The REX.R, REX.X and REX.B bits for the register in the reg field, and the r/m operand
+static uint8_t rex_bits(int reg, const operand_t* rm)
+{
+  uint8_t bits = (reg & 8) != 0 ? 0x4 : 0;
+  if (rm->kind == OPERAND_REGISTER)
+    bits |= (rm->reg & 8) != 0 ? 0x1 : 0;
+  else
+  {
+    if (rm->index != NO_REGISTER && (rm->index & 8) != 0)
+      bits |= 0x2;
+    if (rm->base != NO_REGISTER && rm->base != RIP_REGISTER && (rm->base & 8) != 0)
+      bits |= 0x1;
+  }
+  return bits;
+}
+
+// Appends the ModR/M byte, and the SIB byte and displacement the r/m operand needs.
+// The instruction ends immediate_size bytes after the ModR/M bytes, as %rip-relative
+// displacements are counted from there
+static void append_modrm(int reg, const operand_t* rm, size_t immediate_size)
+{
+  uint8_t reg_bits = (reg & 7) << 3;
+  if (rm->kind == OPERAND_REGISTER)
+  {
+    append_byte(0xC0 | reg_bits | (rm->reg & 7));
+    return;
+  }
+
+  if (rm->base == RIP_REGISTER)
+  {
+    append_byte(0x05 | reg_bits);
+    add_reference(rm->label, 4 + immediate_size, false);
+    return;
+  }
+
+  static const uint8_t SCALE_BITS[9] = {[1] = 0, [2] = 1, [4] = 2, [8] = 3};
+  if (rm->base == NO_REGISTER)
+  {
+    // Only a scaled index and a 32-bit displacement
+    uint8_t index = rm->index == NO_REGISTER ? 4 : rm->index & 7;
+    append_byte(0x04 | reg_bits);
+    append_byte(SCALE_BITS[rm->scale] << 6 | index << 3 | 5);
+    append_value(rm->value, 4);
+    return;
+  }
+
+  // Without a displacement, a base of %rbp or %r13 means there is no base, so they get a zero one
+  uint8_t mod;
+  if (rm->value == 0 && (rm->base & 7) != 5)
+    mod = 0x00;
+  else if (fits_int8(rm->value))
+    mod = 0x40;
+  else
+    mod = 0x80;
+
+  // A base of %rsp or %r12 in the r/m field means there is a SIB byte
+  if (rm->index != NO_REGISTER || (rm->base & 7) == 4)
+  {
+    uint8_t index = rm->index == NO_REGISTER ? 4 : rm->index & 7;
+    append_byte(mod | reg_bits | 4);
+    append_byte(SCALE_BITS[rm->scale] << 6 | index << 3 | (rm->base & 7));
+  }
+  else
+    append_byte(mod | reg_bits | (rm->base & 7));
+
+  if (mod == 0x40)
+    append_value(rm->value, 1);
+  else if (mod == 0x80)
+    append_value(rm->value, 4);
+}
+
+// Appends an instruction using a ModR/M byte: the legacy prefix if it is not 0, the REX prefix if
+// it is needed, the opcode, the ModR/M bytes and the immediate, if its size is not 0.
+// For instructions with an opcode extension, reg is the extension
+static void encode(uint8_t prefix, bool rex_w, const char* opcode, int reg, const operand_t* rm,
+                   bool byte_registers, int64_t immediate, size_t immediate_size)
+{
+  if (prefix != 0)
+    append_byte(prefix);
+  uint8_t rex = (rex_w ? 0x8 : 0) | rex_bits(reg, rm);
+  if (rex != 0 || byte_registers)
+    append_byte(0x40 | rex);
+  for (size_t i = 0; opcode[i] != '\0'; i++)
+    append_byte((uint8_t)opcode[i]);
+  append_modrm(reg, rm, immediate_size);
+  append_value(immediate, immediate_size);
+}
+
+// Appends an instruction with a VEX prefix, on %ymm registers if ymm is set. The legacy prefix
+// 0x66 or 0xF3 becomes the pp field, while vvvv is the extra source register of three-operand
+// instructions, or 0 if there is none
+static void encode_vex(uint8_t prefix, bool ymm, uint8_t opcode, int reg, int vvvv,
+                       const operand_t* rm)
+{
+  uint8_t rex = rex_bits(reg, rm);
+  uint8_t pp = prefix == 0x66 ? 1 : prefix == 0xF3 ? 2 : prefix == 0xF2 ? 3 : 0;
+  uint8_t last = (~vvvv & 0xF) << 3 | (ymm ? 0x4 : 0) | pp;
+  if ((rex & 0x3) == 0)
+  {
+    // The short form only has room for the inverted REX.R bit
+    append_byte(0xC5);
+    append_byte(((rex & 0x4) != 0 ? 0 : 0x80) | last);
+  }
+  else
+  {
+    append_byte(0xC4);
+    append_byte((~rex & 0x7) << 5 | 0x01); // The 0F opcode map
+    append_byte(last);
+  }
+  append_byte(opcode);
+  append_modrm(reg, rm, 0);
+}
+
+// The condition codes of jcc and setcc, with the number they are encoded as
+static int condition_code(const char* name)
+{
+  static const struct
+  {
+    const char* name;
+    int code;
+  } CONDITIONS[] = {
+      {"o", 0x0},   {"no", 0x1},  {"b", 0x2},  {"c", 0x2},  {"nae", 0x2}, {"ae", 0x3},
+      {"nb", 0x3},  {"nc", 0x3},  {"e", 0x4},  {"z", 0x4},  {"ne", 0x5},  {"nz", 0x5},
+      {"be", 0x6},  {"na", 0x6},  {"a", 0x7},  {"nbe", 0x7}, {"s", 0x8},  {"ns", 0x9},
+      {"p", 0xA},   {"pe", 0xA},  {"np", 0xB}, {"po", 0xB}, {"l", 0xC},   {"nge", 0xC},
+      {"ge", 0xD},  {"nl", 0xD},  {"le", 0xE}, {"ng", 0xE}, {"g", 0xF},   {"nle", 0xF},
+  };
+  for (size_t i = 0; i < sizeof(CONDITIONS) / sizeof(CONDITIONS[0]); i++)
+    if (strcmp(CONDITIONS[i].name, name) == 0)
+      return CONDITIONS[i].code;
+  return -1;
+}
+
+static bool is_register_of_size(const operand_t* operand, int size)
+{
+  return operand->kind == OPERAND_REGISTER && operand->size == size &&
+         operand->reg != RIP_REGISTER;
+}
+
+// Reg or memory operands of the given size, as accepted in the r/m field
+static bool is_rm(const operand_t* operand, int size)
+{
+  return is_register_of_size(operand, size) || operand->kind == OPERAND_MEMORY;
+}
+
+// The arithmetic instructions sharing the same encodings, with the opcode extension of each
+static const struct
+{
+  const char* name;
+  int extension;
+} ARITHMETIC[] = {
+    {"add", 0}, {"or", 1}, {"and", 4}, {"sub", 5}, {"xor", 6}, {"cmp", 7},
+};
+
+// Encodes add, or, and, sub, xor and cmp. Returns false if the operands are not supported
+static bool encode_arithmetic(int extension, bool rex_w, int size, const operand_t* source,
+                              const operand_t* destination)
+{
+  if (source->kind == OPERAND_IMMEDIATE && is_rm(destination, size))
+  {
+    if (fits_int8(source->value))
+      encode(0, rex_w, "\x83", extension, destination, false, source->value, 1);
+    else if (!fits_int32(source->value))
+      return false;
+    else if (is_register_of_size(destination, size) && destination->reg == 0)
+    {
+      // The short form for %rax
+      if (rex_w)
+        append_byte(0x48);
+      append_byte(extension << 3 | 5);
+      append_value(source->value, 4);
+    }
+    else
+      encode(0, rex_w, "\x81", extension, destination, false, source->value, 4);
+    return true;
+  }
+  char opcode[2] = {0};
+  if (is_register_of_size(source, size) && is_rm(destination, size))
+  {
+    opcode[0] = (char)(extension << 3 | 1);
+    encode(0, rex_w, opcode, source->reg, destination, false, 0, 0);
+    return true;
+  }
+  if (source->kind == OPERAND_MEMORY && is_register_of_size(destination, size))
+  {
+    opcode[0] = (char)(extension << 3 | 3);
+    encode(0, rex_w, opcode, destination->reg, source, false, 0, 0);
+    return true;
+  }
+  return false;
+}
+
+// Encodes the instruction, where all operands are parsed. Returns false if it is not supported
+static bool encode_instruction(const char* mnemonic, const operand_t* operands, size_t n_operands)
+{
+  const operand_t* a = &operands[0];
+  const operand_t* b = &operands[1];
+  size_t length = strlen(mnemonic);
+  char suffix = length > 0 ? mnemonic[length - 1] : '\0';
+
+  // add, or, and, sub, xor and cmp, on 64 or 32 bits
+  for (size_t i = 0; i < sizeof(ARITHMETIC) / sizeof(ARITHMETIC[0]); i++)
+  {
+    size_t name_length = strlen(ARITHMETIC[i].name);
+    if (length == name_length + 1 && strncmp(mnemonic, ARITHMETIC[i].name, name_length) == 0 &&
+        (suffix == 'q' || suffix == 'l') && n_operands == 2)
+      return encode_arithmetic(ARITHMETIC[i].extension, suffix == 'q', suffix == 'q' ? 8 : 4, a,
+                               b);
+  }
+
+  if (strcmp(mnemonic, "movq") == 0 && n_operands == 2)
+  {
+    if (is_register_of_size(a, 8) && is_rm(b, 8))
+      encode(0, true, "\x89", a->reg, b, false, 0, 0);
+    else if (a->kind == OPERAND_MEMORY && is_register_of_size(b, 8))
+      encode(0, true, "\x8B", b->reg, a, false, 0, 0);
+    else if (a->kind == OPERAND_IMMEDIATE && is_rm(b, 8) && fits_int32(a->value))
+      encode(0, true, "\xC7", 0, b, false, a->value, 4);
+    else if (a->kind == OPERAND_IMMEDIATE && is_register_of_size(b, 8))
+      return encode_instruction("movabsq", operands, n_operands);
+    else
+      return false;
+    return true;
+  }
+  if (strcmp(mnemonic, "movabsq") == 0 && n_operands == 2)
+  {
+    if (a->kind != OPERAND_IMMEDIATE || !is_register_of_size(b, 8))
+      return false;
+    append_byte(0x48 | ((b->reg & 8) != 0 ? 0x1 : 0));
+    append_byte(0xB8 | (b->reg & 7));
+    append_value(a->value, 8);
+    return true;
+  }
+  if (strcmp(mnemonic, "movb") == 0 && n_operands == 2)
+  {
+    if (a->kind == OPERAND_IMMEDIATE && is_rm(b, 1) && a->value >= INT8_MIN && a->value <= 0xFF)
+      encode(0, false, "\xC6", 0, b, needs_rex(b), a->value, 1);
+    else if (is_register_of_size(a, 1) && is_rm(b, 1))
+      encode(0, false, "\x88", a->reg, b, needs_rex(a) || needs_rex(b), 0, 0);
+    else if (a->kind == OPERAND_MEMORY && is_register_of_size(b, 1))
+      encode(0, false, "\x8A", b->reg, a, needs_rex(b), 0, 0);
+    else
+      return false;
+    return true;
+  }
+  if (strcmp(mnemonic, "movzbq") == 0 && n_operands == 2)
+  {
+    if (!is_rm(a, 1) || !is_register_of_size(b, 8))
+      return false;
+    encode(0, true, "\x0F\xB6", b->reg, a, false, 0, 0);
+    return true;
+  }
+  if (strcmp(mnemonic, "leaq") == 0 && n_operands == 2)
+  {
+    if (a->kind != OPERAND_MEMORY || !is_register_of_size(b, 8))
+      return false;
+    encode(0, true, "\x8D", b->reg, a, false, 0, 0);
+    return true;
+  }
+  if (strcmp(mnemonic, "testq") == 0 && n_operands == 2)
+  {
+    if (is_register_of_size(a, 8) && is_rm(b, 8))
+      encode(0, true, "\x85", a->reg, b, false, 0, 0);
+    else if (a->kind == OPERAND_IMMEDIATE && fits_int32(a->value) && is_register_of_size(b, 8) &&
+             b->reg == 0)
+    {
+      append_byte(0x48);
+      append_byte(0xA9);
+      append_value(a->value, 4);
+    }
+    else if (a->kind == OPERAND_IMMEDIATE && fits_int32(a->value) && is_rm(b, 8))
+      encode(0, true, "\xF7", 0, b, false, a->value, 4);
+    else
+      return false;
+    return true;
+  }
+  if (strcmp(mnemonic, "imulq") == 0)
+  {
+    if (n_operands == 1 && is_rm(a, 8))
+      encode(0, true, "\xF7", 5, a, false, 0, 0);
+    else if (n_operands == 2 && is_rm(a, 8) && is_register_of_size(b, 8))
+      encode(0, true, "\x0F\xAF", b->reg, a, false, 0, 0);
+    else if (n_operands >= 2 && a->kind == OPERAND_IMMEDIATE && fits_int32(a->value))
+    {
+      // With two operands, the destination is also the source
+      const operand_t* source = b;
+      const operand_t* destination = n_operands == 3 ? &operands[2] : b;
+      if (!is_rm(source, 8) || !is_register_of_size(destination, 8))
+        return false;
+      if (fits_int8(a->value))
+        encode(0, true, "\x6B", destination->reg, source, false, a->value, 1);
+      else
+        encode(0, true, "\x69", destination->reg, source, false, a->value, 4);
+    }
+    else
+      return false;
+    return true;
+  }
+
+  // Instructions with a single r/m operand, and an opcode extension
+  static const struct
+  {
+    const char* name;
+    int extension;
+  } UNARY[] = {{"notq", 2}, {"negq", 3}, {"mulq", 4}, {"divq", 6}, {"idivq", 7}};
+  for (size_t i = 0; i < sizeof(UNARY) / sizeof(UNARY[0]); i++)
+  {
+    if (strcmp(mnemonic, UNARY[i].name) == 0)
+    {
+      if (n_operands != 1 || !is_rm(a, 8))
+        return false;
+      encode(0, true, "\xF7", UNARY[i].extension, a, false, 0, 0);
+      return true;
+    }
+  }
+
+  static const struct
+  {
+    const char* name;
+    int extension;
+  } SHIFTS[] = {{"salq", 4}, {"shlq", 4}, {"shrq", 5}, {"sarq", 7}};
+  for (size_t i = 0; i < sizeof(SHIFTS) / sizeof(SHIFTS[0]); i++)
+  {
+    if (strcmp(mnemonic, SHIFTS[i].name) == 0)
+    {
+      if (n_operands != 2 || !is_rm(b, 8))
+        return false;
+      if (a->kind == OPERAND_IMMEDIATE && a->value == 1)
+        encode(0, true, "\xD1", SHIFTS[i].extension, b, false, 0, 0);
+      else if (a->kind == OPERAND_IMMEDIATE && a->value >= 0 && a->value < 64)
+        encode(0, true, "\xC1", SHIFTS[i].extension, b, false, a->value, 1);
+      else if (is_register_of_size(a, 1) && a->reg == 1) // %cl
+        encode(0, true, "\xD3", SHIFTS[i].extension, b, false, 0, 0);
+      else
+        return false;
+      return true;
+    }
+  }
+
+  if (strcmp(mnemonic, "pushq") == 0 && n_operands == 1)
+  {
+    if (is_register_of_size(a, 8))
+    {
+      if (a->reg >= 8)
+        append_byte(0x41);
+      append_byte(0x50 | (a->reg & 7));
+    }
+    else if (a->kind == OPERAND_IMMEDIATE && fits_int8(a->value))
+    {
+      append_byte(0x6A);
+      append_value(a->value, 1);
+    }
+    else if (a->kind == OPERAND_IMMEDIATE && fits_int32(a->value))
+    {
+      append_byte(0x68);
+      append_value(a->value, 4);
+    }
+    else if (a->kind == OPERAND_MEMORY)
+      encode(0, false, "\xFF", 6, a, false, 0, 0);
+    else
+      return false;
+    return true;
+  }
+  if (strcmp(mnemonic, "popq") == 0 && n_operands == 1)
+  {
+    if (is_register_of_size(a, 8))
+    {
+      if (a->reg >= 8)
+        append_byte(0x41);
+      append_byte(0x58 | (a->reg & 7));
+    }
+    else if (a->kind == OPERAND_MEMORY)
+      encode(0, false, "\x8F", 0, a, false, 0, 0);
+    else
+      return false;
+    return true;
+  }
+
+  if (n_operands == 0)
+  {
+    if (strcmp(mnemonic, "ret") == 0)
+      append_byte(0xC3);
+    else if (strcmp(mnemonic, "cqo") == 0)
+      append_bytes(current_section, "\x48\x99", 2);
+    else if (strcmp(mnemonic, "vzeroupper") == 0)
+      append_bytes(current_section, "\xC5\xF8\x77", 3);
+    else
+      return false;
+    return true;
+  }
+
+  if (strcmp(mnemonic, "call") == 0 && n_operands == 1)
+  {
+    if (a->kind != OPERAND_LABEL)
+      return false;
+    append_byte(0xE8);
+    add_reference(a->label, 4, true);
+    return true;
+  }
+  if (mnemonic[0] == 'j' && n_operands == 1 && a->kind == OPERAND_LABEL)
+  {
+    int condition = strcmp(mnemonic, "jmp") == 0 ? -1 : condition_code(&mnemonic[1]);
+    if (condition == -1 && strcmp(mnemonic, "jmp") != 0)
+      return false;
+    add_jump(condition, a->label);
+    return true;
+  }
+  if (strncmp(mnemonic, "set", 3) == 0 && n_operands == 1)
+  {
+    int condition = condition_code(&mnemonic[3]);
+    if (condition == -1 || !is_rm(a, 1))
+      return false;
+    char opcode[3] = {0x0F, (char)(0x90 | condition), 0};
+    encode(0, false, opcode, 0, a, needs_rex(a), 0, 0);
+    return true;
+  }
+
+  // SSE2 and AVX2, on %xmm and %ymm registers
+  if (strcmp(mnemonic, "movdqu") == 0 && n_operands == 2)
+  {
+    if (is_rm(a, 16) && is_register_of_size(b, 16))
+      encode(0xF3, false, "\x0F\x6F", b->reg, a, false, 0, 0);
+    else if (is_register_of_size(a, 16) && b->kind == OPERAND_MEMORY)
+      encode(0xF3, false, "\x0F\x7F", a->reg, b, false, 0, 0);
+    else
+      return false;
+    return true;
+  }
+  if ((strcmp(mnemonic, "paddq") == 0 || strcmp(mnemonic, "psubq") == 0) && n_operands == 2)
+  {
+    if (!is_rm(a, 16) || !is_register_of_size(b, 16))
+      return false;
+    encode(0x66, false, mnemonic[1] == 'a' ? "\x0F\xD4" : "\x0F\xFB", b->reg, a, false, 0, 0);
+    return true;
+  }
+  if (strcmp(mnemonic, "pxor") == 0 && n_operands == 2)
+  {
+    if (!is_rm(a, 16) || !is_register_of_size(b, 16))
+      return false;
+    encode(0x66, false, "\x0F\xEF", b->reg, a, false, 0, 0);
+    return true;
+  }
+  if (strcmp(mnemonic, "vmovdqu") == 0 && n_operands == 2)
+  {
+    int size = b->kind == OPERAND_REGISTER ? b->size : a->size;
+    if (size != 16 && size != 32)
+      return false;
+    if (is_rm(a, size) && is_register_of_size(b, size))
+      encode_vex(0xF3, size == 32, 0x6F, b->reg, 0, a);
+    else if (is_register_of_size(a, size) && b->kind == OPERAND_MEMORY)
+      encode_vex(0xF3, size == 32, 0x7F, a->reg, 0, b);
+    else
+      return false;
+    return true;
+  }
+  if ((strcmp(mnemonic, "vpaddq") == 0 || strcmp(mnemonic, "vpsubq") == 0) && n_operands == 3)
+  {
+    const operand_t* destination = &operands[2];
+    int size = destination->size;
+    if ((size != 16 && size != 32) || !is_rm(a, size) || !is_register_of_size(b, size) ||
+        !is_register_of_size(destination, size))
+      return false;
+    encode_vex(0x66, size == 32, mnemonic[2] == 'a' ? 0xD4 : 0xFB, destination->reg, b->reg, a);
+    return true;
+  }
+  return false;
+}
+
+void assemble_instruction(const char* mnemonic, char* const* operands, size_t n_operands)
+{
+  if (current_section != SECTION_TEXT)
+  {
+    fprintf(stderr, "error: instructions can only be assembled in .text\n");
+    exit(EXIT_FAILURE);
+  }
+
+  operand_t parsed[3];
+  for (size_t i = 0; i < n_operands; i++)
+    if (!parse_operand(operands[i], &parsed[i]))
+      unsupported(mnemonic, operands, n_operands);
+
+  // Encodings that are given up on leave nothing behind, so the error shows the whole line
+  if (!encode_instruction(mnemonic, parsed, n_operands))
+    unsupported(mnemonic, operands, n_operands);
+}
+
+/* Directives */
+
+// Appends the characters of a string literal, possibly followed by a zero byte
+static void append_string(const char* text, bool zero_terminated)
+{
+  size_t length;
+  char* characters = decode_string_literal(text, &length);
+  append_bytes(current_section, characters, length + zero_terminated);
+  free(characters);
+}
+
+static size_t parse_size(const char* directive, const char* text)
+{
+  int64_t value;
+  if (!parse_number(text, &value) || value < 0)
+  {
+    fprintf(stderr, "error: expected a size after '%s', found '%s'\n", directive, text);
+    exit(EXIT_FAILURE);
+  }
+  return (size_t)value;
+}
+
+void assemble_label(const char* name)
+{
+  define_label(name, strlen(name));
+}
+
+void assemble_directive(const char* text)
+{
+  text += strspn(text, " \t");
+
+  // Data is usually labeled on the same line, as in "string0: .asciz ..."
+  size_t name_length = strcspn(text, ": \t");
+  if (name_length > 0 && text[name_length] == ':')
+  {
+    define_label(text, name_length);
+    text += name_length + 1;
+    text += strspn(text, " \t");
+  }
+  if (*text == '\0')
+    return;
+
+  size_t directive_length = strcspn(text, " \t");
+  char* directive = strndup(text, directive_length);
+  const char* argument = text + directive_length;
+  argument += strspn(argument, " \t");
+
+  if (strcmp(directive, ".text") == 0)
+    current_section = SECTION_TEXT;
+  else if (strcmp(directive, ".section") == 0)
+  {
+    // The flags and type following the name are those of the section with that name
+    size_t name_length = strcspn(argument, ", \t");
+    size_t i;
+    for (i = 0; i < SECTION_COUNT; i++)
+      if (strlen(SECTION_NAMES[i]) == name_length &&
+          strncmp(argument, SECTION_NAMES[i], name_length) == 0)
+        break;
+    if (i == SECTION_COUNT)
+    {
+      fprintf(stderr, "error: the assembler has no section '%s'\n", argument);
+      exit(EXIT_FAILURE);
+    }
+    current_section = i;
+  }
+  else if (strcmp(directive, ".global") == 0 || strcmp(directive, ".globl") == 0)
+  {
+    size_t index = find_label(argument, strlen(argument));
+    labels[index].global = true;
+  }
+  else if (strcmp(directive, ".align") == 0 || strcmp(directive, ".balign") == 0)
+  {
+    size_t alignment = parse_size(directive, argument);
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+      fprintf(stderr, "error: '%s' expects a power of two, found '%s'\n", directive, argument);
+      exit(EXIT_FAILURE);
+    }
+    align_section(alignment);
+  }
+  else if (strcmp(directive, ".p2align") == 0)
+  {
+    size_t log2 = parse_size(directive, argument);
+    if (log2 >= 16)
+    {
+      fprintf(stderr, "error: '.p2align' expects at most 15, found '%s'\n", argument);
+      exit(EXIT_FAILURE);
+    }
+    align_section((size_t)1 << log2);
+  }
+  else if (strcmp(directive, ".zero") == 0)
+  {
+    size_t size = parse_size(directive, argument);
+    if (current_section == SECTION_BSS)
+      sections[SECTION_BSS].length += size;
+    else
+      for (size_t i = 0; i < size; i++)
+        append_byte(0);
+  }
+  else if (strcmp(directive, ".asciz") == 0 && current_section != SECTION_BSS)
+    append_string(argument, true);
+  else if (strcmp(directive, ".ascii") == 0 && current_section != SECTION_BSS)
+    append_string(argument, false);
+  else
+  {
+    fprintf(stderr, "error: the assembler does not support '%s'\n", text);
+    exit(EXIT_FAILURE);
+  }
+  free(directive);
+}
+
+/* Placing jumps */
+
+static size_t jump_size(const jump_t* jump)
+{
+  if (!jump->long_form)
+    return 2;
+  return jump->condition == -1 ? 5 : 6;
+}
+
+// The address in the final .text of a position in the bytes without jumps, coming after the
+// given number of jumps, which start at the given addresses
+static size_t final_address(const size_t* addresses, size_t position, size_t n_jumps_before)
+{
+  if (n_jumps_before == 0)
+    return position;
+  const jump_t* last = &jumps[n_jumps_before - 1];
+  return position + addresses[n_jumps_before - 1] + jump_size(last) - last->position;
+}
+
+// Makes every jump long that can not reach its target with an 8-bit displacement.
+// Making a jump long may put other jumps out of reach, so this is repeated until no more jumps
+// grow. Fills in the address each jump starts at, and the length of .text after the last one
+static void place_jumps(size_t* addresses)
+{
+  for (size_t i = 0; i < n_jumps; i++)
+  {
+    label_t* target = &labels[jumps[i].target];
+    if (!target->defined || target->section != SECTION_TEXT)
+    {
+      fprintf(stderr, "error: jump to '%s', which is not a label in .text\n", target->name);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (size_t i = 0; i < n_jumps; i++)
+      addresses[i] = final_address(addresses, jumps[i].position, i);
+    addresses[n_jumps] = final_address(addresses, sections[SECTION_TEXT].length, n_jumps);
+
+    for (size_t i = 0; i < n_jumps; i++)
+    {
+      label_t* target = &labels[jumps[i].target];
+      size_t target_address = final_address(addresses, target->offset, target->n_jumps_before);
+      int64_t displacement = (int64_t)target_address - (int64_t)(addresses[i] + 2);
+      if (!jumps[i].long_form && !fits_int8(displacement))
+      {
+        jumps[i].long_form = true;
+        changed = true;
+      }
+    }
+  }
+}
+
+// Rebuilds .text with all jumps in it, and moves labels and references to their final offsets
+static void insert_jumps(void)
+{
+  size_t* addresses = malloc((n_jumps + 1) * sizeof(size_t));
+  place_jumps(addresses);
+
+  section_t* text = &sections[SECTION_TEXT];
+  size_t length = addresses[n_jumps];
+  uint8_t* bytes = malloc(length + 1);
+  size_t copied = 0;
+  size_t out = 0;
+  for (size_t i = 0; i < n_jumps; i++)
+  {
+    memcpy(&bytes[out], &text->bytes[copied], jumps[i].position - copied);
+    out += jumps[i].position - copied;
+    copied = jumps[i].position;
+
+    const jump_t* jump = &jumps[i];
+    const label_t* target = &labels[jump->target];
+    size_t target_address = final_address(addresses, target->offset, target->n_jumps_before);
+    int64_t displacement = (int64_t)target_address - (int64_t)(out + jump_size(jump));
+    if (!jump->long_form)
+    {
+      bytes[out++] = jump->condition == -1 ? 0xEB : 0x70 | jump->condition;
+      bytes[out++] = (uint8_t)displacement;
+      continue;
+    }
+    if (jump->condition == -1)
+      bytes[out++] = 0xE9;
+    else
+    {
+      bytes[out++] = 0x0F;
+      bytes[out++] = 0x80 | jump->condition;
+    }
+    for (int j = 0; j < 4; j++)
+      bytes[out++] = (uint8_t)((uint64_t)displacement >> (8 * j));
+  }
+  memcpy(&bytes[out], &text->bytes[copied], text->length - copied);
+
+  for (size_t i = 0; i < n_labels; i++)
+    if (labels[i].defined && labels[i].section == SECTION_TEXT)
+      labels[i].offset = final_address(addresses, labels[i].offset, labels[i].n_jumps_before);
+  for (size_t i = 0; i < n_references; i++)
+    references[i].position =
+        final_address(addresses, references[i].position, references[i].n_jumps_before);
+
+  free(text->bytes);
+  text->bytes = bytes;
+  text->length = length;
+  text->capacity = length + 1;
+  free(addresses);
+}
+
+/* Writing the object */
+
+// A growing buffer of bytes, for the tables of the object file
+typedef struct
+{
+  uint8_t* bytes;
+  size_t length;
+  size_t capacity;
+} buffer_t;
+
+static void buffer_append(buffer_t* buffer, const void* bytes, size_t length)
+{
+  if (buffer->length + length > buffer->capacity)
+  {
+    buffer->capacity = (buffer->length + length) * 2 + 256;
+    buffer->bytes = realloc(buffer->bytes, buffer->capacity);
+  }
+  memcpy(buffer->bytes + buffer->length, bytes, length);
+  buffer->length += length;
+}
+
+// Adds the string to the string table, and returns its offset
+static Elf64_Word add_string(buffer_t* strings, const char* string)
+{
+  Elf64_Word offset = strings->length;
+  buffer_append(strings, string, strlen(string) + 1);
+  return offset;
+}
+
+// The sections of the object file, in the order of their headers
+enum
+{
+  HEADER_NULL,
+  HEADER_TEXT,
+  HEADER_RELA_TEXT,
+  HEADER_RODATA,
+  HEADER_BSS,
+  HEADER_SYMTAB,
+  HEADER_STRTAB,
+  HEADER_NOTE_STACK,
+  HEADER_SHSTRTAB,
+  HEADER_COUNT
+};
+
+static const Elf64_Half SECTION_HEADERS[SECTION_COUNT] = {HEADER_TEXT, HEADER_RODATA, HEADER_BSS};
+
+static void add_symbol(buffer_t* symbols, Elf64_Word name, unsigned char info, Elf64_Half section,
+                       Elf64_Addr value)
+{
+  Elf64_Sym symbol = {
+      .st_name = name, .st_info = info, .st_other = STV_DEFAULT, .st_shndx = section,
+      .st_value = value, .st_size = 0};
+  buffer_append(symbols, &symbol, sizeof(symbol));
+}
+
+static void free_assembler(void)
+{
+  for (size_t i = 0; i < SECTION_COUNT; i++)
+    free(sections[i].bytes);
+  memset(sections, 0, sizeof(sections));
+  current_section = SECTION_TEXT;
+  free(labels);
+  free(label_buckets);
+  free(jumps);
+  free(references);
+  labels = NULL;
+  label_buckets = NULL;
+  jumps = NULL;
+  references = NULL;
+  n_labels = labels_capacity = n_label_buckets = 0;
+  n_jumps = jumps_capacity = 0;
+  n_references = references_capacity = 0;
+}
+
+// Writes the 32-bit displacement into .text, at the given position
+static void patch_displacement(size_t position, int64_t displacement)
+{
+  for (int i = 0; i < 4; i++)
+    sections[SECTION_TEXT].bytes[position + i] = (uint8_t)((uint64_t)displacement >> (8 * i));
+}
+
+// Places the jumps, and resolves the references to labels in .text.
+// These are at the same distance wherever .text is loaded, so the rest are left
+static void resolve_text_references(void)
+{
+  insert_jumps();
+  for (size_t i = 0; i < n_references; i++)
+  {
+    reference_t* reference = &references[i];
+    label_t* label = &labels[reference->label];
+    size_t end = reference->position + reference->distance;
+    if (label->defined && label->section == SECTION_TEXT)
+      patch_displacement(reference->position, (int64_t)label->offset - (int64_t)end);
+  }
+}
+
+void write_object(void)
+{
+  resolve_text_references();
+
+  buffer_t strings = {0};
+  buffer_t symbols = {0};
+  buffer_t relocations = {0};
+  add_string(&strings, "");
+  add_symbol(&symbols, 0, 0, SHN_UNDEF, 0);
+  for (size_t i = 0; i < SECTION_COUNT; i++)
+    add_symbol(&symbols, 0, ELF64_ST_INFO(STB_LOCAL, STT_SECTION), SECTION_HEADERS[i], 0);
+
+  // Local symbols must come before the global ones.
+  // Labels that are used but never defined are functions in the C library
+  Elf64_Word* symbol_indices = malloc((n_labels + 1) * sizeof(Elf64_Word));
+  Elf64_Word first_global_symbol = 0;
+  for (int global = 0; global < 2; global++)
+  {
+    if (global)
+      first_global_symbol = symbols.length / sizeof(Elf64_Sym);
+    for (size_t i = 0; i < n_labels; i++)
+    {
+      label_t* label = &labels[i];
+      bool is_global = label->global || !label->defined;
+      if (is_global != (bool)global)
+        continue;
+      symbol_indices[i] = symbols.length / sizeof(Elf64_Sym);
+      unsigned char binding = is_global ? STB_GLOBAL : STB_LOCAL;
+      add_symbol(&symbols, add_string(&strings, label->name), ELF64_ST_INFO(binding, STT_NOTYPE),
+                 label->defined ? SECTION_HEADERS[label->section] : SHN_UNDEF,
+                 label->defined ? label->offset : 0);
+    }
+  }
+
+  // The references to the other sections and the C library are left to the linker
+  section_t* text = &sections[SECTION_TEXT];
+  for (size_t i = 0; i < n_references; i++)
+  {
+    reference_t* reference = &references[i];
+    label_t* label = &labels[reference->label];
+    if (label->defined && label->section == SECTION_TEXT)
+      continue;
+
+    Elf64_Rela relocation = {.r_offset = reference->position};
+    int64_t to_end = -(int64_t)reference->distance;
+    // The linker moves the strings when merging them, so references to them must be relative
+    // to the label of the string, and not to the start of the section
+    if (label->defined && label->section == SECTION_RODATA)
+    {
+      relocation.r_info = ELF64_R_INFO(symbol_indices[reference->label], R_X86_64_PC32);
+      relocation.r_addend = to_end;
+    }
+    else if (label->defined)
+    {
+      relocation.r_info = ELF64_R_INFO(1 + label->section, R_X86_64_PC32);
+      relocation.r_addend = (int64_t)label->offset + to_end;
+    }
+    else
+    {
+      Elf64_Word type = reference->call ? R_X86_64_PLT32 : R_X86_64_PC32;
+      relocation.r_info = ELF64_R_INFO(symbol_indices[reference->label], type);
+      relocation.r_addend = to_end;
+    }
+    buffer_append(&relocations, &relocation, sizeof(relocation));
+  }
+  free(symbol_indices);
+
+  buffer_t section_names = {0};
+  Elf64_Word names[HEADER_COUNT] = {0};
+  add_string(&section_names, "");
+  names[HEADER_TEXT] = add_string(&section_names, ".text");
+  names[HEADER_RELA_TEXT] = add_string(&section_names, ".rela.text");
+  names[HEADER_RODATA] = add_string(&section_names, SECTION_NAMES[SECTION_RODATA]);
+  names[HEADER_BSS] = add_string(&section_names, ".bss");
+  names[HEADER_SYMTAB] = add_string(&section_names, ".symtab");
+  names[HEADER_STRTAB] = add_string(&section_names, ".strtab");
+  names[HEADER_NOTE_STACK] = add_string(&section_names, ".note.GNU-stack"); // A stack without exec
+  names[HEADER_SHSTRTAB] = add_string(&section_names, ".shstrtab");
+
+  // The contents of each section follow the file header, in the order of the section headers,
+  // each aligned to 8 bytes
+  Elf64_Shdr headers[HEADER_COUNT] = {0};
+  const void* contents[HEADER_COUNT] = {0};
+  headers[HEADER_TEXT] = (Elf64_Shdr){.sh_type = SHT_PROGBITS,
+                                      .sh_flags = SHF_ALLOC | SHF_EXECINSTR,
+                                      .sh_size = text->length,
+                                      .sh_addralign = text->alignment > 0 ? text->alignment : 1};
+  contents[HEADER_TEXT] = text->bytes;
+  headers[HEADER_RELA_TEXT] = (Elf64_Shdr){.sh_type = SHT_RELA,
+                                           .sh_flags = SHF_INFO_LINK,
+                                           .sh_size = relocations.length,
+                                           .sh_link = HEADER_SYMTAB,
+                                           .sh_info = HEADER_TEXT,
+                                           .sh_addralign = 8,
+                                           .sh_entsize = sizeof(Elf64_Rela)};
+  contents[HEADER_RELA_TEXT] = relocations.bytes;
+  section_t* rodata = &sections[SECTION_RODATA];
+  headers[HEADER_RODATA] =
+      (Elf64_Shdr){.sh_type = SHT_PROGBITS,
+                   .sh_flags = SHF_ALLOC | SHF_MERGE | SHF_STRINGS,
+                   .sh_size = rodata->length,
+                   .sh_addralign = rodata->alignment > 0 ? rodata->alignment : 1,
+                   .sh_entsize = 1};
+  contents[HEADER_RODATA] = rodata->bytes;
+  section_t* bss = &sections[SECTION_BSS];
+  headers[HEADER_BSS] = (Elf64_Shdr){.sh_type = SHT_NOBITS,
+                                     .sh_flags = SHF_ALLOC | SHF_WRITE,
+                                     .sh_size = bss->length,
+                                     .sh_addralign = bss->alignment > 0 ? bss->alignment : 1};
+  headers[HEADER_SYMTAB] = (Elf64_Shdr){.sh_type = SHT_SYMTAB,
+                                        .sh_size = symbols.length,
+                                        .sh_link = HEADER_STRTAB,
+                                        .sh_info = first_global_symbol,
+                                        .sh_addralign = 8,
+                                        .sh_entsize = sizeof(Elf64_Sym)};
+  contents[HEADER_SYMTAB] = symbols.bytes;
+  headers[HEADER_STRTAB] =
+      (Elf64_Shdr){.sh_type = SHT_STRTAB, .sh_size = strings.length, .sh_addralign = 1};
+  contents[HEADER_STRTAB] = strings.bytes;
+  headers[HEADER_NOTE_STACK] = (Elf64_Shdr){.sh_type = SHT_PROGBITS, .sh_addralign = 1};
+  headers[HEADER_SHSTRTAB] =
+      (Elf64_Shdr){.sh_type = SHT_STRTAB, .sh_size = section_names.length, .sh_addralign = 1};
+  contents[HEADER_SHSTRTAB] = section_names.bytes;
+
+  size_t offset = sizeof(Elf64_Ehdr);
+  for (size_t i = 1; i < HEADER_COUNT; i++)
+  {
+    headers[i].sh_name = names[i];
+    offset = (offset + 7) & ~(size_t)7;
+    headers[i].sh_offset = offset;
+    if (headers[i].sh_type != SHT_NOBITS)
+      offset += headers[i].sh_size;
+  }
+  size_t headers_offset = (offset + 7) & ~(size_t)7;
+
+  Elf64_Ehdr header = {
+      .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT,
+                  ELFOSABI_SYSV},
+      .e_type = ET_REL,
+      .e_machine = EM_X86_64,
+      .e_version = EV_CURRENT,
+      .e_shoff = headers_offset,
+      .e_ehsize = sizeof(Elf64_Ehdr),
+      .e_shentsize = sizeof(Elf64_Shdr),
+      .e_shnum = HEADER_COUNT,
+      .e_shstrndx = HEADER_SHSTRTAB,
+  };
+
+  FILE* output = object_output;
+  static const uint8_t padding[8] = {0};
+  fwrite(&header, sizeof(header), 1, output);
+  size_t written = sizeof(header);
+  for (size_t i = 1; i < HEADER_COUNT; i++)
+  {
+    if (headers[i].sh_type == SHT_NOBITS)
+      continue;
+    fwrite(padding, 1, headers[i].sh_offset - written, output);
+    if (headers[i].sh_size > 0)
+      fwrite(contents[i], 1, headers[i].sh_size, output);
+    written = headers[i].sh_offset + headers[i].sh_size;
+  }
+  fwrite(padding, 1, headers_offset - written, output);
+  fwrite(headers, sizeof(Elf64_Shdr), HEADER_COUNT, output);
+
+  free(strings.bytes);
+  free(symbols.bytes);
+  free(relocations.bytes);
+  free(section_names.bytes);
+  free_assembler();
+}
+
+/* Running in memory */
+
+// The memory the program is loaded into, as one mapping.
+// .text and the stubs come first, followed by .rodata and the .bss, each starting on a new page
+static _Thread_local uint8_t* program_memory;
+static _Thread_local size_t program_memory_size;
+static _Thread_local int (*program_main)(int argc, char** argv);
+
+// The program exits by calling exit(), which jumps back into run_loaded_program() instead
+static _Thread_local jmp_buf program_exit;
+static _Thread_local int program_exit_status;
+
+static void exit_program(int status)
+{
+  program_exit_status = status;
+  longjmp(program_exit, 1);
+}
+
+// The functions of the C library the generated code calls, by name
+static const struct
+{
+  const char* name;
+  void* address;
+} HOST_FUNCTIONS[] = {
+    {"printf", (void*)printf},   {"puts", (void*)puts},   {"putchar", (void*)putchar},
+    {"strtol", (void*)strtol},   {"write", (void*)write}, {"exit", (void*)exit_program},
+    {"fopen", (void*)fopen},     {"fprintf", (void*)fprintf}, {"fclose", (void*)fclose},
+};
+
+// The C library may be mapped too far away for a 32-bit displacement, so each function is
+// called through a stub after .text, which is "jmp *0(%rip)" followed by the address
+#define STUB_SIZE 16
+
+// Symbols defined for the loaded code by the compiler itself, with define_host_symbol().
+// They are looked up before the functions of the C library
+typedef struct
+{
+  char* name;
+  void* address;
+} host_symbol_t;
+static _Thread_local host_symbol_t* host_symbols;
+static _Thread_local size_t n_host_symbols;
+
+void define_host_symbol(const char* name, void* address)
+{
+  host_symbols = realloc(host_symbols, (n_host_symbols + 1) * sizeof(host_symbol_t));
+  host_symbols[n_host_symbols++] = (host_symbol_t){.name = strdup(name), .address = address};
+}
+
+static void* host_symbol(const label_t* label)
+{
+  for (size_t i = 0; i < n_host_symbols; i++)
+    if (strcmp(host_symbols[i].name, label->name) == 0)
+      return host_symbols[i].address;
+  for (size_t i = 0; i < sizeof(HOST_FUNCTIONS) / sizeof(HOST_FUNCTIONS[0]); i++)
+    if (strcmp(HOST_FUNCTIONS[i].name, label->name) == 0)
+      return HOST_FUNCTIONS[i].address;
+  fprintf(stderr, "error: '%s' is not defined by the program or the C library\n", label->name);
+  exit(EXIT_FAILURE);
+}
+
+static size_t round_up(size_t size, size_t alignment)
+{
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+static uint8_t* map_memory(size_t size)
+{
+  uint8_t* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+  {
+    fprintf(stderr, "error: could not map memory for the program\n");
+    exit(EXIT_FAILURE);
+  }
+  return memory;
+}
+
+// Lays out everything assembled so far in writable memory from allocate(), with .text and the
+// stubs first, followed by .rodata and the .bss, each starting on a new page. All references are
+// patched, and the code is made executable. Returns the memory and its size, and the address of
+// the given label, or NULL if it is not in .text. Frees the state of the assembler
+static uint8_t* load_sections(uint8_t* (*allocate)(size_t size), size_t* size, const char* entry,
+                              void** entry_address)
+{
+  resolve_text_references();
+
+  // Every undefined label gets a stub, in case it is a function that is called
+  size_t* stubs = malloc((n_labels + 1) * sizeof(size_t));
+  size_t n_stubs = 0;
+  for (size_t i = 0; i < n_labels; i++)
+    stubs[i] = labels[i].defined ? SIZE_MAX : n_stubs++;
+
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t stubs_offset = round_up(sections[SECTION_TEXT].length, STUB_SIZE);
+  size_t offsets[SECTION_COUNT];
+  offsets[SECTION_TEXT] = 0;
+  offsets[SECTION_RODATA] = round_up(stubs_offset + n_stubs * STUB_SIZE, page_size);
+  offsets[SECTION_BSS] = round_up(offsets[SECTION_RODATA] + sections[SECTION_RODATA].length,
+                                  page_size);
+  *size = round_up(offsets[SECTION_BSS] + sections[SECTION_BSS].length + 1, page_size);
+
+  // The pages are written first, and only made executable once everything is in place
+  uint8_t* memory = allocate(*size);
+  memcpy(memory, sections[SECTION_TEXT].bytes, sections[SECTION_TEXT].length);
+  if (sections[SECTION_RODATA].length > 0)
+    memcpy(memory + offsets[SECTION_RODATA], sections[SECTION_RODATA].bytes,
+           sections[SECTION_RODATA].length);
+
+  for (size_t i = 0; i < n_labels; i++)
+  {
+    if (stubs[i] == SIZE_MAX)
+      continue;
+    uint8_t* stub = memory + stubs_offset + stubs[i] * STUB_SIZE;
+    void* address = host_symbol(&labels[i]);
+    memcpy(stub, "\xFF\x25\x00\x00\x00\x00", 6);
+    memcpy(stub + 6, &address, sizeof(address));
+  }
+
+  // Displacements within the memory always fit in 32 bits. Data defined by the compiler is
+  // addressed directly, which needs it in the same code heap
+  for (size_t i = 0; i < n_references; i++)
+  {
+    reference_t* reference = &references[i];
+    label_t* label = &labels[reference->label];
+    uint8_t* end = memory + reference->position + reference->distance;
+    uint8_t* target;
+    if (label->defined)
+      target = memory + offsets[label->section] + label->offset;
+    else if (reference->call)
+      target = memory + stubs_offset + stubs[reference->label] * STUB_SIZE;
+    else
+      target = host_symbol(label);
+
+    int64_t distance = target - end;
+    if (distance != (int32_t)distance)
+    {
+      fprintf(stderr, "error: '%s' is too far away from the code using it\n", label->name);
+      exit(EXIT_FAILURE);
+    }
+    int32_t displacement = (int32_t)distance;
+    memcpy(memory + reference->position, &displacement, sizeof(displacement));
+  }
+  free(stubs);
+
+  size_t entry_label = find_label(entry, strlen(entry));
+  bool in_text = labels[entry_label].defined && labels[entry_label].section == SECTION_TEXT;
+  *entry_address = in_text ? memory + labels[entry_label].offset : NULL;
+
+  if (mprotect(memory, offsets[SECTION_RODATA], PROT_READ | PROT_EXEC) != 0 ||
+      mprotect(memory + offsets[SECTION_RODATA], offsets[SECTION_BSS] - offsets[SECTION_RODATA],
+               PROT_READ) != 0)
+  {
+    fprintf(stderr, "error: could not make the program executable\n");
+    exit(EXIT_FAILURE);
+  }
+  free_assembler();
+  return memory;
+}
+
+void load_program(void)
+{
+  void* main_address;
+  program_memory = load_sections(map_memory, &program_memory_size, "main", &main_address);
+  if (main_address == NULL)
+  {
+    fprintf(stderr, "error: the program has no main function\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(&program_main, &main_address, sizeof(main_address));
+}
+
+// With tiered execution, code is loaded a function at a time, and uses data allocated by the
+// interpreter. All of it is placed in one reserved range of addresses, the code heap, so that
+// the 32-bit displacements between them always fit
+#define CODE_HEAP_SIZE ((size_t)1 << 30)
+static _Thread_local uint8_t* code_heap;
+static _Thread_local size_t code_heap_used;
+
+void* allocate_loaded_memory(size_t size)
+{
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  if (code_heap == NULL)
+  {
+    // Only the pages handed out are made accessible, so the rest takes no memory
+    code_heap = mmap(NULL, CODE_HEAP_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                     -1, 0);
+    if (code_heap == MAP_FAILED)
+    {
+      fprintf(stderr, "error: could not reserve memory for loading code\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  size = round_up(size > 0 ? size : 1, page_size);
+  if (code_heap_used + size > CODE_HEAP_SIZE)
+  {
+    fprintf(stderr, "error: the loaded code does not fit in %zu bytes\n", CODE_HEAP_SIZE);
+    exit(EXIT_FAILURE);
+  }
+  uint8_t* memory = code_heap + code_heap_used;
+  if (mprotect(memory, size, PROT_READ | PROT_WRITE) != 0)
+  {
+    fprintf(stderr, "error: could not map memory for loading code\n");
+    exit(EXIT_FAILURE);
+  }
+  code_heap_used += size;
+  return memory;
+}
+
+static uint8_t* allocate_code(size_t size)
+{
+  return allocate_loaded_memory(size);
+}
+
+void* load_code(const char* label)
+{
+  size_t size;
+  void* address;
+  load_sections(allocate_code, &size, label, &address);
+  if (address == NULL)
+  {
+    fprintf(stderr, "error: the loaded code has no function '%s'\n", label);
+    exit(EXIT_FAILURE);
+  }
+  return address;
+}
+
+void unload_code(void)
+{
+  if (code_heap != NULL)
+    munmap(code_heap, CODE_HEAP_SIZE);
+  code_heap = NULL;
+  code_heap_used = 0;
+
+  for (size_t i = 0; i < n_host_symbols; i++)
+    free(host_symbols[i].name);
+  free(host_symbols);
+  host_symbols = NULL;
+  n_host_symbols = 0;
+}
+
+int run_loaded_program(int argc, char** argv)
+{
+  assert(program_main != NULL && "run_loaded_program() needs a program loaded first");
+
+  // The generated main never returns, but exits with the value of the first function
+  if (setjmp(program_exit) == 0)
+    program_exit_status = program_main(argc, argv);
+  fflush(stdout);
+
+  munmap(program_memory, program_memory_size);
+  program_memory = NULL;
+  program_main = NULL;
+  return program_exit_status;
+}
+
+#endif // __APPLE__
@@ -0,0 +1,839 @@
+#include "vslc.h"
+
+// With --emit-ast=bin, the syntax tree is written out once it is simplified and bound, together
+// with the symbol tables and the string list. Giving that file to vslc as input again loads the
+// tree directly, without scanning, parsing, simplifying or binding anything.
+//
+// The file is a header, followed by these lists, each one right after the previous:
+//  - every node, including the unused NO_NODE and nodes detached by simplification
+//  - the child IDs of all nodes, as in syntax_tree_child_ids
+//  - every symbol: the globals first, then the local symbol table of each function, in the order
+//    of the functions among the globals. Each symbol is given the sequence number it is written
+//    with within its table
+//  - the string list, as indices into the strings
+//  - where each string starts in the characters
+//  - the characters of all strings, each one ending in a zero byte
+// Pointers in nodes and symbols are written as indices into these lists, where a symbol index
+// of 0 means no symbol. Numbers are written in the byte order of the compiler, as the file is
+// only meant to be read by the same compiler that wrote it.
+//
+// The passes after loading trust the tree as much as one they built themselves, so the loaded
+// tree is checked to have the shape the parser and simplification give it before it is used
+
+_Thread_local bool syntax_tree_loaded = false;
+
+#define AST_FILE_VERSION 1
+
+typedef struct
+{
+  char magic[8]; // AST_FILE_MAGIC, with its zero byte
+  uint32_t version;
+  uint32_t root;
+  uint32_t n_nodes;
+  uint32_t n_child_ids;
+  uint32_t n_symbols;
+  uint32_t string_list_len;
+  uint32_t n_strings;
+  uint32_t string_bytes;
+} ast_file_header_t;
+
+typedef struct
+{
+  uint32_t type;
+  uint32_t n_children;
+  uint32_t first_child;
+  uint32_t symbol; // One more than the index of the symbol, or 0
+  int64_t data;    // The number, or the index of the string, or the position in the string list
+} ast_file_node_t;
+
+typedef struct
+{
+  uint32_t name;  // Index of the string
+  uint32_t type;  // The symtype_t
+  uint32_t node;  // The node defining the symbol
+  uint32_t table; // 0 for the global table, else one more than the index of the function
+} ast_file_symbol_t;
+
+/* Writing */
+
+// Maps pointers to the index they are written with, using open addressing.
+// Used for the symbols, and for the strings, so that every atom is only written once
+typedef struct
+{
+  const void* key;
+  uint32_t index;
+} pointer_entry_t;
+
+typedef struct
+{
+  pointer_entry_t* entries;
+  size_t capacity; // Always a power of two
+  size_t n_entries;
+} pointer_map_t;
+
+static size_t pointer_slot(pointer_map_t* map, const void* key)
+{
+  size_t slot = ((uintptr_t)key >> 3) * 0x9e3779b97f4a7c15ull & (map->capacity - 1);
+  while (map->entries[slot].key != NULL && map->entries[slot].key != key)
+    slot = (slot + 1) & (map->capacity - 1);
+  return slot;
+}
+
+static void pointer_map_insert(pointer_map_t* map, const void* key, uint32_t index)
+{
+  if ((map->n_entries + 1) * 2 > map->capacity)
+  {
+    pointer_map_t grown = {.capacity = map->capacity > 0 ? map->capacity * 2 : 64};
+    grown.entries = calloc(grown.capacity, sizeof(pointer_entry_t));
+    for (size_t i = 0; i < map->capacity; i++)
+      if (map->entries[i].key != NULL)
+        pointer_map_insert(&grown, map->entries[i].key, map->entries[i].index);
+    free(map->entries);
+    *map = grown;
+  }
+  size_t slot = pointer_slot(map, key);
+  if (map->entries[slot].key == NULL)
+    map->n_entries++;
+  map->entries[slot] = (pointer_entry_t){.key = key, .index = index};
+}
+
+// Returns the index of the pointer, or -1 if it has none
+static int64_t pointer_map_lookup(pointer_map_t* map, const void* key)
+{
+  if (map->capacity == 0)
+    return -1;
+  size_t slot = pointer_slot(map, key);
+  return map->entries[slot].key == NULL ? -1 : (int64_t)map->entries[slot].index;
+}
+
+// The strings of the file being written, and where each of them starts
+typedef struct
+{
+  pointer_map_t indices;
+  uint32_t* offsets;
+  size_t n_strings;
+  char* characters;
+  size_t n_characters;
+} string_writer_t;
+
+// Returns the index of the string, adding it the first time it is seen
+static uint32_t write_string(string_writer_t* strings, const char* string)
+{
+  int64_t index = pointer_map_lookup(&strings->indices, string);
+  if (index >= 0)
+    return index;
+
+  size_t length = strlen(string) + 1;
+  strings->offsets = realloc(strings->offsets, (strings->n_strings + 1) * sizeof(uint32_t));
+  strings->offsets[strings->n_strings] = strings->n_characters;
+  strings->characters = realloc(strings->characters, strings->n_characters + length);
+  memcpy(strings->characters + strings->n_characters, string, length);
+  strings->n_characters += length;
+  pointer_map_insert(&strings->indices, string, strings->n_strings);
+  return strings->n_strings++;
+}
+
+static void add_symbol(ast_file_symbol_t** symbols, size_t* n_symbols, pointer_map_t* indices,
+                       string_writer_t* strings, symbol_t* symbol, uint32_t table)
+{
+  *symbols = realloc(*symbols, (*n_symbols + 1) * sizeof(ast_file_symbol_t));
+  (*symbols)[*n_symbols] = (ast_file_symbol_t){
+      .name = write_string(strings, symbol->name),
+      .type = symbol->type,
+      .node = symbol->node,
+      .table = table,
+  };
+  pointer_map_insert(indices, symbol, *n_symbols);
+  (*n_symbols)++;
+}
+
+static void write_list(const void* list, size_t size, size_t count)
+{
+  if (count > 0 && fwrite(list, size, count, stdout) != count)
+  {
+    fprintf(stderr, "error: could not write the syntax tree\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void write_ast_file(void)
+{
+  string_writer_t strings = {.offsets = NULL};
+
+  ast_file_symbol_t* symbols = NULL;
+  size_t n_symbols = 0;
+  pointer_map_t symbol_indices = {.entries = NULL};
+  for (size_t i = 0; i < global_symbols->n_symbols; i++)
+    add_symbol(&symbols, &n_symbols, &symbol_indices, &strings, global_symbols->symbols[i], 0);
+  for (size_t i = 0; i < global_symbols->n_of_type[SYMBOL_FUNCTION]; i++)
+  {
+    symbol_t* function = global_symbols->of_type[SYMBOL_FUNCTION][i];
+    symbol_table_t* locals = function->function_symtable;
+    uint32_t table = function->sequence_number + 1;
+    for (size_t j = 0; j < locals->n_symbols; j++)
+      add_symbol(&symbols, &n_symbols, &symbol_indices, &strings, locals->symbols[j], table);
+  }
+
+  // NO_NODE is never initialized, so it is written as an empty node
+  size_t n_nodes = syntax_tree_node_count() + 1;
+  ast_file_node_t* nodes = calloc(n_nodes, sizeof(ast_file_node_t));
+  for (size_t i = 1; i < n_nodes; i++)
+  {
+    node_t* node = &syntax_tree_nodes[i];
+    int64_t symbol = -1;
+    if (node->symbol != NULL)
+      symbol = pointer_map_lookup(&symbol_indices, node->symbol);
+    nodes[i] = (ast_file_node_t){
+        .type = node->type,
+        .n_children = node->n_children,
+        .first_child = node->first_child,
+        .symbol = symbol + 1,
+    };
+    switch (node->type)
+    {
+    case OPERATOR:
+      nodes[i].data = write_string(&strings, node->data.operator);
+      break;
+    case IDENTIFIER:
+      nodes[i].data = write_string(&strings, node->data.identifier);
+      break;
+    case STRING_LITERAL:
+      nodes[i].data = write_string(&strings, node->data.string_literal);
+      break;
+    case NUMBER_LITERAL:
+      nodes[i].data = node->data.number_literal;
+      break;
+    case STRING_LIST_REFERENCE:
+      nodes[i].data = node->data.string_list_index;
+      break;
+    default:
+      break;
+    }
+  }
+
+  // The child IDs in use all come before the end of the last list of children. The rest of the
+  // list is either room for more children, or lists that were moved, and is written as NO_NODE
+  size_t n_child_ids = 0;
+  for (size_t i = 1; i < n_nodes; i++)
+  {
+    node_t* node = &syntax_tree_nodes[i];
+    if (node->first_child + node->n_children > n_child_ids)
+      n_child_ids = node->first_child + node->n_children;
+  }
+  node_id_t* child_ids = calloc(n_child_ids + 1, sizeof(node_id_t));
+  for (size_t i = 1; i < n_nodes; i++)
+  {
+    node_t* node = &syntax_tree_nodes[i];
+    memcpy(&child_ids[node->first_child], &syntax_tree_child_ids[node->first_child],
+           node->n_children * sizeof(node_id_t));
+  }
+
+  uint32_t* string_list_indices = malloc((string_list_len + 1) * sizeof(uint32_t));
+  for (size_t i = 0; i < string_list_len; i++)
+    string_list_indices[i] = write_string(&strings, string_list[i]);
+
+  ast_file_header_t header = {
+      .magic = AST_FILE_MAGIC,
+      .version = AST_FILE_VERSION,
+      .root = root,
+      .n_nodes = n_nodes,
+      .n_child_ids = n_child_ids,
+      .n_symbols = n_symbols,
+      .string_list_len = string_list_len,
+      .n_strings = strings.n_strings,
+      .string_bytes = strings.n_characters,
+  };
+  write_list(&header, sizeof(header), 1);
+  write_list(nodes, sizeof(ast_file_node_t), n_nodes);
+  write_list(child_ids, sizeof(node_id_t), n_child_ids);
+  write_list(symbols, sizeof(ast_file_symbol_t), n_symbols);
+  write_list(string_list_indices, sizeof(uint32_t), string_list_len);
+  write_list(strings.offsets, sizeof(uint32_t), strings.n_strings);
+  write_list(strings.characters, 1, strings.n_characters);
+  fflush(stdout);
+
+  free(string_list_indices);
+  free(child_ids);
+  free(nodes);
+  free(symbols);
+  free(symbol_indices.entries);
+  free(strings.indices.entries);
+  free(strings.offsets);
+  free(strings.characters);
+}
+
+/* Reading */
+
+bool is_ast_file(const char* data, size_t length)
+{
+  return length >= sizeof(ast_file_header_t) && memcmp(data, AST_FILE_MAGIC, 8) == 0;
+}
+
+static void malformed(const char* problem)
+{
+  fprintf(stderr, "error: malformed syntax tree file: %s\n", problem);
+  exit(EXIT_FAILURE);
+}
+
+// Returns the string with the given index as an atom. Each string is only interned the first time
+static atom_t string_atom(atom_t* atoms, const char* const* strings, size_t index)
+{
+  if (atoms[index] == NULL)
+    atoms[index] = atom_intern(strings[index], strlen(strings[index]));
+  return atoms[index];
+}
+
+// Returns the next list of the file, of count elements of the given size, and moves past it.
+// Exits if the file ends before it does
+static const void* read_list(const char** position, const char* end, size_t size, size_t count)
+{
+  if ((size_t)(end - *position) / size < count)
+    malformed("the file ends too early");
+  const void* list = *position;
+  *position += size * count;
+  return list;
+}
+
+/* Validating */
+
+// The place of a node in the tree, which decides what the node may be
+typedef enum
+{
+  PLACE_GLOBALS,          // The root LIST
+  PLACE_GLOBAL,           // A GLOBAL_DECLARATION or FUNCTION in the root LIST
+  PLACE_GLOBAL_VARIABLES, // The LIST of variables and arrays of a GLOBAL_DECLARATION
+  PLACE_GLOBAL_VARIABLE,  // An IDENTIFIER or ARRAY_INDEXING declaring a global
+  PLACE_PARAMETERS,       // The LIST of parameters of a FUNCTION
+  PLACE_PARAMETER,        // An IDENTIFIER declaring a parameter
+  PLACE_DECLARATIONS,     // The LIST of declarations, when a BLOCK has two children
+  PLACE_DECLARATION,      // The LIST of variables and arrays of one declaration
+  PLACE_LOCAL_VARIABLE,   // An IDENTIFIER or ARRAY_INDEXING declaring a local
+  PLACE_DECLARED_NAME,    // The IDENTIFIER naming a FUNCTION or a global array
+  PLACE_LOCAL_ARRAY_NAME, // The IDENTIFIER naming a local array, bound to it
+  PLACE_STATEMENTS,       // The LIST of statements of a BLOCK
+  PLACE_STATEMENT,        // Any statement, or NO_NODE when it was removed by simplification
+  PLACE_ASSIGNED,         // The IDENTIFIER or ARRAY_INDEXING an ASSIGNMENT_STATEMENT assigns to
+  PLACE_PRINT_ITEMS,      // The LIST of a PRINT_STATEMENT
+  PLACE_PRINT_ITEM,       // An expression or a STRING_LIST_REFERENCE
+  PLACE_ARGUMENTS,        // The LIST of arguments of a FUNCTION_CALL
+  PLACE_EXPRESSION,       // Any expression
+  PLACE_VARIABLE,         // An IDENTIFIER bound to a variable or parameter
+  PLACE_ARRAY,            // The IDENTIFIER of an ARRAY_INDEXING, bound to an array
+  PLACE_CALLED,           // The IDENTIFIER of a FUNCTION_CALL, bound to a function
+} place_t;
+
+// A node yet to be checked, with what is known about it from its parents
+typedef struct
+{
+  node_id_t id;
+  place_t place;
+  uint32_t function; // The table of the function the node is in, as written in the file
+  uint32_t symbol;   // For PLACE_LOCAL_ARRAY_NAME, the symbol it must be bound to
+  bool in_loop;
+} pending_node_t;
+
+typedef struct
+{
+  pending_node_t* nodes;
+  size_t n_nodes;
+  size_t capacity;
+} pending_stack_t;
+
+// Pushes the children of the node, each in the place at the same index.
+// The last place is used for all remaining children
+static void push_children(pending_stack_t* stack, node_t* node, pending_node_t parent,
+                          const place_t* places, size_t n_places)
+{
+  if (stack->n_nodes + node->n_children > stack->capacity)
+  {
+    stack->capacity = (stack->n_nodes + node->n_children) * 2 + 8;
+    stack->nodes = realloc(stack->nodes, stack->capacity * sizeof(pending_node_t));
+  }
+  for (size_t i = 0; i < node->n_children; i++)
+  {
+    pending_node_t child = parent;
+    child.id = syntax_tree_child_ids[node->first_child + i];
+    child.place = places[i < n_places ? i : n_places - 1];
+    stack->nodes[stack->n_nodes++] = child;
+  }
+}
+
+#define PUSH_CHILDREN(stack, node, parent, ...)                                  \
+  push_children((stack), (node), (parent), (const place_t[]){__VA_ARGS__},       \
+                sizeof((const place_t[]){__VA_ARGS__}) / sizeof(place_t))
+
+static void expect_children(node_t* node, size_t min, size_t max)
+{
+  if (node->n_children < min || node->n_children > max)
+    malformed("wrong number of children");
+}
+
+static bool is_operator(const char* operator, size_t n_operands)
+{
+  static const char* const unary[] = {"-", "!"};
+  static const char* const binary[] = {"==", "!=", "<", "<=", ">", ">=", "+", "-", "*", "/"};
+  const char* const* operators = n_operands == 1 ? unary : binary;
+  size_t n_operators = n_operands == 1 ? sizeof(unary) / sizeof(*unary)
+                                       : sizeof(binary) / sizeof(*binary);
+  for (size_t i = 0; i < n_operators; i++)
+    if (strcmp(operator, operators[i]) == 0)
+      return true;
+  return false;
+}
+
+// The symbols a node may be declared by, or bound to, in each place
+static bool symbol_fits(place_t place, symtype_t type)
+{
+  switch (place)
+  {
+  case PLACE_VARIABLE:
+  case PLACE_ASSIGNED:
+    return type == SYMBOL_GLOBAL_VAR || type == SYMBOL_PARAMETER || type == SYMBOL_LOCAL_VAR;
+  case PLACE_ARRAY:
+    return type == SYMBOL_GLOBAL_ARRAY || type == SYMBOL_LOCAL_ARRAY;
+  case PLACE_CALLED:
+    return type == SYMBOL_FUNCTION;
+  default:
+    return false;
+  }
+}
+
+// Checks that every node reachable from the root is where the parser and simplification could
+// have put it, with the right number and types of children, and that every symbol is declared by
+// exactly one of them. Identifiers must be bound to symbols of the right type, in the function
+// they are used in. Nodes are checked using an explicit stack, and a node reached twice means the
+// file has a cycle or a shared child, so trees of any depth are checked without recursing
+static void validate_syntax_tree(const ast_file_node_t* nodes, size_t n_nodes,
+                                 const ast_file_symbol_t* symbols, symbol_t** symbol_pointers,
+                                 size_t n_symbols)
+{
+  // The symbol declared by each node, as written in the file
+  uint32_t* declared = calloc(n_nodes, sizeof(uint32_t));
+  for (size_t i = 0; i < n_symbols; i++)
+  {
+    if (declared[symbols[i].node] != 0)
+      malformed("node declaring two symbols");
+    declared[symbols[i].node] = i + 1;
+  }
+  size_t n_declared = 0;
+
+  bool* visited = calloc(n_nodes, sizeof(bool));
+  pending_stack_t stack = {.nodes = malloc(sizeof(pending_node_t)), .n_nodes = 1, .capacity = 1};
+  stack.nodes[0] = (pending_node_t){.id = root, .place = PLACE_GLOBALS};
+
+  while (stack.n_nodes > 0)
+  {
+    pending_node_t pending = stack.nodes[--stack.n_nodes];
+    if (pending.id == NO_NODE)
+    {
+      if (pending.place != PLACE_STATEMENT)
+        malformed("missing child");
+      continue;
+    }
+    if (visited[pending.id])
+      malformed("node reached twice");
+    visited[pending.id] = true;
+
+    node_t* node = &syntax_tree_nodes[pending.id];
+    const ast_file_node_t* record = &nodes[pending.id];
+
+    // Nodes declaring a symbol are of the symbol's type, and in the function owning it
+    symtype_t declares = SYMBOL_TYPE_COUNT;
+    // Identifiers using a symbol are bound to one that fits the place
+    bool binds = false;
+
+    switch (pending.place)
+    {
+    case PLACE_GLOBAL:
+      if (node->type == GLOBAL_DECLARATION)
+      {
+        expect_children(node, 1, 1);
+        PUSH_CHILDREN(&stack, node, pending, PLACE_GLOBAL_VARIABLES);
+      }
+      else if (node->type == FUNCTION)
+      {
+        expect_children(node, 3, 3);
+        declares = SYMBOL_FUNCTION;
+        if (declared[pending.id] != 0)
+          pending.function = symbol_pointers[declared[pending.id] - 1]->sequence_number + 1;
+        PUSH_CHILDREN(&stack, node, pending, PLACE_DECLARED_NAME, PLACE_PARAMETERS,
+                      PLACE_STATEMENT);
+      }
+      else
+        malformed("unexpected global node");
+      break;
+
+    case PLACE_GLOBALS:
+    case PLACE_GLOBAL_VARIABLES:
+    case PLACE_PARAMETERS:
+    case PLACE_DECLARATIONS:
+    case PLACE_DECLARATION:
+    case PLACE_STATEMENTS:
+    case PLACE_PRINT_ITEMS:
+    case PLACE_ARGUMENTS:
+    {
+      if (node->type != LIST)
+        malformed("expected a list");
+      static const place_t element_places[] = {
+          [PLACE_GLOBALS] = PLACE_GLOBAL,
+          [PLACE_GLOBAL_VARIABLES] = PLACE_GLOBAL_VARIABLE,
+          [PLACE_PARAMETERS] = PLACE_PARAMETER,
+          [PLACE_DECLARATIONS] = PLACE_DECLARATION,
+          [PLACE_DECLARATION] = PLACE_LOCAL_VARIABLE,
+          [PLACE_STATEMENTS] = PLACE_STATEMENT,
+          [PLACE_PRINT_ITEMS] = PLACE_PRINT_ITEM,
+          [PLACE_ARGUMENTS] = PLACE_EXPRESSION,
+      };
+      PUSH_CHILDREN(&stack, node, pending, element_places[pending.place]);
+      break;
+    }
+
+    case PLACE_GLOBAL_VARIABLE:
+    case PLACE_LOCAL_VARIABLE:
+    {
+      bool global = pending.place == PLACE_GLOBAL_VARIABLE;
+      if (node->type == IDENTIFIER)
+      {
+        expect_children(node, 0, 0);
+        declares = global ? SYMBOL_GLOBAL_VAR : SYMBOL_LOCAL_VAR;
+      }
+      else if (node->type == ARRAY_INDEXING)
+      {
+        expect_children(node, 2, 2);
+        declares = global ? SYMBOL_GLOBAL_ARRAY : SYMBOL_LOCAL_ARRAY;
+        // Global arrays have constant lengths, which the code generator needs
+        if (global && node_child(node, 1)->type != NUMBER_LITERAL)
+          malformed("global array without a constant length");
+        pending.symbol = declared[pending.id];
+        PUSH_CHILDREN(&stack, node, pending,
+                      global ? PLACE_DECLARED_NAME : PLACE_LOCAL_ARRAY_NAME, PLACE_EXPRESSION);
+      }
+      else
+        malformed("unexpected declaration");
+      break;
+    }
+
+    case PLACE_PARAMETER:
+      if (node->type != IDENTIFIER)
+        malformed("unexpected parameter");
+      expect_children(node, 0, 0);
+      declares = SYMBOL_PARAMETER;
+      break;
+
+    case PLACE_DECLARED_NAME:
+      if (node->type != IDENTIFIER)
+        malformed("expected a name");
+      expect_children(node, 0, 0);
+      break;
+
+    case PLACE_LOCAL_ARRAY_NAME:
+      if (node->type != IDENTIFIER || record->symbol != pending.symbol)
+        malformed("local array not bound to itself");
+      expect_children(node, 0, 0);
+      binds = true;
+      break;
+
+    case PLACE_STATEMENT:
+      switch (node->type)
+      {
+      case BLOCK:
+        expect_children(node, 1, 2);
+        if (node->n_children == 2)
+          PUSH_CHILDREN(&stack, node, pending, PLACE_DECLARATIONS, PLACE_STATEMENTS);
+        else
+          PUSH_CHILDREN(&stack, node, pending, PLACE_STATEMENTS);
+        break;
+      case ASSIGNMENT_STATEMENT:
+        expect_children(node, 2, 2);
+        PUSH_CHILDREN(&stack, node, pending, PLACE_ASSIGNED, PLACE_EXPRESSION);
+        break;
+      case RETURN_STATEMENT:
+        expect_children(node, 1, 1);
+        PUSH_CHILDREN(&stack, node, pending, PLACE_EXPRESSION);
+        break;
+      case PRINT_STATEMENT:
+        expect_children(node, 1, 1);
+        PUSH_CHILDREN(&stack, node, pending, PLACE_PRINT_ITEMS);
+        break;
+      case IF_STATEMENT:
+        expect_children(node, 2, 3);
+        PUSH_CHILDREN(&stack, node, pending, PLACE_EXPRESSION, PLACE_STATEMENT);
+        break;
+      case WHILE_STATEMENT:
+        expect_children(node, 2, 2);
+        PUSH_CHILDREN(&stack, node, pending, PLACE_EXPRESSION, PLACE_STATEMENT);
+        stack.nodes[stack.n_nodes - 1].in_loop = true; // The body
+        break;
+      case BREAK_STATEMENT:
+        if (!pending.in_loop)
+          malformed("break outside of a while loop");
+        expect_children(node, 0, 0);
+        break;
+      case FUNCTION_CALL:
+        pending.place = PLACE_EXPRESSION;
+        break;
+      default:
+        malformed("unexpected statement");
+      }
+      break;
+
+    case PLACE_ASSIGNED:
+      if (node->type == IDENTIFIER)
+      {
+        expect_children(node, 0, 0);
+        binds = true;
+      }
+      else if (node->type == ARRAY_INDEXING)
+        pending.place = PLACE_EXPRESSION;
+      else
+        malformed("unexpected assignment");
+      break;
+
+    case PLACE_PRINT_ITEM:
+      if (node->type == STRING_LIST_REFERENCE)
+        expect_children(node, 0, 0);
+      else
+        pending.place = PLACE_EXPRESSION;
+      break;
+
+    case PLACE_VARIABLE:
+    case PLACE_ARRAY:
+    case PLACE_CALLED:
+      if (node->type != IDENTIFIER)
+        malformed("expected a name");
+      expect_children(node, 0, 0);
+      binds = true;
+      break;
+
+    default:
+      break;
+    }
+
+    // Function calls and array indexing are checked as expressions, also where they are
+    // statements or assigned to
+    if (pending.place == PLACE_EXPRESSION)
+    {
+      switch (node->type)
+      {
+      case OPERATOR:
+        expect_children(node, 1, 2);
+        if (!is_operator(node->data.operator, node->n_children))
+          malformed("unknown operator");
+        PUSH_CHILDREN(&stack, node, pending, PLACE_EXPRESSION);
+        break;
+      case FUNCTION_CALL:
+        expect_children(node, 2, 2);
+        PUSH_CHILDREN(&stack, node, pending, PLACE_CALLED, PLACE_ARGUMENTS);
+        break;
+      case ARRAY_INDEXING:
+        expect_children(node, 2, 2);
+        PUSH_CHILDREN(&stack, node, pending, PLACE_ARRAY, PLACE_EXPRESSION);
+        break;
+      case IDENTIFIER:
+        expect_children(node, 0, 0);
+        pending.place = PLACE_VARIABLE;
+        binds = true;
+        break;
+      case NUMBER_LITERAL:
+        expect_children(node, 0, 0);
+        break;
+      default:
+        malformed("unexpected expression");
+      }
+    }
+
+    if (binds)
+    {
+      if (record->symbol == 0)
+        malformed("identifier without a symbol");
+      const ast_file_symbol_t* symbol = &symbols[record->symbol - 1];
+      if (pending.place != PLACE_LOCAL_ARRAY_NAME && !symbol_fits(pending.place, symbol->type))
+        malformed("identifier bound to the wrong type of symbol");
+      if (symbol->table != 0 && symbol->table != pending.function)
+        malformed("identifier bound to a symbol of another function");
+    }
+    else if (record->symbol != 0)
+      malformed("symbol on a node that does not use one");
+
+    if (declares != SYMBOL_TYPE_COUNT)
+    {
+      uint32_t index = declared[pending.id];
+      uint32_t table = declares == SYMBOL_FUNCTION || declares == SYMBOL_GLOBAL_VAR ||
+                               declares == SYMBOL_GLOBAL_ARRAY
+                           ? 0
+                           : pending.function;
+      if (index == 0 || symbols[index - 1].type != declares || symbols[index - 1].table != table)
+        malformed("declaration without its symbol");
+      n_declared++;
+    }
+    else if (declared[pending.id] != 0)
+      malformed("symbol not declared by its node");
+  }
+
+  // Every symbol was declared by a node of the tree, since no node declares two
+  if (n_declared != n_symbols)
+    malformed("symbol declared outside of the tree");
+
+  free(stack.nodes);
+  free(visited);
+  free(declared);
+}
+
+void read_ast_file(const char* data, size_t length)
+{
+  const char* end = data + length;
+  const char* position = data;
+  ast_file_header_t header;
+  memcpy(&header, read_list(&position, end, sizeof(header), 1), sizeof(header));
+  if (header.version != AST_FILE_VERSION)
+    malformed("written by another version of vslc");
+
+  // The lists are copied out of the file, which may not keep them aligned. Each list is found in
+  // the file before it is copied, so the counts in the header are never larger than the file
+  size_t n_nodes = header.n_nodes;
+  const void* node_list = read_list(&position, end, sizeof(ast_file_node_t), n_nodes);
+  ast_file_node_t* nodes = malloc((n_nodes + 1) * sizeof(ast_file_node_t));
+  memcpy(nodes, node_list, n_nodes * sizeof(ast_file_node_t));
+  const void* child_ids = read_list(&position, end, sizeof(node_id_t), header.n_child_ids);
+  const void* symbol_list =
+      read_list(&position, end, sizeof(ast_file_symbol_t), header.n_symbols);
+  ast_file_symbol_t* symbols = malloc((header.n_symbols + 1) * sizeof(ast_file_symbol_t));
+  memcpy(symbols, symbol_list, header.n_symbols * sizeof(ast_file_symbol_t));
+  const void* index_list = read_list(&position, end, sizeof(uint32_t), header.string_list_len);
+  uint32_t* string_list_indices = malloc((header.string_list_len + 1) * sizeof(uint32_t));
+  memcpy(string_list_indices, index_list, header.string_list_len * sizeof(uint32_t));
+  const void* offset_list = read_list(&position, end, sizeof(uint32_t), header.n_strings);
+  uint32_t* offsets = malloc((header.n_strings + 1) * sizeof(uint32_t));
+  memcpy(offsets, offset_list, header.n_strings * sizeof(uint32_t));
+  const char* characters = read_list(&position, end, 1, header.string_bytes);
+  if (n_nodes == 0 || header.root == NO_NODE || header.root >= n_nodes)
+    malformed("no root node");
+  if (header.string_bytes > 0 && characters[header.string_bytes - 1] != '\0')
+    malformed("unterminated string");
+
+  const char** strings = malloc((header.n_strings + 1) * sizeof(char*));
+  for (size_t i = 0; i < header.n_strings; i++)
+  {
+    if (offsets[i] >= header.string_bytes)
+      malformed("string out of range");
+    strings[i] = characters + offsets[i];
+  }
+  atom_t* atoms = calloc(header.n_strings + 1, sizeof(atom_t));
+
+  allocate_syntax_tree(n_nodes, header.n_child_ids);
+  memcpy(syntax_tree_child_ids, child_ids, header.n_child_ids * sizeof(node_id_t));
+  for (size_t i = 0; i < header.n_child_ids; i++)
+    if (syntax_tree_child_ids[i] >= n_nodes)
+      malformed("child out of range");
+  root = header.root;
+
+  // The symbols are made before the nodes, which point to them
+  symbol_t** symbol_pointers = malloc((header.n_symbols + 1) * sizeof(symbol_t*));
+  global_symbols = symbol_table_init();
+  for (size_t i = 0; i < header.n_symbols; i++)
+  {
+    ast_file_symbol_t* record = &symbols[i];
+    if (record->name >= header.n_strings || record->node >= n_nodes ||
+        record->type >= SYMBOL_TYPE_COUNT)
+      malformed("symbol out of range");
+
+    symbol_t* symbol = malloc(sizeof(symbol_t));
+    *symbol = (symbol_t){
+        .name = string_atom(atoms, strings, record->name),
+        .type = record->type,
+        .node = record->node,
+        .function_symtable = NULL,
+    };
+    symbol_pointers[i] = symbol;
+
+    // Functions come before their local symbols, which are in order of their sequence numbers
+    if (record->table == 0)
+    {
+      if (symbol->type == SYMBOL_FUNCTION)
+        symbol->function_symtable = symbol_table_init();
+      if (symbol_table_insert(global_symbols, symbol) == INSERT_COLLISION)
+        malformed("symbol defined twice");
+      continue;
+    }
+    if (record->table > global_symbols->n_symbols ||
+        global_symbols->symbols[record->table - 1]->type != SYMBOL_FUNCTION)
+      malformed("symbol in a table that does not exist");
+    symbol_table_t* table = global_symbols->symbols[record->table - 1]->function_symtable;
+    if (symbol->type == SYMBOL_PARAMETER)
+    {
+      if (symbol_table_insert(table, symbol) == INSERT_COLLISION)
+        malformed("symbol defined twice");
+    }
+    else
+    {
+      symbol->function_symtable = table;
+      symbol_table_append(table, symbol);
+    }
+  }
+
+  syntax_tree_nodes[NO_NODE] = (node_t){.type = LIST};
+  for (size_t i = 1; i < n_nodes; i++)
+  {
+    ast_file_node_t* record = &nodes[i];
+    if (record->type >= NODE_TYPE_COUNT || record->symbol > header.n_symbols ||
+        (uint64_t)record->first_child + record->n_children > header.n_child_ids)
+      malformed("node out of range");
+
+    node_t* node = &syntax_tree_nodes[i];
+    *node = (node_t){
+        .type = record->type,
+        .n_children = record->n_children,
+        .first_child = record->first_child,
+        .children_capacity = record->n_children,
+        .symbol = record->symbol != 0 ? symbol_pointers[record->symbol - 1] : NULL,
+    };
+
+    bool is_string =
+        record->type == OPERATOR || record->type == IDENTIFIER || record->type == STRING_LITERAL;
+    if (is_string && (record->data < 0 || record->data >= header.n_strings))
+      malformed("string out of range");
+    switch (record->type)
+    {
+    case OPERATOR:
+      node->data.operator = string_atom(atoms, strings, record->data);
+      break;
+    case IDENTIFIER:
+      node->data.identifier = string_atom(atoms, strings, record->data);
+      break;
+    case STRING_LITERAL:
+      node->data.string_literal = node_strdup(strings[record->data]);
+      break;
+    case NUMBER_LITERAL:
+      node->data.number_literal = record->data;
+      break;
+    case STRING_LIST_REFERENCE:
+      if (record->data < 0 || record->data >= header.string_list_len)
+        malformed("string list reference out of range");
+      node->data.string_list_index = record->data;
+      break;
+    default:
+      break;
+    }
+  }
+
+  // The strings of the string list belong to the syntax tree
+  string_list = malloc((header.string_list_len + 1) * sizeof(char*));
+  string_list_len = header.string_list_len;
+  for (size_t i = 0; i < header.string_list_len; i++)
+  {
+    if (string_list_indices[i] >= header.n_strings)
+      malformed("string out of range");
+    string_list[i] = node_strdup(strings[string_list_indices[i]]);
+  }
+
+  validate_syntax_tree(nodes, n_nodes, symbols, symbol_pointers, header.n_symbols);
+
+  syntax_tree_loaded = true;
+  free(symbol_pointers);
+  free(atoms);
+  free(strings);
+  free(offsets);
+  free(string_list_indices);
+  free(symbols);
+  free(nodes);
+}
@@ -0,0 +1,119 @@
+#include "atoms.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Each atom is one allocation, holding the hash, length and binding followed by the characters
+typedef struct
+{
+  uint64_t hash;
+  size_t length;
+  struct symbol* binding;
+  char text[];
+} atom_entry_t;
+
+// All atoms, in a hash table using open addressing.
+// The number of buckets is always a power of two, and at most half of them are used
+static _Thread_local atom_entry_t** buckets;
+static _Thread_local size_t n_buckets;
+static _Thread_local size_t n_atoms;
+
+// The 64-bit FNV-1a hash of the characters.
+// Hash tables only use the lowest bits of the hash, so the bits are mixed at the end,
+// using the finalizer of MurmurHash3. This keeps names that only differ at the end,
+// like x1, x2 and x3, from landing in neighbouring buckets
+static uint64_t hash_characters(const char* string, size_t length)
+{
+  uint64_t hash = 14695981039346656037u;
+  for (size_t i = 0; i < length; i++)
+  {
+    hash ^= (unsigned char)string[i];
+    hash *= 1099511628211u;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdu;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb34fe63bd5dbu;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static atom_entry_t* entry_of(atom_t atom)
+{
+  return (atom_entry_t*)(atom - offsetof(atom_entry_t, text));
+}
+
+// Places the entry in the first free bucket, starting from the bucket given by its hash
+static void place_entry(atom_entry_t* entry)
+{
+  size_t bucket = entry->hash & (n_buckets - 1);
+  while (buckets[bucket] != NULL)
+    bucket = (bucket + 1) & (n_buckets - 1);
+  buckets[bucket] = entry;
+}
+
+// Doubles the number of buckets, and places all atoms again
+static void grow_table(void)
+{
+  atom_entry_t** old_buckets = buckets;
+  size_t old_n_buckets = n_buckets;
+
+  n_buckets = n_buckets == 0 ? 64 : n_buckets * 2;
+  buckets = calloc(n_buckets, sizeof(atom_entry_t*));
+  for (size_t i = 0; i < old_n_buckets; i++)
+    if (old_buckets[i] != NULL)
+      place_entry(old_buckets[i]);
+
+  free(old_buckets);
+}
+
+atom_t atom_intern(const char* string, size_t length)
+{
+  if ((n_atoms + 1) * 2 > n_buckets)
+    grow_table();
+
+  uint64_t hash = hash_characters(string, length);
+  size_t bucket = hash & (n_buckets - 1);
+  while (buckets[bucket] != NULL)
+  {
+    atom_entry_t* entry = buckets[bucket];
+    if (entry->hash == hash && entry->length == length &&
+        memcmp(entry->text, string, length) == 0)
+      return entry->text;
+    bucket = (bucket + 1) & (n_buckets - 1);
+  }
+
+  atom_entry_t* entry = malloc(sizeof(atom_entry_t) + length + 1);
+  entry->hash = hash;
+  entry->length = length;
+  entry->binding = NULL;
+  memcpy(entry->text, string, length);
+  entry->text[length] = '\0';
+
+  buckets[bucket] = entry;
+  n_atoms++;
+  return entry->text;
+}
+
+uint64_t atom_hash(atom_t atom)
+{
+  assert(atom != NULL);
+  return entry_of(atom)->hash;
+}
+
+struct symbol** atom_binding(atom_t atom)
+{
+  assert(atom != NULL);
+  return &entry_of(atom)->binding;
+}
+
+void destroy_atoms(void)
+{
+  for (size_t i = 0; i < n_buckets; i++)
+    free(buckets[i]);
+  free(buckets);
+  buckets = NULL;
+  n_buckets = 0;
+  n_atoms = 0;
+}
@@ -0,0 +1,26 @@
+#ifndef ATOMS_H
+#define ATOMS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Atoms are interned strings. There is only ever one atom with the same characters,
+// so two atoms are equal exactly when they are the same pointer.
+// Every atom also stores its hash, right before its characters.
+// All identifiers in the syntax tree, and thus all symbol names, are atoms
+typedef const char* atom_t;
+
+// Returns the atom with the given characters, creating it the first time it is seen
+atom_t atom_intern(const char* string, size_t length);
+
+// Returns the hash of the atom's characters, without looking at them
+uint64_t atom_hash(atom_t atom);
+
+// Every atom has room for the symbol the name currently refers to, used when binding names.
+// Returns a pointer to it, so that it can be changed. It is NULL until something is stored there
+struct symbol** atom_binding(atom_t atom);
+
+// Frees all atoms
+void destroy_atoms(void);
+
+#endif // ATOMS_H
@@ -0,0 +1,424 @@
+#include "vslc.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+// With -C, the assembly generated for each function is kept in a file in the cache directory,
+// named by a hash of everything the assembly depends on:
+//  - the syntax tree of the function, after simplification and binding, where every reference
+//    to a global symbol is hashed as its name, symbol type, and parameter count or array length,
+//    and every reference to a local symbol as its symbol type and sequence number
+//  - the syntax tree of every function it calls, directly or through other functions, with
+//    -finline, since those may be inlined, and inlined calls are inlined again
+//  - the features enabled with -f, which change the generated code
+// A function whose hash has a file in the directory reuses its assembly, and is neither
+// optimized nor generated. The other functions are written to the directory once generated
+
+const char* cache_directory = NULL;
+
+// Bump this whenever the generated code changes, so that older entries are no longer used
+#define CACHE_VERSION "vslc function cache 1"
+
+// A 128-bit hash, made of two 64-bit FNV-1a style hashes with different primes
+typedef struct
+{
+  uint64_t a, b;
+} hash_t;
+
+static void hash_bytes(hash_t* hash, const void* bytes, size_t length)
+{
+  const uint8_t* data = bytes;
+  for (size_t i = 0; i < length; i++)
+  {
+    hash->a = (hash->a ^ data[i]) * 0x100000001b3ull;
+    hash->b = (hash->b ^ data[i]) * 0x9e3779b97f4a7c15ull;
+  }
+}
+
+static void hash_value(hash_t* hash, uint64_t value)
+{
+  hash_bytes(hash, &value, sizeof(value));
+}
+
+// Strings are hashed with their length, so that two strings after each other are never mistaken
+// for other strings
+static void hash_string(hash_t* hash, const char* string)
+{
+  size_t length = strlen(string);
+  hash_value(hash, length);
+  hash_bytes(hash, string, length);
+}
+
+static hash_t new_hash(void)
+{
+  return (hash_t){.a = 0xcbf29ce484222325ull, .b = 0x84222325cbf29ce4ull};
+}
+
+// What is found while hashing the syntax tree of a function
+typedef struct
+{
+  hash_t hash;
+  bool* calls; // Which functions are called, by sequence number
+} function_hash_t;
+
+static void hash_symbol(hash_t* hash, symbol_t* symbol)
+{
+  hash_value(hash, symbol->type);
+  switch (symbol->type)
+  {
+  case SYMBOL_PARAMETER:
+  case SYMBOL_LOCAL_VAR:
+  case SYMBOL_LOCAL_ARRAY:
+    hash_value(hash, symbol->sequence_number);
+    break;
+  case SYMBOL_FUNCTION:
+    hash_string(hash, symbol->name);
+    hash_value(hash, FUNC_PARAM_COUNT(symbol));
+    break;
+  case SYMBOL_GLOBAL_ARRAY:
+    hash_string(hash, symbol->name);
+    hash_value(hash, node_child(node_get(symbol->node), 1)->data.number_literal);
+    break;
+  case SYMBOL_GLOBAL_VAR:
+    hash_string(hash, symbol->name);
+    break;
+  default:
+    break;
+  }
+}
+
+static visit_order_t hash_node(node_t* node, node_t* parent, void* context)
+{
+  (void)parent;
+  function_hash_t* function = context;
+  hash_t* hash = &function->hash;
+  if (node == NULL)
+  {
+    hash_value(hash, NODE_TYPE_COUNT);
+    return SKIP_CHILDREN;
+  }
+
+  hash_value(hash, node->type);
+  hash_value(hash, node->n_children);
+  switch (node->type)
+  {
+  case OPERATOR:
+    hash_string(hash, node->data.operator);
+    break;
+  case NUMBER_LITERAL:
+    hash_value(hash, node->data.number_literal);
+    break;
+  case IDENTIFIER:
+    // Declarations have no symbol, and only their name
+    if (node->symbol != NULL)
+      hash_symbol(hash, node->symbol);
+    else
+      hash_string(hash, node->data.identifier);
+    break;
+  case STRING_LITERAL:
+    hash_string(hash, node->data.string_literal);
+    break;
+  case STRING_LIST_REFERENCE:
+    // The strings are part of the format strings, except with -fprint-runtime, which refers to
+    // them by their position in the string list
+    hash_string(hash, string_list[node->data.string_list_index]);
+    if (feature_print_runtime)
+      hash_value(hash, node->data.string_list_index);
+    break;
+  case FUNCTION_CALL:
+  {
+    symbol_t* callee = node_child(node, 0)->symbol;
+    if (callee != NULL && callee->type == SYMBOL_FUNCTION)
+      function->calls[callee->sequence_number] = true;
+    break;
+  }
+  default:
+    break;
+  }
+  return VISIT_CHILDREN;
+}
+
+// The assembly of a function found in the cache, with the format strings it uses.
+// The assembly refers to them as format0, format1 and so on, in the order of the list
+typedef struct
+{
+  char* assembly;
+  char** formats;
+  size_t n_formats;
+} cache_entry_t;
+
+// The hash and cache entry of every function, indexed by sequence number.
+// Functions that were not found in the cache have no assembly
+static _Thread_local hash_t* function_hashes;
+static _Thread_local cache_entry_t* entries;
+static _Thread_local size_t n_entries;
+
+// Counted for -P
+_Thread_local size_t cache_hits = 0;
+_Thread_local size_t cache_misses = 0;
+
+static char* entry_path(symbol_t* function)
+{
+  hash_t hash = function_hashes[function->sequence_number];
+  size_t length = strlen(cache_directory) + 40;
+  char* path = malloc(length);
+  snprintf(path, length, "%s/%016llx%016llx.s", cache_directory, (unsigned long long)hash.a,
+           (unsigned long long)hash.b);
+  return path;
+}
+
+// Reads the whole file, or returns NULL if it can not be read
+static char* read_file(const char* path, size_t* length)
+{
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  size_t capacity = 4096;
+  char* text = malloc(capacity);
+  *length = 0;
+  size_t n;
+  while ((n = fread(text + *length, 1, capacity - *length - 1, file)) > 0)
+  {
+    *length += n;
+    if (*length + 1 >= capacity)
+    {
+      capacity *= 2;
+      text = realloc(text, capacity);
+    }
+  }
+  fclose(file);
+  text[*length] = '\0';
+  return text;
+}
+
+// Entries start with a line holding the number of format strings, followed by a line with the
+// length and characters of each of them. The rest is the assembly of the function.
+// Returns false if the file is not a valid entry
+static bool parse_entry(char* text, size_t length, cache_entry_t* entry)
+{
+  char* end = text + length;
+  char* position = text;
+  size_t n_formats = strtoul(position, &position, 10);
+  if (*position++ != '\n' || n_formats > length)
+    return false;
+
+  char** formats = calloc(n_formats + 1, sizeof(char*));
+  for (size_t i = 0; i < n_formats; i++)
+  {
+    size_t format_length = strtoul(position, &position, 10);
+    if (position >= end || *position++ != ' ' || format_length > (size_t)(end - position) ||
+        position[format_length] != '\n')
+    {
+      for (size_t j = 0; j < i; j++)
+        free(formats[j]);
+      free(formats);
+      return false;
+    }
+    formats[i] = strndup(position, format_length);
+    position += format_length + 1;
+  }
+
+  *entry = (cache_entry_t){
+      .assembly = strdup(position),
+      .formats = formats,
+      .n_formats = n_formats,
+  };
+  return true;
+}
+
+// Marks every function reachable through calls from the function with the given sequence
+// number, which includes itself only when it is part of a cycle of calls. The callees of each
+// function are given as lists, and stack must have room for one more than every function
+static void find_reachable(size_t function, size_t** callees, size_t* n_callees, bool* reachable,
+                           size_t* stack)
+{
+  memset(reachable, 0, n_entries * sizeof(bool));
+  size_t n_stack = 0;
+  stack[n_stack++] = function;
+  while (n_stack > 0)
+  {
+    size_t caller = stack[--n_stack];
+    for (size_t c = 0; c < n_callees[caller]; c++)
+    {
+      size_t callee = callees[caller][c];
+      if (reachable[callee])
+        continue;
+      reachable[callee] = true;
+      stack[n_stack++] = callee;
+    }
+  }
+}
+
+void lookup_cache(void)
+{
+  n_entries = global_symbols->n_symbols;
+  function_hashes = calloc(n_entries, sizeof(hash_t));
+  entries = calloc(n_entries, sizeof(cache_entry_t));
+  bool** calls = calloc(n_entries, sizeof(bool*));
+
+  // Every function is hashed on its own first, since the hash of a function includes the
+  // hashes of the functions it calls
+  for (size_t i = 0; i < global_symbols->n_of_type[SYMBOL_FUNCTION]; i++)
+  {
+    symbol_t* symbol = global_symbols->of_type[SYMBOL_FUNCTION][i];
+    function_hash_t function = {.hash = new_hash(), .calls = calloc(n_entries, sizeof(bool))};
+    traverse_syntax_tree(node_get(symbol->node), hash_node, NULL, &function);
+    function_hashes[symbol->sequence_number] = function.hash;
+    calls[symbol->sequence_number] = function.calls;
+  }
+
+  // The features, as enabled with -f
+  const bool* features[] = {
+      &feature_register_variables, &feature_ssa,         &feature_peephole,
+      &feature_inline,             &feature_tail_calls,  &feature_omit_frame_pointer,
+      &feature_print_runtime,      &feature_cse,         &feature_loops,
+      &feature_bounds_check,       &feature_vectorize,   &feature_avx2,
+      &feature_dead_stores,
+  };
+  hash_t options = new_hash();
+  hash_string(&options, CACHE_VERSION);
+  for (size_t i = 0; i < sizeof(features) / sizeof(features[0]); i++)
+    hash_value(&options, *features[i]);
+
+  // The profile of -fprofile-use changes the code of every function, so all of it is hashed
+  if (profile_use_filename != NULL)
+  {
+    FILE* profile = fopen(profile_use_filename, "rb");
+    char buffer[4096];
+    size_t length;
+    while (profile != NULL && (length = fread(buffer, 1, sizeof(buffer), profile)) > 0)
+      hash_bytes(&options, buffer, length);
+    if (profile != NULL)
+      fclose(profile);
+  }
+
+  // With -finline, the functions each function calls are followed further, as the callees
+  // inlined into it may have had their own callees inlined
+  size_t** callees = calloc(n_entries, sizeof(size_t*));
+  size_t* n_callees = calloc(n_entries, sizeof(size_t));
+  for (size_t i = 0; i < n_entries; i++)
+  {
+    if (calls[i] == NULL)
+      continue;
+    for (size_t j = 0; j < n_entries; j++)
+    {
+      if (!calls[i][j])
+        continue;
+      callees[i] = realloc(callees[i], (n_callees[i] + 1) * sizeof(size_t));
+      callees[i][n_callees[i]++] = j;
+    }
+  }
+  bool* reachable = malloc(n_entries * sizeof(bool));
+  size_t* stack = malloc((n_entries + 1) * sizeof(size_t));
+
+  hash_t* keys = calloc(n_entries, sizeof(hash_t));
+  for (size_t i = 0; i < n_entries; i++)
+  {
+    if (calls[i] == NULL)
+      continue;
+    keys[i] = options;
+    hash_value(&keys[i], function_hashes[i].a);
+    hash_value(&keys[i], function_hashes[i].b);
+    if (!feature_inline)
+      continue;
+    find_reachable(i, callees, n_callees, reachable, stack);
+    for (size_t j = 0; j < n_entries; j++)
+    {
+      if (!reachable[j] || j == i)
+        continue;
+      hash_value(&keys[i], function_hashes[j].a);
+      hash_value(&keys[i], function_hashes[j].b);
+    }
+  }
+
+  for (size_t i = 0; i < n_entries; i++)
+    free(callees[i]);
+  free(callees);
+  free(n_callees);
+  free(reachable);
+  free(stack);
+
+  for (size_t i = 0; i < n_entries; i++)
+  {
+    free(calls[i]);
+    if (calls[i] == NULL)
+      continue;
+    function_hashes[i] = keys[i];
+
+    char* path = entry_path(global_symbols->symbols[i]);
+    size_t length;
+    char* text = read_file(path, &length);
+    if (text != NULL && parse_entry(text, length, &entries[i]))
+      cache_hits++;
+    else
+      cache_misses++;
+    free(text);
+    free(path);
+  }
+  free(calls);
+  free(keys);
+}
+
+bool is_function_cached(symbol_t* function)
+{
+  return function->sequence_number < n_entries &&
+         entries[function->sequence_number].assembly != NULL;
+}
+
+const char* cached_assembly(symbol_t* function, char*** formats, size_t* n_formats)
+{
+  if (!is_function_cached(function))
+    return NULL;
+  cache_entry_t* entry = &entries[function->sequence_number];
+  *formats = entry->formats;
+  *n_formats = entry->n_formats;
+  return entry->assembly;
+}
+
+void store_in_cache(symbol_t* function, const char* assembly, char* const* formats,
+                    size_t n_formats)
+{
+  // The directory is made on first use. Failing to make it, or to write an entry, only makes
+  // the next compilation slower, so it is not an error
+  mkdir(cache_directory, 0777);
+
+  // The entry is written under a name of its own, and then renamed, so that other compilations
+  // using the same directory never see half an entry. Threads compiling other input files give
+  // their variables different addresses, so the name is unique to the process and the thread
+  char* path = entry_path(function);
+  size_t temporary_length = strlen(path) + 64;
+  char* temporary = malloc(temporary_length);
+  snprintf(temporary, temporary_length, "%s.%ld.%p.tmp", path, (long)getpid(), (void*)&entries);
+
+  FILE* file = fopen(temporary, "wb");
+  if (file != NULL)
+  {
+    fprintf(file, "%zu\n", n_formats);
+    for (size_t i = 0; i < n_formats; i++)
+      fprintf(file, "%zu %s\n", strlen(formats[i]), formats[i]);
+    fputs(assembly, file);
+    if (fclose(file) == 0)
+      rename(temporary, path);
+    else
+      remove(temporary);
+  }
+  free(temporary);
+  free(path);
+}
+
+void destroy_cache(void)
+{
+  for (size_t i = 0; i < n_entries; i++)
+  {
+    free(entries[i].assembly);
+    for (size_t j = 0; j < entries[i].n_formats; j++)
+      free(entries[i].formats[j]);
+    free(entries[i].formats);
+  }
+  free(entries);
+  free(function_hashes);
+  entries = NULL;
+  function_hashes = NULL;
+  n_entries = 0;
+}
@@ -0,0 +1,124 @@
+#include "vslc.h"
+
+// Appends a block to a list of blocks, resizing it when needed
+static void append_block(ir_block_t*** list, size_t* length, ir_block_t* block)
+{
+  *list = realloc(*list, (*length + 1) * sizeof(ir_block_t*));
+  (*list)[(*length)++] = block;
+}
+
+// Visits all blocks reachable from the given block in depth first order,
+// and places each block in the postorder list once all its successors have been visited
+static void postorder_visit(ir_block_t* block, bool* visited, ir_block_t** postorder, size_t* n)
+{
+  visited[block->id] = true;
+  ir_block_t* successors[2];
+  size_t n_successors = ir_block_successors(block, successors);
+  for (size_t i = 0; i < n_successors; i++)
+    if (!visited[successors[i]->id])
+      postorder_visit(successors[i], visited, postorder, n);
+  postorder[(*n)++] = block;
+}
+
+// Finds the closest common dominator of two blocks, by walking up the dominator tree
+// from whichever block comes last in reverse postorder
+static ir_block_t* intersect(ir_block_t* a, ir_block_t* b)
+{
+  while (a != b)
+  {
+    while (a->rpo_index > b->rpo_index)
+      a = a->idom;
+    while (b->rpo_index > a->rpo_index)
+      b = b->idom;
+  }
+  return a;
+}
+
+void ir_compute_cfg(ir_function_t* function)
+{
+  size_t n_blocks = function->n_blocks;
+
+  // Find the predecessors of every block
+  for (size_t i = 0; i < n_blocks; i++)
+  {
+    ir_block_t* block = function->blocks[i];
+    free(block->predecessors);
+    block->predecessors = NULL;
+    block->n_predecessors = 0;
+    block->idom = NULL;
+  }
+  for (size_t i = 0; i < n_blocks; i++)
+  {
+    ir_block_t* block = function->blocks[i];
+
+    // Make sure there is only ever one edge between two blocks
+    ir_instruction_t* terminator = ir_block_terminator(block);
+    if (terminator->opcode == IR_BRANCH && terminator->targets[0] == terminator->targets[1])
+      *terminator = (ir_instruction_t){.opcode = IR_JUMP, .targets = {terminator->targets[0]}};
+
+    ir_block_t* successors[2];
+    size_t n_successors = ir_block_successors(block, successors);
+    for (size_t j = 0; j < n_successors; j++)
+      append_block(&successors[j]->predecessors, &successors[j]->n_predecessors, block);
+  }
+
+  // Number the blocks in reverse postorder, so that every block comes after its dominators
+  bool* visited = calloc(n_blocks, sizeof(bool));
+  ir_block_t** postorder = malloc(n_blocks * sizeof(ir_block_t*));
+  size_t n_visited = 0;
+  postorder_visit(function->blocks[0], visited, postorder, &n_visited);
+  assert(n_visited == n_blocks && "All blocks must be reachable");
+  for (size_t i = 0; i < n_visited; i++)
+    postorder[i]->rpo_index = n_visited - 1 - i;
+
+  // Find immediate dominators using the iterative algorithm by Cooper, Harvey and Kennedy.
+  // The entry block temporarily dominates itself, to mark it as processed
+  ir_block_t* entry = function->blocks[0];
+  entry->idom = entry;
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (size_t i = n_visited - 1; i > 0; i--)
+    {
+      ir_block_t* block = postorder[i - 1];
+      ir_block_t* new_idom = NULL;
+      for (size_t j = 0; j < block->n_predecessors; j++)
+      {
+        ir_block_t* predecessor = block->predecessors[j];
+        if (predecessor->idom == NULL)
+          continue; // Not processed yet
+        new_idom = new_idom ? intersect(predecessor, new_idom) : predecessor;
+      }
+      if (new_idom != block->idom)
+      {
+        block->idom = new_idom;
+        changed = true;
+      }
+    }
+  }
+  entry->idom = NULL;
+
+  free(postorder);
+  free(visited);
+}
+
+bool ir_dominates(ir_block_t* a, ir_block_t* b)
+{
+  // Dominators always come earlier in reverse postorder, so we can stop walking up early
+  while (b != NULL && b->rpo_index >= a->rpo_index)
+  {
+    if (b == a)
+      return true;
+    b = b->idom;
+  }
+  return false;
+}
+
+int64_t ir_predecessor_index(ir_block_t* block, ir_block_t* predecessor)
+{
+  for (size_t i = 0; i < block->n_predecessors; i++)
+    if (block->predecessors[i] == predecessor)
+      return i;
+  return -1;
+}
@@ -24,25 +24,73 @@
 #define MEM(reg) "(" reg ")"
 #define ARRAY_MEM(array, index, stride) "(" array "," index "," stride ")"
 
-#define DIRECTIVE(fmt, ...) printf(fmt "\n" __VA_OPT__(, ) __VA_ARGS__)
-#define LABEL(name, ...) printf(name ":\n" __VA_OPT__(, ) __VA_ARGS__)
-#define EMIT(fmt, ...) printf("\t" fmt "\n" __VA_OPT__(, ) __VA_ARGS__)
+// Lines of assembly are not printed right away, but buffered until flush_assembly() is called.
+// The peephole optimizer can then rewrite the instructions before they are output.
+// Defined in peephole.c
+typedef enum
+{
+  ASM_DIRECTIVE,
+  ASM_LABEL,
+  ASM_INSTRUCTION,
+} asm_line_kind_t;
 
-#define MOVQ(src, dst) EMIT("movq %s, %s", (src), (dst))
-#define PUSHQ(src) EMIT("pushq %s", (src))
-#define POPQ(src) EMIT("popq %s", (src))
+// Buffers a line of the given kind, formatted from a printf-style format string
+void emit_line(asm_line_kind_t kind, const char* format, ...);
 
-#define ADDQ(src, dst) EMIT("addq %s, %s", (src), (dst))
-#define SUBQ(src, dst) EMIT("subq %s, %s", (src), (dst))
-#define NEGQ(reg) EMIT("negq %s", (reg))
+// Buffers an instruction with up to two operands, which are NULL when missing. Nothing is
+// formatted, so it is faster than emit_line(), and used by the macros for single instructions
+void emit_instruction(const char* mnemonic, const char* a, const char* b);
 
-#define IMULQ(src, dst) EMIT("imulq %s, %s", (src), (dst))
-#define CQO EMIT("cqo");                 // Sign extend RAX -> RDX:RAX
-#define IDIVQ(by) EMIT("idivq %s", (by)) // Divide RDX:RAX by "by", store result in RAX
+// Runs the peephole optimizer on all buffered lines, outputs them to assembly_output and empties
+// the buffer. With -o and --run, the lines are given to the assembler instead
+void flush_assembly(void);
 
-#define RET EMIT("ret")
+// With -C, the assembly given to flush_assembly() is also written as text to this file, when it
+// is not NULL, even if it is assembled. emit_assembly_text() outputs lines of such text, like
+// flush_assembly() outputs buffered lines, except that the text is not optimized again
+extern _Thread_local FILE* assembly_copy;
+void emit_assembly_text(const char* text);
 
-#define CMPQ(op1, op2) EMIT("cmpq %s, %s", (op1), (op2)) // Compare the two operands
+// The in-process assembler, which encodes lines of assembly into machine code. write_object()
+// resolves the labels and writes everything assembled so far to object_output, as an ELF object,
+// while load_program() loads it into memory for run_loaded_program(). Defined in assembler.c
+void assemble_directive(const char* text);
+void assemble_label(const char* name);
+void assemble_instruction(const char* mnemonic, char* const* operands, size_t n_operands);
+void write_object(void);
+void load_program(void);
+
+// For tiered execution, load_code() loads everything assembled so far into the code heap, and
+// returns the address of the label. References to labels the code does not define go to the
+// symbols given to define_host_symbol(), or to the C library. Data the code refers to must be
+// allocated with allocate_loaded_memory(), and is freed along with the code by unload_code()
+void define_host_symbol(const char* name, void* address);
+void* allocate_loaded_memory(size_t size);
+void* load_code(const char* label);
+void unload_code(void);
+
+// Whether the lines are given to the assembler instead of being output as text
+#define ASSEMBLING (object_output != NULL || run_in_memory)
+
+#define DIRECTIVE(fmt, ...) emit_line(ASM_DIRECTIVE, fmt __VA_OPT__(, ) __VA_ARGS__)
+#define LABEL(name, ...) emit_line(ASM_LABEL, name __VA_OPT__(, ) __VA_ARGS__)
+#define EMIT(fmt, ...) emit_line(ASM_INSTRUCTION, fmt __VA_OPT__(, ) __VA_ARGS__)
+
+#define MOVQ(src, dst) emit_instruction("movq", (src), (dst))
+#define PUSHQ(src) emit_instruction("pushq", (src), NULL)
+#define POPQ(src) emit_instruction("popq", (src), NULL)
+
+#define ADDQ(src, dst) emit_instruction("addq", (src), (dst))
+#define SUBQ(src, dst) emit_instruction("subq", (src), (dst))
+#define NEGQ(reg) emit_instruction("negq", (reg), NULL)
+
+#define IMULQ(src, dst) emit_instruction("imulq", (src), (dst))
+#define CQO emit_instruction("cqo", NULL, NULL);         // Sign extend RAX -> RDX:RAX
+#define IDIVQ(by) emit_instruction("idivq", (by), NULL) // Divide RDX:RAX by "by", store result in RAX
+
+#define RET emit_instruction("ret", NULL, NULL)
+
+#define CMPQ(op1, op2) emit_instruction("cmpq", (op1), (op2)) // Compare the two operands
 
 // The SETcc-family of instructions assigns either 0 or 1 to a byte register, based on a comparison.
 // The instruction immediately before the SETcc should be a
@@ -50,26 +98,29 @@
 // The suffix given to SET, the "cc" part of "setcc", is the "condition code".
 // It determines the kind of comparison being done.
 // If the comparison is true, 1 is stored into "byte_reg". Otherwise 0 is stored.
-#define SETE(byte_reg) EMIT("sete %s", (byte_reg))   // Store result of op1 == op2
-#define SETNE(byte_reg) EMIT("setne %s", (byte_reg)) // Store result of op1 != op2
+#define SETE(byte_reg) emit_instruction("sete", (byte_reg), NULL) // Store result of op1 == op2
+#define SETNE(byte_reg) emit_instruction("setne", (byte_reg), NULL) // Store result of op1 != op2
 // NOTE: for inequality checks, the order of CMPQ's operands is the opposite of what you expect
 // The following inequalities are all for signed integer operands
-#define SETG(byte_reg) EMIT("setg %s", (byte_reg))   // Store result of op2 > op1
-#define SETGE(byte_reg) EMIT("setge %s", (byte_reg)) // Store result of op2 >= op1
-#define SETL(byte_reg) EMIT("setl %s", (byte_reg))   // Store result of op2 < op1
-#define SETLE(byte_reg) EMIT("setle %s", (byte_reg)) // Store result of op2 <= op1
+#define SETG(byte_reg) emit_instruction("setg", (byte_reg), NULL) // Store result of op2 > op1
+#define SETGE(byte_reg) emit_instruction("setge", (byte_reg), NULL) // Store result of op2 >= op1
+#define SETL(byte_reg) emit_instruction("setl", (byte_reg), NULL) // Store result of op2 < op1
+#define SETLE(byte_reg) emit_instruction("setle", (byte_reg), NULL) // Store result of op2 <= op1
+// Generic version, taking the condition code as a string, such as "le"
+#define SETCC(cc, byte_reg) EMIT("set%s %s", (cc), (byte_reg))
 
 // Since set*-instructions assign to a byte register, we must extend the byte to fill
 // an entire 64-bit register, using movzbq (move Zero-extend Byte to Quadword).
 #define MOVZBQ(byte_reg, full_reg) \
-  EMIT("movzbq %s, %s", (byte_reg), (full_reg)) // full_reg <- byte_reg
+  emit_instruction("movzbq", (byte_reg), (full_reg)) // full_reg <- byte_reg
 
-#define JE(label) EMIT("je %s", (label)) // Conditional jump (equal)
-#define JNE(label) EMIT("jne %s", (label)) // Conditional jump (not equal)
-#define JMP(label) EMIT("jmp %s", (label)) // Unconditional jump
+#define JE(label) emit_instruction("je", (label), NULL) // Conditional jump (equal)
+#define JNE(label) emit_instruction("jne", (label), NULL) // Conditional jump (not equal)
+#define JMP(label) emit_instruction("jmp", (label), NULL) // Unconditional jump
+#define JCC(cc, label) EMIT("j%s %s", (cc), (label)) // Conditional jump, with condition code cc
 
 // Bitwise and
-#define ANDQ(src, dst) EMIT("andq %s, %s", (src), (dst))
+#define ANDQ(src, dst) emit_instruction("andq", (src), (dst))
 
 // These directives are set based on platform,
 // allowing the compiler to work on macOS as well.
@@ -82,13 +133,17 @@
   ".set printf, _printf      \n" \
   ".set putchar, _putchar    \n" \
   ".set puts, _puts          \n" \
+  ".set write, _write        \n" \
   ".set strtol, _strtol      \n" \
   ".set exit, _exit          \n" \
+  ".set fopen, _fopen        \n" \
+  ".set fprintf, _fprintf    \n" \
+  ".set fclose, _fclose      \n" \
   ".set _main, main          \n" \
   ".global _main"
 #else
 #define ASM_BSS_SECTION ".bss"
-#define ASM_STRING_SECTION ".rodata"
+#define ASM_STRING_SECTION ".rodata.str1.1,\"aMS\",@progbits,1"
 #define ASM_DECLARE_SYMBOLS ".global main"
 #endif
 
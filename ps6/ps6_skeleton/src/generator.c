@@ -1,21 +1,197 @@
 #include "vslc.h"
 
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
 // This header defines a bunch of macros we can use to emit assembly to stdout
 #include "emit.h"
 
+// The register allocator decides where every vreg of the IR is stored
+#include "regalloc.h"
+
 // In the System V calling convention, the first 6 integer parameters are passed in registers
 #define NUM_REGISTER_PARAMS 6
 static const char* REGISTER_PARAMS[6] = {RDI, RSI, RDX, RCX, R8, R9};
 
-// Takes in a symbol of type SYMBOL_FUNCTION, and returns how many parameters the function takes
-#define FUNC_PARAM_COUNT(func) ((func)->node->children[1]->n_children)
-
 static void generate_stringtable(void);
 static void generate_global_variables(void);
-static void generate_function(symbol_t* function);
-static void generate_expression(node_t* expression);
-static void generate_statement(node_t* node);
+static void generate_function(ir_function_t* function);
 static void generate_main(symbol_t* first);
+static void generate_bounds_error(void);
+static void generate_format_strings(void);
+static void generate_print_runtime(void);
+static void generate_profile_runtime(void);
+static void collect_format_strings(void);
+static void generate_functions_in_parallel(size_t n_threads);
+static void generate_cached_function(ir_function_t* function);
+
+// ================== The string table ==================
+
+// All strings of the program are collected in a table, and output together at the end by
+// generate_string_table(). A string that is the end of another string is not output on its own,
+// but gets a label inside the other one, and the strings go in a section the linker can merge
+// with the strings of other objects
+typedef struct
+{
+  char* label;
+  char* bytes; // The decoded characters, without the final zero byte
+  size_t length;
+} table_string_t;
+
+static _Thread_local table_string_t* table_strings;
+static _Thread_local size_t table_strings_len;
+
+// Adds a string literal in quotes, with the escapes of the assembler, to the string table.
+// The label is formatted like printf
+static void add_table_string(const char* literal, const char* label_format, ...)
+{
+  table_strings = realloc(table_strings, (table_strings_len + 1) * sizeof(table_string_t));
+  table_string_t* string = &table_strings[table_strings_len++];
+  string->bytes = decode_string_literal(literal, &string->length);
+
+  va_list arguments;
+  va_start(arguments, label_format);
+  int length = vsnprintf(NULL, 0, label_format, arguments);
+  va_end(arguments);
+  string->label = malloc(length + 1);
+  va_start(arguments, label_format);
+  vsnprintf(string->label, length + 1, label_format, arguments);
+  va_end(arguments);
+}
+
+// Orders strings by their characters read backwards, so every string comes right before the
+// strings it is the end of, or before a string it is not the end of
+static int compare_reversed_strings(const void* a, const void* b)
+{
+  const table_string_t* lhs = *(table_string_t* const*)a;
+  const table_string_t* rhs = *(table_string_t* const*)b;
+  for (size_t i = 1; i <= lhs->length && i <= rhs->length; i++)
+  {
+    unsigned char l = lhs->bytes[lhs->length - i];
+    unsigned char r = rhs->bytes[rhs->length - i];
+    if (l != r)
+      return l < r ? -1 : 1;
+  }
+  return (lhs->length > rhs->length) - (lhs->length < rhs->length);
+}
+
+// Returns a string literal in quotes for the characters. Characters that are not printable ASCII
+// are escaped, in octal unless they have a named escape
+static char* escape_string(const char* bytes, size_t length)
+{
+  char* literal = malloc(length * 4 + 3);
+  size_t n = 0;
+  literal[n++] = '"';
+  for (size_t i = 0; i < length; i++)
+  {
+    unsigned char c = bytes[i];
+    if (c == '"' || c == '\\')
+    {
+      literal[n++] = '\\';
+      literal[n++] = c;
+    }
+    else if (c == '\n' || c == '\t')
+    {
+      literal[n++] = '\\';
+      literal[n++] = c == '\n' ? 'n' : 't';
+    }
+    else if (c >= ' ' && c <= '~')
+      literal[n++] = c;
+    else
+      n += sprintf(&literal[n], "\\%03o", c);
+  }
+  literal[n++] = '"';
+  literal[n] = '\0';
+  return literal;
+}
+
+// A place in the output of the string table: the label of a string, placed at the given offset
+// into the string it is output as part of
+typedef struct
+{
+  size_t host;
+  size_t offset;
+  size_t string;
+} string_placement_t;
+
+static int compare_placements(const void* a, const void* b)
+{
+  const string_placement_t* lhs = a;
+  const string_placement_t* rhs = b;
+  if (lhs->host != rhs->host)
+    return lhs->host < rhs->host ? -1 : 1;
+  if (lhs->offset != rhs->offset)
+    return lhs->offset < rhs->offset ? -1 : 1;
+  return (lhs->string > rhs->string) - (lhs->string < rhs->string);
+}
+
+// Outputs and empties the string table. Every string is placed in the longest string it is the
+// end of, which is found by sorting the strings by their reversed characters
+static void generate_string_table(void)
+{
+  size_t n = table_strings_len;
+  if (n == 0)
+    return;
+
+  table_string_t** sorted = malloc(n * sizeof(table_string_t*));
+  for (size_t i = 0; i < n; i++)
+    sorted[i] = &table_strings[i];
+  qsort(sorted, n, sizeof(table_string_t*), compare_reversed_strings);
+
+  string_placement_t* placements = malloc(n * sizeof(string_placement_t));
+  for (size_t k = n; k > 0; k--)
+  {
+    table_string_t* string = sorted[k - 1];
+    size_t index = string - table_strings;
+    placements[index] = (string_placement_t){.host = index, .offset = 0, .string = index};
+    if (k == n)
+      continue;
+
+    table_string_t* next = sorted[k];
+    bool is_end = string->length <= next->length &&
+                  memcmp(next->bytes + next->length - string->length, string->bytes,
+                         string->length) == 0;
+    if (is_end)
+    {
+      size_t host = placements[next - table_strings].host;
+      placements[index].host = host;
+      placements[index].offset = table_strings[host].length - string->length;
+    }
+  }
+  free(sorted);
+
+  // Each string is output in pieces, from the label of one string to the next
+  qsort(placements, n, sizeof(string_placement_t), compare_placements);
+  DIRECTIVE(".section %s", ASM_STRING_SECTION);
+  for (size_t i = 0; i < n; i++)
+  {
+    string_placement_t* placement = &placements[i];
+    table_string_t* host = &table_strings[placement->host];
+    const char* label = table_strings[placement->string].label;
+    bool last = i + 1 == n || placements[i + 1].host != placement->host;
+    if (!last && placements[i + 1].offset == placement->offset)
+    {
+      DIRECTIVE("%s:", label);
+      continue;
+    }
+
+    size_t end = last ? host->length : placements[i + 1].offset;
+    char* piece = escape_string(host->bytes + placement->offset, end - placement->offset);
+    DIRECTIVE("%s: \t%s %s", label, last ? ".asciz" : ".ascii", piece);
+    free(piece);
+  }
+  free(placements);
+
+  for (size_t i = 0; i < n; i++)
+  {
+    free(table_strings[i].label);
+    free(table_strings[i].bytes);
+  }
+  free(table_strings);
+  table_strings = NULL;
+  table_strings_len = 0;
+}
 
 // Entry point for code generation
 void generate_program(void)
@@ -24,553 +200,1470 @@ void generate_program(void)
   generate_global_variables();
 
   DIRECTIVE(".text");
-  symbol_t* first_function = NULL;
-  for (size_t i = 0; i < global_symbols->n_symbols; i++)
+  flush_assembly();
+
+  // Each function is output on its own, so only one function is buffered at a time.
+  // The assembler keeps the labels of the whole program, so it is given the functions on one thread
+  // With -C, the functions are looked up in the cache on one thread, since they number their
+  // format strings in the order they are found
+  size_t n_threads = codegen_threads < ir_functions_len ? codegen_threads : ir_functions_len;
+  if (n_threads > 1 && !ASSEMBLING && cache_directory == NULL)
   {
-    symbol_t* symbol = global_symbols->symbols[i];
-    if (symbol->type != SYMBOL_FUNCTION)
-      continue;
-    if (!first_function)
-      first_function = symbol;
-    generate_function(symbol);
+    generate_functions_in_parallel(n_threads);
+  }
+  else
+  {
+    for (size_t i = 0; i < ir_functions_len; i++)
+    {
+      if (cache_directory != NULL)
+      {
+        generate_cached_function(ir_functions[i]);
+        continue;
+      }
+      generate_function(ir_functions[i]);
+      flush_assembly();
+    }
   }
 
-  if (first_function == NULL)
+  if (ir_functions_len == 0)
   {
     fprintf(stderr, "error: program contained no functions\n");
     exit(EXIT_FAILURE);
   }
-  generate_main(first_function);
+  generate_main(ir_functions[0]->symbol);
+  if (feature_print_runtime)
+    generate_print_runtime();
+  if (feature_profile_generate)
+    generate_profile_runtime();
+  generate_format_strings();
+  generate_string_table();
+  flush_assembly();
+  if (object_output != NULL)
+    write_object();
+  else if (run_in_memory)
+    load_program();
+}
+
+// Generates a single function with the format strings it uses, for tiered execution in
+// interpreter.c. Calls to other functions and the global variables are not defined here, but by
+// whoever loads the code. The code is always assembled
+void generate_single_function(ir_function_t* function)
+{
+  DIRECTIVE(".text");
+  generate_function(function);
+  if (feature_bounds_check)
+  {
+    generate_bounds_error();
+    add_table_string("\"Array index out of bounds\"", "boundserr");
+  }
+  generate_format_strings();
+  generate_string_table();
+  flush_assembly();
 }
 
-// Prints one .asciz entry for each string in the global string_list
+// Adds the strings used by the entry point and the runtime to the string table, and with
+// -fprint-runtime, every string in the global string_list
 static void generate_stringtable(void)
 {
-  DIRECTIVE(".section %s", ASM_STRING_SECTION);
-  // These strings are used by printf
-  DIRECTIVE("intout: .asciz \"%s\"", "%ld");
-  DIRECTIVE("strout: .asciz \"%s\"", "%s");
+  // This string is used by the print runtime
+  if (feature_print_runtime)
+    add_table_string("\"\\n\"", "newline");
   // This string is used by the entry point-wrapper
-  DIRECTIVE("errout: .asciz \"%s\"", "Wrong number of arguments");
-
-  for (size_t i = 0; i < string_list_len; i++)
-    DIRECTIVE("string%ld: \t.asciz %s", i, string_list[i]);
+  add_table_string("\"Wrong number of arguments\"", "errout");
+  // This string is used when a bounds check fails, with -fbounds-check
+  if (feature_bounds_check)
+    add_table_string("\"Array index out of bounds\"", "boundserr");
+
+  // Otherwise the strings are only used as part of the format strings
+  for (size_t i = 0; i < string_list_len && feature_print_runtime; i++)
+    add_table_string(string_list[i], "string%zu", i);
 }
 
-// Prints .zero entries in the .bss section to allocate room for global variables and arrays
+// Prints .zero entries in the .bss section to allocate room for global variables and arrays.
+// The variables come first, so the padding aligning the arrays is only needed between arrays
 static void generate_global_variables(void)
 {
   DIRECTIVE(".section %s", ASM_BSS_SECTION);
   DIRECTIVE(".align 8");
-  for (size_t i = 0; i < global_symbols->n_symbols; i++)
+  for (size_t i = 0; i < global_symbols->n_of_type[SYMBOL_GLOBAL_VAR]; i++)
+    DIRECTIVE(".%s: \t.zero 8", global_symbols->of_type[SYMBOL_GLOBAL_VAR][i]->name);
+
+  for (size_t i = 0; i < global_symbols->n_of_type[SYMBOL_GLOBAL_ARRAY]; i++)
   {
-    symbol_t* symbol = global_symbols->symbols[i];
-    if (symbol->type == SYMBOL_GLOBAL_VAR)
-    {
-      DIRECTIVE(".%s: \t.zero 8", symbol->name);
-    }
-    else if (symbol->type == SYMBOL_GLOBAL_ARRAY)
+    symbol_t* symbol = global_symbols->of_type[SYMBOL_GLOBAL_ARRAY][i];
+    if (node_child(node_get(symbol->node), 1)->type != NUMBER_LITERAL)
     {
-      if (symbol->node->children[1]->type != NUMBER_LITERAL)
-      {
-        fprintf(stderr, "error: length of array '%s' is not compile time known", symbol->name);
-        exit(EXIT_FAILURE);
-      }
-      int64_t length = symbol->node->children[1]->data.number_literal;
-      DIRECTIVE(".%s: \t.zero %ld", symbol->name, length * 8);
+      fprintf(stderr, "error: length of array '%s' is not compile time known", symbol->name);
+      exit(EXIT_FAILURE);
     }
+    int64_t length = node_child(node_get(symbol->node), 1)->data.number_literal;
+    // Arrays start on 32 bytes, so that vector operations on them do not cross cache lines
+    DIRECTIVE(".balign 32");
+    DIRECTIVE(".%s: \t.zero %ld", symbol->name, length * 8);
   }
 }
 
-// Global variable used to make the functon currently being generated accessible from anywhere
-static symbol_t* current_function;
+// The function currently being generated, and where each of its vregs are stored
+static _Thread_local ir_function_t* current_function;
+static _Thread_local register_allocation_t allocation;
 
-// Prints the entry point. preamble, statements and epilouge of the given function
-static void generate_function(symbol_t* function)
+// With -C, the labels of the blocks of the current function, indexed by block ID. The assembly of
+// a function is reused on its own then, so its labels start with the name of the function, to
+// never be the same as a label of another function. Otherwise it is NULL, and the labels are used
+static _Thread_local char** block_labels;
+
+static const char* block_label(ir_block_t* block)
 {
-  LABEL(".%s", function->name);
-  current_function = function;
+  return block_labels != NULL ? block_labels[block->id] : block->label;
+}
 
-  PUSHQ(RBP);
-  MOVQ(RSP, RBP);
+// Blocks that the same or a later block branches back to start a loop. They are aligned to
+// 1 << LOOP_ALIGNMENT_LOG2 bytes, so that the loop is fetched in as few 16 byte blocks as possible
+#define LOOP_ALIGNMENT_LOG2 4
+
+static bool* find_loop_starts(ir_function_t* function)
+{
+  bool* loop_starts = calloc(function->n_blocks, sizeof(bool));
+  for (size_t i = 0; i < function->n_blocks; i++)
+  {
+    ir_block_t* successors[2];
+    size_t n_successors = ir_block_successors(function->blocks[i], successors);
+    for (size_t s = 0; s < n_successors; s++)
+      if (successors[s]->id <= i)
+        loop_starts[successors[s]->id] = true;
+  }
+  return loop_starts;
+}
+
+// The layout of the current stack frame. All stack slots are given relative to where %rbp points.
+// With -fomit-frame-pointer, functions that make no calls don't set up %rbp, and address their
+// stack slots relative to %rsp instead. Such functions never push anything in their body,
+// so %rsp stays frame_base_distance bytes below where %rbp would have pointed
+static _Thread_local bool omit_frame_pointer;
+static _Thread_local size_t frame_slots_size; // The number of bytes reserved by subq, below the saved registers
+static _Thread_local int64_t frame_base_distance;
+
+// Local arrays of a fixed length are stored below the stack slots, each taking an even number of
+// 8 byte words, so they can be zeroed 16 bytes at a time. Their offsets from the frame's %rbp are
+// indexed by the sequence number of the array. Arrays of dynamic length are allocated on the stack
+// when they are declared, which moves %rsp, so functions with such arrays need %rbp
+static _Thread_local int64_t* local_array_offsets;
+
+// Arrays up to this many bytes are zeroed by a run of stores, larger ones by a loop
+#define UNROLLED_ZEROING_LIMIT 128
+
+// Numbers the allocations of dynamic arrays in the current function, to give their loops labels
+static _Thread_local int allocation_counter;
+
+// Operand strings are built in a few rotating buffers,
+// so that every instruction can use several of them at once
+#define NUM_OPERAND_BUFFERS 8
+static _Thread_local char operand_buffers[NUM_OPERAND_BUFFERS][64];
+static _Thread_local size_t next_operand_buffer = 0;
+
+// Formats an operand string into the next free buffer
+static const char* format_operand(const char* format, ...)
+{
+  char* result = operand_buffers[next_operand_buffer];
+  next_operand_buffer = (next_operand_buffer + 1) % NUM_OPERAND_BUFFERS;
+
+  va_list args;
+  va_start(args, format);
+  vsnprintf(result, sizeof(operand_buffers[0]), format, args);
+  va_end(args);
+  return result;
+}
 
-  // Up to 6 prameters have been passed in registers. Place them on the stack instead
-  for (size_t i = 0; i < FUNC_PARAM_COUNT(function) && i < NUM_REGISTER_PARAMS; i++)
-    PUSHQ(REGISTER_PARAMS[i]);
+// Returns true if the value fits in the sign extended 32-bit immediate of most instructions
+static bool fits_immediate(int64_t value)
+{
+  return value >= INT32_MIN && value <= INT32_MAX;
+}
 
-  // Now, for each local variable, push 8-byte 0 values to the stack
-  for (size_t i = 0; i < function->function_symtable->n_symbols; i++)
-    if (function->function_symtable->symbols[i]->type == SYMBOL_LOCAL_VAR)
-      PUSHQ("$0");
+static vreg_location_t* vreg_location(ir_operand_t operand)
+{
+  assert(operand.kind == IR_OPERAND_VREG);
+  vreg_location_t* location = &allocation.locations[operand.value];
+  assert(location->used && "vreg is used without being live");
+  return location;
+}
+
+// Returns true if the operand is a vreg stored in a register
+static bool in_register(ir_operand_t operand)
+{
+  return operand.kind == IR_OPERAND_VREG && vreg_location(operand)->reg != NULL;
+}
 
-  generate_statement(function->node->children[2]);
+// Returns true if the operand is a vreg stored in a stack slot
+static bool in_memory(ir_operand_t operand)
+{
+  return operand.kind == IR_OPERAND_VREG && vreg_location(operand)->reg == NULL;
+}
 
-  LABEL(".%s.epilogue", function->name);
-  // leaveq is written out manually, to increase clarity of what happens
-  MOVQ(RBP, RSP);
-  POPQ(RBP);
-  RET;
+// Returns the assembly for the stack location at the given offset from the frame's %rbp
+static const char* frame_slot_text(int64_t offset)
+{
+  if (omit_frame_pointer)
+    return format_operand("%ld(%s)", offset + frame_base_distance, RSP);
+  return format_operand("%ld(%s)", offset, RBP);
+}
+
+// Returns the assembly for the byte in the frame at the given offset from %rbp, plus a register
+static const char* frame_element_text(int64_t offset, const char* index)
+{
+  if (omit_frame_pointer)
+    return format_operand("%ld(%s,%s)", offset + frame_base_distance, RSP, index);
+  return format_operand("%ld(%s,%s)", offset, RBP, index);
+}
+
+// Returns the assembly for the register or stack slot of a vreg
+static const char* vreg_text(ir_operand_t operand)
+{
+  vreg_location_t* location = vreg_location(operand);
+  if (location->reg)
+    return location->reg;
+  return frame_slot_text(location->offset);
 }
 
-// Generates code for a function call, which can either be a statement or an expression
-static void generate_function_call(node_t* call)
+// Returns true if the two vregs are stored in the same register or stack slot
+static bool same_location(ir_operand_t a, ir_operand_t b)
 {
-  symbol_t* symbol = call->children[0]->symbol;
-  if (symbol->type != SYMBOL_FUNCTION)
+  if (a.kind != IR_OPERAND_VREG || b.kind != IR_OPERAND_VREG)
+    return false;
+  return strcmp(vreg_text(a), vreg_text(b)) == 0;
+}
+
+// Returns the assembly for reading the operand as a source operand.
+// This is either an immediate, a register or a memory location.
+// Constants too wide for an immediate are first placed in the scratch register
+static const char* source_text(ir_operand_t operand, const char* scratch)
+{
+  switch (operand.kind)
   {
-    fprintf(stderr, "error: '%s' is not a function\n", symbol->name);
-    exit(EXIT_FAILURE);
+  case IR_OPERAND_CONST:
+    if (fits_immediate(operand.value))
+      return format_operand("$%ld", operand.value);
+    EMIT("movabsq $%ld, %s", operand.value, scratch);
+    return scratch;
+  case IR_OPERAND_VREG:
+    return vreg_text(operand);
+  default:
+    assert(false && "Operand can not be used as a value");
   }
+}
 
-  node_t* argument_list = call->children[1];
+// Returns a register holding the value of the operand.
+// If the operand is not already in a register, it is moved into the scratch register
+static const char* register_text(ir_operand_t operand, const char* scratch)
+{
+  if (in_register(operand))
+    return vreg_location(operand)->reg;
+  MOVQ(source_text(operand, scratch), scratch);
+  return scratch;
+}
 
-  size_t parameter_count = FUNC_PARAM_COUNT(symbol);
-  if (parameter_count != argument_list->n_children)
+// Returns a register or immediate holding the value of the operand.
+// Values in memory are moved into the scratch register
+static const char* register_or_immediate_text(ir_operand_t operand, const char* scratch)
+{
+  if (in_memory(operand))
   {
-    fprintf(
-        stderr,
-        "error: function '%s' expects '%zu' arguments, but '%zu' were given\n",
-        symbol->name,
-        parameter_count,
-        argument_list->n_children);
-    exit(EXIT_FAILURE);
+    MOVQ(vreg_text(operand), scratch);
+    return scratch;
+  }
+  return source_text(operand, scratch);
+}
+
+// Moves the value of the operand into the vreg dst, unless they already share a location
+static void generate_move(ir_operand_t dst, ir_operand_t src)
+{
+  if (same_location(dst, src))
+    return;
+  if (in_register(dst))
+    MOVQ(source_text(src, RAX), vreg_text(dst));
+  else
+    MOVQ(register_or_immediate_text(src, RAX), vreg_text(dst));
+}
+
+// Moves a value from a register into the vreg dst
+static void generate_store_register(ir_operand_t dst, const char* src)
+{
+  const char* dst_text = vreg_text(dst);
+  if (strcmp(dst_text, src) != 0)
+    MOVQ(src, dst_text);
+}
+
+// The condition code suffixes for jcc and setcc, when comparing
+//   cmpq b, a
+// to find the result of a op b
+static const char* CONDITION_CODES[IR_OPCODE_COUNT] = {
+    [IR_EQ] = "e",
+    [IR_NE] = "ne",
+    [IR_LT] = "l",
+    [IR_LE] = "le",
+    [IR_GT] = "g",
+    [IR_GE] = "ge",
+};
+
+// The comparison giving the same result when the operands swap places
+static ir_opcode_t swapped_condition(ir_opcode_t condition)
+{
+  switch (condition)
+  {
+  case IR_LT:
+    return IR_GT;
+  case IR_LE:
+    return IR_GE;
+  case IR_GT:
+    return IR_LT;
+  case IR_GE:
+    return IR_LE;
+  default:
+    return condition;
   }
+}
 
-  // We evaluate all parameters from right to left, pushing them to the stack
-  for (int i = parameter_count - 1; i >= 0; i--)
+// Emits a cmpq setting the flags for comparing a to b.
+// Returns the condition to check in the flags, which can differ from the given condition
+// if the operands had to swap places
+static ir_opcode_t generate_comparison(ir_operand_t a, ir_operand_t b, ir_opcode_t condition)
+{
+  // The second operand of cmpq can not be an immediate, so a constant is better placed first
+  if (a.kind == IR_OPERAND_CONST && b.kind != IR_OPERAND_CONST)
   {
-    generate_expression(argument_list->children[i]);
-    PUSHQ(RAX);
+    ir_operand_t swap = a;
+    a = b;
+    b = swap;
+    condition = swapped_condition(condition);
   }
 
-  // Up to 6 parameters should be passed through registers instead. Pop them off the stack
-  for (size_t i = 0; i < parameter_count && i < NUM_REGISTER_PARAMS; i++)
+  // At most one operand can be in memory
+  const char* lhs;
+  if (a.kind == IR_OPERAND_CONST || (in_memory(a) && in_memory(b)))
+    lhs = register_text(a, RAX);
+  else
+    lhs = vreg_text(a);
+  CMPQ(source_text(b, RCX), lhs);
+  return condition;
+}
+
+// The instructions used for the arithmetic opcodes
+static const char* ARITHMETIC_MNEMONICS[IR_OPCODE_COUNT] = {
+    [IR_ADD] = "addq",
+    [IR_SUB] = "subq",
+    [IR_MUL] = "imulq",
+    [IR_SHL] = "salq",
+    [IR_SAR] = "sarq",
+    [IR_SHR] = "shrq",
+};
+
+// dst = a op b, for addition, subtraction, multiplication and shifts.
+// Shifts always have a constant b
+static void generate_arithmetic(ir_instruction_t* instruction)
+{
+  const char* mnemonic = ARITHMETIC_MNEMONICS[instruction->opcode];
+  bool commutative = instruction->opcode == IR_ADD || instruction->opcode == IR_MUL;
+  assert(mnemonic != NULL);
+  ir_operand_t dst = instruction->dst;
+  ir_operand_t a = instruction->a;
+  ir_operand_t b = instruction->b;
+
+  // Try to avoid having to copy a into dst, or to overwrite b before it is read
+  if (commutative && (same_location(dst, b) || a.kind == IR_OPERAND_CONST))
   {
-    POPQ(REGISTER_PARAMS[i]);
+    ir_operand_t swap = a;
+    a = b;
+    b = swap;
   }
 
-  EMIT("call .%s", symbol->name);
+  // Everything but multiplication can be done in place in a stack slot
+  bool in_place_memory = instruction->opcode != IR_MUL && in_memory(dst) && same_location(dst, a) &&
+                         !in_memory(b);
 
-  // Now pop away any stack passed parameters still left on the stack, by moving %rsp upwards
-  if (parameter_count > NUM_REGISTER_PARAMS)
+  if (in_register(dst) && !same_location(dst, b))
+  {
+    const char* dst_text = vreg_text(dst);
+    if (!same_location(dst, a))
+      MOVQ(source_text(a, RAX), dst_text);
+    emit_instruction(mnemonic, source_text(b, RCX), dst_text);
+  }
+  else if (in_place_memory)
+  {
+    emit_instruction(mnemonic, register_or_immediate_text(b, RCX), vreg_text(dst));
+  }
+  else
   {
-    EMIT("addq $%zu, %s", (parameter_count - NUM_REGISTER_PARAMS) * 8, RSP);
+    MOVQ(source_text(a, RAX), RAX);
+    emit_instruction(mnemonic, source_text(b, RCX), RAX);
+    generate_store_register(dst, RAX);
   }
 }
 
-// Returns a string for accessing the quadword referenced by node
-static const char* generate_variable_access(node_t* node)
+// dst = a / b, using idivq, which divides RDX:RAX and places the result in RAX
+static void generate_division(ir_instruction_t* instruction)
 {
-  static char result[100];
+  MOVQ(source_text(instruction->a, RAX), RAX);
+  CQO;
+  // idivq takes no immediate operand
+  if (instruction->b.kind == IR_OPERAND_CONST)
+    IDIVQ(register_text(instruction->b, RCX));
+  else
+    IDIVQ(vreg_text(instruction->b));
+  generate_store_register(instruction->dst, RAX);
+}
 
-  assert(node->type == IDENTIFIER);
+// dst = the upper half of a * b, using the one operand imulq, which places the product in RDX:RAX
+static void generate_multiply_high(ir_instruction_t* instruction)
+{
+  MOVQ(source_text(instruction->a, RAX), RAX);
+  // The one operand imulq takes no immediate operand
+  if (instruction->b.kind == IR_OPERAND_CONST)
+    EMIT("imulq %s", register_text(instruction->b, RCX));
+  else
+    EMIT("imulq %s", vreg_text(instruction->b));
+  generate_store_register(instruction->dst, RDX);
+}
 
-  symbol_t* symbol = node->symbol;
-  switch (symbol->type)
-  {
-  case SYMBOL_GLOBAL_VAR:
-    snprintf(result, sizeof(result), ".%s(%s)", symbol->name, RIP);
-    return result;
-  case SYMBOL_LOCAL_VAR:
-  {
-    // If we have more than 6 parameters, subtract away the hole in the sequence numbers
-    int call_frame_offset = symbol->sequence_number;
-    if (FUNC_PARAM_COUNT(current_function) > NUM_REGISTER_PARAMS)
-      call_frame_offset -= FUNC_PARAM_COUNT(current_function) - NUM_REGISTER_PARAMS;
-    // The stack grows down, in multiples of 8, and sequence number 0 corresponds to -8
-    call_frame_offset = (-call_frame_offset - 1) * 8;
+// Creates the address of array element (a + 8 * b), using RCX and RAX as scratch registers
+static const char* element_address(ir_operand_t address, ir_operand_t index)
+{
+  const char* base = register_text(address, RCX);
+  if (index.kind == IR_OPERAND_CONST && fits_immediate(index.value * 8))
+    return format_operand("%ld(%s)", index.value * 8, base);
+  return format_operand("(%s,%s,8)", base, register_text(index, RAX));
+}
 
-    snprintf(result, sizeof(result), "%d(%s)", call_frame_offset, RBP);
-    return result;
+// Functions with vector operations using AVX2 registers run vzeroupper before calls and returns.
+// Leaving the upper halves of the registers dirty slows down SSE code, such as in printf
+static _Thread_local bool uses_avx;
+
+static void generate_avx_exit(void)
+{
+  if (uses_avx)
+    EMIT("vzeroupper");
+}
+
+// Adds or subtracts IR_VECTOR_WIDTH elements of two arrays at once, with the index in RAX and
+// the array addresses in RCX as they are needed. Arrays may start anywhere, so the moves are
+// unaligned, which is as fast as aligned moves on aligned addresses
+static void generate_vector_operation(ir_instruction_t* instruction)
+{
+  const char* index = register_text(instruction->args[0], RAX);
+  const char* first = format_operand("(%s,%s,8)", register_text(instruction->b, RCX), index);
+  bool add = instruction->opcode == IR_VECTOR_ADD;
+  if (feature_avx2)
+  {
+    EMIT("vmovdqu %s, %%ymm0", first);
+    const char* second = format_operand("(%s,%s,8)", register_text(instruction->c, RCX), index);
+    EMIT("%s %s, %%ymm0, %%ymm0", add ? "vpaddq" : "vpsubq", second);
+    const char* result = format_operand("(%s,%s,8)", register_text(instruction->a, RCX), index);
+    EMIT("vmovdqu %%ymm0, %s", result);
+    return;
   }
-  case SYMBOL_PARAMETER:
+  EMIT("movdqu %s, %%xmm0", first);
+  const char* second = format_operand("(%s,%s,8)", register_text(instruction->c, RCX), index);
+  EMIT("movdqu %s, %%xmm1", second);
+  EMIT("%s %%xmm1, %%xmm0", add ? "paddq" : "psubq");
+  const char* result = format_operand("(%s,%s,8)", register_text(instruction->a, RCX), index);
+  EMIT("movdqu %%xmm0, %s", result);
+}
+
+// Moves every source register into its destination as if all moves happened at once.
+// Since a register can be both the source of one move and the destination of another,
+// the moves must be ordered so that no register is overwritten before it is read.
+// Cycles are broken through RAX. The arrays are used as scratch space
+static void generate_parallel_moves(const char** sources, const char** destinations,
+                                    size_t n_moves)
+{
+  // Moves to where the value already is are not needed
+  for (size_t i = 0; i < n_moves;)
   {
-    int call_frame_offset;
-    // Handle the first 6 parameters differently
-    if (symbol->sequence_number < NUM_REGISTER_PARAMS)
-      // Move along down the stack, with parameter 0 at position -8(%rbp)
-      call_frame_offset = -(symbol->sequence_number + 1) * 8;
+    if (strcmp(sources[i], destinations[i]) == 0)
+    {
+      n_moves--;
+      sources[i] = sources[n_moves];
+      destinations[i] = destinations[n_moves];
+    }
     else
-      // Parameter 6 is at 16(%rbp), with further parameters moving up from there
-      call_frame_offset = 16 + (symbol->sequence_number - NUM_REGISTER_PARAMS) * 8;
+      i++;
+  }
 
-    snprintf(result, sizeof(result), "%d(%s)", call_frame_offset, RBP);
-    return result;
+  while (n_moves > 0)
+  {
+    // Find a move whose destination is not needed by any remaining move
+    size_t ready = n_moves;
+    for (size_t i = 0; i < n_moves && ready == n_moves; i++)
+    {
+      bool blocked = false;
+      for (size_t j = 0; j < n_moves; j++)
+        if (j != i && strcmp(sources[j], destinations[i]) == 0)
+          blocked = true;
+      if (!blocked)
+        ready = i;
+    }
+
+    if (ready == n_moves)
+    {
+      // All remaining moves form cycles. Break one by moving its source out of the way
+      MOVQ(sources[0], RAX);
+      for (size_t j = 1; j < n_moves; j++)
+        if (strcmp(sources[j], sources[0]) == 0)
+          sources[j] = RAX;
+      sources[0] = RAX;
+      continue;
+    }
+
+    MOVQ(sources[ready], destinations[ready]);
+    n_moves--;
+    sources[ready] = sources[n_moves];
+    destinations[ready] = destinations[n_moves];
   }
-  case SYMBOL_FUNCTION:
-    fprintf(stderr, "error: symbol '%s' is a function, not a variable\n", symbol->name);
-    exit(EXIT_FAILURE);
-  case SYMBOL_GLOBAL_ARRAY:
-    fprintf(stderr, "error: symbol '%s' is an array, not a variable\n", symbol->name);
-    exit(EXIT_FAILURE);
-  default:
-    assert(false && "Unknown variable symbol type");
+}
+
+// Places the first 6 arguments of a call in their parameter registers.
+// Arguments in registers are moved first, as moving the others may overwrite them
+static void generate_register_arguments(ir_instruction_t* instruction)
+{
+  const char* sources[NUM_REGISTER_PARAMS];
+  const char* destinations[NUM_REGISTER_PARAMS];
+  size_t n_moves = 0;
+  size_t n_register_args =
+      instruction->n_args < NUM_REGISTER_PARAMS ? instruction->n_args : NUM_REGISTER_PARAMS;
+
+  for (size_t i = 0; i < n_register_args; i++)
+  {
+    if (!in_register(instruction->args[i]))
+      continue;
+    sources[n_moves] = vreg_text(instruction->args[i]);
+    destinations[n_moves] = REGISTER_PARAMS[i];
+    n_moves++;
+  }
+  generate_parallel_moves(sources, destinations, n_moves);
+
+  for (size_t i = 0; i < n_register_args; i++)
+  {
+    if (in_register(instruction->args[i]))
+      continue;
+    const char* source = source_text(instruction->args[i], REGISTER_PARAMS[i]);
+    if (strcmp(source, REGISTER_PARAMS[i]) != 0)
+      MOVQ(source, REGISTER_PARAMS[i]);
   }
 }
 
-/**
- * Takes in an ARRAY_INDEXING node, such as array[x]
- * The function emits code to evaluate x, which may clobber all registers.
- * Once x is evaluated, the address of array[x] is calculated, and stored in the RCX register.
- * The return value is the string "(%rcx)", the assembly for using RCX as an address.
- */
-static const char* generate_array_access(node_t* node)
+// Calls the function, passing arguments in registers and on the stack,
+// and places the return value in dst.
+// The stack frame is always a multiple of 16 bytes, so %rsp is only misaligned at the call
+// if an odd number of arguments are passed on the stack
+static void generate_call(ir_instruction_t* instruction)
 {
-  assert(node->type == ARRAY_INDEXING);
+  size_t n_stack_args =
+      instruction->n_args > NUM_REGISTER_PARAMS ? instruction->n_args - NUM_REGISTER_PARAMS : 0;
+  size_t padding = n_stack_args % 2 == 1 ? 8 : 0;
+
+  // The arguments passed on the stack are stored below %rsp first, since their values may be
+  // in the registers the other arguments are passed in
+  if (n_stack_args > 0)
+    EMIT("subq $%zu, %s", n_stack_args * 8 + padding, RSP);
+  for (size_t i = NUM_REGISTER_PARAMS; i < instruction->n_args; i++)
+    MOVQ(register_or_immediate_text(instruction->args[i], RAX),
+         format_operand("%zu(%s)", (i - NUM_REGISTER_PARAMS) * 8, RSP));
+  generate_register_arguments(instruction);
+
+  generate_avx_exit();
+  EMIT("call .%s", instruction->symbol->name);
+
+  // Remove the arguments that were passed on the stack
+  if (n_stack_args > 0)
+    EMIT("addq $%zu, %s", n_stack_args * 8 + padding, RSP);
+
+  if (allocation.locations[instruction->dst.value].used)
+    generate_store_register(instruction->dst, RAX);
+}
 
-  symbol_t* symbol = node->children[0]->symbol;
-  if (symbol->type != SYMBOL_GLOBAL_ARRAY)
+// Returns true if the instruction at the given position in the block is a call whose result is
+// directly returned. With -ftail-calls, such calls reuse the current stack frame by jumping to
+// the callee, as long as all arguments are passed in registers
+static bool is_tail_call(ir_block_t* block, size_t position)
+{
+  if (!feature_tail_calls || position + 2 != block->n_instructions)
+    return false;
+  ir_instruction_t* call = &block->instructions[position];
+  ir_instruction_t* ret = &block->instructions[position + 1];
+  return call->opcode == IR_CALL && call->n_args <= NUM_REGISTER_PARAMS &&
+         ret->opcode == IR_RETURN && ret->a.kind == IR_OPERAND_VREG &&
+         ret->a.value == call->dst.value;
+}
+
+// Restores the callee saved registers and the caller's %rbp, and removes the stack frame
+static void generate_frame_teardown(void)
+{
+  generate_avx_exit();
+  if (omit_frame_pointer)
   {
-    fprintf(stderr, "error: symbol '%s' is not an array\n", symbol->name);
-    exit(EXIT_FAILURE);
+    if (frame_slots_size > 0)
+      EMIT("addq $%zu, %s", frame_slots_size, RSP);
+    for (size_t i = allocation.n_saved_registers; i > 0; i--)
+      POPQ(allocation.saved_registers[i - 1]);
+    return;
   }
 
-  // Calculate the index of the array into %rax
-  generate_expression(node->children[1]);
+  // Restore the callee saved registers, in the opposite order of how they were pushed
+  if (allocation.n_saved_registers > 0)
+  {
+    EMIT("leaq %d(%s), %s", -(int)allocation.n_saved_registers * 8, RBP, RSP);
+    for (size_t i = allocation.n_saved_registers; i > 0; i--)
+      POPQ(allocation.saved_registers[i - 1]);
+  }
+  // leaveq is written out manually, to increase clarity of what happens
+  MOVQ(RBP, RSP);
+  POPQ(RBP);
+}
 
-  // Place the base of the array into %rcx
-  EMIT("leaq .%s(%s), %s", symbol->name, RIP, RCX);
+// Allocates a local array on the stack, taking its length from a, and places its address in dst.
+// Negative lengths allocate nothing. The size is rounded up to 16 bytes to keep %rsp aligned for
+// calls, and the array is zeroed 16 bytes at a time from the end, while %rax counts down
+static void generate_allocation(ir_instruction_t* instruction)
+{
+  int id = ++allocation_counter;
+  const char* name = current_function->symbol->name;
+  MOVQ(source_text(instruction->a, RAX), RAX);
+  MOVQ(RAX, RCX);
+  EMIT("sarq $63, %s", RCX);
+  EMIT("notq %s", RCX);
+  EMIT("andq %s, %s", RCX, RAX);
+  EMIT("shlq $3, %s", RAX);
+  EMIT("addq $15, %s", RAX);
+  EMIT("andq $-16, %s", RAX);
+  EMIT("subq %s, %s", RAX, RSP);
+  EMIT("pxor %%xmm0, %%xmm0");
+  JMP(format_operand(".%s.allocate%d.test", name, id));
+  LABEL(".%s.allocate%d", name, id);
+  EMIT("subq $16, %s", RAX);
+  EMIT("movdqu %%xmm0, (%s,%s)", RSP, RAX);
+  LABEL(".%s.allocate%d.test", name, id);
+  EMIT("testq %s, %s", RAX, RAX);
+  JCC("ne", format_operand(".%s.allocate%d", name, id));
+  generate_store_register(instruction->dst, RSP);
+}
 
-  // Place the exact position of the element we wish to access, into %rcx
-  EMIT("leaq (%s, %s, 8), %s", RCX, RAX, RCX);
+// Passes the arguments in registers, removes the current stack frame, and jumps to the callee.
+// The stack is then exactly as when this function was called, so the callee returns directly
+// to our caller, with its return value in RAX
+static void generate_tail_call(ir_instruction_t* instruction)
+{
+  generate_register_arguments(instruction);
+  generate_frame_teardown();
+  EMIT("jmp .%s", instruction->symbol->name);
+}
 
-  // Now, the address of the element is stored at %rcx, so just use MEM() to reference it
-  return MEM(RCX);
+// The printf format strings of all print statements, output at the end of the program.
+// Identical format strings are only stored once. They are found through a hash table of their
+// positions in format_strings, using open addressing. The number of buckets is always a power
+// of two, and at most half of them are used. Empty buckets are SIZE_MAX
+static _Thread_local char** format_strings;
+static _Thread_local size_t format_strings_len;
+static _Thread_local size_t* format_buckets;
+static _Thread_local size_t n_format_buckets;
+
+// Appends n characters to a growing string
+static void append_text(char** text, size_t* length, const char* characters, size_t n)
+{
+  *text = realloc(*text, *length + n + 1);
+  memcpy(*text + *length, characters, n);
+  *length += n;
+  (*text)[*length] = '\0';
 }
 
-// Generates code to evaluate the expression, and place the result in %rax
-static void generate_expression(node_t* expression)
+// Returns the bucket holding the format string, or the empty bucket where it belongs.
+// The hash is 64-bit FNV-1a
+static size_t find_format_bucket(const char* format)
 {
-  switch (expression->type)
-  {
-  case NUMBER_LITERAL:
-    // Simply place the number into %rax
-    EMIT("movq $%ld, %s", expression->data.number_literal, RAX);
-    break;
-  case IDENTIFIER:
-    // Load the variable, and put the result in RAX
-    MOVQ(generate_variable_access(expression), RAX);
-    break;
-  case ARRAY_INDEXING:
-    // Load the value pointed to by array[idx], and put the result in RAX
-    MOVQ(generate_array_access(expression), RAX);
-    break;
-  case OPERATOR:
+  uint64_t hash = 14695981039346656037u;
+  for (const char* c = format; *c != '\0'; c++)
+    hash = (hash ^ (unsigned char)*c) * 1099511628211u;
+
+  size_t bucket = hash & (n_format_buckets - 1);
+  while (format_buckets[bucket] != SIZE_MAX &&
+         strcmp(format_strings[format_buckets[bucket]], format) != 0)
+    bucket = (bucket + 1) & (n_format_buckets - 1);
+  return bucket;
+}
+
+// Returns the index of the format string in format_strings, adding it if it is not there.
+// Takes ownership of the format string
+static size_t intern_format_string(char* format)
+{
+  if (n_format_buckets > 0)
   {
-    const char* op = expression->data.operator;
-    if (strcmp(op, "+") == 0)
+    size_t bucket = find_format_bucket(format);
+    if (format_buckets[bucket] != SIZE_MAX)
     {
-      generate_expression(expression->children[0]);
-      PUSHQ(RAX);
-      generate_expression(expression->children[1]);
-      POPQ(RCX);
-      ADDQ(RCX, RAX);
+      free(format);
+      return format_buckets[bucket];
     }
-    else if (strcmp(op, "-") == 0)
-    {
-      if (expression->n_children == 1)
-      {
-        // Unary minus
-        generate_expression(expression->children[0]);
-        NEGQ(RAX);
-      }
-      else
-      {
-        // Binary minus. Evaluate RHS first, to get the result in RAX easier
-        generate_expression(expression->children[1]);
-        PUSHQ(RAX);
-        generate_expression(expression->children[0]);
-        POPQ(RCX);
-        SUBQ(RCX, RAX);
-      }
-    }
-    else if (strcmp(op, "*") == 0)
-    {
-      // Multiplication does not need to do sign extend
-      generate_expression(expression->children[0]);
-      PUSHQ(RAX);
-      generate_expression(expression->children[1]);
-      POPQ(RCX);
-      IMULQ(RCX, RAX);
-    }
-    else if (strcmp(op, "/") == 0)
+  }
+
+  format_strings = realloc(format_strings, (format_strings_len + 1) * sizeof(char*));
+  format_strings[format_strings_len] = format;
+  format_strings_len++;
+
+  // Doubling the buckets places all format strings again, including the new one
+  if (format_strings_len * 2 > n_format_buckets)
+  {
+    free(format_buckets);
+    n_format_buckets = n_format_buckets == 0 ? 64 : n_format_buckets * 2;
+    format_buckets = malloc(n_format_buckets * sizeof(size_t));
+    for (size_t i = 0; i < n_format_buckets; i++)
+      format_buckets[i] = SIZE_MAX;
+    for (size_t i = 0; i < format_strings_len; i++)
+      format_buckets[find_format_bucket(format_strings[i])] = i;
+  }
+  else
+    format_buckets[find_format_bucket(format)] = format_strings_len - 1;
+  return format_strings_len - 1;
+}
+
+// Builds the format string printing all arguments of the print instruction with one printf.
+// String arguments are placed directly in the format, with % escaped, while values become %ld.
+// Returns the index of the format string in format_strings
+static size_t print_format_string(ir_instruction_t* instruction)
+{
+  char* format = NULL;
+  size_t length = 0;
+  append_text(&format, &length, "", 0);
+  for (size_t i = 0; i < instruction->n_args; i++)
+  {
+    ir_operand_t arg = instruction->args[i];
+    if (arg.kind != IR_OPERAND_STRING)
     {
-      generate_expression(expression->children[1]);
-      PUSHQ(RAX);
-      generate_expression(expression->children[0]);
-      CQO; // Sign extend RAX -> RDX:RAX
-      POPQ(RCX);
-      IDIVQ(RCX); // Didivde RDX:RAX by RCX, placing the result in RAX
+      append_text(&format, &length, "%ld", 3);
+      continue;
     }
-    else if (strcmp(op, "==") == 0)
+
+    // Strings in the string list still have their quotes, and escape sequences are kept as is,
+    // since the assembler understands the same escapes
+    const char* string = string_list[arg.value];
+    for (size_t j = 1; string[j] != '\0' && string[j + 1] != '\0'; j++)
     {
-      generate_expression(expression->children[0]);
-      PUSHQ(RAX);
-      generate_expression(expression->children[1]);
-      POPQ(RCX);
-      CMPQ(RAX, RCX);
-      SETE(AL);        // Store lhs == rhs into %al
-      MOVZBQ(AL, RAX); // Zero extend to all of %rax
+      if (string[j] == '%')
+        append_text(&format, &length, "%", 1);
+      append_text(&format, &length, &string[j], 1);
     }
-    else if (strcmp(op, "!=") == 0)
+  }
+  if (instruction->newline)
+    append_text(&format, &length, "\\n", 2);
+  return intern_format_string(format);
+}
+
+
+// Prints every argument with a single call to printf, and then possibly a newline.
+// The format string is built at compile time, and the values are passed like the arguments
+// of any other call, after the format string.
+// The stack is always aligned outside of calls, so printf can be called directly
+static void generate_printf(ir_instruction_t* instruction)
+{
+  size_t format = print_format_string(instruction);
+
+  ir_operand_t* values = malloc(instruction->n_args * sizeof(ir_operand_t));
+  size_t n_values = 0;
+  for (size_t i = 0; i < instruction->n_args; i++)
+    if (instruction->args[i].kind != IR_OPERAND_STRING)
+      values[n_values++] = instruction->args[i];
+
+  // The format string is the first argument, so only 5 values fit in registers
+  size_t n_stack_args = n_values > NUM_REGISTER_PARAMS - 1 ? n_values - NUM_REGISTER_PARAMS + 1 : 0;
+  size_t padding = n_stack_args % 2 == 1 ? 8 : 0;
+  if (padding > 0)
+    EMIT("subq $%zu, %s", padding, RSP);
+  for (size_t i = n_values; i > 0; i--)
+    PUSHQ(source_text(values[i - 1], RAX));
+  for (size_t i = 0; i < n_values && i < NUM_REGISTER_PARAMS - 1; i++)
+    POPQ(REGISTER_PARAMS[i + 1]);
+  free(values);
+
+  EMIT("leaq format%zu(%s), %s", format, RIP, RDI);
+  // printf takes a variable number of arguments, so %al holds the number of vector registers used
+  EMIT("xorl %s, %s", EAX, EAX);
+  EMIT("call printf");
+
+  if (n_stack_args > 0)
+    EMIT("addq $%zu, %s", n_stack_args * 8 + padding, RSP);
+}
+
+// Prints every argument, and then possibly a newline, using the runtime from
+// generate_print_runtime(). Every argument is a separate call, but the calls are cheap
+static void generate_print_with_runtime(ir_instruction_t* instruction)
+{
+  for (size_t i = 0; i < instruction->n_args; i++)
+  {
+    ir_operand_t arg = instruction->args[i];
+    if (arg.kind == IR_OPERAND_STRING)
     {
-      generate_expression(expression->children[0]);
-      PUSHQ(RAX);
-      generate_expression(expression->children[1]);
-      POPQ(RCX);
-      CMPQ(RAX, RCX);
-      SETNE(AL);       // Store lhs != rhs into %al
-      MOVZBQ(AL, RAX); // Zero extend to all of %rax
+      EMIT("leaq string%zu(%s), %s", (size_t)arg.value, RIP, RDI);
+      EMIT("call print_string");
     }
-    else if (strcmp(op, "<") == 0)
+    else
     {
-      generate_expression(expression->children[0]);
-      PUSHQ(RAX);
-      generate_expression(expression->children[1]);
-      POPQ(RCX);
-      CMPQ(RAX, RCX);
-      SETL(AL);        // Store lhs < rhs into %al
-      MOVZBQ(AL, RAX); // Zero extend to all of %rax
+      MOVQ(source_text(arg, RDI), RDI);
+      EMIT("call print_integer");
     }
-    else if (strcmp(op, "<=") == 0)
+  }
+
+  if (instruction->newline)
+  {
+    EMIT("leaq newline(%s), %s", RIP, RDI);
+    EMIT("call print_string");
+  }
+}
+
+static void generate_print(ir_instruction_t* instruction)
+{
+  generate_avx_exit();
+  if (feature_print_runtime)
+    generate_print_with_runtime(instruction);
+  else
+    generate_printf(instruction);
+}
+
+// Emits the assembly for a single instruction in the given block
+static void generate_instruction(ir_block_t* block, ir_instruction_t* instruction)
+{
+  ir_operand_t dst = instruction->dst;
+  ir_operand_t a = instruction->a;
+  ir_operand_t b = instruction->b;
+
+  // Instructions without side effects are skipped if their result is never used
+  if (dst.kind == IR_OPERAND_VREG && instruction->opcode != IR_CALL &&
+      !allocation.locations[dst.value].used)
+    return;
+
+  switch (instruction->opcode)
+  {
+  case IR_MOVE:
+    generate_move(dst, a);
+    break;
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL:
+  case IR_SHL:
+  case IR_SAR:
+  case IR_SHR:
+    generate_arithmetic(instruction);
+    break;
+  case IR_MULHI:
+    generate_multiply_high(instruction);
+    break;
+  case IR_DIV:
+    generate_division(instruction);
+    break;
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE:
+  case IR_GT:
+  case IR_GE:
+    SETCC(CONDITION_CODES[generate_comparison(a, b, instruction->opcode)], AL);
+    MOVZBQ(AL, RAX);
+    generate_store_register(dst, RAX);
+    break;
+  case IR_NEG:
+    if (in_register(dst))
     {
-      generate_expression(expression->children[0]);
-      PUSHQ(RAX);
-      generate_expression(expression->children[1]);
-      POPQ(RCX);
-      CMPQ(RAX, RCX);
-      SETLE(AL);       // Store lhs <= rhs into %al
-      MOVZBQ(AL, RAX); // Zero extend to all of %rax
+      generate_move(dst, a);
+      NEGQ(vreg_text(dst));
     }
-    else if (strcmp(op, ">") == 0)
+    else
     {
-      generate_expression(expression->children[0]);
-      PUSHQ(RAX);
-      generate_expression(expression->children[1]);
-      POPQ(RCX);
-      CMPQ(RAX, RCX);
-      SETG(AL);        // Store lhs > rhs into %al
-      MOVZBQ(AL, RAX); // Zero extend to all of %rax
+      MOVQ(source_text(a, RAX), RAX);
+      NEGQ(RAX);
+      generate_store_register(dst, RAX);
     }
-    else if (strcmp(op, ">=") == 0)
+    break;
+  case IR_NOT:
+    generate_comparison(a, IR_CONST(0), IR_EQ);
+    SETCC(CONDITION_CODES[IR_EQ], AL);
+    MOVZBQ(AL, RAX);
+    generate_store_register(dst, RAX);
+    break;
+  case IR_LOAD_GLOBAL:
+  {
+    const char* global = format_operand(".%s(%s)", instruction->symbol->name, RIP);
+    if (in_register(dst))
+      MOVQ(global, vreg_text(dst));
+    else
     {
-      generate_expression(expression->children[0]);
-      PUSHQ(RAX);
-      generate_expression(expression->children[1]);
-      POPQ(RCX);
-      CMPQ(RAX, RCX);
-      SETGE(AL);       // Store lhs >= rhs into %al
-      MOVZBQ(AL, RAX); // Zero extend to all of %rax
+      MOVQ(global, RAX);
+      generate_store_register(dst, RAX);
     }
-    else if (strcmp(op, "!") == 0)
+    break;
+  }
+  case IR_STORE_GLOBAL:
+    MOVQ(register_or_immediate_text(a, RAX),
+         format_operand(".%s(%s)", instruction->symbol->name, RIP));
+    break;
+  case IR_ADDRESS_OF:
+  {
+    const char* address = in_register(dst) ? vreg_text(dst) : RAX;
+    if (instruction->symbol->type == SYMBOL_LOCAL_ARRAY)
+      EMIT("leaq %s, %s",
+           frame_slot_text(local_array_offsets[instruction->symbol->sequence_number]),
+           address);
+    else
+      EMIT("leaq .%s(%s), %s", instruction->symbol->name, RIP, address);
+    generate_store_register(dst, address);
+    break;
+  }
+  case IR_ALLOCATE:
+    generate_allocation(instruction);
+    break;
+  case IR_SAVE_STACK:
+    generate_store_register(dst, RSP);
+    break;
+  case IR_RESTORE_STACK:
+    MOVQ(source_text(a, RAX), RSP);
+    break;
+  case IR_LOAD_ELEMENT:
+  {
+    const char* element = element_address(a, b);
+    const char* value = in_register(dst) ? vreg_text(dst) : RAX;
+    MOVQ(element, value);
+    generate_store_register(dst, value);
+    break;
+  }
+  case IR_STORE_ELEMENT:
+  {
+    const char* value = register_or_immediate_text(instruction->c, RDX);
+    MOVQ(value, element_address(a, b));
+    break;
+  }
+  case IR_CHECK_BOUNDS:
+  {
+    // Negative indices are huge when compared as unsigned, so one comparison checks both bounds
+    int64_t length = node_child(node_get(instruction->symbol->node), 1)->data.number_literal;
+    const char* index = in_memory(a) ? vreg_text(a) : register_text(a, RAX);
+    CMPQ(format_operand("$%ld", length), index);
+    JCC("ae", "BOUNDS_ERROR");
+    break;
+  }
+  case IR_VECTOR_ADD:
+  case IR_VECTOR_SUB:
+    generate_vector_operation(instruction);
+    break;
+  case IR_CALL:
+    generate_call(instruction);
+    break;
+  case IR_PRINT:
+    generate_print(instruction);
+    break;
+  case IR_COUNT:
+    EMIT("addq $1, profile_counter%ld(%s)", a.value, RIP);
+    break;
+  case IR_JUMP:
+    // Falling through to the next block needs no jump
+    if (instruction->targets[0]->id != block->id + 1)
+      JMP(block_label(instruction->targets[0]));
+    break;
+  case IR_BRANCH:
+  {
+    ir_opcode_t condition = generate_comparison(a, b, instruction->condition);
+    ir_block_t* if_true = instruction->targets[0];
+    ir_block_t* if_false = instruction->targets[1];
+    if (if_true->id == block->id + 1)
+      JCC(CONDITION_CODES[ir_inverse_condition(condition)], block_label(if_false));
+    else
     {
-      generate_expression(expression->children[0]);
-      CMPQ("$0", RAX);
-      SETE(AL);        // Store %rax == 0 into %al
-      MOVZBQ(AL, RAX); // Zero extend to all of %rax
+      JCC(CONDITION_CODES[condition], block_label(if_true));
+      if (if_false->id != block->id + 1)
+        JMP(block_label(if_false));
     }
-    else
-      assert(false && "Unknown expression operation");
     break;
   }
-  case FUNCTION_CALL:
-    generate_function_call(expression);
+  case IR_RETURN:
+    MOVQ(source_text(a, RAX), RAX);
+    // The epilogue directly follows the last block
+    if (block->id + 1 != current_function->n_blocks)
+      EMIT("jmp .%s.epilogue", current_function->symbol->name);
     break;
   default:
-    assert(false && "Unknown expression type");
+    assert(false && "Unknown IR opcode");
   }
 }
 
-static void generate_assignment_statement(node_t* statement)
+// Moves the parameters passed in registers to the locations chosen by the register allocator
+static void generate_parameter_moves(size_t n_parameters)
 {
-  node_t* dest = statement->children[0];
-  node_t* expression = statement->children[1];
+  const char* sources[NUM_REGISTER_PARAMS];
+  const char* destinations[NUM_REGISTER_PARAMS];
+  size_t n_moves = 0;
+
+  for (size_t i = 0; i < n_parameters && i < NUM_REGISTER_PARAMS; i++)
+  {
+    if (!allocation.locations[i].used)
+      continue;
+    sources[n_moves] = REGISTER_PARAMS[i];
+    destinations[n_moves] = vreg_text(IR_VREG(i));
+    n_moves++;
+  }
+  generate_parallel_moves(sources, destinations, n_moves);
 
-  // First the right hand side of the assignment is evaluated
-  generate_expression(expression);
+  // Parameter 6 and up are passed on the stack, starting at 16(%rbp)
+  for (size_t i = NUM_REGISTER_PARAMS; i < n_parameters; i++)
+    if (allocation.locations[i].used && in_register(IR_VREG(i)))
+      MOVQ(frame_slot_text(16 + (i - NUM_REGISTER_PARAMS) * 8), vreg_text(IR_VREG(i)));
+}
 
-  if (dest->type == IDENTIFIER)
-    // Store rax into the memory location corresponding to the variable
-    MOVQ(RAX, generate_variable_access(dest));
-  else
+// Returns true if the function calls any function, including printf and putchar
+static bool makes_calls(ir_function_t* function)
+{
+  for (size_t i = 0; i < function->n_blocks; i++)
+  {
+    ir_block_t* block = function->blocks[i];
+    for (size_t j = 0; j < block->n_instructions; j++)
+      if (ir_is_call(&block->instructions[j]))
+        return true;
+  }
+  return false;
+}
+
+// Returns true if the function allocates arrays on the stack while running
+static bool allocates_arrays(ir_function_t* function)
+{
+  for (size_t i = 0; i < function->n_blocks; i++)
   {
-    assert(dest->type == ARRAY_INDEXING);
-    // Store rax until the final address of the array element is found,
-    // since array index calculation can potentially modify all registers
-    PUSHQ(RAX);
-    const char* dest_mem = generate_array_access(dest);
-    POPQ(RAX);
-    MOVQ(RAX, dest_mem);
+    ir_block_t* block = function->blocks[i];
+    for (size_t j = 0; j < block->n_instructions; j++)
+      if (block->instructions[j].opcode == IR_ALLOCATE)
+        return true;
   }
+  return false;
 }
 
-static void generate_print_statement(node_t* statement)
+// Gives each local array of a fixed length its place below the first n_words words of the frame,
+// and returns how many words they take in total
+static size_t place_local_arrays(symbol_table_t* symtable, size_t n_words)
 {
-  node_t* print_items = statement->children[0];
-  for (size_t i = 0; i < print_items->n_children; i++)
+  size_t n_array_words = 0;
+  local_array_offsets = calloc(symtable->n_symbols, sizeof(int64_t));
+  for (size_t i = 0; i < symtable->n_of_type[SYMBOL_LOCAL_ARRAY]; i++)
   {
-    node_t* item = print_items->children[i];
-    if (item->type == STRING_LIST_REFERENCE)
+    symbol_t* array = symtable->of_type[SYMBOL_LOCAL_ARRAY][i];
+    if (IS_DYNAMIC_ARRAY(array))
+      continue;
+    size_t length = ARRAY_LENGTH_NODE(array)->data.number_literal;
+    n_array_words += (length + 1) / 2 * 2;
+    local_array_offsets[array->sequence_number] = -(int64_t)(n_words + n_array_words) * 8;
+  }
+  return n_array_words;
+}
+
+// Local arrays start out as all zeroes, like the variables. The frame of the function has just
+// been made, so %rax and %xmm0 are free to use
+static void generate_zeroed_arrays(symbol_table_t* symtable)
+{
+  bool zeroed_xmm0 = false;
+  for (size_t i = 0; i < symtable->n_of_type[SYMBOL_LOCAL_ARRAY]; i++)
+  {
+    symbol_t* array = symtable->of_type[SYMBOL_LOCAL_ARRAY][i];
+    if (IS_DYNAMIC_ARRAY(array))
+      continue;
+    int64_t length = ARRAY_LENGTH_NODE(array)->data.number_literal;
+    int64_t size = (length + 1) / 2 * 16;
+    if (size == 0)
+      continue;
+    if (!zeroed_xmm0)
+      EMIT("pxor %%xmm0, %%xmm0");
+    zeroed_xmm0 = true;
+
+    int64_t offset = local_array_offsets[array->sequence_number];
+    if (size <= UNROLLED_ZEROING_LIMIT)
     {
-      EMIT("leaq strout(%s), %s", RIP, RDI);
-      EMIT("leaq string%zu(%s), %s", (size_t)item->data.string_list_index, RIP, RSI);
+      for (int64_t position = 0; position < size; position += 16)
+        EMIT("movdqu %%xmm0, %s", frame_slot_text(offset + position));
+      continue;
     }
+
+    // %rax counts up from -size to 0, addressing the array from its end
+    const char* name = current_function->symbol->name;
+    EMIT("movq $%ld, %s", -size, RAX);
+    LABEL(".%s.zero%zu", name, array->sequence_number);
+    EMIT("movdqu %%xmm0, %s", frame_element_text(offset + size, RAX));
+    EMIT("addq $16, %s", RAX);
+    JCC("ne", format_operand(".%s.zero%zu", name, array->sequence_number));
+  }
+}
+
+static int compare_offsets(const void* a, const void* b)
+{
+  return *(const int*)a - *(const int*)b;
+}
+
+// Local variables start out as 0, so the entry block starts with one move of 0 for each of them.
+// The ones in stack slots are stored 16 bytes at a time from a zeroed %xmm0 instead, where two
+// slots are next to each other. Returns how many instructions at the start of the block are done
+static size_t generate_zeroed_variables(ir_block_t* block)
+{
+  size_t n_moves = 0;
+  while (n_moves < block->n_instructions)
+  {
+    ir_instruction_t* instruction = &block->instructions[n_moves];
+    if (instruction->opcode != IR_MOVE || instruction->dst.kind != IR_OPERAND_VREG ||
+        instruction->a.kind != IR_OPERAND_CONST || instruction->a.value != 0)
+      break;
+    n_moves++;
+  }
+
+  int* offsets = malloc((n_moves + 1) * sizeof(int));
+  size_t n_offsets = 0;
+  for (size_t i = 0; i < n_moves; i++)
+  {
+    ir_instruction_t* instruction = &block->instructions[i];
+    if (!allocation.locations[instruction->dst.value].used)
+      continue;
+    if (in_memory(instruction->dst))
+      offsets[n_offsets++] = vreg_location(instruction->dst)->offset;
     else
+      generate_instruction(block, instruction);
+  }
+  qsort(offsets, n_offsets, sizeof(int), compare_offsets);
+
+  bool zeroed_xmm0 = false;
+  for (size_t i = 0; i < n_offsets; i++)
+  {
+    if (i + 1 < n_offsets && offsets[i + 1] == offsets[i] + 8)
     {
-      generate_expression(item);
-      MOVQ(RAX, RSI);
-      EMIT("leaq intout(%s), %s", RIP, RDI);
+      if (!zeroed_xmm0)
+        EMIT("pxor %%xmm0, %%xmm0");
+      zeroed_xmm0 = true;
+      EMIT("movdqu %%xmm0, %s", frame_slot_text(offsets[i]));
+      i++;
     }
-    EMIT("call safe_printf");
+    else
+      EMIT("movq $0, %s", frame_slot_text(offsets[i]));
   }
-
-  MOVQ("$'\\n'", RDI);
-  EMIT("call safe_putchar");
+  free(offsets);
+  return n_moves;
 }
 
-
-static void generate_return_statement(node_t* statement)
+// Prints the entry point, preamble, blocks and epilogue of the given function
+static void generate_function(ir_function_t* function)
 {
-  generate_expression(statement->children[0]);
-  EMIT("jmp .%s.epilogue", current_function->name);
-}
+  symbol_t* symbol = function->symbol;
+  current_function = function;
+  allocation = allocate_registers(function);
+
+  omit_frame_pointer =
+      feature_omit_frame_pointer && !makes_calls(function) && !allocates_arrays(function);
+  allocation_counter = 0;
+  uses_avx = false;
+  for (size_t i = 0; i < function->n_blocks && feature_avx2; i++)
+    for (size_t j = 0; j < function->blocks[i]->n_instructions; j++)
+      if (function->blocks[i]->instructions[j].opcode == IR_VECTOR_ADD ||
+          function->blocks[i]->instructions[j].opcode == IR_VECTOR_SUB)
+        uses_avx = true;
+  size_t n_saved = allocation.n_saved_registers;
+  size_t n_slots = allocation.n_stack_slots;
+  n_slots += place_local_arrays(symbol->function_symtable, n_saved + n_slots);
+
+  if (cache_directory != NULL)
+  {
+    block_labels = malloc(function->n_blocks * sizeof(char*));
+    for (size_t i = 0; i < function->n_blocks; i++)
+    {
+      const char* label = function->blocks[i]->label;
+      if (label[0] == '.')
+        label++;
+      size_t length = strlen(symbol->name) + strlen(label) + 3;
+      block_labels[i] = malloc(length);
+      snprintf(block_labels[i], length, ".%s.%s", symbol->name, label);
+    }
+  }
+
+  LABEL(".%s", symbol->name);
+  if (omit_frame_pointer)
+  {
+    // Without the pushed %rbp, the saved registers start 8 bytes higher than the register
+    // allocator expects, so the stack slots must reach 8 bytes further down
+    frame_slots_size = n_slots > 0 ? (n_slots + 1) * 8 : 0;
+    frame_base_distance = (int64_t)(n_saved * 8 + frame_slots_size) - 8;
+  }
+  else
+  {
+    // The stack must stay 16-byte aligned for calls. It is aligned after pushing %rbp,
+    // so the saved registers and stack slots must fill a multiple of 16 bytes
+    frame_slots_size = ((n_saved + n_slots + 1) / 2 * 2 - n_saved) * 8;
+    PUSHQ(RBP);
+    MOVQ(RSP, RBP);
+  }
 
-static int if_statement_counter = 0;
+  // Save the callee saved registers we are about to use. They are stored right below the old %rbp
+  for (size_t i = 0; i < n_saved; i++)
+    PUSHQ(allocation.saved_registers[i]);
 
-static void generate_if_statement(node_t* statement)
-{
-  // Generate code for emitting both if-then statements, and if-then-else statements.
-  // Check the number of children to determine which.
-  
-  // You will need to define your own unique labels for this if statement,
-  // so consider using a global variable as a counter to give each label a suffix unique to this if.
-  
-  if_statement_counter++; // Increment global counter
-  const int curr_if_statement = if_statement_counter; // Define local copy of counter, to be used for this if statement
+  // Make room for all vregs that live in stack slots
+  if (frame_slots_size > 0)
+    EMIT("subq $%zu, %s", frame_slots_size, RSP);
 
-  LABEL("if%d", curr_if_statement);
-  // First child is the condition
-  generate_expression(statement->children[0]);
-  CMPQ("$0", RAX);
+  generate_parameter_moves(FUNC_PARAM_COUNT(symbol));
 
-  if (statement->n_children == 3) {
-    // if-then-else
-    EMIT("je else%d", curr_if_statement);
-    generate_statement(statement->children[1]); // Second child contains the then-statement
-    EMIT("jmp endif%d", curr_if_statement);
-    LABEL("else%d", curr_if_statement);
-    generate_statement(statement->children[2]); // Third child contains the else-statement
-  } else {
-    // if-then
-    EMIT("je endif%d", curr_if_statement);
-    generate_statement(statement->children[1]);
+  bool* loop_starts = find_loop_starts(function);
+  for (size_t i = 0; i < function->n_blocks; i++)
+  {
+    ir_block_t* block = function->blocks[i];
+    if (loop_starts[i])
+      DIRECTIVE(".p2align %d", LOOP_ALIGNMENT_LOG2);
+    LABEL("%s", block_label(block));
+    size_t first = 0;
+    if (i == 0)
+    {
+      generate_zeroed_arrays(symbol->function_symtable);
+      first = generate_zeroed_variables(block);
+    }
+    for (size_t j = first; j < block->n_instructions; j++)
+    {
+      // A tail call replaces both the call and the return
+      if (is_tail_call(block, j))
+      {
+        generate_tail_call(&block->instructions[j]);
+        break;
+      }
+      generate_instruction(block, &block->instructions[j]);
+    }
   }
-  LABEL("endif%d", curr_if_statement);
-}
+  free(loop_starts);
+
+  LABEL(".%s.epilogue", symbol->name);
+  generate_frame_teardown();
+  RET;
 
-static int while_statement_counter = 0;
+  destroy_register_allocation(&allocation);
+  current_function = NULL;
+  free(local_array_offsets);
+  local_array_offsets = NULL;
+  for (size_t i = 0; i < function->n_blocks && block_labels != NULL; i++)
+    free(block_labels[i]);
+  free(block_labels);
+  block_labels = NULL;
+}
 
-static int curr_while_statement;
+// ================== Parallel code generation ==================
 
-static void generate_while_statement(node_t* statement)
+// Functions are generated independently of each other, and only read the IR, the symbol tables and
+// the syntax tree. Several threads can then generate functions at once, each into its own buffer.
+// The buffers are output in the order of the functions, so the output is the same as
+// generating them one after another.
+//
+// The state of the compilation is kept in _Thread_local variables, so the threads start out
+// with copies of the pointers to it, taken from the thread running generate_program()
+typedef struct
 {
-  // Implement while loops, similarily to the way if statements were generated.
-  // Remember to make label names unique, and to handle nested while loops.
-  while_statement_counter++;
-  curr_while_statement = while_statement_counter;
-
-  LABEL("while%d", curr_while_statement);
-  generate_expression(statement->children[0]);
-  CMPQ("$0", RAX);
-  EMIT("je endwhile%d", curr_while_statement);
-  generate_statement(statement->children[1]);
-  EMIT("jmp while%d", curr_while_statement);
-  LABEL("endwhile%d", curr_while_statement);
-  curr_while_statement--;
+  node_t* nodes;
+  node_id_t* child_ids;
+  symbol_table_t* globals;
+  char** strings;
+  size_t n_strings;
+  ir_function_t** functions;
+  size_t n_functions;
+  char** formats;
+  size_t n_formats;
+  size_t* format_buckets;
+  size_t n_format_buckets;
+
+  // The assembly of each function, and the next function no thread has started generating
+  char** outputs;
+  size_t* output_lengths;
+  atomic_size_t next_function;
+} codegen_jobs_t;
+
+// The body of each thread, generating functions until none are left
+static void* codegen_job(void* argument)
+{
+  codegen_jobs_t* jobs = argument;
+  syntax_tree_nodes = jobs->nodes;
+  syntax_tree_child_ids = jobs->child_ids;
+  global_symbols = jobs->globals;
+  string_list = jobs->strings;
+  string_list_len = jobs->n_strings;
+  ir_functions = jobs->functions;
+  ir_functions_len = jobs->n_functions;
+  format_strings = jobs->formats;
+  format_strings_len = jobs->n_formats;
+  format_buckets = jobs->format_buckets;
+  n_format_buckets = jobs->n_format_buckets;
+
+  while (true)
+  {
+    size_t index = atomic_fetch_add(&jobs->next_function, 1);
+    if (index >= jobs->n_functions)
+      break;
+
+    assembly_output = open_memstream(&jobs->outputs[index], &jobs->output_lengths[index]);
+    generate_function(ir_functions[index]);
+    flush_assembly();
+    fclose(assembly_output);
+  }
+  assembly_output = NULL;
+  return NULL;
 }
 
-// Leaves the currently innermost while loop using its end-label
-static void generate_break_statement()
+static void generate_functions_in_parallel(size_t n_threads)
 {
-  // Generate the break statement, jumping out past the end of the current innermost while loop.
-  // You can use a global variable to keep track of the current innermost call to
-  // generate_while_statement().
-  EMIT("jmp endwhile%d", curr_while_statement);
+  // The format strings are numbered in the order they are first used. Collecting them all first
+  // lets every thread find the number of its format strings, without adding any
+  collect_format_strings();
+
+  codegen_jobs_t jobs = {
+      .nodes = syntax_tree_nodes,
+      .child_ids = syntax_tree_child_ids,
+      .globals = global_symbols,
+      .strings = string_list,
+      .n_strings = string_list_len,
+      .functions = ir_functions,
+      .n_functions = ir_functions_len,
+      .formats = format_strings,
+      .n_formats = format_strings_len,
+      .format_buckets = format_buckets,
+      .n_format_buckets = n_format_buckets,
+      .outputs = calloc(ir_functions_len, sizeof(char*)),
+      .output_lengths = calloc(ir_functions_len, sizeof(size_t)),
+      .next_function = 0,
+  };
+
+  pthread_t* threads = malloc(n_threads * sizeof(pthread_t));
+  for (size_t i = 0; i < n_threads; i++)
+    pthread_create(&threads[i], NULL, codegen_job, &jobs);
+  for (size_t i = 0; i < n_threads; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  FILE* output = assembly_output != NULL ? assembly_output : stdout;
+  for (size_t i = 0; i < ir_functions_len; i++)
+  {
+    fwrite(jobs.outputs[i], 1, jobs.output_lengths[i], output);
+    free(jobs.outputs[i]);
+  }
+  free(jobs.outputs);
+  free(jobs.output_lengths);
 }
 
-// Recursively generate the given statement node, and all sub-statements.
-static void generate_statement(node_t* node)
+// ================== Cached functions ==================
+
+// With -C, every function is looked up in the cache, and only generated if it is not found.
+// Cached assembly numbers the format strings it uses from 0, so the numbers are changed to
+// those of format_strings when it is reused, and the other way around when it is stored
+
+// The numbers of format_strings used by one function, in the order it numbers them
+typedef struct
 {
-  if (node == NULL)
-    return;
+  size_t* numbers;
+  size_t n_numbers;
+} format_numbers_t;
+
+// Returns the text with the number of every format<number> label replaced by what renumber
+// returns for it
+static char* renumber_format_labels(const char* text,
+                                    size_t (*renumber)(size_t number, format_numbers_t* numbers),
+                                    format_numbers_t* numbers)
+{
+  char* result = NULL;
+  size_t length = 0;
+  append_text(&result, &length, "", 0);
 
-  switch (node->type)
-  {
-  case BLOCK:
+  const char* position = text;
+  const char* found;
+  while ((found = strstr(position, "format")) != NULL)
   {
-    // All handling of pushing and popping scopes has already been done
-    // Just generate the statements that make up the statement body, one by one
-    node_t* statement_list = node->children[node->n_children - 1];
-    for (size_t i = 0; i < statement_list->n_children; i++)
-      generate_statement(statement_list->children[i]);
-    break;
-  }
-  case ASSIGNMENT_STATEMENT:
-    generate_assignment_statement(node);
-    break;
-  case PRINT_STATEMENT:
-    generate_print_statement(node);
-    break;
-  case RETURN_STATEMENT:
-    generate_return_statement(node);
-    break;
-  case FUNCTION_CALL:
-    generate_function_call(node);
-    break;
-  case IF_STATEMENT:
-    generate_if_statement(node);
-    break;
-  case WHILE_STATEMENT:
-    generate_while_statement(node);
-    break;
-  case BREAK_STATEMENT:
-    generate_break_statement();
-    break;
-  default:
-    assert(false && "Unknown statement type");
+    // Function and variable labels start with a dot, so .format1 is not a format string
+    const char* digits = found + strlen("format");
+    size_t n_digits = strspn(digits, "0123456789");
+    bool starts_label = found == text || !(isalnum(found[-1]) || found[-1] == '_' ||
+                                           found[-1] == '.');
+    bool ends_label = !(isalnum(digits[n_digits]) || digits[n_digits] == '_');
+    append_text(&result, &length, position, digits - position);
+    position = digits;
+    if (!starts_label || n_digits == 0 || !ends_label)
+      continue;
+
+    char number[32];
+    int n = snprintf(number, sizeof(number), "%zu", renumber(strtoul(digits, NULL, 10), numbers));
+    append_text(&result, &length, number, n);
+    position += n_digits;
   }
+  append_text(&result, &length, position, strlen(position));
+  return result;
 }
 
-static void generate_safe_printf(void)
+// Numbers the format strings of a function in the order it uses them, for storing it
+static size_t local_format_number(size_t number, format_numbers_t* numbers)
 {
-  LABEL("safe_printf");
+  for (size_t i = 0; i < numbers->n_numbers; i++)
+    if (numbers->numbers[i] == number)
+      return i;
+  numbers->numbers = realloc(numbers->numbers, (numbers->n_numbers + 1) * sizeof(size_t));
+  numbers->numbers[numbers->n_numbers] = number;
+  return numbers->n_numbers++;
+}
 
-  PUSHQ(RBP);
-  MOVQ(RSP, RBP);
-  // This is a bitmask that abuses how negative numbers work, to clear the last 4 bits
-  // A stack pointer that is not 16-byte aligned, will be moved down to a 16-byte boundary
-  ANDQ("$-16", RSP);
-  EMIT("call printf");
-  // Cleanup the stack back to how it was
-  MOVQ(RBP, RSP);
-  POPQ(RBP);
-  RET;
+// Gives the format strings of a cached function their numbers in format_strings
+static size_t global_format_number(size_t number, format_numbers_t* numbers)
+{
+  return number < numbers->n_numbers ? numbers->numbers[number] : number;
 }
 
-static void generate_safe_putchar(void)
+// Outputs the cached assembly of the function, or generates it and stores it in the cache
+static void generate_cached_function(ir_function_t* function)
 {
-  LABEL("safe_putchar");
+  char** formats;
+  size_t n_formats;
+  const char* cached = cached_assembly(function->symbol, &formats, &n_formats);
+  if (cached != NULL)
+  {
+    format_numbers_t numbers = {.numbers = malloc((n_formats + 1) * sizeof(size_t))};
+    for (size_t i = 0; i < n_formats; i++)
+      numbers.numbers[numbers.n_numbers++] = intern_format_string(strdup(formats[i]));
+    char* text = renumber_format_labels(cached, global_format_number, &numbers);
+    emit_assembly_text(text);
+    free(text);
+    free(numbers.numbers);
+    return;
+  }
 
-  PUSHQ(RBP);
-  MOVQ(RSP, RBP);
-  // This is a bitmask that abuses how negative numbers work, to clear the last 4 bits
-  // A stack pointer that is not 16-byte aligned, will be moved down to a 16-byte boundary
-  ANDQ("$-16", RSP);
-  EMIT("call putchar");
-  // Cleanup the stack back to how it was
-  MOVQ(RBP, RSP);
-  POPQ(RBP);
-  RET;
+  char* text = NULL;
+  size_t length = 0;
+  assembly_copy = open_memstream(&text, &length);
+  generate_function(function);
+  flush_assembly();
+  fclose(assembly_copy);
+  assembly_copy = NULL;
+
+  format_numbers_t numbers = {.numbers = NULL};
+  char* stored = renumber_format_labels(text, local_format_number, &numbers);
+  char** used = malloc((numbers.n_numbers + 1) * sizeof(char*));
+  for (size_t i = 0; i < numbers.n_numbers; i++)
+    used[i] = format_strings[numbers.numbers[i]];
+  store_in_cache(function->symbol, stored, used, numbers.n_numbers);
+  free(used);
+  free(stored);
+  free(text);
+  free(numbers.numbers);
+}
+
+// Builds the format strings of all print instructions, in the order generate_function() would
+static void collect_format_strings(void)
+{
+  if (feature_print_runtime)
+    return;
+
+  for (size_t i = 0; i < ir_functions_len; i++)
+  {
+    ir_function_t* function = ir_functions[i];
+    for (size_t j = 0; j < function->n_blocks; j++)
+    {
+      ir_block_t* block = function->blocks[j];
+      for (size_t k = 0; k < block->n_instructions; k++)
+        if (block->instructions[k].opcode == IR_PRINT)
+          print_format_string(&block->instructions[k]);
+    }
+  }
 }
 
 // Generates the scaffolding for parsing integers from the command line, and passing them to the
@@ -580,9 +1673,13 @@ static void generate_main(symbol_t* first)
   // Make the globally available main function
   LABEL("main");
 
-  // Save old base pointer, and set new base pointer
+  // Save old base pointer, and set new base pointer.
+  // The loop below keeps its state in callee saved registers, so they are saved as well.
+  // After these three pushes, the stack is 16-byte aligned
   PUSHQ(RBP);
   MOVQ(RSP, RBP);
+  PUSHQ(RBX);
+  PUSHQ(R12);
 
   // Which registers argc and argv are passed in
   const char* argc = RDI;
@@ -597,39 +1694,49 @@ static void generate_main(symbol_t* first)
   if (expected_args == 0)
     goto skip_args; // No need to parse argv
 
-  // Now we emit a loop to parse all parameters, and push them to the stack,
-  // in right-to-left order
-
-  // First move the argv pointer to the vert rightmost parameter
-  EMIT("addq $%ld, %s", expected_args * 8, argv);
-
-  // We use rcx as a counter, starting at the number of arguments
-  MOVQ(argc, RCX);
+  // Now we emit a loop to parse all parameters into an array on the stack, with the first
+  // parameter at %rsp. Parameters 6 and up are then already where the callee expects them.
+  // The array is padded to a multiple of 16 bytes, so that the stack stays aligned
+  // both when calling strtol and when calling the entry point
+  size_t padding = expected_args % 2 == 1 ? 8 : 0;
+  EMIT("subq $%zu, %s", expected_args * 8 + padding, RSP);
+
+  // We use rbx as a counter, going from the number of arguments down to 1,
+  // and r12 as the argv pointer, since both must survive the calls to strtol
+  MOVQ(argc, RBX);
+  MOVQ(argv, R12);
   LABEL("PARSE_ARGV"); // A loop to parse all parameters
-  PUSHQ(argv);         // push registers to caller save them
-  PUSHQ(RCX);
 
   // Now call strtol to parse the argument
-  EMIT("movq (%s), %s", argv, RDI); // 1st argument, the char *
-  MOVQ("$0", RSI);                  // 2nd argument, a null pointer
-  MOVQ("$10", RDX);                 // 3rd argument, we want base 10
+  EMIT("movq (%s,%s,8), %s", R12, RBX, RDI); // 1st argument, the char *
+  MOVQ("$0", RSI);                           // 2nd argument, a null pointer
+  MOVQ("$10", RDX);                          // 3rd argument, we want base 10
   EMIT("call strtol");
+  EMIT("movq %s, -8(%s,%s,8)", RAX, RSP, RBX); // Store the parsed argument in the array
 
-  // Restore caller saved registers
-  POPQ(RCX);
-  POPQ(argv);
-  PUSHQ(RAX); // Store the parsed argument on the stack
-
-  SUBQ("$8", argv);        // Point to the previous char*
-  EMIT("loop PARSE_ARGV"); // Loop uses RCX as a counter automatically
+  SUBQ("$1", RBX);
+  JNE("PARSE_ARGV");
 
-  // Now, pop up to 6 arguments into registers instead of stack
+  // Now, load up to 6 arguments into registers instead of stack
   for (size_t i = 0; i < expected_args && i < NUM_REGISTER_PARAMS; i++)
-    POPQ(REGISTER_PARAMS[i]);
+    EMIT("movq %zu(%s), %s", i * 8, RSP, REGISTER_PARAMS[i]);
+  if (expected_args > NUM_REGISTER_PARAMS)
+    EMIT("addq $%d, %s", NUM_REGISTER_PARAMS * 8, RSP);
 
 skip_args:
 
   EMIT("call .%s", first->name);
+  if (feature_print_runtime || feature_profile_generate)
+  {
+    // Output everything still in the print buffer, and write the profile,
+    // keeping the return value safe in rbx
+    MOVQ(RAX, RBX);
+    if (feature_print_runtime)
+      EMIT("call print_flush");
+    if (feature_profile_generate)
+      EMIT("call profile_write");
+    MOVQ(RBX, RAX);
+  }
   MOVQ(RAX, RDI);    // Move the return value of the function into RDI
   EMIT("call exit"); // Exit with the return value as exit code
 
@@ -639,9 +1746,175 @@ skip_args:
   MOVQ("$1", RDI);
   EMIT("call exit"); // Exit with return code 1
 
-  generate_safe_printf();
-  generate_safe_putchar();
+  if (feature_bounds_check)
+    generate_bounds_error();
 
   // Declares global symbols we use or emit, such as main, printf and putchar
   DIRECTIVE("%s", ASM_DECLARE_SYMBOLS);
 }
+
+// With -fbounds-check, a failed bounds check jumps here from anywhere in a function,
+// so the stack is realigned before printing the error
+static void generate_bounds_error(void)
+{
+  LABEL("BOUNDS_ERROR");
+  EMIT("andq $-16, %s", RSP);
+  if (feature_print_runtime)
+    EMIT("call print_flush");
+  EMIT("leaq boundserr(%s), %s", RIP, RDI);
+  EMIT("call puts");
+  MOVQ("$1", RDI);
+  EMIT("call exit");
+}
+
+// Adds the format strings used by the print statements, built by print_format_string(), to the
+// string table
+static void generate_format_strings(void)
+{
+  for (size_t i = 0; i < format_strings_len; i++)
+  {
+    size_t length = strlen(format_strings[i]) + 3;
+    char* literal = malloc(length);
+    snprintf(literal, length, "\"%s\"", format_strings[i]);
+    add_table_string(literal, "format%zu", i);
+    free(literal);
+    free(format_strings[i]);
+  }
+  free(format_strings);
+  format_strings = NULL;
+  format_strings_len = 0;
+  free(format_buckets);
+  format_buckets = NULL;
+  n_format_buckets = 0;
+}
+
+// With -fprint-runtime, output goes through a small runtime instead of printf.
+// It collects the output in a buffer, which is written with a single call to write
+// when it is full, and when the program exits from main.
+// All its functions follow the calling convention, and are called with an aligned stack
+#define PRINT_BUFFER_SIZE 4096
+static void generate_print_runtime(void)
+{
+  DIRECTIVE(".section %s", ASM_BSS_SECTION);
+  DIRECTIVE(".align 8");
+  DIRECTIVE("print_buffer_length: .zero 8");
+  DIRECTIVE("print_buffer: .zero %d", PRINT_BUFFER_SIZE);
+  DIRECTIVE(".text");
+
+  // print_flush() writes the buffer to stdout, and empties it
+  LABEL("print_flush");
+  SUBQ("$8", RSP); // Align the stack for the call
+  MOVQ("$1", RDI);
+  EMIT("leaq print_buffer(%s), %s", RIP, RSI);
+  MOVQ("print_buffer_length(%rip)", RDX);
+  EMIT("call write");
+  MOVQ("$0", "print_buffer_length(%rip)");
+  EMIT("addq $8, %s", RSP);
+  RET;
+
+  // print_string(string) copies the zero terminated string into the buffer, byte by byte,
+  // flushing the buffer whenever it fills up
+  LABEL("print_string");
+  MOVQ("print_buffer_length(%rip)", RAX);
+  EMIT("leaq print_buffer(%s), %s", RIP, RCX);
+  LABEL("print_string_loop");
+  EMIT("movzbq (%s), %s", RDI, RDX);
+  EMIT("testq %s, %s", RDX, RDX);
+  JE("print_string_end");
+  EMIT("movb %%dl, (%s,%s)", RCX, RAX);
+  EMIT("addq $1, %s", RAX);
+  EMIT("addq $1, %s", RDI);
+  EMIT("cmpq $%d, %s", PRINT_BUFFER_SIZE, RAX);
+  JNE("print_string_loop");
+  // The buffer is full. The string pointer is saved across the flush, which also aligns the stack
+  MOVQ(RAX, "print_buffer_length(%rip)");
+  PUSHQ(RDI);
+  EMIT("call print_flush");
+  POPQ(RDI);
+  JMP("print_string");
+  LABEL("print_string_end");
+  MOVQ(RAX, "print_buffer_length(%rip)");
+  RET;
+
+  // print_integer(value) converts the value to decimal digits in a buffer on the stack,
+  // from the last digit to the first, and then prints the buffer with print_string.
+  // The absolute value is divided as an unsigned number, so the most negative value works too
+  LABEL("print_integer");
+  SUBQ("$24", RSP); // Room for 20 digits, a sign and the terminator, keeping the stack aligned
+  EMIT("leaq 23(%s), %s", RSP, RCX);
+  EMIT("movb $0, (%s)", RCX);
+  MOVQ(RDI, RAX);
+  EMIT("testq %s, %s", RAX, RAX);
+  EMIT("jns print_integer_digits");
+  NEGQ(RAX);
+  LABEL("print_integer_digits");
+  MOVQ("$10", R8);
+  LABEL("print_integer_loop");
+  EMIT("xorl %%edx, %%edx");
+  EMIT("divq %s", R8);
+  EMIT("addq $'0', %s", RDX);
+  EMIT("subq $1, %s", RCX);
+  EMIT("movb %%dl, (%s)", RCX);
+  EMIT("testq %s, %s", RAX, RAX);
+  JNE("print_integer_loop");
+  EMIT("testq %s, %s", RDI, RDI);
+  EMIT("jns print_integer_end");
+  EMIT("subq $1, %s", RCX);
+  EMIT("movb $'-', (%s)", RCX);
+  LABEL("print_integer_end");
+  MOVQ(RCX, RDI);
+  EMIT("call print_string");
+  EMIT("addq $24, %s", RSP);
+  RET;
+}
+
+// With -fprofile-generate, every block counts how many times it runs in its own counter.
+// When main returns, profile_write() writes one line for each counter to PROFILE_FILENAME,
+// with the function, the label of the block and the count. It follows the calling convention,
+// and is called with an aligned stack
+static void generate_profile_runtime(void)
+{
+  DIRECTIVE(".section %s", ASM_BSS_SECTION);
+  DIRECTIVE(".align 8");
+  for (size_t i = 0; i < n_profile_counters; i++)
+    DIRECTIVE("profile_counter%zu: .zero 8", i);
+
+  add_table_string("\"" PROFILE_FILENAME "\"", "profile_filename");
+  add_table_string("\"w\"", "profile_mode");
+  for (size_t i = 0; i < n_profile_counters; i++)
+  {
+    size_t length = strlen(profile_counter_formats[i]) + 3;
+    char* literal = malloc(length);
+    snprintf(literal, length, "\"%s\"", profile_counter_formats[i]);
+    add_table_string(literal, "profile_format%zu", i);
+    free(literal);
+    free(profile_counter_formats[i]);
+  }
+  free(profile_counter_formats);
+  profile_counter_formats = NULL;
+  DIRECTIVE(".text");
+
+  // The file is kept in rbx, which also aligns the stack
+  LABEL("profile_write");
+  PUSHQ(RBX);
+  EMIT("leaq profile_filename(%s), %s", RIP, RDI);
+  EMIT("leaq profile_mode(%s), %s", RIP, RSI);
+  EMIT("call fopen");
+  EMIT("testq %s, %s", RAX, RAX);
+  JE("profile_write_end");
+  MOVQ(RAX, RBX);
+  for (size_t i = 0; i < n_profile_counters; i++)
+  {
+    MOVQ(RBX, RDI);
+    EMIT("leaq profile_format%zu(%s), %s", i, RIP, RSI);
+    EMIT("movq profile_counter%zu(%s), %s", i, RIP, RDX);
+    MOVQ("$0", RAX); // No vector registers are passed to the variadic fprintf
+    EMIT("call fprintf");
+  }
+  MOVQ(RBX, RDI);
+  EMIT("call fclose");
+  LABEL("profile_write_end");
+  POPQ(RBX);
+  RET;
+  n_profile_counters = 0;
+}
@@ -23,9 +23,13 @@ static void print_escaped_string(char* str)
   }
 }
 
-// A recursive function for printing a node as GraphViz, and all its children
-static void graphviz_node_print_internal(node_t* node)
+// Prints a node as GraphViz, with the edges to all its children.
+// The children themselves are printed when the traversal reaches them
+static visit_order_t graphviz_node_print_enter(node_t* node, node_t* parent, void* context)
 {
+  if (node == NULL)
+    return SKIP_CHILDREN;
+
   printf("node%p [label=\"%s", node, NODE_TYPE_NAMES[node->type]);
   switch (node->type)
   {
@@ -52,20 +56,18 @@ static void graphviz_node_print_internal(node_t* node)
   printf("\"];\n");
   for (size_t i = 0; i < node->n_children; i++)
   {
-    node_t* child = node->children[i];
+    node_t* child = node_child(node, i);
     if (child == NULL)
       printf("node%p -- node%pNULL%zu ;\n", node, node, i);
     else
-    {
       printf("node%p -- node%p ;\n", node, child);
-      graphviz_node_print_internal(child);
-    }
   }
+  return VISIT_CHILDREN;
 }
 
 void graphviz_node_print(node_t* root)
 {
   printf("graph \"\" {\n node[shape=box];\n");
-  graphviz_node_print_internal(root);
+  traverse_syntax_tree(root, graphviz_node_print_enter, NULL, NULL);
   printf("}\n");
 }
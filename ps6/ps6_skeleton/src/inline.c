@@ -0,0 +1,237 @@
+#include "vslc.h"
+
+// Functions with at most this many instructions are small enough to be inlined
+#define INLINE_CALLEE_LIMIT 40
+
+// How many times larger than INLINE_CALLEE_LIMIT a function that ran in the profile may be
+#define HOT_CALLEE_FACTOR 4
+
+// No more calls are inlined into a function once it has grown to this many instructions
+#define INLINE_CALLER_LIMIT 2000
+
+// Every inlined call gets a unique number, used to make the labels of its blocks unique
+static _Thread_local int inline_counter = 0;
+
+// Returns the IR of the given function symbol
+static ir_function_t* find_function(symbol_t* symbol)
+{
+  for (size_t i = 0; i < ir_functions_len; i++)
+    if (ir_functions[i]->symbol == symbol)
+      return ir_functions[i];
+  assert(false && "Called function has no IR");
+  return NULL;
+}
+
+// Returns the number of instructions in the function
+static size_t function_size(ir_function_t* function)
+{
+  size_t size = 0;
+  for (size_t i = 0; i < function->n_blocks; i++)
+    size += function->blocks[i]->n_instructions;
+  return size;
+}
+
+// Returns true if the function calls any function, including itself
+static bool contains_calls(ir_function_t* function)
+{
+  for (size_t i = 0; i < function->n_blocks; i++)
+  {
+    ir_block_t* block = function->blocks[i];
+    for (size_t j = 0; j < block->n_instructions; j++)
+      if (block->instructions[j].opcode == IR_CALL)
+        return true;
+  }
+  return false;
+}
+
+// Only leaf functions are inlined, which means that a recursive function is never inlined,
+// not even into itself. Inlining can turn the caller into a leaf function, making it a
+// candidate in the next round. With a profile, callees that never ran are not inlined, while
+// those that ran are allowed to be HOT_CALLEE_FACTOR times larger. Local arrays live in the frame
+// of their own function, so callees with local arrays are not inlined either
+static bool can_inline(ir_function_t* caller, ir_function_t* callee)
+{
+  if (callee->symbol->function_symtable->n_of_type[SYMBOL_LOCAL_ARRAY] > 0)
+    return false;
+
+  size_t callee_limit = INLINE_CALLEE_LIMIT;
+  int64_t entry_count = callee->blocks[0]->profile_count;
+  if (entry_count == 0)
+    return false;
+  if (entry_count > 0)
+    callee_limit *= HOT_CALLEE_FACTOR;
+
+  return caller != callee && !contains_calls(callee) &&
+         function_size(callee) <= callee_limit &&
+         function_size(caller) < INLINE_CALLER_LIMIT;
+}
+
+// Moves a vreg to account for count new variables being placed at the end of the variables
+static void shift_temporary(ir_operand_t* operand, size_t n_variables, size_t count)
+{
+  if (operand->kind == IR_OPERAND_VREG && (size_t)operand->value >= n_variables)
+    operand->value += count;
+}
+
+// Adds count new variables to the function, and returns the vreg of the first one.
+// Variables must be the first vregs of the function, so all temporaries are renumbered
+static size_t add_variables(ir_function_t* function, size_t count)
+{
+  size_t n_variables = function->n_variables;
+  for (size_t i = 0; i < function->n_blocks; i++)
+  {
+    ir_block_t* block = function->blocks[i];
+    for (size_t j = 0; j < block->n_instructions; j++)
+    {
+      ir_instruction_t* instruction = &block->instructions[j];
+      shift_temporary(&instruction->dst, n_variables, count);
+      for (size_t s = 0; s < ir_source_count(instruction); s++)
+        shift_temporary(ir_source(instruction, s), n_variables, count);
+    }
+  }
+
+  // Create the new vregs at the end, and shift all temporaries up to make room
+  for (size_t i = 0; i < count; i++)
+    ir_new_vreg(function, -1);
+  memmove(&function->vreg_variables[n_variables + count],
+          &function->vreg_variables[n_variables],
+          (function->n_vregs - n_variables - count) * sizeof(int64_t));
+  for (size_t i = 0; i < count; i++)
+    function->vreg_variables[n_variables + i] = n_variables + i;
+
+  function->n_variables += count;
+  return n_variables;
+}
+
+// Translates a vreg of the callee into the caller
+static void map_operand(ir_operand_t* operand, ir_operand_t* vreg_map)
+{
+  if (operand->kind == IR_OPERAND_VREG)
+    *operand = vreg_map[operand->value];
+}
+
+// Replaces the call at the given position in the block by a copy of the body of the callee.
+// The block is split in two at the call: the first half moves the arguments into the callee's
+// parameters and jumps to the copied entry block, and every return in the copy
+// stores its value and jumps to the second half
+static void inline_call(ir_function_t* caller, ir_block_t* block, size_t position)
+{
+  ir_function_t* callee = find_function(block->instructions[position].symbol);
+  int number = ++inline_counter;
+
+  // The variables of the callee become variables of the caller, with one extra variable
+  // holding the return value. Temporaries of the callee become new temporaries
+  size_t first_variable = add_variables(caller, callee->n_variables + 1);
+  ir_instruction_t call = block->instructions[position];
+  assert(call.n_args == FUNC_PARAM_COUNT(callee->symbol));
+  ir_operand_t result = IR_VREG(first_variable + callee->n_variables);
+  ir_operand_t* vreg_map = malloc(callee->n_vregs * sizeof(ir_operand_t));
+  for (size_t i = 0; i < callee->n_vregs; i++)
+    vreg_map[i] =
+        i < callee->n_variables ? IR_VREG(first_variable + i) : ir_new_vreg(caller, -1);
+
+  // The second half of the block starts with the return value
+  ir_block_t* continuation =
+      ir_new_block(".%s.return.inline%d", callee->symbol->name, number);
+  if (call.dst.kind != IR_OPERAND_NONE)
+    ir_append_instruction(continuation,
+                          (ir_instruction_t){.opcode = IR_MOVE, .dst = call.dst, .a = result});
+  for (size_t i = position + 1; i < block->n_instructions; i++)
+    ir_append_instruction(continuation, block->instructions[i]);
+
+  ir_block_t** copies = malloc(callee->n_blocks * sizeof(ir_block_t*));
+  for (size_t i = 0; i < callee->n_blocks; i++)
+  {
+    copies[i] = ir_new_block("%s.inline%d", callee->blocks[i]->label, number);
+    copies[i]->profile_count = callee->blocks[i]->profile_count;
+  }
+  continuation->profile_count = block->profile_count;
+
+  // The first half of the block passes the arguments
+  block->n_instructions = position;
+  for (size_t i = 0; i < call.n_args; i++)
+    ir_append_instruction(block,
+                          (ir_instruction_t){
+                              .opcode = IR_MOVE,
+                              .dst = IR_VREG(first_variable + i),
+                              .a = call.args[i],
+                          });
+  ir_append_instruction(block, (ir_instruction_t){.opcode = IR_JUMP, .targets = {copies[0]}});
+  ir_destroy_instruction(&call);
+
+  for (size_t i = 0; i < callee->n_blocks; i++)
+  {
+    ir_block_t* original = callee->blocks[i];
+    for (size_t j = 0; j < original->n_instructions; j++)
+    {
+      ir_instruction_t instruction = original->instructions[j];
+      if (instruction.n_args > 0)
+      {
+        instruction.args = malloc(instruction.n_args * sizeof(ir_operand_t));
+        memcpy(instruction.args, original->instructions[j].args,
+               instruction.n_args * sizeof(ir_operand_t));
+      }
+      map_operand(&instruction.dst, vreg_map);
+      for (size_t s = 0; s < ir_source_count(&instruction); s++)
+        map_operand(ir_source(&instruction, s), vreg_map);
+      for (size_t t = 0; t < 2; t++)
+        if (instruction.targets[t] != NULL)
+          instruction.targets[t] = copies[instruction.targets[t]->id];
+
+      if (instruction.opcode == IR_RETURN)
+      {
+        ir_append_instruction(copies[i],
+                              (ir_instruction_t){
+                                  .opcode = IR_MOVE,
+                                  .dst = result,
+                                  .a = instruction.a,
+                              });
+        instruction = (ir_instruction_t){.opcode = IR_JUMP, .targets = {continuation}};
+      }
+      ir_append_instruction(copies[i], instruction);
+    }
+  }
+
+  // Lay the copied blocks out right after the call, so that the entry can be fallen through to
+  for (size_t i = 0; i < callee->n_blocks; i++)
+    ir_insert_block(caller, copies[i], block->id + 1 + i);
+  ir_insert_block(caller, continuation, block->id + 1 + callee->n_blocks);
+
+  free(copies);
+  free(vreg_map);
+}
+
+// Inlines every call in the function that can be inlined. Returns true if anything was inlined
+static bool inline_calls(ir_function_t* function)
+{
+  bool changed = false;
+  for (size_t i = 0; i < function->n_blocks; i++)
+  {
+    ir_block_t* block = function->blocks[i];
+    for (size_t j = 0; j < block->n_instructions; j++)
+    {
+      ir_instruction_t* instruction = &block->instructions[j];
+      if (instruction->opcode == IR_CALL &&
+          can_inline(function, find_function(instruction->symbol)))
+      {
+        // The rest of the block is moved into a new block, which is visited later
+        inline_call(function, block, j);
+        changed = true;
+        break;
+      }
+    }
+  }
+  return changed;
+}
+
+void ir_inline_functions(void)
+{
+  // Every inlined call is replaced by code without calls, so this always terminates
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (size_t i = 0; i < ir_functions_len; i++)
+      changed |= inline_calls(ir_functions[i]);
+  }
+}
@@ -0,0 +1,1071 @@
+#include "vslc.h"
+
+#include <inttypes.h>
+#include <setjmp.h>
+#include <signal.h>
+
+// With -ftiered, hot functions are compiled into machine code, which needs the emit macros
+#include "emit.h"
+
+// The interpreter runs programs straight from the bound syntax tree made by create_tables(),
+// without building the IR or generating any code. Each function is compiled into bytecode for a
+// stack machine, as a list of 32-bit words: an opcode followed by its operands.
+//
+// Parameters and local variables live in the slots of the function's frame, indexed by the
+// sequence number of their symbol. The elements of local arrays of a fixed length take the slots
+// after them, and the values being computed are pushed after those.
+// Global variables, arrays and functions are indexed by their sequence number in the global
+// symbol table. The bytecode owns copies of everything it needs, so the syntax tree and the
+// symbol tables can be freed before it runs.
+//
+// With -ftiered, every call and loop iteration adds to the hotness of the function. A function
+// that gets hot is compiled into machine code, like by generate_program(), and then runs as
+// machine code in every call after that. Functions already running keep being interpreted.
+// Compiled code calls other functions through a trampoline back into the interpreter, which
+// calls their machine code instead if they have any. The global variables and arrays are
+// shared, and the syntax tree and the symbol tables are kept until the program is done
+
+// All opcodes, with the number of operands following each one, and how many values it pushes
+// minus how many it pops. The stack effect of calls depends on the function called
+// clang-format off
+#define OPCODES(X)                                                                               \
+  X(CONSTANT, 1, 1)           /* Pushes the operand */                                           \
+  X(LARGE_CONSTANT, 1, 1)     /* Pushes the constant with the operand as index, when it needs */ \
+                              /* more than 32 bits */                                            \
+  X(LOAD_LOCAL, 1, 1)         /* Pushes the slot given by the operand */                         \
+  X(STORE_LOCAL, 1, -1)       /* Pops a value into the slot */                                   \
+  X(LOAD_GLOBAL, 1, 1)                                                                           \
+  X(STORE_GLOBAL, 1, -1)                                                                         \
+  X(LOAD_ELEMENT, 1, 0)       /* Replaces the index on top with the element of the array */      \
+  X(STORE_ELEMENT, 1, -2)     /* Pops the index, and then the value to store */                  \
+  X(LOAD_LOCAL_ELEMENT, 2, 0) /* The same for local arrays, with the slot of their */            \
+  X(STORE_LOCAL_ELEMENT, 2, -2) /* first element and their length as operands */                 \
+  X(ADD, 0, -1)                                                                                  \
+  X(SUB, 0, -1)               /* The left operand is on top, as it is evaluated last */          \
+  X(MUL, 0, -1)                                                                                  \
+  X(DIV, 0, -1)               /* The left operand is on top, as it is evaluated last */          \
+  X(EQ, 0, -1)                                                                                   \
+  X(NE, 0, -1)                                                                                   \
+  X(LT, 0, -1)                                                                                   \
+  X(LE, 0, -1)                                                                                   \
+  X(GT, 0, -1)                                                                                   \
+  X(GE, 0, -1)                                                                                   \
+  X(NEG, 0, 0)                                                                                   \
+  X(NOT, 0, 0)                                                                                   \
+  X(JUMP, 1, 0)               /* Jumps to the word given by the operand */                       \
+  X(LOOP, 1, 0)               /* Jumps back to the start of a loop */                            \
+  X(JUMP_IF_ZERO, 1, -1)      /* Pops a value, and jumps if it is zero */                        \
+  X(JUMP_IF_NOT_ZERO, 1, -1)                                                                     \
+  X(JUMP_IF_EQ, 1, -2)        /* Pops the right and left operand, and jumps if left == right */  \
+  X(JUMP_IF_NE, 1, -2)                                                                           \
+  X(JUMP_IF_LT, 1, -2)                                                                           \
+  X(JUMP_IF_LE, 1, -2)                                                                           \
+  X(JUMP_IF_GT, 1, -2)                                                                           \
+  X(JUMP_IF_GE, 1, -2)                                                                           \
+  X(CALL, 1, 0)               /* Calls the function, with the first argument on top */          \
+  X(RETURN, 0, -1)            /* Returns the value on top */                                     \
+  X(POP, 0, -1)                                                                                  \
+  X(PRINT_INTEGER, 0, -1)                                                                        \
+  X(PRINT_STRING, 1, 0)       /* Prints the string given by the operand */                       \
+  X(PRINT_NEWLINE, 0, 0)
+// clang-format on
+
+typedef enum
+{
+#define OPCODE_ENUM(name, n_operands, stack_effect) OP_##name,
+  OPCODES(OPCODE_ENUM)
+#undef OPCODE_ENUM
+      OP_COUNT
+} opcode_t;
+
+static const int STACK_EFFECTS[OP_COUNT] = {
+#define OPCODE_EFFECT(name, n_operands, stack_effect) stack_effect,
+    OPCODES(OPCODE_EFFECT)
+#undef OPCODE_EFFECT
+};
+
+typedef int32_t word_t;
+
+typedef struct
+{
+  word_t* code;
+  size_t length;
+  size_t capacity;
+  size_t n_parameters;
+  size_t n_slots;   // Parameters, local variables and the elements of local arrays
+  size_t max_stack; // The most values the function has pushed after its slots at once
+
+  // With -ftiered, the number of calls and loop iterations so far, and the machine code, which
+  // takes the arguments as an array, once the function is hot
+  size_t hotness;
+  int64_t (*native)(const int64_t* arguments);
+} bytecode_function_t;
+
+// How hot a function must get before it is compiled with -ftiered
+#ifndef VSLC_TIER_UP_THRESHOLD
+#define VSLC_TIER_UP_THRESHOLD 1000
+#endif
+
+// Everything the program needs to run, indexed by the sequence numbers of the global symbols.
+// Only the entries of the right kind of symbol are used in each list
+static _Thread_local bytecode_function_t* functions;
+static _Thread_local int64_t* data; // The global variables, followed by the elements of arrays
+static _Thread_local int64_t* globals;
+static _Thread_local int64_t** arrays;
+static _Thread_local int64_t* array_lengths;
+static _Thread_local size_t n_globals;
+static _Thread_local size_t entry_function;
+
+// Constants that do not fit in an operand
+static _Thread_local int64_t* constants;
+static _Thread_local size_t n_constants;
+
+// The strings of the program, decoded from string_list
+static _Thread_local char** strings;
+static _Thread_local size_t n_strings;
+
+/* Compiling the syntax tree */
+
+// The function being compiled, and how many values it has on the stack at this point
+static _Thread_local bytecode_function_t* current_function;
+static _Thread_local size_t stack_depth;
+
+// The slot of the first element of every local array of the function, by sequence number
+static _Thread_local size_t* local_array_slots;
+
+// The jumps of the break statements in each enclosing while loop, which are patched to jump to
+// the end of the loop once it is known
+static _Thread_local size_t* breaks;
+static _Thread_local size_t n_breaks;
+static _Thread_local size_t breaks_capacity;
+
+static void emit_word(word_t word)
+{
+  bytecode_function_t* function = current_function;
+  if (function->length + 1 >= function->capacity)
+  {
+    function->capacity = function->capacity * 2 + 64;
+    function->code = realloc(function->code, function->capacity * sizeof(word_t));
+  }
+  function->code[function->length++] = word;
+}
+
+// Emits the opcode, and keeps track of how deep the stack gets
+static void emit_opcode(opcode_t opcode, int stack_effect)
+{
+  emit_word(opcode);
+  stack_depth += stack_effect;
+  if (stack_depth > current_function->max_stack)
+    current_function->max_stack = stack_depth;
+}
+
+static void emit(opcode_t opcode)
+{
+  emit_opcode(opcode, STACK_EFFECTS[opcode]);
+}
+
+static void emit_with_operand(opcode_t opcode, word_t operand)
+{
+  emit(opcode);
+  emit_word(operand);
+}
+
+// Emits a jump to a word that is not known yet, and returns where its target goes
+static size_t emit_jump(opcode_t opcode)
+{
+  emit_with_operand(opcode, 0);
+  return current_function->length - 1;
+}
+
+// Makes the jump go to the next word emitted
+static void patch_jump(size_t jump)
+{
+  current_function->code[jump] = (word_t)current_function->length;
+}
+
+static void emit_constant(int64_t value)
+{
+  if (value >= INT32_MIN && value <= INT32_MAX)
+  {
+    emit_with_operand(OP_CONSTANT, (word_t)value);
+    return;
+  }
+  constants = realloc(constants, (n_constants + 1) * sizeof(int64_t));
+  constants[n_constants] = value;
+  emit_with_operand(OP_LARGE_CONSTANT, (word_t)n_constants++);
+}
+
+// Checks that the identifier refers to a variable, and returns its symbol
+static symbol_t* variable_symbol(node_t* identifier)
+{
+  symbol_t* symbol = identifier->symbol;
+  if (symbol->type == SYMBOL_FUNCTION)
+  {
+    fprintf(stderr, "error: symbol '%s' is a function, not a variable\n", symbol->name);
+    exit(EXIT_FAILURE);
+  }
+  if (symbol->type == SYMBOL_GLOBAL_ARRAY || symbol->type == SYMBOL_LOCAL_ARRAY)
+  {
+    fprintf(stderr, "error: symbol '%s' is an array, not a variable\n", symbol->name);
+    exit(EXIT_FAILURE);
+  }
+  return symbol;
+}
+
+// Checks that the ARRAY_INDEXING node indexes into an array, and returns the array's symbol.
+// Frames have a fixed number of slots, so local arrays of a length only known when they are
+// declared are only supported in compiled code
+static symbol_t* array_symbol(node_t* array_indexing)
+{
+  symbol_t* symbol = node_child(array_indexing, 0)->symbol;
+  if (IS_DYNAMIC_ARRAY(symbol))
+  {
+    fprintf(stderr, "error: local array '%s' has a dynamic length, and can only be compiled\n",
+            symbol->name);
+    exit(EXIT_FAILURE);
+  }
+  if (symbol->type != SYMBOL_GLOBAL_ARRAY && symbol->type != SYMBOL_LOCAL_ARRAY)
+  {
+    fprintf(stderr, "error: symbol '%s' is not an array\n", symbol->name);
+    exit(EXIT_FAILURE);
+  }
+  return symbol;
+}
+
+// Checks that the FUNCTION_CALL calls a function with the right number of arguments,
+// and returns the function's symbol
+static symbol_t* called_function(node_t* call)
+{
+  symbol_t* symbol = node_child(call, 0)->symbol;
+  if (symbol->type != SYMBOL_FUNCTION)
+  {
+    fprintf(stderr, "error: '%s' is not a function\n", symbol->name);
+    exit(EXIT_FAILURE);
+  }
+
+  size_t parameter_count = FUNC_PARAM_COUNT(symbol);
+  size_t argument_count = node_child(call, 1)->n_children;
+  if (parameter_count != argument_count)
+  {
+    fprintf(stderr, "error: function '%s' expects '%zu' arguments, but '%zu' were given\n",
+            symbol->name, parameter_count, argument_count);
+    exit(EXIT_FAILURE);
+  }
+  return symbol;
+}
+
+// Emits the load or store of an element of the array, with the index on top of the stack
+static void emit_element_access(symbol_t* array, opcode_t global_opcode, opcode_t local_opcode)
+{
+  if (array->type == SYMBOL_GLOBAL_ARRAY)
+  {
+    emit_with_operand(global_opcode, (word_t)array->sequence_number);
+    return;
+  }
+  emit_with_operand(local_opcode, (word_t)local_array_slots[array->sequence_number]);
+  emit_word((word_t)ARRAY_LENGTH_NODE(array)->data.number_literal);
+}
+
+// The operators, with the opcode computing them and the jump taken when they are true
+static const struct
+{
+  const char* operator;
+  opcode_t opcode;
+  opcode_t jump;
+  opcode_t inverse_jump;
+} BINARY_OPERATORS[] = {
+    {"+", OP_ADD, OP_COUNT, OP_COUNT},
+    {"-", OP_SUB, OP_COUNT, OP_COUNT},
+    {"*", OP_MUL, OP_COUNT, OP_COUNT},
+    {"/", OP_DIV, OP_COUNT, OP_COUNT},
+    {"==", OP_EQ, OP_JUMP_IF_EQ, OP_JUMP_IF_NE},
+    {"!=", OP_NE, OP_JUMP_IF_NE, OP_JUMP_IF_EQ},
+    {"<", OP_LT, OP_JUMP_IF_LT, OP_JUMP_IF_GE},
+    {"<=", OP_LE, OP_JUMP_IF_LE, OP_JUMP_IF_GT},
+    {">", OP_GT, OP_JUMP_IF_GT, OP_JUMP_IF_LE},
+    {">=", OP_GE, OP_JUMP_IF_GE, OP_JUMP_IF_LT},
+};
+
+static size_t binary_operator(const char* op)
+{
+  for (size_t i = 0; i < sizeof(BINARY_OPERATORS) / sizeof(BINARY_OPERATORS[0]); i++)
+    if (strcmp(op, BINARY_OPERATORS[i].operator) == 0)
+      return i;
+  assert(false && "Unknown expression operation");
+  return 0;
+}
+
+// Compiles the expression, leaving its value on the stack.
+// The operands are evaluated in the same order as in the compiled program
+static void compile_expression(node_t* node)
+{
+  switch (node->type)
+  {
+  case NUMBER_LITERAL:
+    emit_constant(node->data.number_literal);
+    break;
+  case IDENTIFIER:
+  {
+    symbol_t* symbol = variable_symbol(node);
+    if (symbol->type == SYMBOL_GLOBAL_VAR)
+      emit_with_operand(OP_LOAD_GLOBAL, (word_t)symbol->sequence_number);
+    else
+      emit_with_operand(OP_LOAD_LOCAL, (word_t)symbol->sequence_number);
+    break;
+  }
+  case ARRAY_INDEXING:
+  {
+    symbol_t* symbol = array_symbol(node);
+    compile_expression(node_child(node, 1));
+    emit_element_access(symbol, OP_LOAD_ELEMENT, OP_LOAD_LOCAL_ELEMENT);
+    break;
+  }
+  case OPERATOR:
+  {
+    const char* op = node->data.operator;
+    if (node->n_children == 1)
+    {
+      compile_expression(node_child(node, 0));
+      if (strcmp(op, "-") == 0)
+        emit(OP_NEG);
+      else if (strcmp(op, "!") == 0)
+        emit(OP_NOT);
+      else
+        assert(false && "Unknown unary operator");
+      break;
+    }
+
+    // Subtraction and division evaluate the right hand side first
+    opcode_t opcode = BINARY_OPERATORS[binary_operator(op)].opcode;
+    bool reversed = opcode == OP_SUB || opcode == OP_DIV;
+    compile_expression(node_child(node, reversed ? 1 : 0));
+    compile_expression(node_child(node, reversed ? 0 : 1));
+    emit(opcode);
+    break;
+  }
+  case FUNCTION_CALL:
+  {
+    // The arguments are evaluated from last to first, so the first argument ends up on top
+    symbol_t* symbol = called_function(node);
+    node_t* arguments = node_child(node, 1);
+    for (size_t i = arguments->n_children; i > 0; i--)
+      compile_expression(node_child(arguments, i - 1));
+    emit_opcode(OP_CALL, 1 - (int)arguments->n_children);
+    emit_word((word_t)symbol->sequence_number);
+    break;
+  }
+  default:
+    assert(false && "Unknown expression type");
+  }
+}
+
+// Compiles the condition, followed by a jump that is taken when the condition is the given truth
+// value. Returns the jump, to be patched once its target is known.
+// Comparisons jump directly on the comparison, and ! just flips which truth value jumps
+static size_t compile_condition_jump(node_t* condition, bool jump_if)
+{
+  if (condition->type == OPERATOR && condition->n_children == 1 &&
+      strcmp(condition->data.operator, "!") == 0)
+    return compile_condition_jump(node_child(condition, 0), !jump_if);
+
+  if (condition->type == OPERATOR && condition->n_children == 2)
+  {
+    size_t i = binary_operator(condition->data.operator);
+    if (BINARY_OPERATORS[i].jump != OP_COUNT)
+    {
+      compile_expression(node_child(condition, 0));
+      compile_expression(node_child(condition, 1));
+      return emit_jump(jump_if ? BINARY_OPERATORS[i].jump : BINARY_OPERATORS[i].inverse_jump);
+    }
+  }
+
+  compile_expression(condition);
+  return emit_jump(jump_if ? OP_JUMP_IF_NOT_ZERO : OP_JUMP_IF_ZERO);
+}
+
+static void compile_statement(node_t* node)
+{
+  if (node == NULL)
+    return;
+
+  switch (node->type)
+  {
+  case BLOCK:
+  {
+    node_t* statement_list = node_child(node, node->n_children - 1);
+    for (size_t i = 0; i < statement_list->n_children; i++)
+      compile_statement(node_child(statement_list, i));
+    break;
+  }
+  case ASSIGNMENT_STATEMENT:
+  {
+    node_t* destination = node_child(node, 0);
+    compile_expression(node_child(node, 1));
+    if (destination->type == IDENTIFIER)
+    {
+      symbol_t* symbol = variable_symbol(destination);
+      opcode_t store = symbol->type == SYMBOL_GLOBAL_VAR ? OP_STORE_GLOBAL : OP_STORE_LOCAL;
+      emit_with_operand(store, (word_t)symbol->sequence_number);
+    }
+    else
+    {
+      symbol_t* symbol = array_symbol(destination);
+      compile_expression(node_child(destination, 1));
+      emit_element_access(symbol, OP_STORE_ELEMENT, OP_STORE_LOCAL_ELEMENT);
+    }
+    break;
+  }
+  case PRINT_STATEMENT:
+  {
+    // Each item is printed once it is evaluated. Called functions may print as well, which the
+    // compiled program handles by printing everything before the call first
+    node_t* items = node_child(node, 0);
+    for (size_t i = 0; i < items->n_children; i++)
+    {
+      node_t* item = node_child(items, i);
+      if (item->type == STRING_LIST_REFERENCE)
+        emit_with_operand(OP_PRINT_STRING, (word_t)item->data.string_list_index);
+      else
+      {
+        compile_expression(item);
+        emit(OP_PRINT_INTEGER);
+      }
+    }
+    emit(OP_PRINT_NEWLINE);
+    break;
+  }
+  case RETURN_STATEMENT:
+    compile_expression(node_child(node, 0));
+    emit(OP_RETURN);
+    break;
+  case FUNCTION_CALL:
+    compile_expression(node);
+    emit(OP_POP);
+    break;
+  case IF_STATEMENT:
+  {
+    size_t to_else = compile_condition_jump(node_child(node, 0), false);
+    compile_statement(node_child(node, 1));
+    if (node->n_children == 3)
+    {
+      size_t to_end = emit_jump(OP_JUMP);
+      patch_jump(to_else);
+      compile_statement(node_child(node, 2));
+      patch_jump(to_end);
+    }
+    else
+      patch_jump(to_else);
+    break;
+  }
+  case WHILE_STATEMENT:
+  {
+    size_t start = current_function->length;
+    size_t to_end = compile_condition_jump(node_child(node, 0), false);
+    size_t first_break = n_breaks;
+    compile_statement(node_child(node, 1));
+    emit_with_operand(OP_LOOP, (word_t)start);
+
+    patch_jump(to_end);
+    for (size_t i = first_break; i < n_breaks; i++)
+      patch_jump(breaks[i]);
+    n_breaks = first_break;
+    break;
+  }
+  case BREAK_STATEMENT:
+    if (n_breaks + 1 >= breaks_capacity)
+    {
+      breaks_capacity = breaks_capacity * 2 + 8;
+      breaks = realloc(breaks, breaks_capacity * sizeof(size_t));
+    }
+    breaks[n_breaks++] = emit_jump(OP_JUMP);
+    break;
+  default:
+    assert(false && "Unknown statement type");
+  }
+}
+
+static void compile_function(symbol_t* symbol)
+{
+  bytecode_function_t* function = &functions[symbol->sequence_number];
+  symbol_table_t* symtable = symbol->function_symtable;
+  *function = (bytecode_function_t){
+      .n_parameters = FUNC_PARAM_COUNT(symbol),
+      .n_slots = symtable->n_symbols,
+  };
+
+  // The elements of the arrays are zeroed on entry along with the variables, like in the
+  // compiled program
+  local_array_slots = calloc(symtable->n_symbols, sizeof(size_t));
+  for (size_t i = 0; i < symtable->n_of_type[SYMBOL_LOCAL_ARRAY]; i++)
+  {
+    symbol_t* array = symtable->of_type[SYMBOL_LOCAL_ARRAY][i];
+    if (IS_DYNAMIC_ARRAY(array))
+      continue;
+    int64_t length = ARRAY_LENGTH_NODE(array)->data.number_literal;
+    if (length < 0)
+    {
+      fprintf(stderr, "error: length of array '%s' is negative\n", array->name);
+      exit(EXIT_FAILURE);
+    }
+    if (length > INT32_MAX - (int64_t)function->n_slots)
+    {
+      fprintf(stderr, "error: local array '%s' is too long to be interpreted\n", array->name);
+      exit(EXIT_FAILURE);
+    }
+    local_array_slots[array->sequence_number] = function->n_slots;
+    function->n_slots += length;
+  }
+
+  current_function = function;
+  stack_depth = 0;
+  compile_statement(node_child(node_get(symbol->node), 2));
+  free(local_array_slots);
+  local_array_slots = NULL;
+
+  // Functions always end with a return, but the last statement may be inside an if
+  emit_constant(0);
+  emit(OP_RETURN);
+  current_function = NULL;
+}
+
+void compile_bytecode(void)
+{
+  n_globals = global_symbols->n_symbols;
+  functions = calloc(n_globals, sizeof(bytecode_function_t));
+  arrays = calloc(n_globals, sizeof(int64_t*));
+  array_lengths = calloc(n_globals, sizeof(int64_t));
+  entry_function = n_globals;
+
+  for (size_t i = 0; i < n_globals; i++)
+  {
+    symbol_t* symbol = global_symbols->symbols[i];
+    switch (symbol->type)
+    {
+    case SYMBOL_FUNCTION:
+      if (entry_function == n_globals)
+        entry_function = i;
+      compile_function(symbol);
+      break;
+    case SYMBOL_GLOBAL_ARRAY:
+      array_lengths[i] = node_child(node_get(symbol->node), 1)->data.number_literal;
+      break;
+    default:
+      break;
+    }
+  }
+  free(breaks);
+  breaks = NULL;
+  breaks_capacity = 0;
+
+  if (entry_function == n_globals)
+  {
+    fprintf(stderr, "error: program contained no functions\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // With -ftiered, the compiled code addresses the globals directly, which must then be in the
+  // code heap along with it
+  size_t n_words = n_globals;
+  for (size_t i = 0; i < n_globals; i++)
+    n_words += array_lengths[i];
+  if (feature_tiered)
+    data = allocate_loaded_memory(n_words * sizeof(int64_t));
+  else
+    data = calloc(n_words, sizeof(int64_t));
+  globals = data;
+  for (size_t i = 0, offset = n_globals; i < n_globals; offset += array_lengths[i++])
+    arrays[i] = &data[offset];
+
+  n_strings = string_list_len;
+  strings = malloc((n_strings + 1) * sizeof(char*));
+  for (size_t i = 0; i < n_strings; i++)
+  {
+    size_t length;
+    strings[i] = decode_string_literal(string_list[i], &length);
+  }
+}
+
+/* Running the bytecode */
+
+// The frame of a function that has called another one
+typedef struct
+{
+  bytecode_function_t* function;
+  const word_t* return_address;
+  size_t slots; // Where the slots of the function start on the stack
+} frame_t;
+
+// The values and frames of every function being interpreted. With -ftiered, compiled code can
+// call back into the interpreter, which then continues above the values that are in use
+static _Thread_local int64_t* value_stack;
+static _Thread_local size_t value_stack_capacity;
+static _Thread_local size_t value_stack_used;
+static _Thread_local frame_t* frames;
+static _Thread_local size_t n_frames;
+static _Thread_local size_t frames_capacity;
+
+// The program exits by failing a bounds check, which can happen deep inside compiled code with
+// -ftiered, so it jumps straight back out to run_bytecode()
+static _Thread_local jmp_buf program_exit;
+static _Thread_local int program_exit_status;
+
+static void exit_program(int status)
+{
+  program_exit_status = status;
+  longjmp(program_exit, 1);
+}
+
+// Makes room for the given number of values above the used part of the stack.
+// Growing the stack moves it, so pointers into it must be found again afterwards
+static void reserve_values(size_t n_values)
+{
+  if (value_stack_used + n_values <= value_stack_capacity)
+    return;
+  value_stack_capacity = (value_stack_used + n_values) * 2 + 1024;
+  value_stack = realloc(value_stack, value_stack_capacity * sizeof(int64_t));
+}
+
+static void define_tiered_symbols(void);
+static void tier_up(size_t function);
+
+// Counts a call of the function with -ftiered, and returns true if it has machine code
+static bool call_native(size_t function)
+{
+  bytecode_function_t* callee = &functions[function];
+  if (callee->native == NULL && ++callee->hotness >= VSLC_TIER_UP_THRESHOLD)
+    tier_up(function);
+  return callee->native != NULL;
+}
+
+static void destroy_bytecode(void)
+{
+  for (size_t i = 0; i < n_globals; i++)
+    free(functions[i].code);
+  for (size_t i = 0; i < n_strings; i++)
+    free(strings[i]);
+  if (feature_tiered)
+    unload_code(); // Which frees the globals as well
+  else
+    free(data);
+  free(functions);
+  free(arrays);
+  free(array_lengths);
+  free(constants);
+  free(strings);
+  free(value_stack);
+  free(frames);
+  functions = NULL;
+  data = globals = NULL;
+  arrays = NULL;
+  array_lengths = NULL;
+  constants = NULL;
+  strings = NULL;
+  value_stack = NULL;
+  frames = NULL;
+  n_globals = n_constants = n_strings = 0;
+  value_stack_capacity = value_stack_used = 0;
+  n_frames = frames_capacity = 0;
+}
+
+// Runs the function, with its arguments already placed at the start of the unused part of the
+// stack, and returns the value it returns
+static int64_t execute(size_t entry)
+{
+  // Labels as values are an extension of GCC and Clang. Every instruction jumps straight to the
+  // next one, which is faster to predict than returning to a switch
+  static void* const DISPATCH[OP_COUNT] = {
+#define OPCODE_LABEL(name, n_operands, stack_effect) [OP_##name] = &&do_##name,
+      OPCODES(OPCODE_LABEL)
+#undef OPCODE_LABEL
+  };
+#define NEXT() goto* DISPATCH[*pc++]
+
+  bytecode_function_t* function = &functions[entry];
+  size_t base = value_stack_used;
+  size_t first_frame = n_frames;
+  reserve_values(function->n_slots + function->max_stack);
+
+  int64_t* stack = value_stack;
+  int64_t* slots = &stack[base];
+  memset(&slots[function->n_parameters], 0,
+         (function->n_slots - function->n_parameters) * sizeof(int64_t));
+  int64_t* sp = slots + function->n_slots; // The next free value on the stack
+  const word_t* pc = function->code;
+  NEXT();
+
+do_CONSTANT:
+  *sp++ = *pc++;
+  NEXT();
+do_LARGE_CONSTANT:
+  *sp++ = constants[*pc++];
+  NEXT();
+do_LOAD_LOCAL:
+  *sp++ = slots[*pc++];
+  NEXT();
+do_STORE_LOCAL:
+  slots[*pc++] = *--sp;
+  NEXT();
+do_LOAD_GLOBAL:
+  *sp++ = globals[*pc++];
+  NEXT();
+do_STORE_GLOBAL:
+  globals[*pc++] = *--sp;
+  NEXT();
+do_LOAD_ELEMENT:
+{
+  word_t array = *pc++;
+  int64_t index = sp[-1];
+  if (index < 0 || index >= array_lengths[array])
+    goto out_of_bounds;
+  sp[-1] = arrays[array][index];
+  NEXT();
+}
+do_STORE_ELEMENT:
+{
+  word_t array = *pc++;
+  int64_t index = sp[-1];
+  if (index < 0 || index >= array_lengths[array])
+    goto out_of_bounds;
+  arrays[array][index] = sp[-2];
+  sp -= 2;
+  NEXT();
+}
+do_LOAD_LOCAL_ELEMENT:
+{
+  int64_t index = sp[-1];
+  if (index < 0 || index >= pc[1])
+    goto out_of_bounds;
+  sp[-1] = slots[pc[0] + index];
+  pc += 2;
+  NEXT();
+}
+do_STORE_LOCAL_ELEMENT:
+{
+  int64_t index = sp[-1];
+  if (index < 0 || index >= pc[1])
+    goto out_of_bounds;
+  slots[pc[0] + index] = sp[-2];
+  sp -= 2;
+  pc += 2;
+  NEXT();
+}
+
+  // Arithmetic wraps around like the machine instructions, instead of overflowing
+do_ADD:
+  sp--;
+  sp[-1] = (int64_t)((uint64_t)sp[-1] + (uint64_t)sp[0]);
+  NEXT();
+do_SUB:
+  sp--;
+  sp[-1] = (int64_t)((uint64_t)sp[0] - (uint64_t)sp[-1]);
+  NEXT();
+do_MUL:
+  sp--;
+  sp[-1] = (int64_t)((uint64_t)sp[-1] * (uint64_t)sp[0]);
+  NEXT();
+do_DIV:
+  sp--;
+  // These divisions trap in the compiled program as well
+  if (sp[-1] == 0 || (sp[0] == INT64_MIN && sp[-1] == -1))
+    raise(SIGFPE);
+  sp[-1] = sp[0] / sp[-1];
+  NEXT();
+do_EQ:
+  sp--;
+  sp[-1] = sp[-1] == sp[0];
+  NEXT();
+do_NE:
+  sp--;
+  sp[-1] = sp[-1] != sp[0];
+  NEXT();
+do_LT:
+  sp--;
+  sp[-1] = sp[-1] < sp[0];
+  NEXT();
+do_LE:
+  sp--;
+  sp[-1] = sp[-1] <= sp[0];
+  NEXT();
+do_GT:
+  sp--;
+  sp[-1] = sp[-1] > sp[0];
+  NEXT();
+do_GE:
+  sp--;
+  sp[-1] = sp[-1] >= sp[0];
+  NEXT();
+do_NEG:
+  sp[-1] = (int64_t)(0 - (uint64_t)sp[-1]);
+  NEXT();
+do_NOT:
+  sp[-1] = sp[-1] == 0;
+  NEXT();
+
+do_JUMP:
+  pc = function->code + *pc;
+  NEXT();
+do_LOOP:
+  // The function keeps being interpreted until it returns, even when it gets hot here
+  if (feature_tiered && function->native == NULL &&
+      ++function->hotness == VSLC_TIER_UP_THRESHOLD)
+    tier_up(function - functions);
+  pc = function->code + *pc;
+  NEXT();
+do_JUMP_IF_ZERO:
+  pc = *--sp == 0 ? function->code + *pc : pc + 1;
+  NEXT();
+do_JUMP_IF_NOT_ZERO:
+  pc = *--sp != 0 ? function->code + *pc : pc + 1;
+  NEXT();
+#define COMPARE_AND_JUMP(condition)                           \
+  sp -= 2;                                                    \
+  pc = sp[0] condition sp[1] ? function->code + *pc : pc + 1; \
+  NEXT();
+do_JUMP_IF_EQ:
+  COMPARE_AND_JUMP(==)
+do_JUMP_IF_NE:
+  COMPARE_AND_JUMP(!=)
+do_JUMP_IF_LT:
+  COMPARE_AND_JUMP(<)
+do_JUMP_IF_LE:
+  COMPARE_AND_JUMP(<=)
+do_JUMP_IF_GT:
+  COMPARE_AND_JUMP(>)
+do_JUMP_IF_GE:
+  COMPARE_AND_JUMP(>=)
+#undef COMPARE_AND_JUMP
+
+do_CALL:
+{
+  size_t index = *pc++;
+  bytecode_function_t* callee = &functions[index];
+
+  // The arguments become the first slots, after putting the first one at the bottom
+  int64_t* arguments = sp - callee->n_parameters;
+  for (size_t i = 0; i < callee->n_parameters / 2; i++)
+  {
+    int64_t first = arguments[i];
+    arguments[i] = sp[-1 - (int64_t)i];
+    sp[-1 - (int64_t)i] = first;
+  }
+
+  if (feature_tiered && call_native(index))
+  {
+    // The compiled code may call back into the interpreter, and move the stack
+    size_t arguments_offset = arguments - stack;
+    size_t slots_offset = slots - stack;
+    value_stack_used = sp - stack;
+    int64_t value = callee->native(arguments);
+    stack = value_stack;
+    slots = stack + slots_offset;
+    sp = stack + arguments_offset;
+    *sp++ = value;
+    NEXT();
+  }
+
+  if (n_frames + 1 >= frames_capacity)
+  {
+    frames_capacity = frames_capacity * 2 + 64;
+    frames = realloc(frames, frames_capacity * sizeof(frame_t));
+  }
+  frames[n_frames++] = (frame_t){
+      .function = function,
+      .return_address = pc,
+      .slots = slots - stack,
+  };
+
+  value_stack_used = arguments - stack;
+  reserve_values(callee->n_slots + callee->max_stack);
+  stack = value_stack;
+  slots = stack + value_stack_used;
+  sp = slots + callee->n_parameters;
+  for (size_t i = callee->n_parameters; i < callee->n_slots; i++)
+    *sp++ = 0;
+
+  function = callee;
+  pc = callee->code;
+  NEXT();
+}
+do_RETURN:
+{
+  int64_t value = sp[-1];
+  if (n_frames == first_frame)
+  {
+    value_stack_used = base;
+    return value;
+  }
+  frame_t* frame = &frames[--n_frames];
+  sp = slots;
+  *sp++ = value;
+  slots = stack + frame->slots;
+  pc = frame->return_address;
+  function = frame->function;
+  NEXT();
+}
+do_POP:
+  sp--;
+  NEXT();
+
+do_PRINT_INTEGER:
+  printf("%" PRId64, *--sp);
+  NEXT();
+do_PRINT_STRING:
+  fputs(strings[*pc++], stdout);
+  NEXT();
+do_PRINT_NEWLINE:
+  putchar('\n');
+  NEXT();
+#undef NEXT
+
+out_of_bounds:
+  // The same as a failed bounds check in the compiled program, which is always done here
+  puts("Array index out of bounds");
+  exit_program(1);
+  return 0;
+}
+
+int run_bytecode(int argc, char** argv)
+{
+  // argv starts with the name of the program, like for main() of the compiled program
+  bytecode_function_t* entry = &functions[entry_function];
+  if ((size_t)argc - 1 != entry->n_parameters)
+  {
+    puts("Wrong number of arguments");
+    destroy_bytecode();
+    return 1;
+  }
+
+  reserve_values(entry->n_parameters);
+  for (size_t i = 0; i < entry->n_parameters; i++)
+    value_stack[i] = strtol(argv[i + 1], NULL, 10);
+
+  if (feature_tiered)
+    define_tiered_symbols();
+  if (setjmp(program_exit) == 0)
+    program_exit_status = (int)execute(entry_function);
+  fflush(stdout);
+  destroy_bytecode();
+  return program_exit_status;
+}
+
+/* Tiered execution */
+
+// The registers the first arguments are passed in, like in generator.c
+#define NUM_REGISTER_ARGUMENTS 6
+static const char* REGISTER_ARGUMENTS[NUM_REGISTER_ARGUMENTS] = {RDI, RSI, RDX, RCX, R8, R9};
+
+// Called by the trampoline of a function, with the arguments the compiled code passed in
+// registers, and the address of those it passed on the stack
+static int64_t call_from_native(size_t function,
+                                const int64_t* register_arguments,
+                                const int64_t* stack_arguments)
+{
+  size_t n_parameters = functions[function].n_parameters;
+  reserve_values(n_parameters);
+  int64_t* arguments = &value_stack[value_stack_used];
+  for (size_t i = 0; i < n_parameters; i++)
+    arguments[i] = i < NUM_REGISTER_ARGUMENTS ? register_arguments[i]
+                                              : stack_arguments[i - NUM_REGISTER_ARGUMENTS];
+
+  if (call_native(function))
+    return functions[function].native(arguments);
+  return execute(function);
+}
+
+// Generates a function with the label the compiled code calls, which passes the arguments
+// to call_from_native(). They are passed like by generate_call(), with the first 6 in
+// registers, which are pushed into an array. The rest are on the stack, above the return address
+static void generate_trampoline(symbol_t* function)
+{
+  LABEL(".%s", function->name);
+  for (size_t i = NUM_REGISTER_ARGUMENTS; i > 0; i--)
+    PUSHQ(REGISTER_ARGUMENTS[i - 1]);
+  EMIT("movq $%zu, %s", function->sequence_number, RDI);
+  MOVQ(RSP, RSI);
+  EMIT("leaq 56(%s), %s", RSP, RDX);
+  SUBQ("$8", RSP); // The 6 pushes and the return address leave the stack misaligned
+  EMIT("call call_from_native");
+  ADDQ("$56", RSP);
+  RET;
+}
+
+// Generates the function the interpreter calls the compiled function through, as
+// int64_t tier_entry(const int64_t* arguments). It passes the arguments like generate_call()
+static void generate_native_entry(symbol_t* function)
+{
+  size_t n_parameters = FUNC_PARAM_COUNT(function);
+  size_t n_register_arguments =
+      n_parameters < NUM_REGISTER_ARGUMENTS ? n_parameters : NUM_REGISTER_ARGUMENTS;
+  size_t n_stack_arguments = n_parameters - n_register_arguments;
+
+  LABEL("tier_entry");
+  PUSHQ(RBP);
+  MOVQ(RSP, RBP);
+  if (n_stack_arguments % 2 == 1)
+    SUBQ("$8", RSP);
+  for (size_t i = n_parameters; i > NUM_REGISTER_ARGUMENTS; i--)
+  {
+    EMIT("movq %zu(%s), %s", (i - 1) * 8, RDI, RAX);
+    PUSHQ(RAX);
+  }
+  // The array is in %rdi, so it is loaded last
+  for (size_t i = n_register_arguments; i > 0; i--)
+    EMIT("movq %zu(%s), %s", (i - 1) * 8, RDI, REGISTER_ARGUMENTS[i - 1]);
+  EMIT("call .%s", function->name);
+  MOVQ(RBP, RSP);
+  POPQ(RBP);
+  RET;
+}
+
+// The compiled code shares the globals of the interpreter, and leaves the program like it
+static void define_tiered_symbols(void)
+{
+  char name[256];
+  for (size_t i = 0; i < n_globals; i++)
+  {
+    symbol_t* symbol = global_symbols->symbols[i];
+    snprintf(name, sizeof(name), ".%s", symbol->name);
+    if (symbol->type == SYMBOL_GLOBAL_VAR)
+      define_host_symbol(name, &globals[i]);
+    else if (symbol->type == SYMBOL_GLOBAL_ARRAY)
+      define_host_symbol(name, arrays[i]);
+  }
+  define_host_symbol("call_from_native", (void*)call_from_native);
+  define_host_symbol("exit", (void*)exit_program);
+}
+
+// Compiles the function into machine code, through the IR like the rest of the compiler
+static void tier_up(size_t index)
+{
+  // The code is assembled and loaded into memory, like with --run
+  run_in_memory = true;
+
+  symbol_t* symbol = global_symbols->symbols[index];
+  ir_function_t* function = create_ir_function(symbol);
+  optimize_ir_function(function);
+  generate_single_function(function);
+
+  // Every other function called gets a trampoline, even if it is compiled already
+  bool* called = calloc(n_globals, sizeof(bool));
+  called[index] = true;
+  DIRECTIVE(".text");
+  for (size_t i = 0; i < function->n_blocks; i++)
+  {
+    ir_block_t* block = function->blocks[i];
+    for (size_t j = 0; j < block->n_instructions; j++)
+    {
+      ir_instruction_t* instruction = &block->instructions[j];
+      if (instruction->opcode != IR_CALL || called[instruction->symbol->sequence_number])
+        continue;
+      called[instruction->symbol->sequence_number] = true;
+      generate_trampoline(instruction->symbol);
+    }
+  }
+  free(called);
+  generate_native_entry(symbol);
+  flush_assembly();
+  destroy_ir_function(function);
+
+  void* entry = load_code("tier_entry");
+  memcpy(&functions[index].native, &entry, sizeof(entry));
+}
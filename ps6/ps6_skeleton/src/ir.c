@@ -0,0 +1,1168 @@
+#include "vslc.h"
+
+// All functions in the program, in the same order as in the global symbol table
+_Thread_local ir_function_t** ir_functions;
+_Thread_local size_t ir_functions_len;
+
+// Declared in ir.h
+_Thread_local size_t bounds_checks_inserted = 0;
+
+// Declarations of helper functions defined further down in this file
+static ir_function_t* build_function(symbol_t* function);
+static void build_statement(node_t* node);
+static ir_operand_t build_expression(node_t* expression);
+static void destroy_value_stack(void);
+static void print_function(ir_function_t* function);
+static void destroy_function(ir_function_t* function);
+
+/* External interface */
+
+// Creates the IR of every function in the global symbol table
+void create_ir(void)
+{
+  size_t n_functions = global_symbols->n_of_type[SYMBOL_FUNCTION];
+  ir_functions = realloc(ir_functions, (ir_functions_len + n_functions) * sizeof(ir_function_t*));
+  symbol_t** functions = global_symbols->of_type[SYMBOL_FUNCTION];
+  for (size_t i = 0; i < n_functions; i++)
+    ir_functions[ir_functions_len++] = build_function(functions[i]);
+  destroy_value_stack();
+
+  if (feature_profile_generate)
+    ir_instrument_functions();
+  if (profile_use_filename != NULL)
+    ir_apply_profile(profile_use_filename);
+}
+
+// Creates the IR of a single function, without adding it to ir_functions
+ir_function_t* create_ir_function(symbol_t* function)
+{
+  ir_function_t* result = build_function(function);
+  destroy_value_stack();
+  return result;
+}
+
+// Prints the IR of every function
+void print_ir(void)
+{
+  for (size_t i = 0; i < ir_functions_len; i++)
+    print_function(ir_functions[i]);
+}
+
+void destroy_ir_function(ir_function_t* function)
+{
+  destroy_function(function);
+}
+
+// Frees the IR of every function
+void destroy_ir(void)
+{
+  for (size_t i = 0; i < ir_functions_len; i++)
+    destroy_function(ir_functions[i]);
+  free(ir_functions);
+  ir_functions = NULL;
+  ir_functions_len = 0;
+}
+
+/* Helper functions for inspecting instructions */
+
+bool ir_is_terminator(ir_opcode_t opcode)
+{
+  return opcode == IR_JUMP || opcode == IR_BRANCH || opcode == IR_RETURN;
+}
+
+ir_instruction_t* ir_block_terminator(ir_block_t* block)
+{
+  assert(block->n_instructions > 0);
+  ir_instruction_t* terminator = &block->instructions[block->n_instructions - 1];
+  assert(ir_is_terminator(terminator->opcode));
+  return terminator;
+}
+
+size_t ir_block_successors(ir_block_t* block, ir_block_t* successors[2])
+{
+  ir_instruction_t* terminator = ir_block_terminator(block);
+  switch (terminator->opcode)
+  {
+  case IR_JUMP:
+    successors[0] = terminator->targets[0];
+    return 1;
+  case IR_BRANCH:
+    successors[0] = terminator->targets[0];
+    successors[1] = terminator->targets[1];
+    return 2;
+  default:
+    return 0;
+  }
+}
+
+bool ir_is_comparison(ir_opcode_t opcode)
+{
+  return opcode >= IR_EQ && opcode <= IR_GE;
+}
+
+ir_opcode_t ir_inverse_condition(ir_opcode_t condition)
+{
+  switch (condition)
+  {
+  case IR_EQ:
+    return IR_NE;
+  case IR_NE:
+    return IR_EQ;
+  case IR_LT:
+    return IR_GE;
+  case IR_LE:
+    return IR_GT;
+  case IR_GT:
+    return IR_LE;
+  case IR_GE:
+    return IR_LT;
+  default:
+    assert(false && "Not a comparison");
+  }
+}
+
+bool ir_is_call(ir_instruction_t* instruction)
+{
+  return instruction->opcode == IR_CALL || instruction->opcode == IR_PRINT;
+}
+
+size_t ir_source_count(ir_instruction_t* instruction)
+{
+  return 3 + instruction->n_args;
+}
+
+ir_operand_t* ir_source(ir_instruction_t* instruction, size_t i)
+{
+  switch (i)
+  {
+  case 0:
+    return &instruction->a;
+  case 1:
+    return &instruction->b;
+  case 2:
+    return &instruction->c;
+  default:
+    assert(i - 3 < instruction->n_args);
+    return &instruction->args[i - 3];
+  }
+}
+
+int64_t ir_defined_vreg(ir_instruction_t* instruction)
+{
+  if (instruction->dst.kind != IR_OPERAND_VREG)
+    return -1;
+  return instruction->dst.value;
+}
+
+/* Helper functions for modifying the IR */
+
+ir_operand_t ir_new_vreg(ir_function_t* function, int64_t variable)
+{
+  if (function->n_vregs + 1 >= function->vreg_capacity)
+  {
+    function->vreg_capacity = function->vreg_capacity * 2 + 8;
+    function->vreg_variables =
+        realloc(function->vreg_variables, function->vreg_capacity * sizeof(int64_t));
+  }
+  function->vreg_variables[function->n_vregs] = variable;
+  return IR_VREG(function->n_vregs++);
+}
+
+ir_block_t* ir_new_block(const char* label_format, ...)
+{
+  ir_block_t* block = malloc(sizeof(ir_block_t));
+  *block = (ir_block_t){
+      .instructions = NULL, .n_instructions = 0, .capacity = 0, .profile_count = -1};
+
+  va_list args;
+  va_start(args, label_format);
+  int length = vsnprintf(NULL, 0, label_format, args);
+  va_end(args);
+
+  block->label = malloc(length + 1);
+  va_start(args, label_format);
+  vsnprintf(block->label, length + 1, label_format, args);
+  va_end(args);
+  return block;
+}
+
+ir_instruction_t* ir_append_instruction(ir_block_t* block, ir_instruction_t instruction)
+{
+  if (block->n_instructions + 1 >= block->capacity)
+  {
+    block->capacity = block->capacity * 2 + 8;
+    block->instructions = realloc(block->instructions, block->capacity * sizeof(ir_instruction_t));
+  }
+  block->instructions[block->n_instructions] = instruction;
+  return &block->instructions[block->n_instructions++];
+}
+
+void ir_insert_block(ir_function_t* function, ir_block_t* block, size_t position)
+{
+  assert(position <= function->n_blocks);
+  if (function->n_blocks + 1 >= function->capacity)
+  {
+    function->capacity = function->capacity * 2 + 8;
+    function->blocks = realloc(function->blocks, function->capacity * sizeof(ir_block_t*));
+  }
+  memmove(&function->blocks[position + 1],
+          &function->blocks[position],
+          (function->n_blocks - position) * sizeof(ir_block_t*));
+  function->blocks[position] = block;
+  function->n_blocks++;
+
+  for (size_t i = position; i < function->n_blocks; i++)
+    function->blocks[i]->id = i;
+}
+
+void ir_destroy_instruction(ir_instruction_t* instruction)
+{
+  free(instruction->args);
+  free(instruction->incoming);
+  instruction->args = NULL;
+  instruction->incoming = NULL;
+  instruction->n_args = 0;
+}
+
+/* Construction of IR from the syntax tree */
+
+// The function currently being built
+static _Thread_local ir_function_t* current_function;
+
+// The block new instructions are appended to.
+// Set to NULL after a terminator, since any following code is unreachable
+static _Thread_local ir_block_t* current_block;
+
+// Every unique label in the program needs a unique number
+static _Thread_local int if_statement_counter = 0;
+static _Thread_local int while_statement_counter = 0;
+static _Thread_local int unreachable_block_counter = 0;
+
+// The exit blocks of all while loops we are currently inside, innermost last
+static _Thread_local ir_block_t** loop_exits;
+static _Thread_local size_t loop_depth;
+
+// The stack pointers saved by the blocks we are currently inside that allocate arrays, innermost
+// last. For each loop, how many of them were saved outside of it, so that a break can free the
+// arrays allocated inside the loop
+static _Thread_local ir_operand_t* stack_saves;
+static _Thread_local size_t n_stack_saves;
+static _Thread_local size_t* loop_stack_saves;
+
+// Places the block at the end of the current function, and makes it the current block.
+// If the previous block has no terminator yet, it gets a jump to this block
+static void start_block(ir_block_t* block);
+
+// Appends an instruction to the current block.
+// If the current block has already been terminated, the instruction is unreachable,
+// so it is placed in a new block with no predecessors.
+static ir_instruction_t* emit(ir_instruction_t instruction)
+{
+  if (current_block == NULL)
+    start_block(ir_new_block("unreachable%d", ++unreachable_block_counter));
+
+  ir_instruction_t* result = ir_append_instruction(current_block, instruction);
+  if (ir_is_terminator(instruction.opcode))
+    current_block = NULL;
+  return result;
+}
+
+static void start_block(ir_block_t* block)
+{
+  if (current_block != NULL)
+    emit((ir_instruction_t){.opcode = IR_JUMP, .targets = {block}});
+
+  ir_insert_block(current_function, block, current_function->n_blocks);
+  current_block = block;
+}
+
+// Returns a fresh temporary vreg
+static ir_operand_t new_temporary(void)
+{
+  return ir_new_vreg(current_function, -1);
+}
+
+// With -fbounds-check, emits a check that the index is within the bounds of the array.
+// Local arrays of a dynamic length are not checked, since their length is not kept anywhere
+static void emit_bounds_check(symbol_t* array, ir_operand_t index)
+{
+  if (!feature_bounds_check || IS_DYNAMIC_ARRAY(array))
+    return;
+  emit((ir_instruction_t){.opcode = IR_CHECK_BOUNDS, .a = index, .symbol = array});
+  bounds_checks_inserted++;
+}
+
+// Emits an instruction computing a new temporary from up to two operands, and returns it
+static ir_operand_t emit_value(ir_opcode_t opcode, ir_operand_t a, ir_operand_t b)
+{
+  ir_operand_t dst = new_temporary();
+  emit((ir_instruction_t){.opcode = opcode, .dst = dst, .a = a, .b = b});
+  return dst;
+}
+
+// Warns about the local variables of the function that are never read. The IR must be freshly
+// built, so that every variable still has a single vreg, and is assigned once to start out as 0
+static void warn_unused_variables(ir_function_t* function)
+{
+  size_t* n_reads = calloc(function->n_variables, sizeof(size_t));
+  size_t* n_writes = calloc(function->n_variables, sizeof(size_t));
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* block = function->blocks[b];
+    for (size_t i = 0; i < block->n_instructions; i++)
+    {
+      ir_instruction_t* instruction = &block->instructions[i];
+      for (size_t s = 0; s < ir_source_count(instruction); s++)
+      {
+        ir_operand_t* operand = ir_source(instruction, s);
+        if (operand->kind == IR_OPERAND_VREG && (size_t)operand->value < function->n_variables)
+          n_reads[operand->value]++;
+      }
+      int64_t def = ir_defined_vreg(instruction);
+      if (def >= 0 && (size_t)def < function->n_variables)
+        n_writes[def]++;
+    }
+  }
+
+  symbol_table_t* symtable = function->symbol->function_symtable;
+  for (size_t i = 0; i < symtable->n_of_type[SYMBOL_LOCAL_VAR]; i++)
+  {
+    symbol_t* variable = symtable->of_type[SYMBOL_LOCAL_VAR][i];
+    size_t v = variable->sequence_number;
+    if (n_reads[v] > 0)
+      continue;
+    fprintf(stderr,
+            "warning: local variable '%s' in function '%s' is %s\n",
+            variable->name,
+            function->symbol->name,
+            n_writes[v] > 1 ? "assigned but never read" : "never used");
+  }
+
+  free(n_writes);
+  free(n_reads);
+}
+
+// Creates the IR for the given function, including all blocks of its body
+static ir_function_t* build_function(symbol_t* function)
+{
+  ir_function_t* result = malloc(sizeof(ir_function_t));
+  symbol_table_t* symtable = function->function_symtable;
+  *result = (ir_function_t){
+      .symbol = function,
+      .blocks = NULL,
+      .n_blocks = 0,
+      .capacity = 0,
+      .n_vregs = 0,
+      .n_variables = symtable->n_symbols,
+      .vreg_variables = NULL,
+      .vreg_capacity = 0,
+  };
+
+  // The first vregs belong to the parameters and local variables
+  for (size_t i = 0; i < symtable->n_symbols; i++)
+    ir_new_vreg(result, i);
+
+  current_function = result;
+  current_block = NULL;
+  start_block(ir_new_block(".%s.entry", function->name));
+
+  // All local variables start out as 0
+  for (size_t i = 0; i < symtable->n_of_type[SYMBOL_LOCAL_VAR]; i++)
+  {
+    size_t variable = symtable->of_type[SYMBOL_LOCAL_VAR][i]->sequence_number;
+    emit((ir_instruction_t){.opcode = IR_MOVE, .dst = IR_VREG(variable), .a = IR_CONST(0)});
+  }
+
+  build_statement(node_child(node_get(function->node), 2));
+
+  // remove_unreachable_code_syntax_tree() makes sure all functions end with a return,
+  // so if the last block is still open, it can never be reached. It still needs a terminator
+  if (current_block != NULL)
+    emit((ir_instruction_t){.opcode = IR_RETURN, .a = IR_CONST(0)});
+
+  ir_remove_unreachable_blocks(result);
+  warn_unused_variables(result);
+  current_function = NULL;
+  return result;
+}
+
+// Checks that the identifier refers to a variable, and returns its symbol
+static symbol_t* variable_symbol(node_t* identifier)
+{
+  assert(identifier->type == IDENTIFIER);
+  symbol_t* symbol = identifier->symbol;
+  switch (symbol->type)
+  {
+  case SYMBOL_GLOBAL_VAR:
+  case SYMBOL_LOCAL_VAR:
+  case SYMBOL_PARAMETER:
+    return symbol;
+  case SYMBOL_FUNCTION:
+    fprintf(stderr, "error: symbol '%s' is a function, not a variable\n", symbol->name);
+    exit(EXIT_FAILURE);
+  case SYMBOL_GLOBAL_ARRAY:
+  case SYMBOL_LOCAL_ARRAY:
+    fprintf(stderr, "error: symbol '%s' is an array, not a variable\n", symbol->name);
+    exit(EXIT_FAILURE);
+  default:
+    assert(false && "Unknown variable symbol type");
+  }
+}
+
+// Checks that the ARRAY_INDEXING node indexes into an array, and returns the array's symbol
+static symbol_t* array_symbol(node_t* array_indexing)
+{
+  assert(array_indexing->type == ARRAY_INDEXING);
+  symbol_t* symbol = node_child(array_indexing, 0)->symbol;
+  if (symbol->type != SYMBOL_GLOBAL_ARRAY && symbol->type != SYMBOL_LOCAL_ARRAY)
+  {
+    fprintf(stderr, "error: symbol '%s' is not an array\n", symbol->name);
+    exit(EXIT_FAILURE);
+  }
+  return symbol;
+}
+
+// Returns the operand holding the address of the array. Arrays of a fixed length have their
+// address taken where it is used, while the address of a dynamic local array is kept in its vreg
+static ir_operand_t array_address(symbol_t* array)
+{
+  if (IS_DYNAMIC_ARRAY(array))
+    return IR_VREG(array->sequence_number);
+  ir_operand_t address = new_temporary();
+  emit((ir_instruction_t){.opcode = IR_ADDRESS_OF, .dst = address, .symbol = array});
+  return address;
+}
+
+// Checks that the FUNCTION_CALL calls a function with the right number of arguments,
+// and returns the function's symbol
+static symbol_t* called_function(node_t* call)
+{
+  symbol_t* symbol = node_child(call, 0)->symbol;
+  if (symbol->type != SYMBOL_FUNCTION)
+  {
+    fprintf(stderr, "error: '%s' is not a function\n", symbol->name);
+    exit(EXIT_FAILURE);
+  }
+
+  node_t* argument_list = node_child(call, 1);
+
+  size_t parameter_count = FUNC_PARAM_COUNT(symbol);
+  if (parameter_count != argument_list->n_children)
+  {
+    fprintf(
+        stderr,
+        "error: function '%s' expects '%zu' arguments, but '%zu' were given\n",
+        symbol->name,
+        parameter_count,
+        (size_t)argument_list->n_children);
+    exit(EXIT_FAILURE);
+  }
+  return symbol;
+}
+
+// Maps operator strings from the syntax tree to IR opcodes
+static const struct
+{
+  const char* operator;
+  ir_opcode_t opcode;
+} BINARY_OPERATORS[] = {
+    {"+", IR_ADD},
+    {"-", IR_SUB},
+    {"*", IR_MUL},
+    {"/", IR_DIV},
+    {"==", IR_EQ},
+    {"!=", IR_NE},
+    {"<", IR_LT},
+    {"<=", IR_LE},
+    {">", IR_GT},
+    {">=", IR_GE},
+};
+
+static ir_opcode_t binary_operator_opcode(const char* op)
+{
+  for (size_t i = 0; i < sizeof(BINARY_OPERATORS) / sizeof(BINARY_OPERATORS[0]); i++)
+    if (strcmp(op, BINARY_OPERATORS[i].operator) == 0)
+      return BINARY_OPERATORS[i].opcode;
+  assert(false && "Unknown expression operation");
+  return IR_ADD;
+}
+
+// Expressions are built from the bottom up by traverse_syntax_tree().
+// Every subexpression pushes the operand holding its value to this stack when it is left,
+// so the values of an expression's operands are on top of the stack when the expression is left.
+// The order the operands are visited in decides the order they are evaluated in
+static _Thread_local ir_operand_t* value_stack;
+static _Thread_local size_t value_stack_len;
+static _Thread_local size_t value_stack_capacity;
+
+static void push_value(ir_operand_t value)
+{
+  if (value_stack_len + 1 >= value_stack_capacity)
+  {
+    value_stack_capacity = value_stack_capacity * 2 + 8;
+    value_stack = realloc(value_stack, value_stack_capacity * sizeof(ir_operand_t));
+  }
+  value_stack[value_stack_len++] = value;
+}
+
+static ir_operand_t pop_value(void)
+{
+  assert(value_stack_len > 0);
+  return value_stack[--value_stack_len];
+}
+
+static void destroy_value_stack(void)
+{
+  assert(value_stack_len == 0);
+  free(value_stack);
+  value_stack = NULL;
+  value_stack_capacity = 0;
+}
+
+// Returns true if the identifier names the array or function of its parent,
+// instead of being a variable used as a value
+static bool is_name(node_t* node, node_t* parent)
+{
+  return parent != NULL && (parent->type == ARRAY_INDEXING || parent->type == FUNCTION_CALL) &&
+         node == node_child(parent, 0);
+}
+
+static visit_order_t build_expression_enter(node_t* node, node_t* parent, void* context)
+{
+  switch (node->type)
+  {
+  case ARRAY_INDEXING:
+    array_symbol(node);
+    return VISIT_CHILDREN;
+  case OPERATOR:
+  {
+    // Subtraction and division evaluate the right hand side first
+    const char* op = node->data.operator;
+    if (node->n_children == 2 && (strcmp(op, "-") == 0 || strcmp(op, "/") == 0))
+      return VISIT_CHILDREN_REVERSED;
+    return VISIT_CHILDREN;
+  }
+  // We evaluate all arguments from right to left.
+  // The argument list is the only LIST found in expressions
+  case FUNCTION_CALL:
+    called_function(node);
+    return VISIT_CHILDREN_REVERSED;
+  case LIST:
+    return VISIT_CHILDREN_REVERSED;
+  default:
+    return SKIP_CHILDREN;
+  }
+}
+
+// Emits the instructions for the node, once all its operands have been built
+static node_t* build_expression_leave(node_t* node, node_t* parent, void* context)
+{
+  switch (node->type)
+  {
+  case NUMBER_LITERAL:
+    push_value(IR_CONST(node->data.number_literal));
+    break;
+  case IDENTIFIER:
+  {
+    if (is_name(node, parent))
+      break;
+    symbol_t* symbol = variable_symbol(node);
+    if (symbol->type == SYMBOL_GLOBAL_VAR)
+    {
+      ir_operand_t dst = new_temporary();
+      emit((ir_instruction_t){.opcode = IR_LOAD_GLOBAL, .dst = dst, .symbol = symbol});
+      push_value(dst);
+    }
+    else
+      push_value(IR_VREG(symbol->sequence_number));
+    break;
+  }
+  case ARRAY_INDEXING:
+  {
+    ir_operand_t index = pop_value();
+    emit_bounds_check(array_symbol(node), index);
+    ir_operand_t address = array_address(array_symbol(node));
+    push_value(emit_value(IR_LOAD_ELEMENT, address, index));
+    break;
+  }
+  case OPERATOR:
+  {
+    const char* op = node->data.operator;
+    if (node->n_children == 1)
+    {
+      ir_operand_t operand = pop_value();
+      if (strcmp(op, "-") == 0)
+        push_value(emit_value(IR_NEG, operand, IR_NONE));
+      else if (strcmp(op, "!") == 0)
+        push_value(emit_value(IR_NOT, operand, IR_NONE));
+      else
+        assert(false && "Unknown unary operator");
+      break;
+    }
+
+    ir_opcode_t opcode = binary_operator_opcode(op);
+    ir_operand_t lhs, rhs;
+    if (opcode == IR_SUB || opcode == IR_DIV)
+    {
+      lhs = pop_value();
+      rhs = pop_value();
+    }
+    else
+    {
+      rhs = pop_value();
+      lhs = pop_value();
+    }
+    push_value(emit_value(opcode, lhs, rhs));
+    break;
+  }
+  case LIST:
+    break;
+  case FUNCTION_CALL:
+  {
+    // The arguments were pushed from last to first, so the first argument is on top
+    symbol_t* symbol = called_function(node);
+    size_t n_args = FUNC_PARAM_COUNT(symbol);
+    ir_operand_t* args = malloc(n_args * sizeof(ir_operand_t));
+    for (size_t i = 0; i < n_args; i++)
+      args[i] = pop_value();
+
+    ir_operand_t dst = new_temporary();
+    emit((ir_instruction_t){
+        .opcode = IR_CALL, .dst = dst, .symbol = symbol, .args = args, .n_args = n_args});
+    push_value(dst);
+    break;
+  }
+  default:
+    assert(false && "Unknown expression type");
+  }
+  return node;
+}
+
+// Builds the instructions for evaluating the expression, and returns an operand holding its value.
+// Parameters and local variables are returned as their own vreg.
+// The operand is only guaranteed to hold the value until the next statement
+static ir_operand_t build_expression(node_t* expression)
+{
+  size_t start = value_stack_len;
+  traverse_syntax_tree(expression, build_expression_enter, build_expression_leave, NULL);
+  assert(value_stack_len == start + 1);
+  return pop_value();
+}
+
+// Builds the instructions for accessing array[index], and returns the address and index operands
+static void build_array_access(node_t* node, ir_operand_t* address, ir_operand_t* index)
+{
+  symbol_t* symbol = array_symbol(node);
+  *index = build_expression(node_child(node, 1));
+  emit_bounds_check(symbol, *index);
+  *address = array_address(symbol);
+}
+
+static void build_assignment_statement(node_t* statement)
+{
+  node_t* dest = node_child(statement, 0);
+  node_t* expression = node_child(statement, 1);
+
+  // First the right hand side of the assignment is evaluated
+  ir_operand_t value = build_expression(expression);
+
+  if (dest->type == IDENTIFIER)
+  {
+    symbol_t* symbol = variable_symbol(dest);
+    if (symbol->type == SYMBOL_GLOBAL_VAR)
+      emit((ir_instruction_t){.opcode = IR_STORE_GLOBAL, .a = value, .symbol = symbol});
+    else
+      emit((ir_instruction_t){
+          .opcode = IR_MOVE, .dst = IR_VREG(symbol->sequence_number), .a = value});
+  }
+  else
+  {
+    ir_operand_t address, index;
+    build_array_access(dest, &address, &index);
+    emit((ir_instruction_t){.opcode = IR_STORE_ELEMENT, .a = address, .b = index, .c = value});
+  }
+}
+
+// Looks for function calls, stopping the search once one is found
+static visit_order_t find_call_enter(node_t* node, node_t* parent, void* context)
+{
+  bool* found = context;
+  if (node != NULL && node->type == FUNCTION_CALL)
+    *found = true;
+  return *found ? SKIP_CHILDREN : VISIT_CHILDREN;
+}
+
+// Returns true if evaluating the expression involves calling a function
+static bool contains_function_call(node_t* node)
+{
+  bool found = false;
+  traverse_syntax_tree(node, find_call_enter, NULL, &found);
+  return found;
+}
+
+// Emits a print instruction for the given arguments, and clears the list of arguments
+static void flush_print_arguments(ir_operand_t** args, size_t* n_args, bool newline)
+{
+  emit((ir_instruction_t){.opcode = IR_PRINT, .args = *args, .n_args = *n_args, .newline = newline});
+  *args = NULL;
+  *n_args = 0;
+}
+
+static void build_print_statement(node_t* statement)
+{
+  node_t* print_items = node_child(statement, 0);
+  ir_operand_t* args = malloc(print_items->n_children * sizeof(ir_operand_t));
+  size_t n_args = 0;
+
+  for (size_t i = 0; i < print_items->n_children; i++)
+  {
+    node_t* item = node_child(print_items, i);
+
+    // Called functions may print as well, so everything before the call must be printed first
+    if (n_args > 0 && contains_function_call(item))
+    {
+      flush_print_arguments(&args, &n_args, false);
+      args = malloc((print_items->n_children - i) * sizeof(ir_operand_t));
+    }
+
+    if (item->type == STRING_LIST_REFERENCE)
+      args[n_args++] = IR_STRING(item->data.string_list_index);
+    else
+      args[n_args++] = build_expression(item);
+  }
+
+  flush_print_arguments(&args, &n_args, true);
+}
+
+static void build_return_statement(node_t* statement)
+{
+  ir_operand_t value = build_expression(node_child(statement, 0));
+  emit((ir_instruction_t){.opcode = IR_RETURN, .a = value});
+}
+
+// Ends the current block with a branch on the condition being non-zero
+// Comparisons branch directly on the comparison, instead of first computing a 0 or 1.
+// A condition negated with ! just swaps the targets
+static void build_condition(node_t* condition, ir_block_t* if_true, ir_block_t* if_false)
+{
+  if (condition->type == OPERATOR && condition->n_children == 1 &&
+      strcmp(condition->data.operator, "!") == 0)
+  {
+    build_condition(node_child(condition, 0), if_false, if_true);
+    return;
+  }
+
+  if (condition->type == OPERATOR && condition->n_children == 2)
+  {
+    for (size_t i = 0; i < sizeof(BINARY_OPERATORS) / sizeof(BINARY_OPERATORS[0]); i++)
+    {
+      ir_opcode_t opcode = BINARY_OPERATORS[i].opcode;
+      if (strcmp(condition->data.operator, BINARY_OPERATORS[i].operator) != 0 ||
+          !ir_is_comparison(opcode))
+        continue;
+
+      ir_operand_t lhs = build_expression(node_child(condition, 0));
+      ir_operand_t rhs = build_expression(node_child(condition, 1));
+      emit((ir_instruction_t){
+          .opcode = IR_BRANCH,
+          .condition = opcode,
+          .a = lhs,
+          .b = rhs,
+          .targets = {if_true, if_false}});
+      return;
+    }
+  }
+
+  ir_operand_t value = build_expression(condition);
+  emit((ir_instruction_t){
+      .opcode = IR_BRANCH,
+      .condition = IR_NE,
+      .a = value,
+      .b = IR_CONST(0),
+      .targets = {if_true, if_false}});
+}
+
+static void build_if_statement(node_t* statement)
+{
+  const int id = ++if_statement_counter;
+
+  ir_block_t* then_block = ir_new_block("then%d", id);
+  ir_block_t* else_block = statement->n_children == 3 ? ir_new_block("else%d", id) : NULL;
+  ir_block_t* end_block = ir_new_block("endif%d", id);
+
+  build_condition(node_child(statement, 0), then_block, else_block ? else_block : end_block);
+
+  start_block(then_block);
+  build_statement(node_child(statement, 1));
+
+  if (else_block)
+  {
+    if (current_block != NULL)
+      emit((ir_instruction_t){.opcode = IR_JUMP, .targets = {end_block}});
+    start_block(else_block);
+    build_statement(node_child(statement, 2));
+  }
+
+  start_block(end_block);
+}
+
+static void build_while_statement(node_t* statement)
+{
+  const int id = ++while_statement_counter;
+
+  ir_block_t* condition_block = ir_new_block("while%d", id);
+  ir_block_t* body_block = ir_new_block("do%d", id);
+  ir_block_t* end_block = ir_new_block("endwhile%d", id);
+
+  start_block(condition_block);
+  build_condition(node_child(statement, 0), body_block, end_block);
+
+  start_block(body_block);
+  loop_exits = realloc(loop_exits, (loop_depth + 1) * sizeof(ir_block_t*));
+  loop_stack_saves = realloc(loop_stack_saves, (loop_depth + 1) * sizeof(size_t));
+  loop_stack_saves[loop_depth] = n_stack_saves;
+  loop_exits[loop_depth++] = end_block;
+  build_statement(node_child(statement, 1));
+  loop_depth--;
+
+  if (current_block != NULL)
+    emit((ir_instruction_t){.opcode = IR_JUMP, .targets = {condition_block}});
+
+  start_block(end_block);
+  if (loop_depth == 0)
+  {
+    free(loop_exits);
+    loop_exits = NULL;
+    free(loop_stack_saves);
+    loop_stack_saves = NULL;
+  }
+}
+
+// Allocates the local arrays in the declaration list of a block whose length is an expression.
+// The stack pointer is saved before the first of them, and the stack they take is freed when the
+// block is left, see build_statement(). Returns true if the stack pointer was saved
+static bool build_array_allocations(node_t* declaration_list)
+{
+  bool saved = false;
+  for (size_t i = 0; i < declaration_list->n_children; i++)
+  {
+    node_t* declaration = node_child(declaration_list, i);
+    for (size_t j = 0; j < declaration->n_children; j++)
+    {
+      node_t* variable = node_child(declaration, j);
+      if (variable->type != ARRAY_INDEXING)
+        continue;
+      symbol_t* array = node_child(variable, 0)->symbol;
+      node_t* length = ARRAY_LENGTH_NODE(array);
+      if (length->type == NUMBER_LITERAL && length->data.number_literal < 0)
+      {
+        fprintf(stderr, "error: length of array '%s' is negative\n", array->name);
+        exit(EXIT_FAILURE);
+      }
+      if (!IS_DYNAMIC_ARRAY(array))
+        continue;
+      if (!saved)
+      {
+        ir_operand_t stack = new_temporary();
+        emit((ir_instruction_t){.opcode = IR_SAVE_STACK, .dst = stack});
+        stack_saves = realloc(stack_saves, (n_stack_saves + 1) * sizeof(ir_operand_t));
+        stack_saves[n_stack_saves++] = stack;
+        saved = true;
+      }
+      emit((ir_instruction_t){
+          .opcode = IR_ALLOCATE,
+          .dst = IR_VREG(array->sequence_number),
+          .a = build_expression(length),
+      });
+    }
+  }
+  return saved;
+}
+
+// Jumps out past the end of the innermost while loop, freeing the arrays allocated inside it
+static void build_break_statement(void)
+{
+  assert(loop_depth > 0 && "break outside of while loop");
+  size_t outside_saves = loop_stack_saves[loop_depth - 1];
+  if (n_stack_saves > outside_saves)
+    emit((ir_instruction_t){.opcode = IR_RESTORE_STACK, .a = stack_saves[outside_saves]});
+  emit((ir_instruction_t){.opcode = IR_JUMP, .targets = {loop_exits[loop_depth - 1]}});
+}
+
+// Recursively builds the given statement node, and all sub-statements
+static void build_statement(node_t* node)
+{
+  if (node == NULL)
+    return;
+
+  switch (node->type)
+  {
+  case BLOCK:
+  {
+    // All handling of scopes has already been done by create_tables(). Local arrays of a length
+    // not known until now are allocated where they are declared, and freed at the end of the
+    // block, so that a block in a loop takes the same stack every iteration. Returns free them
+    // along with the rest of the frame
+    bool saved = node->n_children == 2 && build_array_allocations(node_child(node, 0));
+    node_t* statement_list = node_child(node, node->n_children - 1);
+    for (size_t i = 0; i < statement_list->n_children; i++)
+      build_statement(node_child(statement_list, i));
+    if (saved)
+    {
+      n_stack_saves--;
+      if (current_block != NULL)
+        emit((ir_instruction_t){.opcode = IR_RESTORE_STACK, .a = stack_saves[n_stack_saves]});
+      if (n_stack_saves == 0)
+      {
+        free(stack_saves);
+        stack_saves = NULL;
+      }
+    }
+    break;
+  }
+  case ASSIGNMENT_STATEMENT:
+    build_assignment_statement(node);
+    break;
+  case PRINT_STATEMENT:
+    build_print_statement(node);
+    break;
+  case RETURN_STATEMENT:
+    build_return_statement(node);
+    break;
+  case FUNCTION_CALL:
+    build_expression(node);
+    break;
+  case IF_STATEMENT:
+    build_if_statement(node);
+    break;
+  case WHILE_STATEMENT:
+    build_while_statement(node);
+    break;
+  case BREAK_STATEMENT:
+    build_break_statement();
+    break;
+  default:
+    assert(false && "Unknown statement type");
+  }
+}
+
+// Frees the block, and all instructions in it
+static void destroy_block(ir_block_t* block)
+{
+  for (size_t i = 0; i < block->n_instructions; i++)
+    ir_destroy_instruction(&block->instructions[i]);
+  free(block->instructions);
+  free(block->predecessors);
+  free(block->label);
+  free(block);
+}
+
+// Removes the entries of a phi that come from unreachable blocks
+static void remove_unreachable_phi_entries(ir_instruction_t* phi, bool* reachable)
+{
+  size_t n_args = 0;
+  for (size_t i = 0; i < phi->n_args; i++)
+  {
+    if (!reachable[phi->incoming[i]->id])
+      continue;
+    phi->args[n_args] = phi->args[i];
+    phi->incoming[n_args] = phi->incoming[i];
+    n_args++;
+  }
+  phi->n_args = n_args;
+}
+
+// Removes all blocks that can not be reached from the entry block,
+// and gives the remaining blocks new ids
+void ir_remove_unreachable_blocks(ir_function_t* function)
+{
+  bool* reachable = calloc(function->n_blocks, sizeof(bool));
+  ir_block_t** worklist = malloc(function->n_blocks * sizeof(ir_block_t*));
+  size_t worklist_len = 0;
+
+  reachable[0] = true;
+  worklist[worklist_len++] = function->blocks[0];
+  while (worklist_len > 0)
+  {
+    ir_block_t* successors[2];
+    size_t n_successors = ir_block_successors(worklist[--worklist_len], successors);
+    for (size_t i = 0; i < n_successors; i++)
+    {
+      if (reachable[successors[i]->id])
+        continue;
+      reachable[successors[i]->id] = true;
+      worklist[worklist_len++] = successors[i];
+    }
+  }
+
+  // Phis must forget about predecessors that are going away
+  for (size_t i = 0; i < function->n_blocks; i++)
+  {
+    ir_block_t* block = function->blocks[i];
+    for (size_t j = 0; reachable[i] && j < block->n_instructions; j++)
+      if (block->instructions[j].opcode == IR_PHI)
+        remove_unreachable_phi_entries(&block->instructions[j], reachable);
+  }
+
+  size_t n_reachable = 0;
+  for (size_t i = 0; i < function->n_blocks; i++)
+  {
+    ir_block_t* block = function->blocks[i];
+    if (!reachable[i])
+    {
+      destroy_block(block);
+      continue;
+    }
+    block->id = n_reachable;
+    function->blocks[n_reachable++] = block;
+  }
+  function->n_blocks = n_reachable;
+
+  free(worklist);
+  free(reachable);
+}
+
+/* Printing of IR */
+
+const char* IR_OPCODE_NAMES[IR_OPCODE_COUNT] = {
+    [IR_MOVE] = "move",
+    [IR_PHI] = "phi",
+    [IR_ADD] = "add",
+    [IR_SUB] = "sub",
+    [IR_MUL] = "mul",
+    [IR_DIV] = "div",
+    [IR_SHL] = "shl",
+    [IR_SAR] = "sar",
+    [IR_SHR] = "shr",
+    [IR_MULHI] = "mulhi",
+    [IR_EQ] = "eq",
+    [IR_NE] = "ne",
+    [IR_LT] = "lt",
+    [IR_LE] = "le",
+    [IR_GT] = "gt",
+    [IR_GE] = "ge",
+    [IR_NEG] = "neg",
+    [IR_NOT] = "not",
+    [IR_LOAD_GLOBAL] = "load_global",
+    [IR_STORE_GLOBAL] = "store_global",
+    [IR_ADDRESS_OF] = "address_of",
+    [IR_ALLOCATE] = "allocate",
+    [IR_SAVE_STACK] = "save_stack",
+    [IR_RESTORE_STACK] = "restore_stack",
+    [IR_LOAD_ELEMENT] = "load_element",
+    [IR_STORE_ELEMENT] = "store_element",
+    [IR_CHECK_BOUNDS] = "check_bounds",
+    [IR_VECTOR_ADD] = "vector_add",
+    [IR_VECTOR_SUB] = "vector_sub",
+    [IR_CALL] = "call",
+    [IR_PRINT] = "print",
+    [IR_COUNT] = "count",
+    [IR_JUMP] = "jump",
+    [IR_BRANCH] = "branch",
+    [IR_RETURN] = "return",
+};
+
+static void print_operand(ir_operand_t operand)
+{
+  switch (operand.kind)
+  {
+  case IR_OPERAND_VREG:
+    printf("%%%ld", operand.value);
+    break;
+  case IR_OPERAND_CONST:
+    printf("%ld", operand.value);
+    break;
+  case IR_OPERAND_STRING:
+    printf("%s", string_list[operand.value]);
+    break;
+  default:
+    printf("?");
+    break;
+  }
+}
+
+static void print_instruction(ir_instruction_t* instruction)
+{
+  printf("    ");
+  if (instruction->dst.kind != IR_OPERAND_NONE)
+  {
+    print_operand(instruction->dst);
+    printf(" = ");
+  }
+  printf("%s", IR_OPCODE_NAMES[instruction->opcode]);
+
+  if (instruction->opcode == IR_BRANCH)
+    printf(" %s", IR_OPCODE_NAMES[instruction->condition]);
+  if (instruction->symbol)
+    printf(" .%s", instruction->symbol->name);
+
+  // Phis print each value together with the block it comes from
+  if (instruction->opcode == IR_PHI)
+  {
+    for (size_t i = 0; i < instruction->n_args; i++)
+    {
+      printf("%s[", i == 0 ? " " : ", ");
+      print_operand(instruction->args[i]);
+      printf(", %s]", instruction->incoming[i]->label);
+    }
+    putchar('\n');
+    return;
+  }
+
+  // Print all source operands, separated by commas
+  const char* separator = " ";
+  for (size_t i = 0; i < ir_source_count(instruction); i++)
+  {
+    ir_operand_t* operand = ir_source(instruction, i);
+    if (operand->kind == IR_OPERAND_NONE)
+      continue;
+    printf("%s", separator);
+    print_operand(*operand);
+    separator = ", ";
+  }
+
+  if (instruction->opcode == IR_PRINT && instruction->newline)
+    printf("%s'\\n'", separator);
+
+  switch (instruction->opcode)
+  {
+  case IR_JUMP:
+    printf(" %s", instruction->targets[0]->label);
+    break;
+  case IR_BRANCH:
+    printf(" ? %s : %s", instruction->targets[0]->label, instruction->targets[1]->label);
+    break;
+  default:
+    break;
+  }
+  putchar('\n');
+}
+
+static void print_function(ir_function_t* function)
+{
+  symbol_table_t* symtable = function->symbol->function_symtable;
+
+  printf("function .%s", function->symbol->name);
+  // Variables added by inlining have no names
+  for (size_t i = 0; i < symtable->n_symbols; i++)
+    printf("%s %s=%%%zu", i == 0 ? " with" : ",", symtable->symbols[i]->name, i);
+  putchar('\n');
+
+  for (size_t i = 0; i < function->n_blocks; i++)
+  {
+    ir_block_t* block = function->blocks[i];
+    printf("%s:\n", block->label);
+    for (size_t j = 0; j < block->n_instructions; j++)
+      print_instruction(&block->instructions[j]);
+  }
+  putchar('\n');
+}
+
+static void destroy_function(ir_function_t* function)
+{
+  for (size_t i = 0; i < function->n_blocks; i++)
+    destroy_block(function->blocks[i]);
+  free(function->blocks);
+  free(function->vreg_variables);
+  free(function);
+}
@@ -0,0 +1,329 @@
+#ifndef IR_H
+#define IR_H
+
+#include "symbols.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The intermediate representation (IR) sits between the abstract syntax tree and the assembly.
+// It is a linear three-address code, where every function is a list of basic blocks,
+// and every basic block is a list of instructions ending in a single jump, branch or return.
+//
+// Values live in an unlimited supply of virtual registers (vregs).
+// When the IR is first built, every parameter and local variable of a function gets its own vreg,
+// which are the only vregs that can be assigned more than once.
+// All other vregs are temporaries, assigned exactly once, and only used in the same basic block.
+// Inlining can split a block at a call, leaving uses of a temporary in the blocks that follow.
+//
+// The optimizer turns each function into static single assignment (SSA) form, where every vreg
+// is assigned exactly once, and phi instructions merge values where control flow joins.
+// Before code generation, the phis are replaced by moves again.
+
+typedef enum
+{
+  IR_OPERAND_NONE,   // Unused operand
+  IR_OPERAND_VREG,   // The value in a virtual register
+  IR_OPERAND_CONST,  // An integer constant
+  IR_OPERAND_STRING, // A string from the global string list. Only used by IR_PRINT
+} ir_operand_kind_t;
+
+typedef struct
+{
+  ir_operand_kind_t kind;
+  int64_t value; // The vreg number, the constant, or the string list index
+} ir_operand_t;
+
+typedef enum
+{
+  IR_MOVE, // dst = a
+  IR_PHI,  // dst = args[i], where incoming[i] is the block control flow came from. Only in SSA form
+
+  // Arithmetic, dst = a op b
+  IR_ADD,
+  IR_SUB,
+  IR_MUL,
+  IR_DIV,
+  IR_SHL,   // Shift left by the constant b
+  IR_SAR,   // Arithmetic (signed) shift right by the constant b
+  IR_SHR,   // Logical (unsigned) shift right by the constant b
+  IR_MULHI, // The upper 64 bits of the signed 128-bit product a * b
+
+  // Comparisons, dst = (a op b) ? 1 : 0
+  IR_EQ,
+  IR_NE,
+  IR_LT,
+  IR_LE,
+  IR_GT,
+  IR_GE,
+
+  // Unary operators, dst = op a
+  IR_NEG,
+  IR_NOT,
+
+  IR_LOAD_GLOBAL,   // dst = global variable symbol
+  IR_STORE_GLOBAL,  // global variable symbol = a
+  IR_ADDRESS_OF,    // dst = address of global array symbol, or local array symbol in the frame
+  IR_ALLOCATE,      // dst = address of a new local array of a zeroed elements, on the stack
+  IR_SAVE_STACK,    // dst = the stack pointer, before a block allocates its arrays
+  IR_RESTORE_STACK, // stack pointer = a, freeing the arrays allocated since it was saved
+  IR_LOAD_ELEMENT,  // dst = 8-byte element at address a, index b
+  IR_STORE_ELEMENT, // 8-byte element at address a, index b = c
+  IR_CHECK_BOUNDS,  // Exit with an error unless 0 <= a < the length of array symbol. -fbounds-check
+
+  // Vector operations on the IR_VECTOR_WIDTH elements from index args[0] at the addresses:
+  // element at a = element at b op element at c. Made by the loop vectorizer, -fvectorize
+  IR_VECTOR_ADD,
+  IR_VECTOR_SUB,
+
+  IR_CALL,  // dst = function symbol (args)
+  IR_PRINT, // print args, followed by a newline
+  IR_COUNT, // Add 1 to the profile counter with the constant number a. -fprofile-generate
+
+  // Terminators, exactly one of these ends every basic block
+  IR_JUMP,   // jump to targets[0]
+  IR_BRANCH, // if (a condition b) jump to targets[0], otherwise jump to targets[1]
+  IR_RETURN, // return a
+
+  IR_OPCODE_COUNT
+} ir_opcode_t;
+
+// Textual names of the opcodes, used when printing the IR
+extern const char* IR_OPCODE_NAMES[IR_OPCODE_COUNT];
+
+typedef struct ir_instruction
+{
+  ir_opcode_t opcode;
+  ir_operand_t dst;     // The vreg written by the instruction, if any
+  ir_operand_t a, b, c; // Source operands, unused ones have kind IR_OPERAND_NONE
+
+  symbol_t* symbol; // The global, array or function used by the instruction, if any
+
+  // Arguments of IR_CALL, IR_PRINT and IR_PHI. Owned by the instruction
+  ir_operand_t* args;
+  size_t n_args;
+
+  // For IR_PHI, the predecessor block each of the args comes from. Owned by the instruction
+  struct ir_block** incoming;
+
+  // Set if IR_PRINT should end the line after printing its arguments
+  bool newline;
+
+  // Jump targets of terminators
+  struct ir_block* targets[2];
+
+  // The comparison used by IR_BRANCH, one of IR_EQ to IR_GE
+  ir_opcode_t condition;
+} ir_instruction_t;
+
+typedef struct ir_block
+{
+  size_t id;   // Position in the function's list of blocks
+  char* label; // The assembly label of the block, owned
+
+  ir_instruction_t* instructions; // The last instruction is always a terminator
+  size_t n_instructions;
+  size_t capacity;
+
+  // The control flow graph, filled in by ir_compute_cfg()
+  struct ir_block** predecessors; // Owned list of blocks that can jump to this block
+  size_t n_predecessors;
+  struct ir_block* idom; // The immediate dominator, or NULL for the entry block
+  size_t rpo_index;      // Position of the block in a reverse postorder traversal
+
+  // How many times the block ran in the profile given by -fprofile-use, or -1 if not known
+  int64_t profile_count;
+} ir_block_t;
+
+typedef struct ir_function
+{
+  symbol_t* symbol; // The function symbol
+
+  // All basic blocks of the function. blocks[0] is the entry, the rest follow in layout order
+  ir_block_t** blocks;
+  size_t n_blocks;
+  size_t capacity;
+
+  size_t n_vregs;
+  // The vreg owned by each parameter and local variable, indexed by sequence number.
+  // These are always the vregs 0 up to n_variables
+  size_t n_variables;
+
+  // For every vreg, the sequence number of the variable it holds a version of, or -1 if the vreg
+  // is a temporary. Use ir_new_vreg() to create vregs
+  int64_t* vreg_variables;
+  size_t vreg_capacity;
+} ir_function_t;
+
+// All functions in the program, in the same order as in the global symbol table
+extern _Thread_local ir_function_t** ir_functions;
+extern _Thread_local size_t ir_functions_len;
+
+// Translates the body of every function into IR. Needs the symbol tables from create_tables()
+void create_ir(void);
+
+// Translates the body of a single function into IR, which is not added to ir_functions.
+// Used by the tiered execution in interpreter.c, which frees it with destroy_ir_function()
+ir_function_t* create_ir_function(symbol_t* function);
+void destroy_ir_function(ir_function_t* function);
+
+// Outputs the IR of all functions
+void print_ir(void);
+
+// Runs the enabled optimization passes on the IR of every function, in optimize.c
+void optimize_ir(void);
+
+// Runs the same passes on a single function, except for inlining, which needs every function
+void optimize_ir_function(ir_function_t* function);
+
+// How many bounds checks create_ir() inserted, and how many of them optimize_ir() removed
+// because they can never fail or repeat an earlier check, or moved out of loops.
+// The checks left after optimize_ir() also exclude those in unreachable code. Shown by -P
+extern _Thread_local size_t bounds_checks_inserted;
+extern _Thread_local size_t bounds_checks_removed;
+extern _Thread_local size_t bounds_checks_hoisted;
+extern _Thread_local size_t bounds_checks_left;
+
+// Frees all memory used by the IR
+void destroy_ir(void);
+
+// How many 8-byte elements the vector operations work on at once.
+// With -favx2 they fill a 256-bit register, otherwise a 128-bit SSE2 register
+#define IR_VECTOR_WIDTH (feature_avx2 ? 4 : 2)
+
+// Helpers for constructing operands
+#define IR_NONE ((ir_operand_t){.kind = IR_OPERAND_NONE})
+#define IR_VREG(n) ((ir_operand_t){.kind = IR_OPERAND_VREG, .value = (n)})
+#define IR_CONST(n) ((ir_operand_t){.kind = IR_OPERAND_CONST, .value = (n)})
+#define IR_STRING(n) ((ir_operand_t){.kind = IR_OPERAND_STRING, .value = (n)})
+
+// Returns true for the opcodes that end a basic block
+bool ir_is_terminator(ir_opcode_t opcode);
+
+// Returns the terminator of the given block
+ir_instruction_t* ir_block_terminator(ir_block_t* block);
+
+// Returns the number of successor blocks of the given block, and places them in successors
+size_t ir_block_successors(ir_block_t* block, ir_block_t* successors[2]);
+
+// Returns true for the comparison opcodes, IR_EQ to IR_GE
+bool ir_is_comparison(ir_opcode_t opcode);
+
+// Returns the comparison that is true exactly when the given comparison is false
+ir_opcode_t ir_inverse_condition(ir_opcode_t condition);
+
+// Returns true if the instruction calls a function, which can clobber any caller saved register
+bool ir_is_call(ir_instruction_t* instruction);
+
+// Source operands of an instruction are a, b, c, followed by all the args.
+// Iterate over them with ir_source(instruction, i) for i up to ir_source_count(instruction).
+// Unused operands have kind IR_OPERAND_NONE. The operand can be modified through the pointer
+size_t ir_source_count(ir_instruction_t* instruction);
+ir_operand_t* ir_source(ir_instruction_t* instruction, size_t i);
+
+// Returns the vreg written by the instruction, or -1 if it writes no vreg
+int64_t ir_defined_vreg(ir_instruction_t* instruction);
+
+// Creates a new vreg in the function, holding a version of the given variable,
+// or a temporary if variable is -1
+ir_operand_t ir_new_vreg(ir_function_t* function, int64_t variable);
+
+// Creates a new block with a label given as a printf-style format string.
+// The block is not placed in any function
+ir_block_t* ir_new_block(const char* label_format, ...);
+
+// Appends the instruction to the end of the block
+ir_instruction_t* ir_append_instruction(ir_block_t* block, ir_instruction_t instruction);
+
+// Inserts the block into the function's list of blocks at the given position
+void ir_insert_block(ir_function_t* function, ir_block_t* block, size_t position);
+
+// Frees the memory owned by an instruction that is being removed from its block
+void ir_destroy_instruction(ir_instruction_t* instruction);
+
+// Removes all blocks that can not be reached from the entry block,
+// including their entries in the phis of other blocks
+void ir_remove_unreachable_blocks(ir_function_t* function);
+
+/* Inlining, in inline.c */
+
+// Replaces calls to small functions that make no calls themselves with the body of the function.
+// The parameters and local variables of the inlined function become new variables of the caller.
+// Must be done before any function is taken into SSA form
+void ir_inline_functions(void);
+
+/* Control flow graph analysis, in cfg.c */
+
+// Fills in the predecessors, reverse postorder and immediate dominator of every block.
+// Must be called again after the control flow of the function changes.
+// Branches with the same block as both targets are turned into jumps,
+// so that there is never more than one edge between two blocks
+void ir_compute_cfg(ir_function_t* function);
+
+// Returns true if every path from the entry to block b goes through block a.
+// Every block dominates itself
+bool ir_dominates(ir_block_t* a, ir_block_t* b);
+
+// Returns the position of the predecessor in the block's list of predecessors, or -1
+int64_t ir_predecessor_index(ir_block_t* block, ir_block_t* predecessor);
+
+/* Profiles, in profile.c */
+
+// The file a program built with -fprofile-generate writes its profile to when main returns
+#define PROFILE_FILENAME "vslc.profile"
+
+// With -fprofile-generate, the text of the line written to the profile for every counter,
+// as a printf format string taking the count
+extern _Thread_local char** profile_counter_formats;
+extern _Thread_local size_t n_profile_counters;
+
+// Adds an IR_COUNT to every block of every function, which must be freshly built.
+// Each counter is named by the function and the label of its block
+void ir_instrument_functions(void);
+
+// Reads the profile written by a program built with -fprofile-generate, and sets the
+// profile_count of the blocks of every freshly built function. Exits if the file can not be read
+void ir_apply_profile(const char* filename);
+
+// Returns true if the function has any blocks with a known profile_count
+bool ir_has_profile(ir_function_t* function);
+
+/* Liveness analysis, in liveness.c */
+
+// A set of vregs, stored as one bit per vreg
+typedef uint64_t* bitset_t;
+#define BITSET_WORDS(n) (((n) + 63) / 64)
+#define BITSET_TEST(set, i) (((set)[(i) / 64] >> ((i) % 64)) & 1)
+#define BITSET_SET(set, i) ((set)[(i) / 64] |= (uint64_t)1 << ((i) % 64))
+
+// Which vregs are live at the start and end of every block.
+// Only vregs that are used in several blocks, or used before being defined in a block,
+// take part in the data flow analysis, and are given a dense numbering in global_index.
+// All other vregs are local to a single block, and are never live at its start or end
+typedef struct
+{
+  int64_t* global_index; // The position of every vreg in the sets, or -1 if it is block local
+  size_t n_globals;
+  bitset_t* live_in;  // Indexed by block id
+  bitset_t* live_out; // Indexed by block id
+  uint64_t* storage;  // Owns the bits of all the sets
+} ir_liveness_t;
+
+// Solves the data flow equations for which vregs are live at the start and end of every block.
+// The function must have no phis, as their arguments are not used at the end of the predecessors
+ir_liveness_t ir_compute_liveness(ir_function_t* function);
+
+// Frees the memory used by the liveness sets
+void ir_destroy_liveness(ir_liveness_t* liveness);
+
+/* SSA form, in ssa.c */
+
+// Turns the function into SSA form, by placing phis at the dominance frontiers of variable
+// definitions, and giving every definition its own vreg. Needs the CFG
+void ir_construct_ssa(ir_function_t* function);
+
+// Replaces all phis by moves at the end of the predecessors, splitting critical edges as needed.
+// Leaves the function out of SSA form
+void ir_destruct_ssa(ir_function_t* function);
+
+#endif // IR_H
@@ -0,0 +1,317 @@
+// A hand-written scanner, recognizing the same tokens as scanner.l.
+// It provides the same functions as the reentrant flex scanner, so the parser can use either.
+// Enable it instead of flex by invoking:
+// cmake -B build -DUSE_HANDWRITTEN_LEXER=ON
+
+#include "vslc.h"
+
+// The tokens defined in parser.y
+#include "parser.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The state of one scanner. The whole input is kept in one buffer, ending with two zero bytes
+typedef struct
+{
+  char* text;       // The input, either given to yy_scan_buffer() or read from input
+  char* end;        // Points at the first zero byte after the input
+  char* position;   // Where the next token starts to be searched for
+  bool owns_text;   // Set if the text was read from input, and must be freed
+  FILE* input;      // The file to read all of the text from, before the first token
+  int lineno;       // The line currently being read
+  char* token;      // The text of the last token, terminated by a zero byte
+  char token_end;   // The character the zero byte after the token replaced
+} lexer_t;
+
+// Every character belongs to a class, which decides what kind of token it starts or continues
+typedef enum
+{
+  CLASS_OTHER, // A token of its own
+  CLASS_WHITESPACE,
+  CLASS_NEWLINE,
+  CLASS_DIGIT,
+  CLASS_LETTER, // Letters and _, which start identifiers
+  CLASS_SLASH,
+  CLASS_QUOTE,
+} char_class_t;
+
+#define CLASSES_OF_DIGITS                                                                    \
+  ['0'] = CLASS_DIGIT, ['1'] = CLASS_DIGIT, ['2'] = CLASS_DIGIT, ['3'] = CLASS_DIGIT,       \
+  ['4'] = CLASS_DIGIT, ['5'] = CLASS_DIGIT, ['6'] = CLASS_DIGIT, ['7'] = CLASS_DIGIT,       \
+  ['8'] = CLASS_DIGIT, ['9'] = CLASS_DIGIT
+
+#define CLASSES_OF_LETTERS(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p, q, r, s, t, u, v, w, \
+                           x, y, z)                                                        \
+  [a] = CLASS_LETTER, [b] = CLASS_LETTER, [c] = CLASS_LETTER, [d] = CLASS_LETTER,           \
+  [e] = CLASS_LETTER, [f] = CLASS_LETTER, [g] = CLASS_LETTER, [h] = CLASS_LETTER,           \
+  [i] = CLASS_LETTER, [j] = CLASS_LETTER, [k] = CLASS_LETTER, [l] = CLASS_LETTER,           \
+  [m] = CLASS_LETTER, [n] = CLASS_LETTER, [o] = CLASS_LETTER, [p] = CLASS_LETTER,           \
+  [q] = CLASS_LETTER, [r] = CLASS_LETTER, [s] = CLASS_LETTER, [t] = CLASS_LETTER,           \
+  [u] = CLASS_LETTER, [v] = CLASS_LETTER, [w] = CLASS_LETTER, [x] = CLASS_LETTER,           \
+  [y] = CLASS_LETTER, [z] = CLASS_LETTER
+
+static const uint8_t CHAR_CLASSES[256] = {
+    [' '] = CLASS_WHITESPACE,
+    ['\t'] = CLASS_WHITESPACE,
+    ['\v'] = CLASS_WHITESPACE,
+    ['\r'] = CLASS_WHITESPACE,
+    ['\n'] = CLASS_NEWLINE,
+    ['/'] = CLASS_SLASH,
+    ['"'] = CLASS_QUOTE,
+    ['_'] = CLASS_LETTER,
+    CLASSES_OF_DIGITS,
+    CLASSES_OF_LETTERS('a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o',
+                       'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z'),
+    CLASSES_OF_LETTERS('A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O',
+                       'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z'),
+};
+
+static char_class_t char_class(char c)
+{
+  return CHAR_CLASSES[(unsigned char)c];
+}
+
+static bool continues_identifier(char c)
+{
+  return char_class(c) == CLASS_LETTER || char_class(c) == CLASS_DIGIT;
+}
+
+// The keywords, placed by a perfect hash: the sum of the first and last character, modulo 16.
+// No two keywords get the same bucket, so an identifier is compared against at most one keyword
+#define KEYWORD_HASH(first, last) (((unsigned char)(first) + (unsigned char)(last)) & 15)
+
+static const struct
+{
+  const char* text;
+  size_t length;
+  int token;
+} KEYWORDS[16] = {
+    [KEYWORD_HASH('f', 'c')] = {"func", 4, FUNC},
+    [KEYWORD_HASH('p', 't')] = {"print", 5, PRINT},
+    [KEYWORD_HASH('r', 'n')] = {"return", 6, RETURN},
+    [KEYWORD_HASH('b', 'k')] = {"break", 5, BREAK},
+    [KEYWORD_HASH('i', 'f')] = {"if", 2, IF},
+    [KEYWORD_HASH('t', 'n')] = {"then", 4, THEN},
+    [KEYWORD_HASH('e', 'e')] = {"else", 4, ELSE},
+    [KEYWORD_HASH('w', 'e')] = {"while", 5, WHILE},
+    [KEYWORD_HASH('d', 'o')] = {"do", 2, DO},
+    [KEYWORD_HASH('v', 'r')] = {"var", 3, VAR},
+};
+
+// Returns the token of the identifier, which is a keyword token if it is one
+static int identifier_token(const char* text, size_t length)
+{
+  size_t bucket = KEYWORD_HASH(text[0], text[length - 1]);
+  if (KEYWORDS[bucket].length == length && memcmp(KEYWORDS[bucket].text, text, length) == 0)
+    return KEYWORDS[bucket].token;
+  return IDENTIFIER_TOKEN;
+}
+
+// Skips whitespace, counting the newlines, and returns the first character that is not whitespace.
+// With SSE2, 16 characters are checked at once, for as long as they are all before the end
+static char* skip_whitespace(lexer_t* lexer, char* position)
+{
+#ifdef __SSE2__
+  while (lexer->end - position >= 16)
+  {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)position);
+    __m128i newlines = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n'));
+    __m128i whitespace = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')),
+                     _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t'))),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\v')),
+                     _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r'))));
+    whitespace = _mm_or_si128(whitespace, newlines);
+
+    unsigned whitespace_mask = _mm_movemask_epi8(whitespace);
+    unsigned newline_mask = _mm_movemask_epi8(newlines);
+    if (whitespace_mask != 0xffff)
+    {
+      // Only the whitespace before the first other character is skipped
+      unsigned skipped = __builtin_ctz(~whitespace_mask);
+      lexer->lineno += __builtin_popcount(newline_mask & ((1u << skipped) - 1));
+      return position + skipped;
+    }
+    lexer->lineno += __builtin_popcount(newline_mask);
+    position += 16;
+  }
+#endif
+
+  while (true)
+  {
+    char_class_t class = char_class(*position);
+    if (class == CLASS_NEWLINE)
+      lexer->lineno++;
+    else if (class != CLASS_WHITESPACE)
+      return position;
+    position++;
+  }
+}
+
+// A comment is // followed by at least one character, and goes until the end of the line.
+// It is skipped up to the newline, which memchr() finds using vector instructions
+static bool starts_comment(lexer_t* lexer, char* position)
+{
+  return position[0] == '/' && position[1] == '/' && position + 2 < lexer->end &&
+         position[2] != '\n';
+}
+
+static char* skip_comment(lexer_t* lexer, char* position)
+{
+  char* newline = memchr(position, '\n', lexer->end - position);
+  return newline != NULL ? newline : lexer->end;
+}
+
+// Returns the end of the string literal starting at the quote, or NULL if it has none.
+// The content is any characters but quotes and newlines, or \", and the longest match is used
+static char* string_literal_end(lexer_t* lexer, char* quote)
+{
+  char* end = NULL;
+  for (char* c = quote + 1; c < lexer->end && *c != '\n'; c++)
+  {
+    if (*c != '"')
+      continue;
+
+    end = c + 1;
+    // A quote only belongs to the content when escaped by a backslash in the content
+    if (c[-1] != '\\' || c - 1 == quote)
+      break;
+  }
+  return end;
+}
+
+// Reads all of the input into a buffer of its own, followed by two zero bytes
+static void read_input(lexer_t* lexer)
+{
+  size_t length = 0;
+  size_t capacity = 1 << 16;
+  char* text = malloc(capacity);
+  while (true)
+  {
+    length += fread(&text[length], 1, capacity - length - 2, lexer->input);
+    if (length + 2 < capacity)
+      break;
+    capacity *= 2;
+    text = realloc(text, capacity);
+  }
+  text[length] = text[length + 1] = '\0';
+
+  lexer->text = lexer->position = text;
+  lexer->end = &text[length];
+  lexer->owns_text = true;
+}
+
+int yylex(YYSTYPE* lvalp, yyscan_t scanner)
+{
+  (void)lvalp; // Tokens carry no values, the parser gets their text from yyget_text()
+  lexer_t* lexer = scanner;
+  if (lexer->text == NULL)
+    read_input(lexer);
+
+  // Put back the character that was replaced to end the last token
+  if (lexer->token != NULL)
+    *lexer->position = lexer->token_end;
+
+  char* position = lexer->position;
+  while (true)
+  {
+    position = skip_whitespace(lexer, position);
+    if (!starts_comment(lexer, position))
+      break;
+    position = skip_comment(lexer, position);
+  }
+
+  if (position >= lexer->end)
+  {
+    lexer->position = position;
+    lexer->token = NULL;
+    return 0;
+  }
+
+  // Unknown chars get returned as single char tokens, like in scanner.l
+  char* end = position + 1;
+  int token = *position;
+  switch (char_class(*position))
+  {
+  case CLASS_DIGIT:
+    while (char_class(*end) == CLASS_DIGIT)
+      end++;
+    token = NUMBER_TOKEN;
+    break;
+  case CLASS_LETTER:
+    while (continues_identifier(*end))
+      end++;
+    token = identifier_token(position, end - position);
+    break;
+  case CLASS_QUOTE:
+  {
+    char* literal_end = string_literal_end(lexer, position);
+    if (literal_end != NULL)
+    {
+      end = literal_end;
+      token = STRING_TOKEN;
+    }
+    break;
+  }
+  default:
+    break;
+  }
+
+  // The token is ended by a zero byte, written over the character after it until the next call
+  lexer->token = position;
+  lexer->token_end = *end;
+  *end = '\0';
+  lexer->position = end;
+  return token;
+}
+
+int yylex_init(yyscan_t* scanner)
+{
+  lexer_t* lexer = malloc(sizeof(lexer_t));
+  *lexer = (lexer_t){.input = stdin, .lineno = 1};
+  *scanner = lexer;
+  return 0;
+}
+
+void yyset_in(FILE* input, yyscan_t scanner)
+{
+  lexer_t* lexer = scanner;
+  lexer->input = input;
+}
+
+// The buffer must end with two zero bytes, which are not part of the input.
+// The scanner has only one buffer, so it stands in for the buffer state flex would return
+struct yy_buffer_state* yy_scan_buffer(char* base, size_t size, yyscan_t scanner)
+{
+  lexer_t* lexer = scanner;
+  if (size < 2 || base[size - 2] != '\0' || base[size - 1] != '\0')
+    return NULL;
+
+  lexer->text = lexer->position = base;
+  lexer->end = &base[size - 2];
+  lexer->owns_text = false;
+  return (struct yy_buffer_state*)lexer;
+}
+
+char* yyget_text(yyscan_t scanner)
+{
+  lexer_t* lexer = scanner;
+  return lexer->token;
+}
+
+int yyget_lineno(yyscan_t scanner)
+{
+  lexer_t* lexer = scanner;
+  return lexer->lineno;
+}
+
+int yylex_destroy(yyscan_t scanner)
+{
+  lexer_t* lexer = scanner;
+  if (lexer->owns_text)
+    free(lexer->text);
+  free(lexer);
+  return 0;
+}
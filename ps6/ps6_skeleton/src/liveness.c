@@ -0,0 +1,124 @@
+#include "vslc.h"
+
+ir_liveness_t ir_compute_liveness(ir_function_t* function)
+{
+  size_t n_vregs = function->n_vregs;
+  size_t n_blocks = function->n_blocks;
+
+  // First find which vregs are global, and give them a dense numbering
+  int64_t* seen_in_block = malloc(n_vregs * sizeof(int64_t));
+  int64_t* defined_in_block = malloc(n_vregs * sizeof(int64_t));
+  int64_t* global_index = malloc((n_vregs + 1) * sizeof(int64_t));
+  for (size_t v = 0; v < n_vregs; v++)
+    seen_in_block[v] = defined_in_block[v] = global_index[v] = -1;
+
+  size_t n_globals = 0;
+  for (size_t b = 0; b < n_blocks; b++)
+  {
+    ir_block_t* block = function->blocks[b];
+    for (size_t i = 0; i < block->n_instructions; i++)
+    {
+      ir_instruction_t* instruction = &block->instructions[i];
+      for (size_t s = 0; s < ir_source_count(instruction); s++)
+      {
+        ir_operand_t* operand = ir_source(instruction, s);
+        if (operand->kind != IR_OPERAND_VREG)
+          continue;
+        size_t v = operand->value;
+        bool upward_exposed = defined_in_block[v] != (int64_t)b;
+        bool in_other_block = seen_in_block[v] != -1 && seen_in_block[v] != (int64_t)b;
+        if ((upward_exposed || in_other_block) && global_index[v] == -1)
+          global_index[v] = n_globals++;
+        seen_in_block[v] = b;
+      }
+      int64_t def = ir_defined_vreg(instruction);
+      if (def >= 0)
+      {
+        if (seen_in_block[def] != -1 && seen_in_block[def] != (int64_t)b &&
+            global_index[def] == -1)
+          global_index[def] = n_globals++;
+        seen_in_block[def] = b;
+        defined_in_block[def] = b;
+      }
+    }
+  }
+  free(defined_in_block);
+  free(seen_in_block);
+
+  // Calculate the sets of upward exposed uses (gen) and definitions (kill) of every block
+  size_t words = BITSET_WORDS(n_globals);
+  ir_liveness_t result = {
+      .global_index = global_index,
+      .n_globals = n_globals,
+      .live_in = malloc((n_blocks + 1) * sizeof(bitset_t)),
+      .live_out = malloc((n_blocks + 1) * sizeof(bitset_t)),
+      .storage = calloc(4 * n_blocks * words + 1, sizeof(uint64_t)),
+  };
+  bitset_t* gen = malloc((n_blocks + 1) * sizeof(bitset_t));
+  bitset_t* kill = malloc((n_blocks + 1) * sizeof(bitset_t));
+  bitset_t* live_in = result.live_in;
+  bitset_t* live_out = result.live_out;
+  for (size_t b = 0; b < n_blocks; b++)
+  {
+    gen[b] = result.storage + (4 * b + 0) * words;
+    kill[b] = result.storage + (4 * b + 1) * words;
+    live_in[b] = result.storage + (4 * b + 2) * words;
+    live_out[b] = result.storage + (4 * b + 3) * words;
+
+    ir_block_t* block = function->blocks[b];
+    for (size_t i = 0; i < block->n_instructions; i++)
+    {
+      ir_instruction_t* instruction = &block->instructions[i];
+      for (size_t s = 0; s < ir_source_count(instruction); s++)
+      {
+        ir_operand_t* operand = ir_source(instruction, s);
+        if (operand->kind != IR_OPERAND_VREG || global_index[operand->value] == -1)
+          continue;
+        size_t g = global_index[operand->value];
+        if (!BITSET_TEST(kill[b], g))
+          BITSET_SET(gen[b], g);
+      }
+      int64_t def = ir_defined_vreg(instruction);
+      if (def >= 0 && global_index[def] != -1)
+        BITSET_SET(kill[b], global_index[def]);
+    }
+  }
+
+  // Iterate the data flow equations until nothing changes:
+  //   live_out(b) = union of live_in(s) for all successors s
+  //   live_in(b) = gen(b) + (live_out(b) - kill(b))
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (size_t b = n_blocks; b > 0; b--)
+    {
+      ir_block_t* block = function->blocks[b - 1];
+      ir_block_t* successors[2];
+      size_t n_successors = ir_block_successors(block, successors);
+      for (size_t w = 0; w < words; w++)
+      {
+        uint64_t out = 0;
+        for (size_t s = 0; s < n_successors; s++)
+          out |= live_in[successors[s]->id][w];
+        uint64_t in = gen[b - 1][w] | (out & ~kill[b - 1][w]);
+        if (out != live_out[b - 1][w] || in != live_in[b - 1][w])
+          changed = true;
+        live_out[b - 1][w] = out;
+        live_in[b - 1][w] = in;
+      }
+    }
+  }
+
+  free(gen);
+  free(kill);
+  return result;
+}
+
+void ir_destroy_liveness(ir_liveness_t* liveness)
+{
+  free(liveness->global_index);
+  free(liveness->live_in);
+  free(liveness->live_out);
+  free(liveness->storage);
+}
@@ -0,0 +1,2443 @@
+#include "vslc.h"
+
+static void optimize_function(ir_function_t* function);
+
+// Runs the optimization passes on every function. Functions found in the cache by -C are not
+// generated, so they are not optimized either
+void optimize_ir(void)
+{
+  if (feature_inline)
+    ir_inline_functions();
+
+  for (size_t i = 0; i < ir_functions_len; i++)
+    if (!is_function_cached(ir_functions[i]->symbol))
+      optimize_function(ir_functions[i]);
+
+  if (!feature_bounds_check)
+    return;
+  for (size_t i = 0; i < ir_functions_len; i++)
+  {
+    if (is_function_cached(ir_functions[i]->symbol))
+      continue;
+    for (size_t b = 0; b < ir_functions[i]->n_blocks; b++)
+    {
+      ir_block_t* block = ir_functions[i]->blocks[b];
+      for (size_t j = 0; j < block->n_instructions; j++)
+        if (block->instructions[j].opcode == IR_CHECK_BOUNDS)
+          bounds_checks_left++;
+    }
+  }
+}
+
+void optimize_ir_function(ir_function_t* function)
+{
+  optimize_function(function);
+}
+
+/* Constant and copy propagation */
+
+// Calculates dst = a op b for the given arithmetic, comparison or unary opcode.
+// Returns false if the result can not be known at compile time, such as when dividing by 0.
+// Arithmetic wraps around on overflow, just like it does at runtime
+static bool evaluate_operator(ir_opcode_t opcode, int64_t a, int64_t b, int64_t* result)
+{
+  switch (opcode)
+  {
+  case IR_ADD:
+    *result = (int64_t)((uint64_t)a + (uint64_t)b);
+    return true;
+  case IR_SUB:
+    *result = (int64_t)((uint64_t)a - (uint64_t)b);
+    return true;
+  case IR_MUL:
+    *result = (int64_t)((uint64_t)a * (uint64_t)b);
+    return true;
+  case IR_DIV:
+    if (b == 0 || (a == INT64_MIN && b == -1))
+      return false;
+    *result = a / b;
+    return true;
+  case IR_SHL:
+    *result = (int64_t)((uint64_t)a << (b & 63));
+    return true;
+  case IR_SAR:
+    *result = a >> (b & 63);
+    return true;
+  case IR_SHR:
+    *result = (int64_t)((uint64_t)a >> (b & 63));
+    return true;
+  case IR_MULHI:
+    *result = (int64_t)(((__int128)a * b) >> 64);
+    return true;
+  case IR_EQ:
+    *result = a == b;
+    return true;
+  case IR_NE:
+    *result = a != b;
+    return true;
+  case IR_LT:
+    *result = a < b;
+    return true;
+  case IR_LE:
+    *result = a <= b;
+    return true;
+  case IR_GT:
+    *result = a > b;
+    return true;
+  case IR_GE:
+    *result = a >= b;
+    return true;
+  case IR_NEG:
+    *result = (int64_t)(0 - (uint64_t)a);
+    return true;
+  case IR_NOT:
+    *result = !a;
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Returns true if the opcode computes its result only from its operands
+static bool is_operator(ir_opcode_t opcode)
+{
+  return (opcode >= IR_ADD && opcode <= IR_GE) || opcode == IR_NEG || opcode == IR_NOT;
+}
+
+static bool same_operand(ir_operand_t a, ir_operand_t b)
+{
+  return a.kind == b.kind && a.value == b.value;
+}
+
+// Follows the chain of replacements of the operand, until reaching a value that is not replaced
+static ir_operand_t resolve(ir_operand_t* replacements, ir_operand_t operand)
+{
+  while (operand.kind == IR_OPERAND_VREG && replacements[operand.value].kind != IR_OPERAND_NONE)
+    operand = replacements[operand.value];
+  return operand;
+}
+
+// If all arguments of the phi are the same value, ignoring the phi's own dst, returns it.
+// Otherwise returns IR_NONE
+static ir_operand_t phi_unique_value(ir_instruction_t* phi)
+{
+  ir_operand_t value = IR_NONE;
+  for (size_t i = 0; i < phi->n_args; i++)
+  {
+    ir_operand_t arg = phi->args[i];
+    if (same_operand(arg, phi->dst))
+      continue;
+    if (value.kind != IR_OPERAND_NONE && !same_operand(arg, value))
+      return IR_NONE;
+    value = arg;
+  }
+  return value;
+}
+
+// Returns the value of the instruction if an algebraic rule makes it known without
+// doing the operation, such as x + 0 = x, x * 0 = 0 or x - x = 0. Otherwise returns IR_NONE.
+// Vregs never have side effects, so operands can be dropped freely
+static ir_operand_t algebraic_identity(ir_instruction_t* instruction)
+{
+  ir_operand_t a = instruction->a;
+  ir_operand_t b = instruction->b;
+  bool a_constant = a.kind == IR_OPERAND_CONST;
+  bool b_constant = b.kind == IR_OPERAND_CONST;
+
+  switch (instruction->opcode)
+  {
+  case IR_ADD:
+    if (b_constant && b.value == 0)
+      return a;
+    if (a_constant && a.value == 0)
+      return b;
+    break;
+  case IR_SUB:
+    if (b_constant && b.value == 0)
+      return a;
+    if (same_operand(a, b))
+      return IR_CONST(0);
+    break;
+  case IR_MUL:
+    if ((b_constant && b.value == 0) || (a_constant && a.value == 0))
+      return IR_CONST(0);
+    if (b_constant && b.value == 1)
+      return a;
+    if (a_constant && a.value == 1)
+      return b;
+    break;
+  case IR_DIV:
+    if (b_constant && b.value == 1)
+      return a;
+    break;
+  case IR_SHL:
+  case IR_SAR:
+  case IR_SHR:
+    if (b_constant && b.value == 0)
+      return a;
+    break;
+  case IR_EQ:
+  case IR_LE:
+  case IR_GE:
+    if (same_operand(a, b))
+      return IR_CONST(1);
+    break;
+  case IR_NE:
+  case IR_LT:
+  case IR_GT:
+    if (same_operand(a, b))
+      return IR_CONST(0);
+    break;
+  default:
+    break;
+  }
+  return IR_NONE;
+}
+
+// Removes the phi entries of the block that come from the given predecessor
+static void remove_phi_entries(ir_block_t* block, ir_block_t* predecessor)
+{
+  for (size_t i = 0; i < block->n_instructions && block->instructions[i].opcode == IR_PHI; i++)
+  {
+    ir_instruction_t* phi = &block->instructions[i];
+    size_t n_args = 0;
+    for (size_t j = 0; j < phi->n_args; j++)
+    {
+      if (phi->incoming[j] == predecessor)
+        continue;
+      phi->args[n_args] = phi->args[j];
+      phi->incoming[n_args] = phi->incoming[j];
+      n_args++;
+    }
+    phi->n_args = n_args;
+  }
+}
+
+// Propagates constants and copies through the function, which must be in SSA form.
+// Moves, phis that always give the same value, and operators with only constant operands
+// are removed, and all uses of their result are replaced by the value itself.
+// Branches on constant conditions become jumps, which can make parts of the function unreachable.
+// Returns true if anything changed
+static bool propagate_constants_and_copies(ir_function_t* function)
+{
+  ir_operand_t* replacements = malloc(function->n_vregs * sizeof(ir_operand_t));
+  for (size_t i = 0; i < function->n_vregs; i++)
+    replacements[i] = IR_NONE;
+
+  bool changed_any = false;
+  bool changed = true;
+  bool removed_edges = false;
+  while (changed)
+  {
+    changed = false;
+    for (size_t b = 0; b < function->n_blocks; b++)
+    {
+      ir_block_t* block = function->blocks[b];
+      size_t n_kept = 0;
+      for (size_t i = 0; i < block->n_instructions; i++)
+      {
+        ir_instruction_t* instruction = &block->instructions[i];
+
+        for (size_t s = 0; s < ir_source_count(instruction); s++)
+        {
+          ir_operand_t* operand = ir_source(instruction, s);
+          ir_operand_t resolved = resolve(replacements, *operand);
+          if (!same_operand(resolved, *operand))
+          {
+            *operand = resolved;
+            changed = true;
+          }
+        }
+
+        // Find out if the instruction's value is known without executing it
+        ir_operand_t replacement = IR_NONE;
+        int64_t result;
+        if (instruction->opcode == IR_MOVE)
+          replacement = instruction->a;
+        else if (instruction->opcode == IR_PHI)
+          replacement = phi_unique_value(instruction);
+        else if (is_operator(instruction->opcode) && instruction->a.kind == IR_OPERAND_CONST &&
+                 instruction->b.kind != IR_OPERAND_VREG &&
+                 evaluate_operator(instruction->opcode,
+                                   instruction->a.value,
+                                   instruction->b.value,
+                                   &result))
+          replacement = IR_CONST(result);
+        else if (is_operator(instruction->opcode))
+          replacement = algebraic_identity(instruction);
+
+        if (replacement.kind != IR_OPERAND_NONE)
+        {
+          replacements[instruction->dst.value] = replacement;
+          ir_destroy_instruction(instruction);
+          changed = true;
+          continue;
+        }
+
+        // A branch with a known outcome becomes a jump, and the other target loses a predecessor
+        if (instruction->opcode == IR_BRANCH && instruction->a.kind == IR_OPERAND_CONST &&
+            instruction->b.kind == IR_OPERAND_CONST)
+        {
+          evaluate_operator(
+              instruction->condition, instruction->a.value, instruction->b.value, &result);
+          ir_block_t* taken = instruction->targets[result ? 0 : 1];
+          ir_block_t* not_taken = instruction->targets[result ? 1 : 0];
+          if (taken != not_taken)
+            remove_phi_entries(not_taken, block);
+          *instruction = (ir_instruction_t){.opcode = IR_JUMP, .targets = {taken}};
+          removed_edges = true;
+          changed = true;
+        }
+
+        block->instructions[n_kept++] = *instruction;
+      }
+      block->n_instructions = n_kept;
+    }
+    changed_any |= changed;
+  }
+
+  if (removed_edges)
+  {
+    ir_remove_unreachable_blocks(function);
+    ir_compute_cfg(function);
+  }
+
+  free(replacements);
+  return changed_any;
+}
+
+/* Branch simplification */
+
+// Makes branches test comparisons directly, when the condition is computed by a comparison or
+// a logical not in the same function:
+//   %1 = lt %a, %b                 branch lt %a, %b ? then : else
+//   branch ne %1, 0 ? then : else
+// The function must be in SSA form, so that %a and %b still hold the same values at the branch.
+// The comparison itself is left for dead code elimination. Returns true if anything changed
+static bool fold_branch_conditions(ir_function_t* function)
+{
+  ir_instruction_t** definitions = calloc(function->n_vregs, sizeof(ir_instruction_t*));
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* block = function->blocks[b];
+    for (size_t i = 0; i < block->n_instructions; i++)
+    {
+      int64_t def = ir_defined_vreg(&block->instructions[i]);
+      if (def >= 0)
+        definitions[def] = &block->instructions[i];
+    }
+  }
+
+  bool changed = false;
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_instruction_t* branch = ir_block_terminator(function->blocks[b]);
+    while (branch->opcode == IR_BRANCH &&
+           (branch->condition == IR_NE || branch->condition == IR_EQ) &&
+           branch->a.kind == IR_OPERAND_VREG && branch->b.kind == IR_OPERAND_CONST &&
+           branch->b.value == 0 && definitions[branch->a.value] != NULL)
+    {
+      ir_instruction_t* definition = definitions[branch->a.value];
+      bool negate = branch->condition == IR_EQ;
+      if (ir_is_comparison(definition->opcode))
+      {
+        branch->condition = negate ? ir_inverse_condition(definition->opcode) : definition->opcode;
+        branch->a = definition->a;
+        branch->b = definition->b;
+      }
+      else if (definition->opcode == IR_NOT)
+      {
+        branch->condition = negate ? IR_NE : IR_EQ;
+        branch->a = definition->a;
+      }
+      else
+        break;
+      changed = true;
+    }
+  }
+
+  free(definitions);
+  return changed;
+}
+
+/* Sparse conditional constant propagation */
+
+// What is known about the value of a vreg. Values only ever move down, from unknown to
+// constant to varying, so the propagation always ends
+typedef enum
+{
+  VALUE_UNKNOWN, // Not yet known to be assigned at all
+  VALUE_CONSTANT,
+  VALUE_VARYING,
+} value_state_t;
+
+typedef struct
+{
+  value_state_t state;
+  int64_t constant;
+} lattice_value_t;
+
+static lattice_value_t operand_value(lattice_value_t* values, ir_operand_t operand)
+{
+  if (operand.kind == IR_OPERAND_VREG)
+    return values[operand.value];
+  if (operand.kind == IR_OPERAND_CONST)
+    return (lattice_value_t){VALUE_CONSTANT, operand.value};
+  // Unary operators have no b operand, and ignore it
+  return (lattice_value_t){VALUE_CONSTANT, 0};
+}
+
+// Lowers the value to also cover the new value. Returns true if it changed
+static bool lower_value(lattice_value_t* value, lattice_value_t new_value)
+{
+  if (value->state == VALUE_VARYING || new_value.state == VALUE_UNKNOWN)
+    return false;
+  if (value->state == VALUE_CONSTANT && new_value.state == VALUE_CONSTANT &&
+      value->constant == new_value.constant)
+    return false;
+  if (value->state == VALUE_UNKNOWN)
+    *value = new_value;
+  else
+    value->state = VALUE_VARYING;
+  return true;
+}
+
+// Calculates a op b from what is known about the operands
+static lattice_value_t evaluate_lattice(ir_opcode_t opcode, lattice_value_t a, lattice_value_t b)
+{
+  int64_t result;
+  if (a.state == VALUE_VARYING || b.state == VALUE_VARYING)
+    return (lattice_value_t){VALUE_VARYING, 0};
+  if (a.state == VALUE_UNKNOWN || b.state == VALUE_UNKNOWN)
+    return (lattice_value_t){VALUE_UNKNOWN, 0};
+  if (!evaluate_operator(opcode, a.constant, b.constant, &result))
+    return (lattice_value_t){VALUE_VARYING, 0};
+  return (lattice_value_t){VALUE_CONSTANT, result};
+}
+
+// The edges of the CFG are numbered 2 * block id + target index
+static bool is_edge_executable(bool* executable_edges, ir_block_t* from, ir_block_t* to)
+{
+  ir_instruction_t* terminator = ir_block_terminator(from);
+  for (size_t i = 0; i < 2; i++)
+    if (terminator->targets[i] == to && executable_edges[from->id * 2 + i])
+      return true;
+  return false;
+}
+
+// Marks the edge, and the block it goes to, as executed. Returns true if it was not before
+static bool mark_edge_executable(
+    bool* executable_edges, bool* executable_blocks, ir_block_t* from, size_t target)
+{
+  if (executable_edges[from->id * 2 + target])
+    return false;
+  executable_edges[from->id * 2 + target] = true;
+  executable_blocks[ir_block_terminator(from)->targets[target]->id] = true;
+  return true;
+}
+
+// Finds the vregs that always hold the same constant, and the branches that always go the same
+// way, by the algorithm of Wegman and Zadeck. The function must be in SSA form.
+// Unlike propagate_constants_and_copies(), which only knows a value once all the values it is
+// computed from are known, every vreg starts out unknown, and only blocks found to be reachable
+// are looked at. Phis then only see the values coming from edges that can be taken, which finds
+// flag variables that are constant throughout a loop, where the if below is removed:
+//   debug := 0
+//   while i < n do
+//     if debug then debug := 1
+//     i := i + 1
+// The uses of constant vregs get the constant, branches that only go one way become jumps, and
+// the blocks that are never reached are removed. Returns true if anything changed
+static bool propagate_conditional_constants(ir_function_t* function)
+{
+  lattice_value_t* values = calloc(function->n_vregs, sizeof(lattice_value_t));
+  bool* executable_blocks = calloc(function->n_blocks, sizeof(bool));
+  bool* executable_edges = calloc(function->n_blocks * 2, sizeof(bool));
+
+  // Vregs that are never defined, such as the parameters, can hold anything
+  bool* defined = calloc(function->n_vregs, sizeof(bool));
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* block = function->blocks[b];
+    for (size_t i = 0; i < block->n_instructions; i++)
+    {
+      int64_t def = ir_defined_vreg(&block->instructions[i]);
+      if (def >= 0)
+        defined[def] = true;
+    }
+  }
+  for (size_t i = 0; i < function->n_vregs; i++)
+    if (!defined[i])
+      values[i].state = VALUE_VARYING;
+  free(defined);
+
+  executable_blocks[0] = true;
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (size_t b = 0; b < function->n_blocks; b++)
+    {
+      ir_block_t* block = function->blocks[b];
+      if (!executable_blocks[b])
+        continue;
+
+      for (size_t i = 0; i + 1 < block->n_instructions; i++)
+      {
+        ir_instruction_t* instruction = &block->instructions[i];
+        int64_t def = ir_defined_vreg(instruction);
+        if (def < 0)
+          continue;
+
+        lattice_value_t value = {VALUE_VARYING, 0};
+        if (instruction->opcode == IR_PHI)
+        {
+          value.state = VALUE_UNKNOWN;
+          for (size_t j = 0; j < instruction->n_args; j++)
+            if (is_edge_executable(executable_edges, instruction->incoming[j], block))
+              lower_value(&value, operand_value(values, instruction->args[j]));
+        }
+        else if (instruction->opcode == IR_MOVE)
+          value = operand_value(values, instruction->a);
+        else if (is_operator(instruction->opcode))
+          value = evaluate_lattice(instruction->opcode,
+                                   operand_value(values, instruction->a),
+                                   operand_value(values, instruction->b));
+        changed |= lower_value(&values[def], value);
+      }
+
+      ir_instruction_t* terminator = ir_block_terminator(block);
+      if (terminator->opcode == IR_JUMP)
+        changed |= mark_edge_executable(executable_edges, executable_blocks, block, 0);
+      else if (terminator->opcode == IR_BRANCH)
+      {
+        lattice_value_t taken = evaluate_lattice(terminator->condition,
+                                                 operand_value(values, terminator->a),
+                                                 operand_value(values, terminator->b));
+        for (size_t t = 0; t < 2; t++)
+          if (taken.state == VALUE_VARYING ||
+              (taken.state == VALUE_CONSTANT && (taken.constant != 0) == (t == 0)))
+            changed |= mark_edge_executable(executable_edges, executable_blocks, block, t);
+      }
+    }
+
+    // A branch on a value that is still unknown can only be reached by using a vreg that is
+    // never assigned. Either way may then be taken, so both are kept
+    for (size_t b = 0; b < function->n_blocks && !changed; b++)
+    {
+      ir_block_t* block = function->blocks[b];
+      if (executable_blocks[b] && ir_block_terminator(block)->opcode == IR_BRANCH &&
+          !executable_edges[b * 2] && !executable_edges[b * 2 + 1])
+      {
+        mark_edge_executable(executable_edges, executable_blocks, block, 0);
+        mark_edge_executable(executable_edges, executable_blocks, block, 1);
+        changed = true;
+      }
+    }
+  }
+
+  bool changed_any = false;
+  bool removed_edges = false;
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* block = function->blocks[b];
+    if (!executable_blocks[b])
+      continue;
+
+    size_t n_kept = 0;
+    for (size_t i = 0; i < block->n_instructions; i++)
+    {
+      ir_instruction_t* instruction = &block->instructions[i];
+      int64_t def = ir_defined_vreg(instruction);
+      if (def >= 0 && values[def].state == VALUE_CONSTANT &&
+          (instruction->opcode == IR_PHI || instruction->opcode == IR_MOVE ||
+           is_operator(instruction->opcode)))
+      {
+        ir_destroy_instruction(instruction);
+        changed_any = true;
+        continue;
+      }
+
+      for (size_t s = 0; s < ir_source_count(instruction); s++)
+      {
+        ir_operand_t* operand = ir_source(instruction, s);
+        if (operand->kind == IR_OPERAND_VREG && values[operand->value].state == VALUE_CONSTANT)
+        {
+          *operand = IR_CONST(values[operand->value].constant);
+          changed_any = true;
+        }
+      }
+
+      if (instruction->opcode == IR_BRANCH &&
+          executable_edges[b * 2] != executable_edges[b * 2 + 1])
+      {
+        ir_block_t* taken = instruction->targets[executable_edges[b * 2] ? 0 : 1];
+        ir_block_t* not_taken = instruction->targets[executable_edges[b * 2] ? 1 : 0];
+        if (taken != not_taken)
+          remove_phi_entries(not_taken, block);
+        *instruction = (ir_instruction_t){.opcode = IR_JUMP, .targets = {taken}};
+        removed_edges = true;
+        changed_any = true;
+      }
+
+      block->instructions[n_kept++] = *instruction;
+    }
+    block->n_instructions = n_kept;
+  }
+
+  if (removed_edges)
+  {
+    ir_remove_unreachable_blocks(function);
+    ir_compute_cfg(function);
+  }
+
+  free(executable_edges);
+  free(executable_blocks);
+  free(values);
+  return changed_any;
+}
+
+/* Strength reduction */
+
+// Returns k if the value is 2^k for k from 1 to 62, otherwise -1
+static int power_of_two(int64_t value)
+{
+  if (value < 2 || (value & (value - 1)) != 0)
+    return -1;
+  int k = 0;
+  while (((int64_t)1 << k) != value)
+    k++;
+  return k;
+}
+
+// Finds the magic number M and shift s for signed division by the constant d,
+// such that n / d = (mulhi(n, M) (+ or - n)) >> s, plus 1 if the result is negative.
+// This is the algorithm from Hacker's Delight, chapter 10. |d| must be at least 2
+static void division_magic(int64_t d, int64_t* multiplier, int* shift)
+{
+  const uint64_t two63 = (uint64_t)1 << 63;
+  uint64_t ad = d < 0 ? 0 - (uint64_t)d : (uint64_t)d;
+  uint64_t t = two63 + ((uint64_t)d >> 63);
+  uint64_t anc = t - 1 - t % ad; // Absolute value of nc
+  int p = 63;
+  uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc; // Quotient and remainder of 2^p / |nc|
+  uint64_t q2 = two63 / ad, r2 = two63 - q2 * ad;   // Quotient and remainder of 2^p / |d|
+  uint64_t delta;
+  do
+  {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc)
+    {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad)
+    {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  uint64_t m = q2 + 1;
+  *multiplier = (int64_t)(d < 0 ? 0 - m : m);
+  *shift = p - 64;
+}
+
+// The instructions a multiplication or division is replaced by
+typedef struct
+{
+  ir_function_t* function;
+  ir_instruction_t* instructions;
+  size_t n_instructions;
+  size_t capacity;
+} instruction_list_t;
+
+static void append_to_list(instruction_list_t* list, ir_instruction_t instruction)
+{
+  if (list->n_instructions + 1 >= list->capacity)
+  {
+    list->capacity = list->capacity * 2 + 8;
+    list->instructions = realloc(list->instructions, list->capacity * sizeof(ir_instruction_t));
+  }
+  list->instructions[list->n_instructions++] = instruction;
+}
+
+// Appends dst = a op b to the list. If dst is IR_NONE, a new temporary is used.
+// Returns dst
+static ir_operand_t append_operation(
+    instruction_list_t* list, ir_opcode_t opcode, ir_operand_t dst, ir_operand_t a, ir_operand_t b)
+{
+  if (dst.kind == IR_OPERAND_NONE)
+    dst = ir_new_vreg(list->function, -1);
+  append_to_list(list, (ir_instruction_t){.opcode = opcode, .dst = dst, .a = a, .b = b});
+  return dst;
+}
+
+// Appends instructions computing dst = n / d for a constant d, without using idivq.
+// Returns false if d needs no special handling, or is better left as a division
+static bool reduce_division(instruction_list_t* list, ir_operand_t dst, ir_operand_t n, int64_t d)
+{
+  // Dividing by -1 is left as a division, so that INT64_MIN / -1 still crashes the program
+  if (d == 0 || d == 1 || d == -1 || d == INT64_MIN)
+    return false;
+
+  int64_t absolute = d < 0 ? -d : d;
+  int k = power_of_two(absolute);
+  if (k > 0)
+  {
+    // Shifting rounds towards minus infinity, so negative numbers get 2^k - 1 added first:
+    // (n + ((n >> 63) >>> (64 - k))) >> k
+    ir_operand_t sign = append_operation(list, IR_SAR, IR_NONE, n, IR_CONST(63));
+    ir_operand_t bias = append_operation(list, IR_SHR, IR_NONE, sign, IR_CONST(64 - k));
+    ir_operand_t biased = append_operation(list, IR_ADD, IR_NONE, n, bias);
+    if (d > 0)
+      append_operation(list, IR_SAR, dst, biased, IR_CONST(k));
+    else
+    {
+      ir_operand_t quotient = append_operation(list, IR_SAR, IR_NONE, biased, IR_CONST(k));
+      append_operation(list, IR_NEG, dst, quotient, IR_NONE);
+    }
+    return true;
+  }
+
+  int64_t multiplier;
+  int shift;
+  division_magic(d, &multiplier, &shift);
+
+  ir_operand_t quotient = append_operation(list, IR_MULHI, IR_NONE, n, IR_CONST(multiplier));
+  if (d > 0 && multiplier < 0)
+    quotient = append_operation(list, IR_ADD, IR_NONE, quotient, n);
+  else if (d < 0 && multiplier > 0)
+    quotient = append_operation(list, IR_SUB, IR_NONE, quotient, n);
+  if (shift > 0)
+    quotient = append_operation(list, IR_SAR, IR_NONE, quotient, IR_CONST(shift));
+
+  // Round towards zero, by adding 1 to negative results
+  ir_operand_t sign_bit = append_operation(list, IR_SHR, IR_NONE, quotient, IR_CONST(63));
+  append_operation(list, IR_ADD, dst, quotient, sign_bit);
+  return true;
+}
+
+// Replaces multiplications by powers of two with shifts, and divisions by constants with
+// shifts or multiplications by magic numbers, since idivq is many times slower.
+// Every rewritten instruction still writes its dst last, so it also works outside of SSA form
+static void reduce_strength(ir_function_t* function)
+{
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* block = function->blocks[b];
+    instruction_list_t list = {.function = function};
+
+    for (size_t i = 0; i < block->n_instructions; i++)
+    {
+      ir_instruction_t* instruction = &block->instructions[i];
+      ir_operand_t x = instruction->a;
+      ir_operand_t c = instruction->b;
+
+      if (instruction->opcode == IR_MUL)
+      {
+        if (x.kind == IR_OPERAND_CONST)
+        {
+          x = instruction->b;
+          c = instruction->a;
+        }
+        if (c.kind == IR_OPERAND_CONST && power_of_two(c.value) > 0)
+        {
+          append_operation(
+              &list, IR_SHL, instruction->dst, x, IR_CONST(power_of_two(c.value)));
+          continue;
+        }
+      }
+      else if (instruction->opcode == IR_DIV && c.kind == IR_OPERAND_CONST &&
+               reduce_division(&list, instruction->dst, x, c.value))
+        continue;
+
+      append_to_list(&list, *instruction);
+    }
+
+    free(block->instructions);
+    block->instructions = list.instructions;
+    block->n_instructions = list.n_instructions;
+    block->capacity = list.capacity;
+  }
+}
+
+/* Tail recursion */
+
+// Turns calls from the function to itself, whose result is directly returned, into jumps back
+// to the start of the function, after assigning the arguments to the parameters.
+// The entry block becomes a jump to a new start block, since the entry can not be jumped to.
+// Functions with local arrays are left alone, since every call needs new zeroed arrays.
+// Must be done before the function is taken into SSA form
+static void eliminate_tail_recursion(ir_function_t* function)
+{
+  ir_block_t* start = NULL;
+  size_t n_parameters = FUNC_PARAM_COUNT(function->symbol);
+  if (function->symbol->function_symtable->n_of_type[SYMBOL_LOCAL_ARRAY] > 0)
+    return;
+
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* block = function->blocks[b];
+    size_t n = block->n_instructions;
+    if (n < 2)
+      continue;
+    ir_instruction_t call = block->instructions[n - 2];
+    ir_instruction_t* ret = &block->instructions[n - 1];
+    if (call.opcode != IR_CALL || call.symbol != function->symbol || ret->opcode != IR_RETURN ||
+        ret->a.kind != IR_OPERAND_VREG || ret->a.value != call.dst.value)
+      continue;
+
+    if (start == NULL)
+    {
+      start = ir_new_block(".%s.start", function->symbol->name);
+      ir_block_t* entry = function->blocks[0];
+      *start = (ir_block_t){
+          .label = start->label,
+          .instructions = entry->instructions,
+          .n_instructions = entry->n_instructions,
+          .capacity = entry->capacity,
+      };
+      *entry = (ir_block_t){.id = 0, .label = entry->label};
+      ir_append_instruction(entry, (ir_instruction_t){.opcode = IR_JUMP, .targets = {start}});
+      ir_insert_block(function, start, 1);
+      b++;
+      if (block == entry)
+        block = start;
+    }
+
+    // The arguments can be computed from the parameters, so they are all copied into
+    // temporaries before any parameter is assigned
+    block->n_instructions = n - 2;
+    ir_operand_t* temporaries = malloc(n_parameters * sizeof(ir_operand_t));
+    for (size_t i = 0; i < n_parameters; i++)
+    {
+      temporaries[i] = ir_new_vreg(function, -1);
+      ir_append_instruction(
+          block,
+          (ir_instruction_t){.opcode = IR_MOVE, .dst = temporaries[i], .a = call.args[i]});
+    }
+    for (size_t i = 0; i < n_parameters; i++)
+      ir_append_instruction(
+          block, (ir_instruction_t){.opcode = IR_MOVE, .dst = IR_VREG(i), .a = temporaries[i]});
+    ir_append_instruction(block, (ir_instruction_t){.opcode = IR_JUMP, .targets = {start}});
+    free(temporaries);
+    ir_destroy_instruction(&call);
+  }
+}
+
+/* Common subexpression elimination */
+
+// An operator that was computed earlier, and the vreg holding its value
+typedef struct
+{
+  ir_opcode_t opcode;
+  ir_operand_t a, b;
+  ir_block_t* block; // The block computing it, which must dominate the blocks reusing it
+  ir_operand_t value;
+} computed_expression_t;
+
+// A value known to be in memory, from a load or a store earlier in the same block.
+// An address of an array is also kept here, without index, since it is cheaper to compute again
+// in other blocks than to keep in a register
+typedef struct
+{
+  ir_opcode_t opcode; // IR_LOAD_GLOBAL, IR_LOAD_ELEMENT or IR_ADDRESS_OF
+  symbol_t* symbol;
+  ir_operand_t index;
+  ir_operand_t value;
+} known_value_t;
+
+// Known values further back than this in a block are forgotten, to keep the search short
+#define MAX_KNOWN_VALUES 32
+
+static bool is_commutative(ir_opcode_t opcode)
+{
+  return opcode == IR_ADD || opcode == IR_MUL || opcode == IR_MULHI || opcode == IR_EQ ||
+         opcode == IR_NE;
+}
+
+static uint64_t expression_hash(ir_opcode_t opcode, ir_operand_t a, ir_operand_t b)
+{
+  uint64_t hash = opcode;
+  hash = hash * 0x9E3779B97F4A7C15ull + a.kind * 31 + a.value;
+  hash = hash * 0x9E3779B97F4A7C15ull + b.kind * 31 + b.value;
+  return hash ^ (hash >> 29);
+}
+
+// Returns the length of the array, or -1 if it is not known
+static int64_t array_length(symbol_t* symbol)
+{
+  node_t* length = node_child(node_get(symbol->node), 1);
+  return length->type == NUMBER_LITERAL ? length->data.number_literal : -1;
+}
+
+// Returns true if the index is a constant within the bounds of the array.
+// Stores to other indices could write anywhere, since they are not checked
+static bool in_bounds(symbol_t* array, ir_operand_t index)
+{
+  return index.kind == IR_OPERAND_CONST && index.value >= 0 && index.value < array_length(array);
+}
+
+// Returns the array that every vreg holding an address from IR_ADDRESS_OF points to,
+// and NULL for other vregs. The function must be in SSA form
+static symbol_t** find_address_arrays(ir_function_t* function)
+{
+  symbol_t** address_arrays = calloc(function->n_vregs, sizeof(symbol_t*));
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* block = function->blocks[b];
+    for (size_t i = 0; i < block->n_instructions; i++)
+      if (block->instructions[i].opcode == IR_ADDRESS_OF)
+        address_arrays[block->instructions[i].dst.value] = block->instructions[i].symbol;
+  }
+  return address_arrays;
+}
+
+// Forgets the known values that a store to the element array[index] could overwrite.
+// array is NULL if the stored array is not known
+static void forget_overwritten(
+    known_value_t* known, size_t* n_known, symbol_t* array, ir_operand_t index)
+{
+  bool precise = array != NULL && in_bounds(array, index);
+  size_t n_kept = 0;
+  for (size_t i = 0; i < *n_known; i++)
+  {
+    bool kept;
+    if (known[i].opcode == IR_ADDRESS_OF)
+      kept = true;
+    else if (known[i].opcode == IR_LOAD_GLOBAL)
+      kept = precise;
+    else
+      kept = precise && in_bounds(known[i].symbol, known[i].index) &&
+             (known[i].symbol != array || known[i].index.value != index.value);
+    if (kept)
+      known[n_kept++] = known[i];
+  }
+  *n_known = n_kept;
+}
+
+// Remembers a value in memory, replacing what was known about the same place
+static void remember(known_value_t* known, size_t* n_known, known_value_t value)
+{
+  for (size_t i = 0; i < *n_known; i++)
+  {
+    if (known[i].opcode == value.opcode && known[i].symbol == value.symbol &&
+        same_operand(known[i].index, value.index))
+    {
+      known[i] = value;
+      return;
+    }
+  }
+  if (*n_known == MAX_KNOWN_VALUES)
+  {
+    memmove(&known[0], &known[1], (MAX_KNOWN_VALUES - 1) * sizeof(known_value_t));
+    (*n_known)--;
+  }
+  known[(*n_known)++] = value;
+}
+
+static ir_operand_t find_known(
+    known_value_t* known, size_t n_known, ir_opcode_t opcode, symbol_t* symbol, ir_operand_t index)
+{
+  for (size_t i = 0; i < n_known; i++)
+    if (known[i].opcode == opcode && known[i].symbol == symbol &&
+        same_operand(known[i].index, index))
+      return known[i].value;
+  return IR_NONE;
+}
+
+// Returns the vreg holding the value of the operator, if a dominating block computed it already.
+// Otherwise the operator is added to the table of computed operators, and IR_NONE is returned
+static ir_operand_t reuse_computed(computed_expression_t* computed,
+                                   size_t capacity,
+                                   ir_block_t* block,
+                                   ir_instruction_t* instruction)
+{
+  ir_operand_t a = instruction->a;
+  ir_operand_t b = instruction->b;
+  if (is_commutative(instruction->opcode) &&
+      (a.kind < b.kind || (a.kind == b.kind && a.value > b.value)))
+  {
+    a = instruction->b;
+    b = instruction->a;
+  }
+
+  size_t slot = expression_hash(instruction->opcode, a, b) & (capacity - 1);
+  for (; computed[slot].block != NULL; slot = (slot + 1) & (capacity - 1))
+  {
+    computed_expression_t* candidate = &computed[slot];
+    if (candidate->opcode == instruction->opcode && same_operand(candidate->a, a) &&
+        same_operand(candidate->b, b) && ir_dominates(candidate->block, block))
+      return candidate->value;
+  }
+  computed[slot] = (computed_expression_t){
+      .opcode = instruction->opcode, .a = a, .b = b, .block = block, .value = instruction->dst};
+  return IR_NONE;
+}
+
+// Returns the value loaded by the instruction, if it is already known from earlier in the block.
+// Otherwise updates what is known about memory after the instruction, and returns IR_NONE
+static ir_operand_t reuse_known(known_value_t* known,
+                                size_t* n_known,
+                                symbol_t** address_arrays,
+                                ir_instruction_t* instruction)
+{
+  symbol_t* array =
+      instruction->a.kind == IR_OPERAND_VREG ? address_arrays[instruction->a.value] : NULL;
+  ir_operand_t value = IR_NONE;
+  switch (instruction->opcode)
+  {
+  case IR_ADDRESS_OF:
+  case IR_LOAD_GLOBAL:
+    value = find_known(known, *n_known, instruction->opcode, instruction->symbol, IR_NONE);
+    if (value.kind == IR_OPERAND_NONE)
+      remember(known,
+               n_known,
+               (known_value_t){.opcode = instruction->opcode,
+                               .symbol = instruction->symbol,
+                               .value = instruction->dst});
+    break;
+  case IR_STORE_GLOBAL:
+    remember(known,
+             n_known,
+             (known_value_t){
+                 .opcode = IR_LOAD_GLOBAL, .symbol = instruction->symbol, .value = instruction->a});
+    break;
+  case IR_LOAD_ELEMENT:
+    if (array == NULL)
+      break;
+    value = find_known(known, *n_known, IR_LOAD_ELEMENT, array, instruction->b);
+    if (value.kind == IR_OPERAND_NONE)
+      remember(known,
+               n_known,
+               (known_value_t){.opcode = IR_LOAD_ELEMENT,
+                               .symbol = array,
+                               .index = instruction->b,
+                               .value = instruction->dst});
+    break;
+  case IR_STORE_ELEMENT:
+    forget_overwritten(known, n_known, array, instruction->b);
+    if (array != NULL)
+      remember(known,
+               n_known,
+               (known_value_t){.opcode = IR_LOAD_ELEMENT,
+                               .symbol = array,
+                               .index = instruction->b,
+                               .value = instruction->c});
+    break;
+  case IR_CALL:
+  {
+    // Only the addresses of arrays stay the same
+    size_t n_kept = 0;
+    for (size_t i = 0; i < *n_known; i++)
+      if (known[i].opcode == IR_ADDRESS_OF)
+        known[n_kept++] = known[i];
+    *n_known = n_kept;
+    break;
+  }
+  default:
+    break;
+  }
+  return value;
+}
+
+// Replaces instructions computing a value that is already available by moves, which copy
+// propagation then removes. The function must be in SSA form, with an up to date CFG.
+//
+// Operators are reused from any block dominating the one they are repeated in,
+// since their operands are SSA values that never change.
+// Values in memory are only reused within a block, from earlier loads of the same global or
+// array element, and from stores to them. Calls can write to any global or array, so they are
+// forgotten at calls. A store to an array element that is not a constant index within bounds
+// could write anywhere, so it makes every other global and element unknown.
+// Returns true if anything changed
+static bool eliminate_common_subexpressions(ir_function_t* function)
+{
+  symbol_t** address_arrays = find_address_arrays(function);
+  size_t n_instructions = 0;
+  for (size_t b = 0; b < function->n_blocks; b++)
+    n_instructions += function->blocks[b]->n_instructions;
+
+  // A hash table of the computed operators, with room for all instructions at half load.
+  // The same expression can be computed in several blocks that do not dominate each other
+  size_t capacity = 16;
+  while (capacity < n_instructions * 2)
+    capacity *= 2;
+  computed_expression_t* computed = calloc(capacity, sizeof(computed_expression_t));
+
+  // Dominators come before the blocks they dominate in reverse postorder
+  ir_block_t** order = malloc(function->n_blocks * sizeof(ir_block_t*));
+  for (size_t b = 0; b < function->n_blocks; b++)
+    order[function->blocks[b]->rpo_index] = function->blocks[b];
+
+  known_value_t known[MAX_KNOWN_VALUES];
+  bool changed = false;
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* block = order[b];
+    size_t n_known = 0;
+    for (size_t i = 0; i < block->n_instructions; i++)
+    {
+      ir_instruction_t* instruction = &block->instructions[i];
+      ir_operand_t available =
+          is_operator(instruction->opcode)
+              ? reuse_computed(computed, capacity, block, instruction)
+              : reuse_known(known, &n_known, address_arrays, instruction);
+
+      if (available.kind != IR_OPERAND_NONE)
+      {
+        *instruction =
+            (ir_instruction_t){.opcode = IR_MOVE, .dst = instruction->dst, .a = available};
+        changed = true;
+      }
+    }
+  }
+
+  free(order);
+  free(computed);
+  free(address_arrays);
+  return changed;
+}
+
+/* Dead code elimination */
+
+// Returns true if removing the instruction can change the behavior of the program,
+// even if its result is never used
+static bool has_side_effects(ir_instruction_t* instruction)
+{
+  switch (instruction->opcode)
+  {
+  case IR_STORE_GLOBAL:
+  case IR_STORE_ELEMENT:
+  case IR_CHECK_BOUNDS:
+  case IR_RESTORE_STACK:
+  case IR_VECTOR_ADD:
+  case IR_VECTOR_SUB:
+  case IR_CALL:
+  case IR_PRINT:
+  case IR_COUNT:
+  case IR_JUMP:
+  case IR_BRANCH:
+  case IR_RETURN:
+    return true;
+  case IR_DIV:
+    // Dividing by 0, or INT64_MIN by -1, crashes the program
+    return instruction->b.kind != IR_OPERAND_CONST || instruction->b.value == 0 ||
+           instruction->b.value == -1;
+  default:
+    return false;
+  }
+}
+
+// Marks the vregs read by the instruction as live, and adds the newly live ones to the worklist
+static void mark_operands_live(
+    ir_instruction_t* instruction, bool* live, size_t* worklist, size_t* worklist_len)
+{
+  for (size_t s = 0; s < ir_source_count(instruction); s++)
+  {
+    ir_operand_t* operand = ir_source(instruction, s);
+    if (operand->kind == IR_OPERAND_VREG && !live[operand->value])
+    {
+      live[operand->value] = true;
+      worklist[(*worklist_len)++] = operand->value;
+    }
+  }
+}
+
+// Removes all instructions whose results are never used, and have no side effects.
+// The function must be in SSA form. Returns true if anything was removed
+static bool eliminate_dead_code(ir_function_t* function)
+{
+  size_t n_vregs = function->n_vregs;
+
+  // Find the instruction defining every vreg
+  ir_instruction_t** definitions = calloc(n_vregs, sizeof(ir_instruction_t*));
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* block = function->blocks[b];
+    for (size_t i = 0; i < block->n_instructions; i++)
+    {
+      int64_t def = ir_defined_vreg(&block->instructions[i]);
+      if (def >= 0)
+        definitions[def] = &block->instructions[i];
+    }
+  }
+
+  // Start by marking the operands of instructions with side effects as live,
+  // then mark the operands of the instructions defining live vregs, and so on
+  bool* live = calloc(n_vregs, sizeof(bool));
+  size_t* worklist = malloc(n_vregs * sizeof(size_t));
+  size_t worklist_len = 0;
+
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* block = function->blocks[b];
+    for (size_t i = 0; i < block->n_instructions; i++)
+    {
+      ir_instruction_t* instruction = &block->instructions[i];
+      if (has_side_effects(instruction))
+        mark_operands_live(instruction, live, worklist, &worklist_len);
+    }
+  }
+
+  while (worklist_len > 0)
+  {
+    ir_instruction_t* instruction = definitions[worklist[--worklist_len]];
+    // Parameters are defined on entry, without an instruction
+    if (instruction != NULL)
+      mark_operands_live(instruction, live, worklist, &worklist_len);
+  }
+
+  // Finally remove every instruction without side effects whose result is dead
+  bool changed = false;
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* block = function->blocks[b];
+    size_t n_kept = 0;
+    for (size_t i = 0; i < block->n_instructions; i++)
+    {
+      ir_instruction_t* instruction = &block->instructions[i];
+      int64_t def = ir_defined_vreg(instruction);
+      if (!has_side_effects(instruction) && def >= 0 && !live[def])
+      {
+        ir_destroy_instruction(instruction);
+        changed = true;
+        continue;
+      }
+      block->instructions[n_kept++] = *instruction;
+    }
+    block->n_instructions = n_kept;
+  }
+
+  free(worklist);
+  free(live);
+  free(definitions);
+  return changed;
+}
+
+// Removes the instructions without side effects whose results are never read, because the
+// vreg is assigned again or the function returns first. Unlike eliminate_dead_code(), this also
+// works outside of SSA form, where a variable keeps the same vreg for all its assignments:
+//   %1 = move 0        (removed)
+//   %1 = call f
+// Variables that are only assigned then get no location at all. The function must have no phis.
+// Returns true if anything was removed
+static bool eliminate_dead_stores(ir_function_t* function)
+{
+  bool* live = malloc((function->n_vregs + 1) * sizeof(bool));
+  bool changed_any = false;
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    ir_liveness_t liveness = ir_compute_liveness(function);
+
+    for (size_t b = 0; b < function->n_blocks; b++)
+    {
+      ir_block_t* block = function->blocks[b];
+      for (size_t v = 0; v < function->n_vregs; v++)
+        live[v] = liveness.global_index[v] != -1 &&
+                  BITSET_TEST(liveness.live_out[b], liveness.global_index[v]);
+
+      // Walk the block backwards, marking the instructions whose result is dead at that point
+      bool* removed = calloc(block->n_instructions, sizeof(bool));
+      for (size_t i = block->n_instructions; i > 0; i--)
+      {
+        ir_instruction_t* instruction = &block->instructions[i - 1];
+        int64_t def = ir_defined_vreg(instruction);
+        if (def >= 0 && !live[def] && !has_side_effects(instruction))
+        {
+          removed[i - 1] = true;
+          continue;
+        }
+        if (def >= 0)
+          live[def] = false;
+        for (size_t s = 0; s < ir_source_count(instruction); s++)
+        {
+          ir_operand_t* operand = ir_source(instruction, s);
+          if (operand->kind == IR_OPERAND_VREG)
+            live[operand->value] = true;
+        }
+      }
+
+      size_t n_kept = 0;
+      for (size_t i = 0; i < block->n_instructions; i++)
+      {
+        if (removed[i])
+        {
+          ir_destroy_instruction(&block->instructions[i]);
+          changed = true;
+          continue;
+        }
+        block->instructions[n_kept++] = block->instructions[i];
+      }
+      block->n_instructions = n_kept;
+      free(removed);
+    }
+
+    ir_destroy_liveness(&liveness);
+    changed_any |= changed;
+  }
+
+  free(live);
+  return changed_any;
+}
+
+/* Loop optimizations */
+
+// A natural loop, made of the blocks that can reach a back edge to the header without passing it
+typedef struct
+{
+  ir_block_t* header;
+  bool* body;        // Indexed by block id
+  size_t n_blocks;   // The number of blocks in the body
+  ir_block_t* latch; // The only block jumping back to the header, or NULL if there are several
+  ir_block_t* preheader; // The only block outside the loop jumping to the header, if it has one
+} loop_t;
+
+static _Thread_local int preheader_counter = 0;
+
+// Inserts the instruction at the given position in the block
+static void insert_instruction(ir_block_t* block, size_t position, ir_instruction_t instruction)
+{
+  ir_append_instruction(block, instruction);
+  memmove(&block->instructions[position + 1],
+          &block->instructions[position],
+          (block->n_instructions - 1 - position) * sizeof(ir_instruction_t));
+  block->instructions[position] = instruction;
+}
+
+static void insert_before_terminator(ir_block_t* block, ir_instruction_t instruction)
+{
+  insert_instruction(block, block->n_instructions - 1, instruction);
+}
+
+// Finds the loops of the function, ordered so that inner loops come before the loops around them.
+// Back edges go from a block to a block dominating it, and loops sharing a header are merged
+static loop_t* find_loops(ir_function_t* function, size_t* n_loops)
+{
+  size_t n_blocks = function->n_blocks;
+  loop_t* loops = NULL;
+  *n_loops = 0;
+  ir_block_t** worklist = malloc(n_blocks * sizeof(ir_block_t*));
+
+  for (size_t h = 0; h < n_blocks; h++)
+  {
+    ir_block_t* header = function->blocks[h];
+    loop_t loop = {.header = header};
+    size_t n_latches = 0;
+    size_t worklist_len = 0;
+    for (size_t p = 0; p < header->n_predecessors; p++)
+    {
+      ir_block_t* predecessor = header->predecessors[p];
+      if (!ir_dominates(header, predecessor))
+        continue;
+      if (loop.body == NULL)
+      {
+        loop.body = calloc(n_blocks, sizeof(bool));
+        loop.body[header->id] = true;
+        loop.n_blocks = 1;
+      }
+      loop.latch = n_latches++ == 0 ? predecessor : NULL;
+      if (!loop.body[predecessor->id])
+      {
+        loop.body[predecessor->id] = true;
+        loop.n_blocks++;
+        worklist[worklist_len++] = predecessor;
+      }
+    }
+    if (loop.body == NULL)
+      continue;
+
+    while (worklist_len > 0)
+    {
+      ir_block_t* block = worklist[--worklist_len];
+      for (size_t p = 0; p < block->n_predecessors; p++)
+      {
+        ir_block_t* predecessor = block->predecessors[p];
+        if (!loop.body[predecessor->id])
+        {
+          loop.body[predecessor->id] = true;
+          loop.n_blocks++;
+          worklist[worklist_len++] = predecessor;
+        }
+      }
+    }
+
+    for (size_t p = 0; p < header->n_predecessors; p++)
+    {
+      ir_block_t* predecessor = header->predecessors[p];
+      if (loop.body[predecessor->id])
+        continue;
+      // A loop entered from several blocks gets no preheader
+      loop.preheader = header->n_predecessors - n_latches == 1 ? predecessor : NULL;
+      break;
+    }
+
+    loops = realloc(loops, (*n_loops + 1) * sizeof(loop_t));
+    loops[(*n_loops)++] = loop;
+  }
+  free(worklist);
+
+  // An inner loop has fewer blocks than the loops containing it
+  for (size_t i = 1; i < *n_loops; i++)
+    for (size_t j = i; j > 0 && loops[j].n_blocks < loops[j - 1].n_blocks; j--)
+    {
+      loop_t swap = loops[j];
+      loops[j] = loops[j - 1];
+      loops[j - 1] = swap;
+    }
+  return loops;
+}
+
+static void destroy_loops(loop_t* loops, size_t n_loops)
+{
+  for (size_t i = 0; i < n_loops; i++)
+    free(loops[i].body);
+  free(loops);
+}
+
+// Gives every loop entered from a single block a preheader, which only jumps to the header.
+// When the block entering the loop can also go elsewhere, a new block is placed on the edge.
+// Returns true if any block was created, which makes the CFG out of date
+static bool create_preheaders(ir_function_t* function, loop_t* loops, size_t n_loops)
+{
+  bool created = false;
+  for (size_t i = 0; i < n_loops; i++)
+  {
+    ir_block_t* entering = loops[i].preheader;
+    ir_block_t* header = loops[i].header;
+    if (entering == NULL || ir_block_terminator(entering)->opcode == IR_JUMP)
+      continue;
+
+    ir_block_t* preheader = ir_new_block("preheader%d", ++preheader_counter);
+    ir_append_instruction(preheader, (ir_instruction_t){.opcode = IR_JUMP, .targets = {header}});
+    ir_insert_block(function, preheader, header->id);
+
+    ir_instruction_t* terminator = ir_block_terminator(entering);
+    for (size_t t = 0; t < 2; t++)
+      if (terminator->targets[t] == header)
+        terminator->targets[t] = preheader;
+    for (size_t k = 0; k < header->n_instructions && header->instructions[k].opcode == IR_PHI; k++)
+      for (size_t a = 0; a < header->instructions[k].n_args; a++)
+        if (header->instructions[k].incoming[a] == entering)
+          header->instructions[k].incoming[a] = preheader;
+    created = true;
+  }
+  return created;
+}
+
+// Finds the block defining every vreg. Parameters are defined on entry, and get NULL
+static ir_block_t** find_definition_blocks(ir_function_t* function)
+{
+  ir_block_t** definitions = calloc(function->n_vregs, sizeof(ir_block_t*));
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* block = function->blocks[b];
+    for (size_t i = 0; i < block->n_instructions; i++)
+    {
+      int64_t def = ir_defined_vreg(&block->instructions[i]);
+      if (def >= 0)
+        definitions[def] = block;
+    }
+  }
+  return definitions;
+}
+
+static bool defined_outside(loop_t* loop, ir_block_t** definitions, ir_operand_t operand)
+{
+  if (operand.kind != IR_OPERAND_VREG)
+    return true;
+  ir_block_t* block = definitions[operand.value];
+  return block == NULL || !loop->body[block->id];
+}
+
+// Marks which globals the loop can store to. Returns true if it could store to any of them,
+// through a call or an array element that is not a constant index within bounds
+static bool find_stored_globals(ir_function_t* function, loop_t* loop, bool* stored)
+{
+  symbol_t** address_arrays = find_address_arrays(function);
+  bool stores_any = false;
+  for (size_t b = 0; b < function->n_blocks && !stores_any; b++)
+  {
+    ir_block_t* block = function->blocks[b];
+    if (!loop->body[b])
+      continue;
+    for (size_t i = 0; i < block->n_instructions; i++)
+    {
+      ir_instruction_t* instruction = &block->instructions[i];
+      if (ir_is_call(instruction))
+        stores_any = true;
+      else if (instruction->opcode == IR_STORE_GLOBAL)
+        stored[instruction->symbol->sequence_number] = true;
+      else if (instruction->opcode == IR_STORE_ELEMENT)
+      {
+        symbol_t* array = instruction->a.kind == IR_OPERAND_VREG
+                              ? address_arrays[instruction->a.value]
+                              : NULL;
+        stores_any |= array == NULL || !in_bounds(array, instruction->b);
+      }
+    }
+  }
+  free(address_arrays);
+  return stores_any;
+}
+
+// Returns true if the instruction can be executed before the loop instead, given that its
+// operands are defined outside the loop. It may run even when the loop body never does,
+// so it must not be able to crash. Bounds checks are the exception, when they come before
+// anything with side effects in a block that always runs once the preheader has.
+// The check would then fail in the same place
+static bool is_hoistable(ir_instruction_t* instruction,
+                         bool stores_any,
+                         bool* stored,
+                         bool before_side_effects)
+{
+  if (instruction->opcode == IR_CHECK_BOUNDS)
+    return before_side_effects;
+  if (is_operator(instruction->opcode))
+    return !has_side_effects(instruction);
+  if (instruction->opcode == IR_ADDRESS_OF)
+    return true;
+  if (instruction->opcode == IR_LOAD_GLOBAL)
+    return !stores_any && !stored[instruction->symbol->sequence_number];
+  return false;
+}
+
+// Returns the block of the loop body that runs first in every iteration, when the first
+// iteration is always entered: the header runs nothing with side effects, and then branches on a
+// comparison of one of its phis with a constant, which holds for the phi's value from the
+// preheader. Returns the header itself if it is not known, since it always runs
+static ir_block_t* first_iteration_block(loop_t* loop)
+{
+  ir_block_t* header = loop->header;
+  for (size_t i = 0; i + 1 < header->n_instructions; i++)
+    if (has_side_effects(&header->instructions[i]))
+      return header;
+
+  ir_instruction_t* branch = ir_block_terminator(header);
+  if (branch->opcode != IR_BRANCH || branch->b.kind != IR_OPERAND_CONST)
+    return header;
+  for (size_t i = 0; i < header->n_instructions && header->instructions[i].opcode == IR_PHI; i++)
+  {
+    ir_instruction_t* phi = &header->instructions[i];
+    if (!same_operand(phi->dst, branch->a))
+      continue;
+    ir_operand_t start = IR_NONE;
+    for (size_t k = 0; k < phi->n_args; k++)
+      if (phi->incoming[k] == loop->preheader)
+        start = phi->args[k];
+    int64_t taken;
+    ir_block_t* first = branch->targets[0];
+    if (start.kind != IR_OPERAND_CONST ||
+        !evaluate_operator(branch->condition, start.value, branch->b.value, &taken) ||
+        !taken || !loop->body[first->id] || first->n_predecessors != 1)
+      return header;
+    return first;
+  }
+  return header;
+}
+
+// Moves the instructions that compute the same value in every iteration to the preheader.
+// Blocks are visited in reverse postorder, so operands computed by instructions that move are
+// moved before them. Returns true if anything moved
+static bool hoist_invariants(ir_function_t* function, loop_t* loop, ir_block_t** order)
+{
+  ir_block_t** definitions = find_definition_blocks(function);
+  bool* stored = calloc(global_symbols->n_symbols, sizeof(bool));
+  bool stores_any = find_stored_globals(function, loop, stored);
+  ir_block_t* first = first_iteration_block(loop);
+
+  bool changed = false;
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* block = order[b];
+    if (!loop->body[block->id])
+      continue;
+    size_t n_kept = 0;
+    bool before_side_effects = block == loop->header || block == first;
+    for (size_t i = 0; i < block->n_instructions; i++)
+    {
+      ir_instruction_t instruction = block->instructions[i];
+      bool invariant = is_hoistable(&instruction, stores_any, stored, before_side_effects) &&
+                       defined_outside(loop, definitions, instruction.a) &&
+                       defined_outside(loop, definitions, instruction.b);
+      if (invariant)
+      {
+        insert_before_terminator(loop->preheader, instruction);
+        if (instruction.opcode == IR_CHECK_BOUNDS)
+          bounds_checks_hoisted++;
+        else
+          definitions[instruction.dst.value] = loop->preheader;
+        changed = true;
+        continue;
+      }
+      if (has_side_effects(&instruction))
+        before_side_effects = false;
+      block->instructions[n_kept++] = instruction;
+    }
+    block->n_instructions = n_kept;
+  }
+
+  free(stored);
+  free(definitions);
+  return changed;
+}
+
+// Finds the instruction in the loop defining the vreg
+static ir_instruction_t* find_definition(ir_function_t* function, loop_t* loop, int64_t vreg,
+                                         ir_block_t** block)
+{
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    if (!loop->body[b])
+      continue;
+    *block = function->blocks[b];
+    for (size_t i = 0; i < (*block)->n_instructions; i++)
+      if (ir_defined_vreg(&(*block)->instructions[i]) == vreg)
+        return &(*block)->instructions[i];
+  }
+  return NULL;
+}
+
+// If the phi of the loop header is an induction variable, which changes by a constant step
+// in every iteration, returns true and gives the step and the instruction adding it
+static bool is_induction_variable(ir_function_t* function,
+                                  loop_t* loop,
+                                  ir_instruction_t* phi,
+                                  int64_t* step,
+                                  ir_instruction_t** increment,
+                                  ir_block_t** increment_block)
+{
+  if (phi->n_args != 2)
+    return false;
+  ir_operand_t next = phi->args[phi->incoming[0] == loop->latch ? 0 : 1];
+  if (next.kind != IR_OPERAND_VREG)
+    return false;
+  ir_instruction_t* definition = find_definition(function, loop, next.value, increment_block);
+  if (definition == NULL)
+    return false;
+
+  // The step is the constant added to, or subtracted from, the phi itself
+  ir_operand_t a = definition->a;
+  ir_operand_t b = definition->b;
+  if (definition->opcode == IR_ADD && b.kind == IR_OPERAND_VREG)
+  {
+    a = definition->b;
+    b = definition->a;
+  }
+  if ((definition->opcode != IR_ADD && definition->opcode != IR_SUB) ||
+      !same_operand(a, phi->dst) || b.kind != IR_OPERAND_CONST)
+    return false;
+  *step = definition->opcode == IR_ADD ? b.value : (int64_t)(0 - (uint64_t)b.value);
+  *increment = definition;
+  return true;
+}
+
+// Replaces multiplications of an induction variable by a constant with an induction variable of
+// their own, which the step times the constant is added to in every iteration:
+//   i = phi(0, i'), t = mul i, 3, i' = add i, 1   becomes   t = phi(0, t'), t' = add t, 3
+// Multiplications by powers of two are left alone, since they become shifts that are as cheap.
+// Arithmetic wraps around in both, so the values stay the same. Returns true if anything changed
+static bool reduce_induction_variables(ir_function_t* function, loop_t* loop)
+{
+  if (loop->latch == NULL)
+    return false;
+
+  bool changed = false;
+  ir_block_t* header = loop->header;
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    if (!loop->body[b])
+      continue;
+    ir_block_t* block = function->blocks[b];
+    for (size_t i = 0; i < block->n_instructions; i++)
+    {
+      ir_instruction_t* multiplication = &block->instructions[i];
+      if (multiplication->opcode != IR_MUL)
+        continue;
+      ir_operand_t variable = multiplication->a;
+      ir_operand_t factor = multiplication->b;
+      if (variable.kind == IR_OPERAND_CONST)
+      {
+        variable = multiplication->b;
+        factor = multiplication->a;
+      }
+      if (variable.kind != IR_OPERAND_VREG || factor.kind != IR_OPERAND_CONST ||
+          power_of_two(factor.value < 0 ? -factor.value : factor.value) > 0)
+        continue;
+
+      // The variable must be one of the phis at the start of the header
+      ir_instruction_t* phi = NULL;
+      for (size_t k = 0; k < header->n_instructions && header->instructions[k].opcode == IR_PHI;
+           k++)
+        if (same_operand(header->instructions[k].dst, variable))
+          phi = &header->instructions[k];
+      int64_t step;
+      ir_instruction_t* increment;
+      ir_block_t* increment_block;
+      if (phi == NULL ||
+          !is_induction_variable(function, loop, phi, &step, &increment, &increment_block))
+        continue;
+
+      size_t from_preheader = phi->incoming[0] == loop->latch ? 1 : 0;
+      ir_operand_t initial = phi->args[from_preheader];
+      ir_operand_t product = multiplication->dst;
+      ir_operand_t next = ir_new_vreg(function, -1);
+      size_t increment_position = increment - increment_block->instructions;
+      int64_t scaled_step = (int64_t)((uint64_t)step * (uint64_t)factor.value);
+
+      // The multiplication becomes a phi, starting at the initial value times the factor
+      ir_operand_t start;
+      if (initial.kind == IR_OPERAND_CONST)
+        start = IR_CONST((int64_t)((uint64_t)initial.value * (uint64_t)factor.value));
+      else
+      {
+        start = ir_new_vreg(function, -1);
+        insert_before_terminator(loop->preheader,
+                                 (ir_instruction_t){
+                                     .opcode = IR_MUL, .dst = start, .a = initial, .b = factor});
+      }
+      ir_instruction_t product_phi = {
+          .opcode = IR_PHI,
+          .dst = product,
+          .args = malloc(2 * sizeof(ir_operand_t)),
+          .incoming = malloc(2 * sizeof(ir_block_t*)),
+          .n_args = 2,
+      };
+      for (size_t a = 0; a < 2; a++)
+      {
+        product_phi.incoming[a] = phi->incoming[a];
+        product_phi.args[a] = a == from_preheader ? start : next;
+      }
+
+      // Remove the multiplication, and add the step right after the variable's own increment.
+      // The phi goes first in the header, which moves the instructions of the header down
+      memmove(multiplication,
+              multiplication + 1,
+              (block->n_instructions - i - 1) * sizeof(ir_instruction_t));
+      block->n_instructions--;
+      if (increment_block == block && increment_position > i)
+        increment_position--;
+      insert_instruction(
+          increment_block,
+          increment_position + 1,
+          (ir_instruction_t){
+              .opcode = IR_ADD, .dst = next, .a = product, .b = IR_CONST(scaled_step)});
+      insert_instruction(header, 0, product_phi);
+      changed = true;
+      i = block->n_instructions; // The positions in the block changed, continue with the next one
+    }
+  }
+  return changed;
+}
+
+// Moves loop invariant code to the preheaders of loops, and reduces multiplications of induction
+// variables to additions. Inner loops are done first, so that code can move out of several loops.
+// The function must be in SSA form. Returns true if anything changed
+static bool optimize_loops(ir_function_t* function)
+{
+  size_t n_loops;
+  loop_t* loops = find_loops(function, &n_loops);
+  if (n_loops > 0 && create_preheaders(function, loops, n_loops))
+  {
+    destroy_loops(loops, n_loops);
+    ir_compute_cfg(function);
+    loops = find_loops(function, &n_loops);
+  }
+
+  ir_block_t** order = malloc(function->n_blocks * sizeof(ir_block_t*));
+  for (size_t b = 0; b < function->n_blocks; b++)
+    order[function->blocks[b]->rpo_index] = function->blocks[b];
+
+  bool changed = false;
+  for (size_t i = 0; i < n_loops; i++)
+  {
+    if (loops[i].preheader == NULL)
+      continue;
+    changed |= hoist_invariants(function, &loops[i], order);
+    changed |= reduce_induction_variables(function, &loops[i]);
+  }
+
+  free(order);
+  destroy_loops(loops, n_loops);
+  return changed;
+}
+
+/* Loop vectorization */
+
+static _Thread_local int vector_loop_counter = 0;
+
+// A loop that can be vectorized, together with the instructions of its body
+typedef struct
+{
+  ir_block_t* preheader;
+  ir_block_t* header;
+  ir_instruction_t* counter; // The phi of the header, from start to limit by steps of 1
+  ir_operand_t start;
+  ir_operand_t limit;        // Defined outside the loop, unless limit_global is set
+  symbol_t* limit_global;    // The global the header loads the limit from, if any
+  int64_t length;            // The length of the shortest of the arrays
+  ir_opcode_t opcode;        // IR_ADD or IR_SUB
+  ir_operand_t addresses[3]; // The array stored to, and the arrays of the two operands
+} vector_loop_t;
+
+// Returns the instruction of the body defining the operand, or NULL if it is defined elsewhere
+static ir_instruction_t* body_definition(ir_block_t* body, ir_operand_t operand)
+{
+  if (operand.kind != IR_OPERAND_VREG)
+    return NULL;
+  for (size_t i = 0; i < body->n_instructions; i++)
+    if (ir_defined_vreg(&body->instructions[i]) == operand.value)
+      return &body->instructions[i];
+  return NULL;
+}
+
+// Returns the length of the array at the address, or -1 if it is not known
+static int64_t address_length(symbol_t** address_arrays, ir_operand_t address)
+{
+  if (address.kind != IR_OPERAND_VREG || address_arrays[address.value] == NULL)
+    return -1;
+  return array_length(address_arrays[address.value]);
+}
+
+// Returns true if the loop has the form
+//   header: i = phi(start, i'), (n = load_global .n), branch lt i, n ? body : exit
+//   body:   x = load_element b, i, (y = load_element c, i), t = x op y, store_element a, i, t,
+//           i' = add i, 1, jump header
+// in any order, where op is add or sub, start is a constant of at least 0, and the addresses
+// and limit are defined outside the loop. Every iteration only touches the elements at index i,
+// so iterations within the bounds of the arrays can not depend on each other, even when the
+// arrays are the same. Fills in the vector loop
+static bool is_vectorizable(loop_t* loop,
+                            ir_block_t** definitions,
+                            symbol_t** address_arrays,
+                            vector_loop_t* vector)
+{
+  ir_block_t* header = loop->header;
+  ir_block_t* body = loop->latch;
+  if (loop->preheader == NULL || body == NULL || body == header || loop->n_blocks != 2 ||
+      header->n_instructions < 2 || header->n_instructions > 3 || body->n_instructions > 6)
+    return false;
+
+  ir_instruction_t* phi = &header->instructions[0];
+  ir_instruction_t* branch = ir_block_terminator(header);
+  ir_instruction_t* load_limit = header->n_instructions == 3 ? &header->instructions[1] : NULL;
+  if (phi->opcode != IR_PHI || phi->n_args != 2 || branch->opcode != IR_BRANCH ||
+      branch->condition != IR_LT || !same_operand(branch->a, phi->dst) ||
+      branch->targets[0] != body)
+    return false;
+  if (load_limit != NULL ? load_limit->opcode != IR_LOAD_GLOBAL ||
+                               !same_operand(load_limit->dst, branch->b)
+                         : !defined_outside(loop, definitions, branch->b))
+    return false;
+  size_t from_latch = phi->incoming[0] == body ? 0 : 1;
+  ir_operand_t start = phi->args[1 - from_latch];
+  ir_operand_t counter = phi->dst;
+  if (start.kind != IR_OPERAND_CONST || start.value < 0)
+    return false;
+
+  // The store, and the operation and loads it gets its value from
+  ir_instruction_t* store = NULL;
+  for (size_t i = 0; i < body->n_instructions; i++)
+    if (body->instructions[i].opcode == IR_STORE_ELEMENT)
+      store = &body->instructions[i];
+  if (store == NULL || !same_operand(store->b, counter) ||
+      !defined_outside(loop, definitions, store->a))
+    return false;
+  ir_instruction_t* operation = body_definition(body, store->c);
+  if (operation == NULL || (operation->opcode != IR_ADD && operation->opcode != IR_SUB))
+    return false;
+  ir_instruction_t* loads[2] = {body_definition(body, operation->a),
+                                body_definition(body, operation->b)};
+  for (size_t k = 0; k < 2; k++)
+    if (loads[k] == NULL || loads[k]->opcode != IR_LOAD_ELEMENT ||
+        !same_operand(loads[k]->b, counter) || !defined_outside(loop, definitions, loads[k]->a))
+      return false;
+
+  // The increment must be the only other instruction, besides the jump
+  ir_instruction_t* increment = body_definition(body, phi->args[from_latch]);
+  if (increment == NULL || increment->opcode != IR_ADD || !same_operand(increment->a, counter) ||
+      increment->b.kind != IR_OPERAND_CONST || increment->b.value != 1)
+    return false;
+  size_t n_loads = loads[0] == loads[1] ? 1 : 2;
+  if (body->n_instructions != n_loads + 4)
+    return false;
+
+  *vector = (vector_loop_t){
+      .preheader = loop->preheader,
+      .header = header,
+      .counter = phi,
+      .start = start,
+      .limit = branch->b,
+      .limit_global = load_limit != NULL ? load_limit->symbol : NULL,
+      .length = INT64_MAX,
+      .opcode = operation->opcode,
+      .addresses = {store->a, loads[0]->a, loads[1]->a},
+  };
+  for (size_t k = 0; k < 3; k++)
+  {
+    int64_t length = address_length(address_arrays, vector->addresses[k]);
+    if (length < 0)
+      return false;
+    vector->length = length < vector->length ? length : vector->length;
+  }
+  return true;
+}
+
+// Places a loop doing IR_VECTOR_WIDTH iterations at a time before the loop, which then does the
+// remaining iterations, starting where the vector loop stopped:
+//   vector:       v = phi(start, v'), last = add v, width - 1, branch lt last, length ? ... : ...
+//   vector_limit: branch lt last, limit ? ... : ..., unless the limit is a constant
+//   vector_body:  vector_add a, b, c, v, v' = add v, width, jump vector
+//   vector_exit:  jump header, where the phi now starts at v
+// The last element of an iteration is below the limit exactly when all of its elements are.
+// The vector loop stays within the shortest array, which keeps every store within bounds.
+// A limit loaded from a global then stays the same, and is loaded once in the preheader
+static void vectorize_loop(ir_function_t* function, vector_loop_t* loop)
+{
+  int64_t width = IR_VECTOR_WIDTH;
+  int counter = ++vector_loop_counter;
+  ir_operand_t limit = loop->limit;
+  if (loop->limit_global != NULL)
+  {
+    limit = ir_new_vreg(function, -1);
+    insert_before_terminator(
+        loop->preheader,
+        (ir_instruction_t){.opcode = IR_LOAD_GLOBAL, .dst = limit, .symbol = loop->limit_global});
+  }
+  // A constant limit is combined with the length into one comparison
+  bool constant_limit = limit.kind == IR_OPERAND_CONST;
+  int64_t bound = constant_limit && limit.value < loop->length ? limit.value : loop->length;
+
+  ir_block_t* vector_header = ir_new_block("vector%d", counter);
+  ir_block_t* vector_limit = constant_limit ? NULL : ir_new_block("vector_limit%d", counter);
+  ir_block_t* vector_body = ir_new_block("vector_body%d", counter);
+  ir_block_t* vector_exit = ir_new_block("vector_exit%d", counter);
+
+  ir_operand_t index = ir_new_vreg(function, -1);
+  ir_operand_t next = ir_new_vreg(function, -1);
+  ir_operand_t last = ir_new_vreg(function, -1);
+  ir_instruction_t phi = {
+      .opcode = IR_PHI,
+      .dst = index,
+      .args = malloc(2 * sizeof(ir_operand_t)),
+      .incoming = malloc(2 * sizeof(ir_block_t*)),
+      .n_args = 2,
+  };
+  phi.args[0] = loop->start;
+  phi.incoming[0] = loop->preheader;
+  phi.args[1] = next;
+  phi.incoming[1] = vector_body;
+  ir_append_instruction(vector_header, phi);
+  ir_append_instruction(
+      vector_header,
+      (ir_instruction_t){.opcode = IR_ADD, .dst = last, .a = index, .b = IR_CONST(width - 1)});
+  ir_append_instruction(
+      vector_header,
+      (ir_instruction_t){.opcode = IR_BRANCH,
+                         .condition = IR_LT,
+                         .a = last,
+                         .b = IR_CONST(bound),
+                         .targets = {constant_limit ? vector_body : vector_limit, vector_exit}});
+  if (vector_limit != NULL)
+    ir_append_instruction(vector_limit,
+                          (ir_instruction_t){.opcode = IR_BRANCH,
+                                             .condition = IR_LT,
+                                             .a = last,
+                                             .b = limit,
+                                             .targets = {vector_body, vector_exit}});
+
+  ir_instruction_t operation = {
+      .opcode = loop->opcode == IR_ADD ? IR_VECTOR_ADD : IR_VECTOR_SUB,
+      .a = loop->addresses[0],
+      .b = loop->addresses[1],
+      .c = loop->addresses[2],
+      .args = malloc(sizeof(ir_operand_t)),
+      .n_args = 1,
+  };
+  operation.args[0] = index;
+  ir_append_instruction(vector_body, operation);
+  ir_append_instruction(
+      vector_body,
+      (ir_instruction_t){.opcode = IR_ADD, .dst = next, .a = index, .b = IR_CONST(width)});
+  ir_append_instruction(vector_body,
+                        (ir_instruction_t){.opcode = IR_JUMP, .targets = {vector_header}});
+  ir_append_instruction(vector_exit,
+                        (ir_instruction_t){.opcode = IR_JUMP, .targets = {loop->header}});
+
+  // The preheader only jumps to the header
+  ir_block_terminator(loop->preheader)->targets[0] = vector_header;
+  for (size_t a = 0; a < 2; a++)
+    if (loop->counter->incoming[a] == loop->preheader)
+    {
+      loop->counter->incoming[a] = vector_exit;
+      loop->counter->args[a] = index;
+    }
+
+  ir_insert_block(function, vector_exit, loop->header->id);
+  ir_insert_block(function, vector_body, vector_exit->id);
+  if (vector_limit != NULL)
+    ir_insert_block(function, vector_limit, vector_body->id);
+  ir_insert_block(
+      function, vector_header, vector_limit != NULL ? vector_limit->id : vector_body->id);
+}
+
+// Vectorizes the loops that add or subtract arrays element by element, see is_vectorizable().
+// The loops are all found first, since the vector loops added are vectorizable themselves.
+// The function must be in SSA form. Returns true if anything changed, which makes the CFG out of
+// date
+static bool vectorize_loops(ir_function_t* function)
+{
+  size_t n_loops;
+  loop_t* loops = find_loops(function, &n_loops);
+  if (n_loops > 0 && create_preheaders(function, loops, n_loops))
+  {
+    destroy_loops(loops, n_loops);
+    ir_compute_cfg(function);
+    loops = find_loops(function, &n_loops);
+  }
+
+  ir_block_t** definitions = find_definition_blocks(function);
+  symbol_t** address_arrays = find_address_arrays(function);
+  vector_loop_t* vector_loops = malloc(n_loops * sizeof(vector_loop_t));
+  size_t n_vector_loops = 0;
+  for (size_t i = 0; i < n_loops; i++)
+    if (is_vectorizable(&loops[i], definitions, address_arrays, &vector_loops[n_vector_loops]))
+      n_vector_loops++;
+
+  for (size_t i = 0; i < n_vector_loops; i++)
+    vectorize_loop(function, &vector_loops[i]);
+
+  free(vector_loops);
+  free(address_arrays);
+  free(definitions);
+  destroy_loops(loops, n_loops);
+  return n_vector_loops > 0;
+}
+
+/* Bounds check elimination */
+
+_Thread_local size_t bounds_checks_removed = 0;
+_Thread_local size_t bounds_checks_hoisted = 0;
+_Thread_local size_t bounds_checks_left = 0;
+
+// The values a vreg can hold, from low to high
+typedef struct
+{
+  int64_t low;
+  int64_t high;
+} value_range_t;
+
+#define UNKNOWN_RANGE ((value_range_t){.low = INT64_MIN, .high = INT64_MAX})
+
+// Returns the comparison that gives the same result with the operands swapped
+static ir_opcode_t swapped_condition(ir_opcode_t condition)
+{
+  switch (condition)
+  {
+  case IR_LT:
+    return IR_GT;
+  case IR_LE:
+    return IR_GE;
+  case IR_GT:
+    return IR_LT;
+  case IR_GE:
+    return IR_LE;
+  default:
+    return condition;
+  }
+}
+
+// Narrows the range down to the values v where (v condition bound) is true
+static value_range_t narrow_range(value_range_t range, ir_opcode_t condition, int64_t bound)
+{
+  switch (condition)
+  {
+  case IR_EQ:
+    range.low = bound > range.low ? bound : range.low;
+    range.high = bound < range.high ? bound : range.high;
+    break;
+  case IR_LT:
+    if (bound != INT64_MIN && bound - 1 < range.high)
+      range.high = bound - 1;
+    break;
+  case IR_LE:
+    range.high = bound < range.high ? bound : range.high;
+    break;
+  case IR_GT:
+    if (bound != INT64_MAX && bound + 1 > range.low)
+      range.low = bound + 1;
+    break;
+  case IR_GE:
+    range.low = bound > range.low ? bound : range.low;
+    break;
+  default:
+    break;
+  }
+  return range;
+}
+
+// Finds the instruction defining every vreg, and the block it is in.
+// Parameters are defined on entry, and get NULL
+static ir_instruction_t** find_definitions(ir_function_t* function, ir_block_t** blocks)
+{
+  ir_instruction_t** definitions = calloc(function->n_vregs, sizeof(ir_instruction_t*));
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* block = function->blocks[b];
+    for (size_t i = 0; i < block->n_instructions; i++)
+    {
+      int64_t def = ir_defined_vreg(&block->instructions[i]);
+      if (def >= 0)
+      {
+        definitions[def] = &block->instructions[i];
+        blocks[def] = block;
+      }
+    }
+  }
+  return definitions;
+}
+
+static value_range_t value_range(ir_instruction_t** definitions,
+                                 ir_block_t** definition_blocks,
+                                 ir_block_t* block,
+                                 ir_operand_t operand,
+                                 bool follow_phis);
+
+// Returns the range of the values computed by the instruction, from the ranges of its operands
+// in the given block
+static value_range_t defined_range(ir_instruction_t** definitions,
+                                   ir_block_t** definition_blocks,
+                                   ir_block_t* block,
+                                   ir_instruction_t* instruction,
+                                   bool follow_phis)
+{
+  ir_opcode_t opcode = instruction->opcode;
+  if ((opcode == IR_ADD || opcode == IR_SUB) && instruction->b.kind == IR_OPERAND_CONST)
+  {
+    // Ranges that could wrap around on overflow are not known
+    int64_t step = instruction->b.value;
+    value_range_t range =
+        value_range(definitions, definition_blocks, block, instruction->a, follow_phis);
+    int64_t low, high;
+    bool overflows = opcode == IR_ADD ? __builtin_add_overflow(range.low, step, &low) ||
+                                            __builtin_add_overflow(range.high, step, &high)
+                                      : __builtin_sub_overflow(range.low, step, &low) ||
+                                            __builtin_sub_overflow(range.high, step, &high);
+    return overflows ? UNKNOWN_RANGE : (value_range_t){.low = low, .high = high};
+  }
+
+  // A phi of a constant start, and its own value plus a positive step, never goes below the
+  // start, as long as the addition can not overflow where it is done:
+  //   i = phi(0, i'), ..., i < 10 ? ..., i' = add i, 1
+  if (opcode != IR_PHI || instruction->n_args != 2 || !follow_phis)
+    return UNKNOWN_RANGE;
+  for (size_t k = 0; k < 2; k++)
+  {
+    ir_operand_t start = instruction->args[k];
+    ir_operand_t next = instruction->args[1 - k];
+    if (start.kind != IR_OPERAND_CONST || next.kind != IR_OPERAND_VREG)
+      continue;
+    ir_instruction_t* increment = definitions[next.value];
+    if (increment == NULL || increment->opcode != IR_ADD ||
+        !same_operand(increment->a, instruction->dst) || increment->b.kind != IR_OPERAND_CONST ||
+        increment->b.value <= 0)
+      continue;
+    value_range_t before = value_range(
+        definitions, definition_blocks, definition_blocks[next.value], instruction->dst, false);
+    if (before.high <= INT64_MAX - increment->b.value)
+      return (value_range_t){.low = start.value, .high = INT64_MAX};
+  }
+  return UNKNOWN_RANGE;
+}
+
+// Returns the values the operand can hold in the block. These come from how it is computed, and
+// from the branches that must have been taken to reach the block.
+// Phis are only followed around loops with follow_phis, so that each phi is visited once
+static value_range_t value_range(ir_instruction_t** definitions,
+                                 ir_block_t** definition_blocks,
+                                 ir_block_t* block,
+                                 ir_operand_t operand,
+                                 bool follow_phis)
+{
+  if (operand.kind == IR_OPERAND_CONST)
+    return (value_range_t){.low = operand.value, .high = operand.value};
+  if (operand.kind != IR_OPERAND_VREG)
+    return UNKNOWN_RANGE;
+
+  value_range_t range = UNKNOWN_RANGE;
+  if (definitions[operand.value] != NULL)
+    range = defined_range(
+        definitions, definition_blocks, block, definitions[operand.value], follow_phis);
+
+  // A block with a single predecessor ending in a branch is only reached when the branch goes
+  // its way, and so is every block it dominates
+  for (ir_block_t* dominator = block; dominator->idom != NULL; dominator = dominator->idom)
+  {
+    if (dominator->n_predecessors != 1)
+      continue;
+    ir_instruction_t* branch = ir_block_terminator(dominator->predecessors[0]);
+    if (branch->opcode != IR_BRANCH || branch->targets[0] == branch->targets[1])
+      continue;
+    ir_opcode_t condition = branch->condition;
+    if (branch->targets[1] == dominator)
+      condition = ir_inverse_condition(condition);
+    if (same_operand(branch->a, operand) && branch->b.kind == IR_OPERAND_CONST)
+      range = narrow_range(range, condition, branch->b.value);
+    else if (same_operand(branch->b, operand) && branch->a.kind == IR_OPERAND_CONST)
+      range = narrow_range(range, swapped_condition(condition), branch->a.value);
+  }
+  return range;
+}
+
+// A bounds check that has passed, and the block it is in
+typedef struct
+{
+  ir_block_t* block;
+  ir_operand_t index;
+  int64_t length;
+} passed_check_t;
+
+// Removes the bounds checks that can never fail, since the range of the index is within the
+// array, and those that repeat a check of the same index against an array at most as long,
+// which must have passed before. The function must be in SSA form, with an up to date CFG.
+// Returns true if anything changed
+static bool eliminate_bounds_checks(ir_function_t* function)
+{
+  ir_block_t** definition_blocks = calloc(function->n_vregs, sizeof(ir_block_t*));
+  ir_instruction_t** definitions = find_definitions(function, definition_blocks);
+
+  // Dominators come before the blocks they dominate in reverse postorder
+  ir_block_t** order = malloc(function->n_blocks * sizeof(ir_block_t*));
+  for (size_t b = 0; b < function->n_blocks; b++)
+    order[function->blocks[b]->rpo_index] = function->blocks[b];
+
+  // The removed checks are marked first, since the definitions point into the blocks
+  size_t n_passed = 0;
+  size_t passed_capacity = 16;
+  passed_check_t* passed = malloc(passed_capacity * sizeof(passed_check_t));
+  bool** removed = calloc(function->n_blocks, sizeof(bool*));
+  bool changed = false;
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* block = order[b];
+    for (size_t i = 0; i < block->n_instructions; i++)
+    {
+      ir_instruction_t* check = &block->instructions[i];
+      if (check->opcode != IR_CHECK_BOUNDS)
+        continue;
+
+      int64_t length = array_length(check->symbol);
+      value_range_t range = value_range(definitions, definition_blocks, block, check->a, true);
+      bool redundant = range.low >= 0 && range.high < length;
+      for (size_t k = 0; k < n_passed && !redundant; k++)
+        redundant = same_operand(passed[k].index, check->a) && passed[k].length <= length &&
+                    ir_dominates(passed[k].block, block);
+
+      if (redundant)
+      {
+        if (removed[block->id] == NULL)
+          removed[block->id] = calloc(block->n_instructions, sizeof(bool));
+        removed[block->id][i] = true;
+        bounds_checks_removed++;
+        changed = true;
+        continue;
+      }
+      if (n_passed == passed_capacity)
+      {
+        passed_capacity *= 2;
+        passed = realloc(passed, passed_capacity * sizeof(passed_check_t));
+      }
+      passed[n_passed++] = (passed_check_t){.block = block, .index = check->a, .length = length};
+    }
+  }
+
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* block = function->blocks[b];
+    if (removed[b] == NULL)
+      continue;
+    size_t n_kept = 0;
+    for (size_t i = 0; i < block->n_instructions; i++)
+      if (!removed[b][i])
+        block->instructions[n_kept++] = block->instructions[i];
+    block->n_instructions = n_kept;
+    free(removed[b]);
+  }
+
+  free(removed);
+  free(passed);
+  free(order);
+  free(definitions);
+  free(definition_blocks);
+  return changed;
+}
+
+/* Profile-guided block layout */
+
+// Orders the blocks so that the successor that ran most often in the profile directly follows
+// each block, which lets the hot path fall through, and only the cold path jump:
+//   entry:                              entry:
+//     branch lt %0, 10 ? then1 : else1    branch lt %0, 10 ? then1 : else1
+//   then1: (ran once)                   else1: (ran 1000 times)
+//     jump endif1                         ...
+//   else1: (ran 1000 times)             endif1:
+//     ...                                 ...
+// The blocks are placed in chains starting at the entry, each continuing with the successor
+// that ran most often and is not placed yet. Blocks without a count are taken last. Once all the
+// successors are placed, a new chain starts with the block that came first in the old order
+static void lay_out_hot_paths(ir_function_t* function)
+{
+  size_t n_blocks = function->n_blocks;
+  ir_block_t** order = malloc(n_blocks * sizeof(ir_block_t*));
+  bool* placed = calloc(n_blocks, sizeof(bool));
+  size_t n_placed = 0;
+  size_t first_unplaced = 0;
+
+  ir_block_t* block = function->blocks[0];
+  while (block != NULL)
+  {
+    placed[block->id] = true;
+    order[n_placed++] = block;
+
+    ir_block_t* successors[2];
+    size_t n_successors = ir_block_successors(block, successors);
+    ir_block_t* next = NULL;
+    for (size_t i = 0; i < n_successors; i++)
+      if (!placed[successors[i]->id] &&
+          (next == NULL || successors[i]->profile_count > next->profile_count))
+        next = successors[i];
+
+    while (next == NULL && first_unplaced < n_blocks)
+    {
+      if (!placed[first_unplaced])
+        next = function->blocks[first_unplaced];
+      else
+        first_unplaced++;
+    }
+    block = next;
+  }
+
+  for (size_t i = 0; i < n_blocks; i++)
+  {
+    function->blocks[i] = order[i];
+    function->blocks[i]->id = i;
+  }
+  free(placed);
+  free(order);
+}
+
+/* Loop rotation */
+
+// Loops with a header larger than this are not rotated, to limit how much code is copied
+#define ROTATE_HEADER_LIMIT 12
+
+// Moves the test of every while loop to the bottom, so that each iteration ends with a single
+// conditional branch backwards, instead of a jump back to the test at the top:
+//   while1:                             while1:
+//     branch lt %1, %0 ? do1 : endwhile1  branch lt %1, %0 ? do1 : endwhile1
+//   do1:                                do1:
+//     %1 = add %1, 1                      %1 = add %1, 1
+//     jump while1                         branch lt %1, %0 ? do1 : endwhile1
+//   endwhile1:                          endwhile1:
+// The header is copied into every block jumping back to it, and only runs as a guard when the
+// loop is entered. Must be done out of SSA form, since the copies define the same vregs
+static void rotate_loops(ir_function_t* function)
+{
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* latch = function->blocks[b];
+    ir_instruction_t* jump = ir_block_terminator(latch);
+    if (jump == NULL || jump->opcode != IR_JUMP)
+      continue;
+
+    // The entry block can not be copied, as the generator expects its variable zeroing first
+    ir_block_t* header = jump->targets[0];
+    if (header->id == 0 || header->id >= latch->id ||
+        header->n_instructions > ROTATE_HEADER_LIMIT ||
+        ir_block_terminator(header)->opcode != IR_BRANCH)
+      continue;
+
+    latch->n_instructions--;
+    for (size_t i = 0; i < header->n_instructions; i++)
+    {
+      ir_instruction_t instruction = header->instructions[i];
+      if (instruction.n_args > 0)
+      {
+        instruction.args = malloc(instruction.n_args * sizeof(ir_operand_t));
+        memcpy(instruction.args, header->instructions[i].args,
+               instruction.n_args * sizeof(ir_operand_t));
+      }
+      ir_append_instruction(latch, instruction);
+    }
+  }
+}
+
+// Lays out the blocks, by the profile from -fprofile-use if there is one, and rotates the loops.
+// Done last, as the other passes place the blocks they create in the old order
+static void lay_out_blocks(ir_function_t* function)
+{
+  if (ir_has_profile(function))
+    lay_out_hot_paths(function);
+  if (feature_loops)
+    rotate_loops(function);
+}
+
+// Optimizes a single function, by turning tail recursion into loops, taking it into SSA form, and running passes until none of
+// them change anything more. Without -fssa, only the local strength reduction and dead store
+// elimination are done. Finally the blocks are laid out, and the loops rotated
+static void optimize_function(ir_function_t* function)
+{
+  if (feature_tail_calls)
+    eliminate_tail_recursion(function);
+
+  if (!feature_ssa)
+  {
+    reduce_strength(function);
+    if (feature_dead_stores)
+      eliminate_dead_stores(function);
+    lay_out_blocks(function);
+    return;
+  }
+
+  ir_compute_cfg(function);
+  ir_construct_ssa(function);
+
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    changed |= propagate_conditional_constants(function);
+    changed |= propagate_constants_and_copies(function);
+    changed |= fold_branch_conditions(function);
+    if (feature_cse)
+      changed |= eliminate_common_subexpressions(function);
+    if (feature_loops)
+      changed |= optimize_loops(function);
+    if (feature_bounds_check)
+      changed |= eliminate_bounds_checks(function);
+    changed |= eliminate_dead_code(function);
+  }
+
+  // The loops are vectorized last, since the other passes do not know the vector operations
+  if (feature_vectorize && vectorize_loops(function))
+    ir_compute_cfg(function);
+
+  // Only done once all constants are known
+  reduce_strength(function);
+
+  ir_destruct_ssa(function);
+
+  // The passes after the loop, and the moves replacing the phis, can leave results that are never read
+  if (feature_dead_stores)
+    eliminate_dead_stores(function);
+
+  lay_out_blocks(function);
+}
@@ -1,21 +1,18 @@
 %{
 #include "vslc.h"
 
-// State variables from the flex generated scanner
-extern int yylineno;  // The line currently being read
-extern char yytext[]; // The text of the last consumed lexeme
-
 // The main flex driver function used by the parser
-int yylex(void);
+int yylex(YYSTYPE* lvalp, yyscan_t scanner);
 
 // The function called by the parser when errors occur
-int yyerror(const char *error)
+int yyerror(yyscan_t scanner, const char *error)
 {
-  fprintf(stderr, "%s on line %d\n", error, yylineno);
+  fprintf(stderr, "%s on line %d\n", error, yyget_lineno(scanner));
   exit(EXIT_FAILURE);
 }
 
-// Helper macros for creating nodes
+// Helper macros for creating nodes. Lists are built with begin_list(), push_list_element() and
+// finish_list() instead, see tree.h
 #define N0C(type) \
   node_create( (type), 0 )
 #define N1C(type, child0) \
@@ -26,6 +23,11 @@ int yyerror(const char *error)
   node_create( (type), 3, (child0), (child1), (child2) )
 %}
 
+// The parser keeps no global state, and reads tokens from the scanner it is given.
+// The text of the last consumed lexeme is found with yyget_text(scanner)
+%define api.pure full
+%param {yyscan_t scanner}
+
 %token FUNC PRINT RETURN BREAK IF THEN ELSE WHILE DO VAR
 %token NUMBER_TOKEN IDENTIFIER_TOKEN STRING_TOKEN
 
@@ -42,24 +44,24 @@ int yyerror(const char *error)
 
 %%
 program :
-      global_list { root = $1; }
+      global_list { root = finish_list($1); }
     ;
 global_list :
-      global { $$ = N1C(LIST, $1); }
-    | global_list global { $$ = append_to_list_node($1, $2); }
+      global { $$ = begin_list($1); }
+    | global_list global { push_list_element($2); $$ = $1; }
     ;
 global :
       function { $$ = $1; }
     | global_declaration { $$ = $1; }
     ;
 global_declaration :
-      VAR global_variable_list { $$ = N1C(GLOBAL_DECLARATION, $2); }
+      VAR declared_variable_list { $$ = N1C(GLOBAL_DECLARATION, finish_list($2)); }
     ;
-global_variable_list :
-      global_variable { $$ = N1C(LIST, $1); }
-    | global_variable_list ',' global_variable { $$ = append_to_list_node($1, $3); }
+declared_variable_list :
+      declared_variable { $$ = begin_list($1); }
+    | declared_variable_list ',' declared_variable { push_list_element($3); $$ = $1; }
     ;
-global_variable :
+declared_variable :
       identifier { $$ = $1; }
     | array_indexing { $$ = $1; }
     ;
@@ -67,19 +69,19 @@ array_indexing:
       identifier '[' expression ']' { $$ = N2C(ARRAY_INDEXING, $1, $3); }
     ;
 variable_list :
-      identifier { $$ = N1C(LIST, $1); }
-    | variable_list ',' identifier { $$ = append_to_list_node($1, $3); }
+      identifier { $$ = begin_list($1); }
+    | variable_list ',' identifier { push_list_element($3); $$ = $1; }
     ;
 local_declaration :
-      VAR variable_list { $$ = $2; }
+      VAR declared_variable_list { $$ = finish_list($2); }
     ;
 local_declaration_list :
-      local_declaration { $$ = N1C(LIST, $1); }
-    | local_declaration_list local_declaration { $$ = append_to_list_node($1, $2); }
+      local_declaration { $$ = begin_list($1); }
+    | local_declaration_list local_declaration { push_list_element($2); $$ = $1; }
     ;
 parameter_list :
      /* epsilon */ { $$ = N0C(LIST); }
-    | variable_list { $$ = $1; }
+    | variable_list { $$ = finish_list($1); }
     ;
 function :
       FUNC identifier '(' parameter_list ')' statement
@@ -97,13 +99,17 @@ statement :
     ;
 block :
       '{' local_declaration_list statement_list '}'
-        { $$ = N2C(BLOCK, $2, $3); }
+        {
+          // The statements are above the declarations among the unfinished list elements
+          node_id_t statements = finish_list($3);
+          $$ = N2C(BLOCK, finish_list($2), statements);
+        }
     | '{' statement_list '}'
-        { $$ = N1C(BLOCK, $2); }
+        { $$ = N1C(BLOCK, finish_list($2)); }
     ;
 statement_list :
-      statement { $$ = N1C(LIST, $1); }
-    | statement_list statement { $$ = append_to_list_node($1, $2); }
+      statement { $$ = begin_list($1); }
+    | statement_list statement { push_list_element($2); $$ = $1; }
     ;
 assignment_statement :
       identifier '=' expression { $$ = N2C(ASSIGNMENT_STATEMENT, $1, $3); }
@@ -115,11 +121,11 @@ return_statement :
     ;
 print_statement :
       PRINT print_list
-        { $$ = N1C(PRINT_STATEMENT, $2); }
+        { $$ = N1C(PRINT_STATEMENT, finish_list($2)); }
     ;
 print_list :
-      print_item { $$ = N1C(LIST, $1); }
-    | print_list ',' print_item { $$ = append_to_list_node($1, $3); }
+      print_item { $$ = begin_list($1); }
+    | print_list ',' print_item { push_list_element($3); $$ = $1; }
     ;
 print_item :
       expression { $$ = $1; }
@@ -142,62 +148,62 @@ expression :
       expression '=' '=' expression
         {
           $$ = N2C(OPERATOR, $1, $4);
-          $$->data.operator = "==";
+          node_get($$)->data.operator = "==";
         }
     | expression '!' '=' expression
         {
           $$ = N2C(OPERATOR, $1, $4);
-          $$->data.operator = "!=";
+          node_get($$)->data.operator = "!=";
         }
     | expression '<' expression
         {
           $$ = N2C(OPERATOR, $1, $3);
-          $$->data.operator = "<";
+          node_get($$)->data.operator = "<";
         }
     | expression '<' '=' expression
         {
           $$ = N2C(OPERATOR, $1, $4);
-          $$->data.operator = "<=";
+          node_get($$)->data.operator = "<=";
         }
     | expression '>' expression
         {
           $$ = N2C(OPERATOR, $1, $3);
-          $$->data.operator = ">";
+          node_get($$)->data.operator = ">";
         }
     | expression '>' '=' expression
         {
           $$ = N2C(OPERATOR, $1, $4);
-          $$->data.operator = ">=";
+          node_get($$)->data.operator = ">=";
         }
     | expression '+' expression
         {
           $$ = N2C(OPERATOR, $1, $3);
-          $$->data.operator = "+";
+          node_get($$)->data.operator = "+";
         }
     | expression '-' expression
         {
           $$ = N2C(OPERATOR, $1, $3);
-          $$->data.operator = "-";
+          node_get($$)->data.operator = "-";
         }
     | expression '*' expression
         {
           $$ = N2C(OPERATOR, $1, $3);
-          $$->data.operator = "*";
+          node_get($$)->data.operator = "*";
         }
     | expression '/' expression
         {
           $$ = N2C(OPERATOR, $1, $3);
-          $$->data.operator = "/";
+          node_get($$)->data.operator = "/";
         }
     | '-' expression %prec UNARY_OPERATORS
         {
           $$ = N1C(OPERATOR, $2);
-          $$->data.operator = "-";
+          node_get($$)->data.operator = "-";
         }
     | '!' expression %prec UNARY_OPERATORS
         {
           $$ = N1C(OPERATOR, $2);
-          $$->data.operator = "!";
+          node_get($$)->data.operator = "!";
         }
     | '(' expression ')' { $$ = $2; }
     | number { $$ = $1; }
@@ -208,30 +214,30 @@ expression :
 function_call :
       identifier '(' argument_list ')' { $$ = N2C(FUNCTION_CALL, $1, $3); }
 argument_list :
-      expression_list { $$ = $1; }
+      expression_list { $$ = finish_list($1); }
     | /* epsilon */   { $$ = N0C(LIST); }
     ;
 expression_list :
-      expression { $$ = N1C(LIST, $1); }
-    | expression_list ',' expression { $$ = append_to_list_node($1, $3); }
+      expression { $$ = begin_list($1); }
+    | expression_list ',' expression { push_list_element($3); $$ = $1; }
     ;
 identifier :
       IDENTIFIER_TOKEN
       {
         $$ = N0C(IDENTIFIER);
-        // Allocate a copy of yytext to keep in the syntax tree as data
-        $$->data.identifier = strdup(yytext);
+        // Identical identifiers share the same atom, which is kept in the syntax tree as data
+        node_get($$)->data.identifier = atom_intern(yyget_text(scanner), strlen(yyget_text(scanner)));
       }
 number :
       NUMBER_TOKEN
       {
         $$ = N0C(NUMBER_LITERAL);
-        $$->data.number_literal = strtol(yytext, NULL, 10);
+        node_get($$)->data.number_literal = strtol(yyget_text(scanner), NULL, 10);
       }
 string :
       STRING_TOKEN
       {
         $$ = N0C(STRING_LITERAL);
-        $$->data.string_literal = strdup(yytext);
+        node_get($$)->data.string_literal = node_strdup(yyget_text(scanner));
       }
 %%
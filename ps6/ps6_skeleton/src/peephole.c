@@ -0,0 +1,637 @@
+#include "vslc.h"
+
+#include "emit.h"
+
+// One line of assembly output.
+// Instructions are split into their mnemonic and operands, so that patterns can be matched
+typedef struct
+{
+  asm_line_kind_t kind;
+  bool removed;
+
+  char* text; // The whole line, for labels and directives
+
+  char* mnemonic;     // For instructions only
+  char* operands[3];  // At most three operands, in AT&T order (sources first)
+  size_t n_operands;
+} asm_line_t;
+
+// All lines emitted since the last flush
+static _Thread_local asm_line_t* lines;
+static _Thread_local size_t n_lines;
+static _Thread_local size_t lines_capacity;
+
+_Thread_local FILE* assembly_output;
+_Thread_local FILE* assembly_copy;
+
+// The text of the lines is kept in large chunks, which are all freed by flush_assembly(),
+// instead of allocating every line and operand on its own
+#define TEXT_CHUNK_SIZE (1 << 16)
+static _Thread_local char** text_chunks;
+static _Thread_local size_t n_text_chunks;
+static _Thread_local size_t text_chunk_used; // Bytes used of the last chunk
+
+// Returns a copy of the characters, ending in a zero byte, placed in the text chunks
+static char* copy_text(const char* text, size_t length)
+{
+  if (n_text_chunks == 0 || text_chunk_used + length + 1 > TEXT_CHUNK_SIZE)
+  {
+    text_chunks = realloc(text_chunks, (n_text_chunks + 1) * sizeof(char*));
+    text_chunks[n_text_chunks++] = malloc(length + 1 > TEXT_CHUNK_SIZE ? length + 1 : TEXT_CHUNK_SIZE);
+    text_chunk_used = 0;
+  }
+  char* copy = text_chunks[n_text_chunks - 1] + text_chunk_used;
+  memcpy(copy, text, length);
+  copy[length] = '\0';
+  text_chunk_used += length + 1;
+  return copy;
+}
+
+static void free_text_chunks(void)
+{
+  for (size_t i = 0; i < n_text_chunks; i++)
+    free(text_chunks[i]);
+  free(text_chunks);
+  text_chunks = NULL;
+  n_text_chunks = 0;
+}
+
+// Appends a line to the buffer, and returns it
+static asm_line_t* add_line(asm_line_kind_t kind)
+{
+  if (n_lines + 1 >= lines_capacity)
+  {
+    lines_capacity = lines_capacity * 2 + 64;
+    lines = realloc(lines, lines_capacity * sizeof(asm_line_t));
+  }
+  asm_line_t* line = &lines[n_lines++];
+  *line = (asm_line_t){.kind = kind, .removed = false};
+  return line;
+}
+
+// Splits the text of an instruction into its mnemonic and operands.
+// Operands are separated by commas that are not inside parentheses or character literals
+static void parse_instruction(asm_line_t* line, const char* text)
+{
+  size_t mnemonic_length = strcspn(text, " \t");
+  line->mnemonic = copy_text(text, mnemonic_length);
+  line->n_operands = 0;
+
+  const char* position = text + mnemonic_length;
+  while (*position != '\0')
+  {
+    position += strspn(position, " \t");
+    if (*position == '\0')
+      break;
+
+    // Find the end of this operand
+    const char* end = position;
+    int depth = 0;
+    bool in_character = false;
+    while (*end != '\0' && (*end != ',' || depth > 0 || in_character))
+    {
+      if (*end == '\'')
+        in_character = !in_character;
+      else if (*end == '\\' && in_character && end[1] != '\0')
+        end++;
+      else if (*end == '(' && !in_character)
+        depth++;
+      else if (*end == ')' && !in_character)
+        depth--;
+      end++;
+    }
+
+    assert(line->n_operands < 3 && "Instruction has too many operands");
+    line->operands[line->n_operands++] = copy_text(position, end - position);
+    position = *end == ',' ? end + 1 : end;
+  }
+}
+
+// Most lines are short enough to be formatted on the stack
+#define LINE_BUFFER_SIZE 256
+
+void emit_line(asm_line_kind_t kind, const char* format, ...)
+{
+  char buffer[LINE_BUFFER_SIZE];
+  char* text = buffer;
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  if (length >= LINE_BUFFER_SIZE)
+  {
+    text = malloc(length + 1);
+    va_start(args, format);
+    vsnprintf(text, length + 1, format, args);
+    va_end(args);
+  }
+
+  asm_line_t* line = add_line(kind);
+  if (kind == ASM_INSTRUCTION)
+    parse_instruction(line, text);
+  else
+    line->text = copy_text(text, length);
+  if (text != buffer)
+    free(text);
+}
+
+void emit_instruction(const char* mnemonic, const char* a, const char* b)
+{
+  asm_line_t* line = add_line(ASM_INSTRUCTION);
+  line->mnemonic = copy_text(mnemonic, strlen(mnemonic));
+  if (a != NULL)
+    line->operands[line->n_operands++] = copy_text(a, strlen(a));
+  if (b != NULL)
+    line->operands[line->n_operands++] = copy_text(b, strlen(b));
+}
+
+/* Helpers for matching patterns */
+
+static bool is_instruction(asm_line_t* line, const char* mnemonic, size_t n_operands)
+{
+  return line != NULL && line->kind == ASM_INSTRUCTION && strcmp(line->mnemonic, mnemonic) == 0 &&
+         line->n_operands == n_operands;
+}
+
+static bool is_register(const char* operand)
+{
+  return operand[0] == '%';
+}
+
+static bool is_memory(const char* operand)
+{
+  return operand[0] != '%' && operand[0] != '$';
+}
+
+// Returns the name of the 64-bit register containing the given register
+static const char* full_register(const char* name, size_t length)
+{
+  static const char* aliases[][3] = {
+      {RAX, EAX, AL},
+      {RCX, "%ecx", "%cl"},
+      {RDX, "%edx", "%dl"},
+      {RBX, "%ebx", "%bl"},
+      {RSI, "%esi", "%sil"},
+      {RDI, "%edi", "%dil"},
+      {RSP, "%esp", "%spl"},
+      {RBP, "%ebp", "%bpl"},
+  };
+  for (size_t i = 0; i < sizeof(aliases) / sizeof(aliases[0]); i++)
+    for (size_t j = 0; j < 3; j++)
+      if (strlen(aliases[i][j]) == length && strncmp(aliases[i][j], name, length) == 0)
+        return aliases[i][0];
+  return NULL;
+}
+
+// Returns true if the operand reads or writes any part of the given 64-bit register
+static bool mentions_register(const char* operand, const char* reg)
+{
+  for (const char* position = strchr(operand, '%'); position != NULL;
+       position = strchr(position + 1, '%'))
+  {
+    size_t length = 1 + strspn(position + 1, "abcdefghijklmnopqrstuvwxyz0123456789");
+    const char* full = full_register(position, length);
+    if (full ? strcmp(full, reg) == 0 : strlen(reg) == length && strncmp(position, reg, length) == 0)
+      return true;
+  }
+  return false;
+}
+
+static bool line_mentions_register(asm_line_t* line, const char* reg)
+{
+  for (size_t i = 0; i < line->n_operands; i++)
+    if (mentions_register(line->operands[i], reg))
+      return true;
+  return false;
+}
+
+// Returns the next line after index that has not been removed, or NULL
+static asm_line_t* next_line(size_t* index)
+{
+  for (size_t i = *index + 1; i < n_lines; i++)
+  {
+    if (!lines[i].removed)
+    {
+      *index = i;
+      return &lines[i];
+    }
+  }
+  return NULL;
+}
+
+static void remove_line(asm_line_t* line)
+{
+  line->removed = true;
+}
+
+// Replaces the mnemonic and operands of an instruction
+static void rewrite_instruction(asm_line_t* line, const char* mnemonic, const char* a, const char* b)
+{
+  char* new_mnemonic = copy_text(mnemonic, strlen(mnemonic));
+  char* new_a = a ? copy_text(a, strlen(a)) : NULL;
+  char* new_b = b ? copy_text(b, strlen(b)) : NULL;
+
+  line->mnemonic = new_mnemonic;
+  line->operands[0] = new_a;
+  line->operands[1] = new_b;
+  line->n_operands = a == NULL ? 0 : b == NULL ? 1 : 2;
+}
+
+// The condition codes, and the condition codes that are true when they are false
+static const char* CONDITION_CODES[][2] = {
+    {"e", "ne"},
+    {"ne", "e"},
+    {"l", "ge"},
+    {"ge", "l"},
+    {"le", "g"},
+    {"g", "le"},
+};
+
+// Returns the condition code of a setcc instruction, or NULL if it is not one
+static const char* setcc_condition(asm_line_t* line)
+{
+  if (line->kind != ASM_INSTRUCTION || strncmp(line->mnemonic, "set", 3) != 0)
+    return NULL;
+  for (size_t i = 0; i < sizeof(CONDITION_CODES) / sizeof(CONDITION_CODES[0]); i++)
+    if (strcmp(line->mnemonic + 3, CONDITION_CODES[i][0]) == 0)
+      return CONDITION_CODES[i][0];
+  return NULL;
+}
+
+static const char* inverse_condition(const char* condition)
+{
+  for (size_t i = 0; i < sizeof(CONDITION_CODES) / sizeof(CONDITION_CODES[0]); i++)
+    if (strcmp(condition, CONDITION_CODES[i][0]) == 0)
+      return CONDITION_CODES[i][1];
+  assert(false && "Unknown condition code");
+}
+
+/* The patterns */
+
+// movq X, X does nothing
+static bool remove_self_move(size_t i)
+{
+  asm_line_t* line = &lines[i];
+  if (!is_instruction(line, "movq", 2) || strcmp(line->operands[0], line->operands[1]) != 0)
+    return false;
+  remove_line(line);
+  return true;
+}
+
+// A jump to a label directly following it can be removed:
+//   jmp L
+// L:
+static bool remove_jump_to_next(size_t i)
+{
+  asm_line_t* jump = &lines[i];
+  if (!is_instruction(jump, "jmp", 1))
+    return false;
+
+  // Several labels can point to the next instruction, and loops are aligned before their label
+  size_t j = i;
+  for (asm_line_t* line = next_line(&j);
+       line != NULL && (line->kind == ASM_LABEL ||
+                        (line->kind == ASM_DIRECTIVE && strncmp(line->text, ".p2align", 8) == 0));
+       line = next_line(&j))
+  {
+    if (strcmp(line->text, jump->operands[0]) == 0)
+    {
+      remove_line(jump);
+      return true;
+    }
+  }
+  return false;
+}
+
+// A push followed by a pop, with only register moves in between, becomes a move:
+//   pushq X            movq X, Y
+//   movq A, R    =>    movq A, R
+//   popq Y
+// This requires that the moves in between neither read nor write Y, and don't use the stack
+static bool push_pop_to_move(size_t i)
+{
+  asm_line_t* push = &lines[i];
+  if (!is_instruction(push, "pushq", 1) || mentions_register(push->operands[0], RSP))
+    return false;
+
+  size_t j = i;
+  asm_line_t* line;
+  for (line = next_line(&j); line != NULL; line = next_line(&j))
+  {
+    if (is_instruction(line, "popq", 1))
+      break;
+    if (!is_instruction(line, "movq", 2) || !is_register(line->operands[1]))
+      return false;
+    if (line_mentions_register(line, RSP))
+      return false;
+  }
+  if (line == NULL)
+    return false;
+
+  asm_line_t* pop = line;
+  const char* y = pop->operands[0];
+  if (!is_register(y) || (is_memory(push->operands[0]) && is_memory(y)))
+    return false;
+
+  size_t k = i;
+  for (asm_line_t* between = next_line(&k); between != pop; between = next_line(&k))
+    if (line_mentions_register(between, y))
+      return false;
+
+  if (strcmp(push->operands[0], y) == 0)
+    remove_line(push);
+  else
+    rewrite_instruction(push, "movq", push->operands[0], y);
+  remove_line(pop);
+  return true;
+}
+
+// Loading a value that was just stored, or storing a value that was just loaded, is redundant:
+//   movq R, M          movq R, M
+//   movq M, S    =>    movq R, S
+static bool remove_redundant_load(size_t i)
+{
+  asm_line_t* first = &lines[i];
+  if (!is_instruction(first, "movq", 2))
+    return false;
+
+  size_t j = i;
+  asm_line_t* second = next_line(&j);
+  if (!is_instruction(second, "movq", 2) || strcmp(first->operands[1], second->operands[0]) != 0)
+    return false;
+
+  const char* a = first->operands[0];
+  const char* b = first->operands[1];
+  // One of the locations must be a register, and the register must not be part of the address
+  const char* reg = is_register(a) ? a : is_register(b) ? b : NULL;
+  if (reg == NULL || (is_memory(a) && mentions_register(a, reg)) ||
+      (is_memory(b) && mentions_register(b, reg)))
+    return false;
+
+  // Moving the value back where it came from
+  if (strcmp(second->operands[1], a) == 0)
+  {
+    remove_line(second);
+    return true;
+  }
+
+  // Reading the stored value from the register instead of memory
+  if (is_register(a) && is_memory(b) && !is_memory(second->operands[1]))
+  {
+    rewrite_instruction(second, "movq", a, second->operands[1]);
+    return true;
+  }
+  return false;
+}
+
+// Testing the result of a setcc against 0 can use the flags of the original comparison:
+//   setcc %al                setcc %al
+//   movzbq %al, %rax         movzbq %al, %rax
+//   movq %rax, X       =>    movq %rax, X
+//   cmpq $0, X               jcc L
+//   jne L
+// Any number of movq's from %rax can be in between, as they don't change the flags.
+// If the 0 or 1 is only used by the jump, the setcc and movzbq are removed as well
+static bool fuse_setcc_jump(size_t i)
+{
+  asm_line_t* setcc = &lines[i];
+  const char* condition = setcc_condition(setcc);
+  if (condition == NULL || strcmp(setcc->operands[0], AL) != 0)
+    return false;
+
+  size_t j = i;
+  asm_line_t* extend = next_line(&j);
+  if (!is_instruction(extend, "movzbq", 2) || strcmp(extend->operands[0], AL) != 0 ||
+      strcmp(extend->operands[1], RAX) != 0)
+    return false;
+
+  // Skip copies of %rax, remembering if the value is used by anything but the jump
+  asm_line_t* copies[8];
+  size_t n_copies = 0;
+  asm_line_t* line;
+  for (line = next_line(&j); n_copies < 8 && is_instruction(line, "movq", 2) &&
+                             strcmp(line->operands[0], RAX) == 0 &&
+                             !mentions_register(line->operands[1], RAX);
+       line = next_line(&j))
+    copies[n_copies++] = line;
+
+  // The comparison must be of the result of the setcc
+  asm_line_t* compare = line;
+  if (!is_instruction(compare, "cmpq", 2) || strcmp(compare->operands[0], "$0") != 0)
+    return false;
+  bool compares_result = strcmp(compare->operands[1], RAX) == 0;
+  for (size_t k = 0; k < n_copies; k++)
+    if (strcmp(compare->operands[1], copies[k]->operands[1]) == 0)
+      compares_result = true;
+  if (!compares_result)
+    return false;
+
+  asm_line_t* jump = next_line(&j);
+  bool jump_if_zero = is_instruction(jump, "je", 1);
+  if (!jump_if_zero && !is_instruction(jump, "jne", 1))
+    return false;
+
+  char mnemonic[8];
+  snprintf(mnemonic, sizeof(mnemonic), "j%s", jump_if_zero ? inverse_condition(condition) : condition);
+  rewrite_instruction(jump, mnemonic, jump->operands[0], NULL);
+  remove_line(compare);
+
+  // %rax is only a scratch register, and never holds a value past a jump
+  if (n_copies == 0)
+  {
+    remove_line(setcc);
+    remove_line(extend);
+  }
+  return true;
+}
+
+// Runs all patterns over the buffered lines, until none of them match
+static void optimize_lines(void)
+{
+  static bool (*const patterns[])(size_t) = {
+      remove_self_move,
+      remove_jump_to_next,
+      push_pop_to_move,
+      remove_redundant_load,
+      fuse_setcc_jump,
+  };
+
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (size_t i = 0; i < n_lines; i++)
+    {
+      for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++)
+      {
+        if (lines[i].removed)
+          break;
+        if (patterns[p](i))
+          changed = true;
+      }
+    }
+  }
+}
+
+// The text output by flush_assembly() is collected in a large buffer, and written to the file
+// a buffer at a time, instead of formatting each line with fprintf()
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+typedef struct
+{
+  FILE* file;
+  char* buffer;
+  size_t length;
+} output_sink_t;
+
+static output_sink_t open_sink(FILE* file)
+{
+  return (output_sink_t){.file = file, .buffer = malloc(OUTPUT_BUFFER_SIZE), .length = 0};
+}
+
+static void write_sink(output_sink_t* sink)
+{
+  fwrite(sink->buffer, 1, sink->length, sink->file);
+  sink->length = 0;
+}
+
+static void close_sink(output_sink_t* sink)
+{
+  write_sink(sink);
+  free(sink->buffer);
+  sink->buffer = NULL;
+}
+
+static void append_output(output_sink_t* sink, const char* text, size_t length)
+{
+  if (sink->length + length > OUTPUT_BUFFER_SIZE)
+  {
+    write_sink(sink);
+    // Text larger than the buffer is written directly
+    if (length > OUTPUT_BUFFER_SIZE)
+    {
+      fwrite(text, 1, length, sink->file);
+      return;
+    }
+  }
+  memcpy(sink->buffer + sink->length, text, length);
+  sink->length += length;
+}
+
+static void append_string(output_sink_t* sink, const char* text)
+{
+  append_output(sink, text, strlen(text));
+}
+
+// Outputs the line as text, the way the GNU assembler reads it
+static void print_line(output_sink_t* sink, asm_line_t* line)
+{
+  switch (line->kind)
+  {
+  case ASM_DIRECTIVE:
+    append_string(sink, line->text);
+    append_output(sink, "\n", 1);
+    break;
+  case ASM_LABEL:
+    append_string(sink, line->text);
+    append_output(sink, ":\n", 2);
+    break;
+  case ASM_INSTRUCTION:
+    append_output(sink, "\t", 1);
+    append_string(sink, line->mnemonic);
+    for (size_t j = 0; j < line->n_operands; j++)
+    {
+      append_output(sink, j == 0 ? " " : ", ", j == 0 ? 1 : 2);
+      append_string(sink, line->operands[j]);
+    }
+    append_output(sink, "\n", 1);
+    break;
+  }
+}
+
+// Gives the line to the in-process assembler
+static void assemble_line(asm_line_t* line)
+{
+  switch (line->kind)
+  {
+  case ASM_DIRECTIVE:
+    assemble_directive(line->text);
+    break;
+  case ASM_LABEL:
+    assemble_label(line->text);
+    break;
+  case ASM_INSTRUCTION:
+    assemble_instruction(line->mnemonic, line->operands, line->n_operands);
+    break;
+  }
+}
+
+void flush_assembly(void)
+{
+  if (feature_peephole)
+    optimize_lines();
+
+  output_sink_t output = {.buffer = NULL};
+  output_sink_t copy = {.buffer = NULL};
+  if (!ASSEMBLING)
+    output = open_sink(assembly_output != NULL ? assembly_output : stdout);
+  if (assembly_copy != NULL)
+    copy = open_sink(assembly_copy);
+
+  for (size_t i = 0; i < n_lines; i++)
+  {
+    asm_line_t* line = &lines[i];
+    if (line->removed)
+      continue;
+    if (ASSEMBLING)
+      assemble_line(line);
+    else
+      print_line(&output, line);
+    if (assembly_copy != NULL)
+      print_line(&copy, line);
+  }
+
+  if (output.buffer != NULL)
+    close_sink(&output);
+  if (copy.buffer != NULL)
+    close_sink(&copy);
+  free_text_chunks();
+  free(lines);
+  lines = NULL;
+  n_lines = 0;
+  lines_capacity = 0;
+}
+
+// The copied text is freed by the next flush_assembly()
+void emit_assembly_text(const char* text)
+{
+  if (!ASSEMBLING)
+  {
+    fputs(text, assembly_output != NULL ? assembly_output : stdout);
+    return;
+  }
+
+  // Instructions are indented by a tab, and labels end with a colon
+  while (*text != '\0')
+  {
+    size_t length = strcspn(text, "\n");
+    asm_line_t line = {.text = NULL};
+    if (text[0] == '\t')
+    {
+      line.kind = ASM_INSTRUCTION;
+      parse_instruction(&line, copy_text(text + 1, length - 1));
+    }
+    else if (length > 0 && text[length - 1] == ':')
+    {
+      line.kind = ASM_LABEL;
+      line.text = copy_text(text, length - 1);
+    }
+    else
+    {
+      line.kind = ASM_DIRECTIVE;
+      line.text = copy_text(text, length);
+    }
+    if (length > 0)
+      assemble_line(&line);
+    text += text[length] == '\n' ? length + 1 : length;
+  }
+}
@@ -0,0 +1,120 @@
+#include "vslc.h"
+
+// Declared in ir.h
+_Thread_local char** profile_counter_formats = NULL;
+_Thread_local size_t n_profile_counters = 0;
+
+// Returns the name of the block in the profile, which is the name of its function and its label
+static char* counter_name(ir_function_t* function, ir_block_t* block)
+{
+  size_t length = strlen(function->symbol->name) + strlen(block->label) + 2;
+  char* name = malloc(length);
+  snprintf(name, length, "%s %s", function->symbol->name, block->label);
+  return name;
+}
+
+void ir_instrument_functions(void)
+{
+  for (size_t i = 0; i < ir_functions_len; i++)
+  {
+    ir_function_t* function = ir_functions[i];
+    for (size_t b = 0; b < function->n_blocks; b++)
+    {
+      ir_block_t* block = function->blocks[b];
+
+      // The entry block starts by zeroing the local variables, which the generator looks for
+      // at the very start, so its counter goes after them
+      size_t position = 0;
+      if (b == 0)
+        position = function->symbol->function_symtable->n_of_type[SYMBOL_LOCAL_VAR];
+
+      ir_instruction_t counter = {.opcode = IR_COUNT, .a = IR_CONST(n_profile_counters)};
+      ir_append_instruction(block, counter);
+      memmove(&block->instructions[position + 1],
+              &block->instructions[position],
+              (block->n_instructions - 1 - position) * sizeof(ir_instruction_t));
+      block->instructions[position] = counter;
+
+      char* name = counter_name(function, block);
+      size_t length = strlen(name) + sizeof(" %ld\\n");
+      char* format = malloc(length);
+      snprintf(format, length, "%s %%ld\\n", name);
+      free(name);
+
+      profile_counter_formats =
+          realloc(profile_counter_formats, (n_profile_counters + 1) * sizeof(char*));
+      profile_counter_formats[n_profile_counters++] = format;
+    }
+  }
+}
+
+// A block of the profile, with how many times it ran
+typedef struct
+{
+  char* name;
+  int64_t count;
+} profile_entry_t;
+
+static int compare_entries(const void* a, const void* b)
+{
+  return strcmp(((const profile_entry_t*)a)->name, ((const profile_entry_t*)b)->name);
+}
+
+void ir_apply_profile(const char* filename)
+{
+  FILE* file = fopen(filename, "r");
+  if (file == NULL)
+  {
+    fprintf(stderr, "error: could not open the profile '%s'\n", filename);
+    exit(EXIT_FAILURE);
+  }
+
+  // Every line is the function, the label of the block and the count, separated by spaces
+  profile_entry_t* entries = NULL;
+  size_t n_entries = 0;
+  char function_name[256], label[256];
+  long count;
+  while (fscanf(file, "%255s %255s %ld", function_name, label, &count) == 3)
+  {
+    entries = realloc(entries, (n_entries + 1) * sizeof(profile_entry_t));
+    size_t length = strlen(function_name) + strlen(label) + 2;
+    char* name = malloc(length);
+    snprintf(name, length, "%s %s", function_name, label);
+    entries[n_entries++] = (profile_entry_t){.name = name, .count = count};
+  }
+  if (!feof(file))
+  {
+    fprintf(stderr, "error: the profile '%s' is not written by -fprofile-generate\n", filename);
+    exit(EXIT_FAILURE);
+  }
+  fclose(file);
+  qsort(entries, n_entries, sizeof(profile_entry_t), compare_entries);
+
+  // Blocks missing from the profile, such as those of functions changed since, stay unknown
+  for (size_t i = 0; i < ir_functions_len; i++)
+  {
+    ir_function_t* function = ir_functions[i];
+    for (size_t b = 0; b < function->n_blocks; b++)
+    {
+      ir_block_t* block = function->blocks[b];
+      profile_entry_t key = {.name = counter_name(function, block)};
+      profile_entry_t* entry =
+          bsearch(&key, entries, n_entries, sizeof(profile_entry_t), compare_entries);
+      if (entry != NULL)
+        block->profile_count = entry->count;
+      free(key.name);
+    }
+  }
+
+  for (size_t i = 0; i < n_entries; i++)
+    free(entries[i].name);
+  free(entries);
+}
+
+bool ir_has_profile(ir_function_t* function)
+{
+  for (size_t b = 0; b < function->n_blocks; b++)
+    if (function->blocks[b]->profile_count >= 0)
+      return true;
+  return false;
+}
@@ -0,0 +1,362 @@
+#include "vslc.h"
+
+#include "emit.h"
+#include "regalloc.h"
+
+// Caller saved registers come first, so they are preferred for short lived values
+const char* ALLOCATABLE_REGISTERS[NUM_ALLOCATABLE_REGISTERS] = {
+    R8, R9, R10, R11, RSI, RDI, RBX, R12, R13, R14, R15};
+
+// In the System V calling convention, the first 6 integer parameters are passed in registers.
+// The rest are on the stack, with parameter 6 at 16(%rbp)
+#define NUM_REGISTER_PARAMS 6
+static const char* REGISTER_PARAMS[NUM_REGISTER_PARAMS] = {RDI, RSI, RDX, RCX, R8, R9};
+
+// Every instruction gets 4 positions, so that instruction number k:
+//   reads its operands at position 4k,
+//   clobbers caller saved registers at 4k+1 if it is a call,
+//   and writes its result at position 4k+2.
+// Prints make several calls while reading their arguments, so they clobber at position 4k-1.
+#define USE_POSITION(k) (4 * (int64_t)(k))
+#define CALL_POSITION(k) (4 * (int64_t)(k) + 1)
+#define PRINT_POSITION(k) (4 * (int64_t)(k)-1)
+#define DEF_POSITION(k) (4 * (int64_t)(k) + 2)
+
+// The parameters are moved to their locations before the first instruction, at this position
+#define ENTRY_POSITION (USE_POSITION(0) - 3)
+
+// The range of positions where a vreg is live. Holes in the range are ignored.
+// The weight is how many times the vreg is defined and used when the program runs, as counted
+// by the profile. Blocks without a count count as running once
+typedef struct
+{
+  size_t vreg;
+  int64_t start;
+  int64_t end;
+  int64_t weight;
+} live_interval_t;
+
+// Uses the vregs that are live at the start and end of each block
+// to calculate the live interval of every vreg.
+// Vregs that are local to a single block are live from their definition to their last use.
+static void compute_live_intervals(ir_function_t* function, live_interval_t* intervals)
+{
+  size_t n_vregs = function->n_vregs;
+  size_t n_blocks = function->n_blocks;
+
+  for (size_t v = 0; v < n_vregs; v++)
+    intervals[v] =
+        (live_interval_t){.vreg = v, .start = INT64_MAX, .end = INT64_MIN, .weight = 0};
+
+  ir_liveness_t liveness = ir_compute_liveness(function);
+  int64_t* global_index = liveness.global_index;
+
+  // Extend the live intervals to cover every definition and use,
+  // as well as the whole block for global vregs that are live in or out of it
+  size_t k = 0;
+  for (size_t b = 0; b < n_blocks; b++)
+  {
+    ir_block_t* block = function->blocks[b];
+    int64_t block_start = USE_POSITION(k) - 2;
+    int64_t block_end = USE_POSITION(k + block->n_instructions) - 1;
+    int64_t block_weight = block->profile_count < 0 ? 1 : block->profile_count;
+
+    for (size_t v = 0; v < n_vregs; v++)
+    {
+      if (global_index[v] == -1)
+        continue;
+      live_interval_t* interval = &intervals[v];
+      if (BITSET_TEST(liveness.live_in[b], global_index[v]) && block_start < interval->start)
+        interval->start = block_start;
+      if (BITSET_TEST(liveness.live_out[b], global_index[v]) && block_end > interval->end)
+        interval->end = block_end;
+    }
+
+    for (size_t i = 0; i < block->n_instructions; i++, k++)
+    {
+      ir_instruction_t* instruction = &block->instructions[i];
+      for (size_t s = 0; s < ir_source_count(instruction); s++)
+      {
+        ir_operand_t* operand = ir_source(instruction, s);
+        if (operand->kind != IR_OPERAND_VREG)
+          continue;
+        live_interval_t* interval = &intervals[operand->value];
+        if (USE_POSITION(k) < interval->start)
+          interval->start = USE_POSITION(k);
+        if (USE_POSITION(k) > interval->end)
+          interval->end = USE_POSITION(k);
+        interval->weight += block_weight;
+      }
+      int64_t def = ir_defined_vreg(instruction);
+      if (def >= 0)
+      {
+        live_interval_t* interval = &intervals[def];
+        if (DEF_POSITION(k) < interval->start)
+          interval->start = DEF_POSITION(k);
+        if (DEF_POSITION(k) > interval->end)
+          interval->end = DEF_POSITION(k);
+        interval->weight += block_weight;
+      }
+    }
+  }
+
+  // Every parameter that is used is moved to its location on entry, even when the value it is
+  // passed is dead, such as when it is assigned before it is read. Its register must then not be
+  // shared with any other parameter, so its interval starts with the moves
+  size_t n_parameters = FUNC_PARAM_COUNT(function->symbol);
+  for (size_t v = 0; v < n_parameters && v < n_vregs; v++)
+    if (intervals[v].start <= intervals[v].end)
+      intervals[v].start = ENTRY_POSITION;
+
+  ir_destroy_liveness(&liveness);
+}
+
+// Orders live intervals by their start position
+static int compare_interval_starts(const void* a, const void* b)
+{
+  const live_interval_t* lhs = a;
+  const live_interval_t* rhs = b;
+  if (lhs->start != rhs->start)
+    return lhs->start < rhs->start ? -1 : 1;
+  return lhs->vreg < rhs->vreg ? -1 : lhs->vreg > rhs->vreg;
+}
+
+// Returns true if there is a call position strictly inside the interval.
+// The call positions must be sorted
+static bool crosses_call(live_interval_t* interval, int64_t* calls, size_t n_calls)
+{
+  // Binary search for the first call after the start of the interval
+  size_t low = 0, high = n_calls;
+  while (low < high)
+  {
+    size_t mid = (low + high) / 2;
+    if (calls[mid] <= interval->start)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low < n_calls && calls[low] < interval->end;
+}
+
+// Finds all positions where a call clobbers the caller saved registers, in sorted order
+static int64_t* find_calls(ir_function_t* function, size_t* n_calls)
+{
+  int64_t* calls = NULL;
+  size_t capacity = 0;
+  *n_calls = 0;
+
+  size_t k = 0;
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* block = function->blocks[b];
+    for (size_t i = 0; i < block->n_instructions; i++, k++)
+    {
+      ir_instruction_t* instruction = &block->instructions[i];
+      if (!ir_is_call(instruction))
+        continue;
+      if (*n_calls + 1 >= capacity)
+      {
+        capacity = capacity * 2 + 8;
+        calls = realloc(calls, capacity * sizeof(int64_t));
+      }
+      calls[(*n_calls)++] =
+          instruction->opcode == IR_PRINT ? PRINT_POSITION(k) : CALL_POSITION(k);
+    }
+  }
+  return calls;
+}
+
+// Returns the index of the register in ALLOCATABLE_REGISTERS, or -1 if it is never allocated
+static int64_t allocatable_index(const char* reg)
+{
+  for (size_t r = 0; r < NUM_ALLOCATABLE_REGISTERS; r++)
+    if (strcmp(ALLOCATABLE_REGISTERS[r], reg) == 0)
+      return r;
+  return -1;
+}
+
+// Finds the register each vreg would rather have, or -1 for none. Parameters prefer the
+// register they are passed in, and arguments of calls the register they are passed in, so that
+// the moves between them and their vregs disappear
+static int64_t* find_register_hints(ir_function_t* function)
+{
+  int64_t* hints = malloc(function->n_vregs * sizeof(int64_t));
+  for (size_t v = 0; v < function->n_vregs; v++)
+    hints[v] = -1;
+
+  size_t n_parameters = FUNC_PARAM_COUNT(function->symbol);
+  for (size_t v = 0; v < n_parameters && v < NUM_REGISTER_PARAMS; v++)
+    hints[v] = allocatable_index(REGISTER_PARAMS[v]);
+
+  for (size_t b = 0; b < function->n_blocks; b++)
+  {
+    ir_block_t* block = function->blocks[b];
+    for (size_t i = 0; i < block->n_instructions; i++)
+    {
+      ir_instruction_t* instruction = &block->instructions[i];
+      if (instruction->opcode != IR_CALL)
+        continue;
+      for (size_t a = 0; a < instruction->n_args && a < NUM_REGISTER_PARAMS; a++)
+      {
+        ir_operand_t argument = instruction->args[a];
+        if (argument.kind == IR_OPERAND_VREG && hints[argument.value] == -1)
+          hints[argument.value] = allocatable_index(REGISTER_PARAMS[a]);
+      }
+    }
+  }
+  return hints;
+}
+
+register_allocation_t allocate_registers(ir_function_t* function)
+{
+  size_t n_vregs = function->n_vregs;
+  size_t n_parameters = FUNC_PARAM_COUNT(function->symbol);
+
+  register_allocation_t result = {
+      .locations = calloc(n_vregs, sizeof(vreg_location_t)),
+      .n_saved_registers = 0,
+      .n_stack_slots = 0,
+  };
+
+  live_interval_t* intervals = malloc(n_vregs * sizeof(live_interval_t));
+  compute_live_intervals(function, intervals);
+
+  size_t n_calls;
+  int64_t* calls = find_calls(function, &n_calls);
+  int64_t* hints = find_register_hints(function);
+  bool profiled = ir_has_profile(function);
+
+  // Only keep the vregs that are actually live somewhere, sorted by where they become live
+  size_t n_intervals = 0;
+  for (size_t v = 0; v < n_vregs; v++)
+    if (intervals[v].start <= intervals[v].end)
+      intervals[n_intervals++] = intervals[v];
+  qsort(intervals, n_intervals, sizeof(live_interval_t), compare_interval_starts);
+
+  // The intervals that currently have a register, and which register they have
+  live_interval_t* active[NUM_ALLOCATABLE_REGISTERS];
+  bool register_used[NUM_ALLOCATABLE_REGISTERS] = {false};
+  bool register_ever_used[NUM_ALLOCATABLE_REGISTERS] = {false};
+  size_t active_register[NUM_ALLOCATABLE_REGISTERS];
+  size_t n_active = 0;
+
+  for (size_t i = 0; i < n_intervals; i++)
+  {
+    live_interval_t* current = &intervals[i];
+    vreg_location_t* location = &result.locations[current->vreg];
+    location->used = true;
+
+    // Free the registers of intervals that have ended
+    for (size_t j = 0; j < n_active;)
+    {
+      if (active[j]->end < current->start)
+      {
+        register_used[active_register[j]] = false;
+        active[j] = active[n_active - 1];
+        active_register[j] = active_register[n_active - 1];
+        n_active--;
+      }
+      else
+        j++;
+    }
+
+    // Variables only get registers with -fregister-variables, or when the profile shows that
+    // they are used. Stack passed parameters are also fine staying where they are.
+    // The variables of inlined functions are not in the source of this function, so they are
+    // treated like temporaries
+    int64_t variable = function->vreg_variables[current->vreg];
+    bool is_variable =
+        variable >= 0 && (size_t)variable < function->symbol->function_symtable->n_symbols;
+    bool wants_register =
+        !is_variable || feature_register_variables || (profiled && current->weight > 0);
+
+    // Values that must survive calls, can only be placed in callee saved registers
+    size_t first = crosses_call(current, calls, n_calls) ? NUM_CALLER_SAVED_REGISTERS : 0;
+
+    // Parameters passed in registers may always stay where they are passed, if that register
+    // is free and not clobbered by a call while they are live
+    int64_t reg = -1;
+    int64_t hint = hints[current->vreg];
+    bool register_parameter = current->vreg < n_parameters && current->vreg < NUM_REGISTER_PARAMS;
+    if ((wants_register || register_parameter) && hint >= (int64_t)first && !register_used[hint])
+      reg = hint;
+
+    if (wants_register && reg == -1)
+    {
+      for (size_t r = first; r < NUM_ALLOCATABLE_REGISTERS && reg == -1; r++)
+        if (!register_used[r])
+          reg = r;
+
+      // If no register is free, take the register of the active interval that ends last,
+      // if it ends after the current interval. With a profile, the register of the interval
+      // used the fewest times is taken instead, if it is used fewer times than the current one
+      if (reg == -1)
+      {
+        int64_t victim = -1;
+        for (size_t j = 0; j < n_active; j++)
+        {
+          if (active_register[j] < first)
+            continue;
+          if (profiled ? active[j]->weight < current->weight &&
+                             (victim == -1 || active[j]->weight < active[victim]->weight)
+                       : active[j]->end > current->end &&
+                             (victim == -1 || active[j]->end > active[victim]->end))
+            victim = j;
+        }
+
+        if (victim != -1)
+        {
+          reg = active_register[victim];
+          // The victim is moved to the stack for its entire lifetime
+          result.locations[active[victim]->vreg].reg = NULL;
+          active[victim] = active[n_active - 1];
+          active_register[victim] = active_register[n_active - 1];
+          n_active--;
+          register_used[reg] = false;
+        }
+      }
+    }
+
+    if (reg != -1)
+    {
+      location->reg = ALLOCATABLE_REGISTERS[reg];
+      register_used[reg] = true;
+      register_ever_used[reg] = true;
+      active[n_active] = current;
+      active_register[n_active] = reg;
+      n_active++;
+    }
+  }
+
+  // Every used callee saved register must be saved by the prologue
+  for (size_t r = NUM_CALLER_SAVED_REGISTERS; r < NUM_ALLOCATABLE_REGISTERS; r++)
+    if (register_ever_used[r])
+      result.saved_registers[result.n_saved_registers++] = ALLOCATABLE_REGISTERS[r];
+
+  // Finally give every vreg without a register a stack slot below the saved registers.
+  // Parameters passed on the stack already have a slot
+  for (size_t v = 0; v < n_vregs; v++)
+  {
+    vreg_location_t* location = &result.locations[v];
+    if (!location->used || location->reg != NULL)
+      continue;
+    if (v < n_parameters && v >= NUM_REGISTER_PARAMS)
+      location->offset = 16 + (v - NUM_REGISTER_PARAMS) * 8;
+    else
+    {
+      size_t slot = result.n_stack_slots++;
+      location->offset = -(int)(result.n_saved_registers + slot + 1) * 8;
+    }
+  }
+
+  free(hints);
+  free(calls);
+  free(intervals);
+  return result;
+}
+
+void destroy_register_allocation(register_allocation_t* allocation)
+{
+  free(allocation->locations);
+  allocation->locations = NULL;
+}
@@ -0,0 +1,45 @@
+#ifndef REGALLOC_H
+#define REGALLOC_H
+
+#include "ir.h"
+
+// The 64-bit registers the allocator can assign to vregs.
+// The first ones are caller saved, the rest are callee saved.
+// RAX, RCX and RDX are never allocated, as they are used as scratch registers by the generator
+#define NUM_ALLOCATABLE_REGISTERS 11
+#define NUM_CALLER_SAVED_REGISTERS 6
+extern const char* ALLOCATABLE_REGISTERS[NUM_ALLOCATABLE_REGISTERS];
+
+// Describes where a vreg is stored during its lifetime
+typedef struct
+{
+  bool used;       // False if the vreg is never live, in which case it has no location
+  const char* reg; // The register holding the vreg, or NULL if it is in a stack slot
+  int offset;      // The position of the vreg's stack slot relative to %rbp, when reg is NULL
+} vreg_location_t;
+
+// The result of register allocation for one function
+typedef struct
+{
+  vreg_location_t* locations; // The location of every vreg in the function
+
+  // The callee saved registers that are used, and must be saved in the prologue.
+  // They are pushed in order right below the saved %rbp
+  const char* saved_registers[NUM_ALLOCATABLE_REGISTERS];
+  size_t n_saved_registers;
+
+  // The number of 8-byte stack slots needed below the saved registers
+  size_t n_stack_slots;
+} register_allocation_t;
+
+// Assigns a register or stack slot to every vreg in the function, using linear scan allocation.
+// Vregs that are live across function calls only get callee saved registers.
+// Parameter and local variable vregs are only given registers with -fregister-variables, except
+// for parameters staying in the register they are passed in. Parameters and arguments of calls
+// prefer the registers of the calling convention
+register_allocation_t allocate_registers(ir_function_t* function);
+
+// Frees the memory used by the register allocation
+void destroy_register_allocation(register_allocation_t* allocation);
+
+#endif // REGALLOC_H
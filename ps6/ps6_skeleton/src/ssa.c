@@ -0,0 +1,404 @@
+#include "vslc.h"
+
+// A growable list of blocks
+typedef struct
+{
+  ir_block_t** blocks;
+  size_t length;
+} block_list_t;
+
+static void block_list_append(block_list_t* list, ir_block_t* block)
+{
+  list->blocks = realloc(list->blocks, (list->length + 1) * sizeof(ir_block_t*));
+  list->blocks[list->length++] = block;
+}
+
+// Returns a list of the children of every block in the dominator tree, indexed by block id
+static block_list_t* dominator_tree_children(ir_function_t* function)
+{
+  block_list_t* children = calloc(function->n_blocks, sizeof(block_list_t));
+  for (size_t i = 0; i < function->n_blocks; i++)
+  {
+    ir_block_t* block = function->blocks[i];
+    if (block->idom)
+      block_list_append(&children[block->idom->id], block);
+  }
+  return children;
+}
+
+// Returns the dominance frontier of every block, indexed by block id.
+// The frontier of a block b, are the blocks where b's dominance ends:
+// blocks that are not strictly dominated by b, but have a predecessor dominated by b
+static block_list_t* dominance_frontiers(ir_function_t* function)
+{
+  block_list_t* frontiers = calloc(function->n_blocks, sizeof(block_list_t));
+  for (size_t i = 0; i < function->n_blocks; i++)
+  {
+    ir_block_t* block = function->blocks[i];
+    if (block->n_predecessors < 2)
+      continue;
+
+    for (size_t j = 0; j < block->n_predecessors; j++)
+    {
+      // Walk up from the predecessor, until reaching the block's immediate dominator
+      for (ir_block_t* runner = block->predecessors[j]; runner != block->idom;
+           runner = runner->idom)
+      {
+        block_list_t* frontier = &frontiers[runner->id];
+        if (frontier->length == 0 || frontier->blocks[frontier->length - 1] != block)
+          block_list_append(frontier, block);
+      }
+    }
+  }
+  return frontiers;
+}
+
+static void destroy_block_lists(block_list_t* lists, size_t n_lists)
+{
+  for (size_t i = 0; i < n_lists; i++)
+    free(lists[i].blocks);
+  free(lists);
+}
+
+// Places a phi for the variable at the start of the block, with one argument per predecessor
+static void insert_phi(ir_block_t* block, size_t variable)
+{
+  ir_instruction_t phi = {
+      .opcode = IR_PHI,
+      .dst = IR_VREG(variable),
+      .args = malloc(block->n_predecessors * sizeof(ir_operand_t)),
+      .incoming = malloc(block->n_predecessors * sizeof(ir_block_t*)),
+      .n_args = block->n_predecessors,
+  };
+  for (size_t i = 0; i < block->n_predecessors; i++)
+  {
+    phi.args[i] = IR_VREG(variable);
+    phi.incoming[i] = block->predecessors[i];
+  }
+
+  ir_append_instruction(block, phi);
+  memmove(&block->instructions[1],
+          &block->instructions[0],
+          (block->n_instructions - 1) * sizeof(ir_instruction_t));
+  block->instructions[0] = phi;
+}
+
+// Places phis for every variable in the iterated dominance frontier of its definitions
+static void insert_phis(ir_function_t* function, block_list_t* frontiers)
+{
+  size_t n_blocks = function->n_blocks;
+  size_t n_parameters = FUNC_PARAM_COUNT(function->symbol);
+
+  // For every block, the last variable that got a phi there, or was added to the worklist
+  int64_t* has_phi = malloc(n_blocks * sizeof(int64_t));
+  int64_t* in_worklist = malloc(n_blocks * sizeof(int64_t));
+  ir_block_t** worklist = malloc(n_blocks * sizeof(ir_block_t*));
+  for (size_t i = 0; i < n_blocks; i++)
+    has_phi[i] = in_worklist[i] = -1;
+
+  for (size_t variable = 0; variable < function->n_variables; variable++)
+  {
+    // Start with every block that defines the variable. Parameters are defined on entry
+    size_t worklist_len = 0;
+    for (size_t i = 0; i < n_blocks; i++)
+    {
+      ir_block_t* block = function->blocks[i];
+      bool defines = i == 0 && variable < n_parameters;
+      for (size_t j = 0; j < block->n_instructions && !defines; j++)
+        defines = ir_defined_vreg(&block->instructions[j]) == (int64_t)variable;
+      if (defines)
+      {
+        in_worklist[i] = variable;
+        worklist[worklist_len++] = block;
+      }
+    }
+
+    // A phi is a new definition of the variable, so it can require more phis
+    while (worklist_len > 0)
+    {
+      ir_block_t* block = worklist[--worklist_len];
+      block_list_t* frontier = &frontiers[block->id];
+      for (size_t i = 0; i < frontier->length; i++)
+      {
+        ir_block_t* join = frontier->blocks[i];
+        if (has_phi[join->id] == (int64_t)variable)
+          continue;
+        insert_phi(join, variable);
+        has_phi[join->id] = variable;
+        if (in_worklist[join->id] != (int64_t)variable)
+        {
+          in_worklist[join->id] = variable;
+          worklist[worklist_len++] = join;
+        }
+      }
+    }
+  }
+
+  free(worklist);
+  free(in_worklist);
+  free(has_phi);
+}
+
+// The state used while renaming variables into SSA vregs
+typedef struct
+{
+  ir_function_t* function;
+  block_list_t* children;
+
+  // For every variable, a stack of the operands holding its value at the current point.
+  // The top of the stack is the most recent definition dominating the current block
+  ir_operand_t** stacks;
+  size_t* stack_lengths;
+  size_t* stack_capacities;
+} rename_state_t;
+
+static void push_definition(rename_state_t* state, size_t variable, ir_operand_t value)
+{
+  if (state->stack_lengths[variable] + 1 >= state->stack_capacities[variable])
+  {
+    state->stack_capacities[variable] = state->stack_capacities[variable] * 2 + 8;
+    state->stacks[variable] = realloc(
+        state->stacks[variable], state->stack_capacities[variable] * sizeof(ir_operand_t));
+  }
+  state->stacks[variable][state->stack_lengths[variable]++] = value;
+}
+
+static ir_operand_t current_definition(rename_state_t* state, size_t variable)
+{
+  assert(state->stack_lengths[variable] > 0);
+  return state->stacks[variable][state->stack_lengths[variable] - 1];
+}
+
+// Returns true if the operand refers to one of the original vregs of a variable
+static bool is_variable_operand(rename_state_t* state, ir_operand_t operand)
+{
+  return operand.kind == IR_OPERAND_VREG && (size_t)operand.value < state->function->n_variables;
+}
+
+// Renames all uses and definitions of variables in the block, fills in the phi arguments of
+// its successors, and then does the same for all blocks it dominates
+static void rename_block(rename_state_t* state, ir_block_t* block)
+{
+  ir_function_t* function = state->function;
+
+  // The variables defined in this block, in order. Their definitions are popped at the end
+  size_t* defined = NULL;
+  size_t n_defined = 0;
+
+  for (size_t i = 0; i < block->n_instructions; i++)
+  {
+    ir_instruction_t* instruction = &block->instructions[i];
+
+    // Phi arguments are filled in by the predecessors
+    if (instruction->opcode != IR_PHI)
+    {
+      for (size_t s = 0; s < ir_source_count(instruction); s++)
+      {
+        ir_operand_t* operand = ir_source(instruction, s);
+        if (is_variable_operand(state, *operand))
+          *operand = current_definition(state, operand->value);
+      }
+    }
+
+    if (is_variable_operand(state, instruction->dst))
+    {
+      size_t variable = instruction->dst.value;
+      instruction->dst = ir_new_vreg(function, variable);
+      push_definition(state, variable, instruction->dst);
+      defined = realloc(defined, (n_defined + 1) * sizeof(size_t));
+      defined[n_defined++] = variable;
+    }
+  }
+
+  ir_block_t* successors[2];
+  size_t n_successors = ir_block_successors(block, successors);
+  for (size_t i = 0; i < n_successors; i++)
+  {
+    ir_block_t* successor = successors[i];
+    int64_t index = ir_predecessor_index(successor, block);
+    assert(index >= 0);
+    for (size_t j = 0; j < successor->n_instructions; j++)
+    {
+      ir_instruction_t* phi = &successor->instructions[j];
+      if (phi->opcode != IR_PHI)
+        break;
+      size_t variable = function->vreg_variables[phi->dst.value];
+      phi->args[index] = current_definition(state, variable);
+    }
+  }
+
+  block_list_t* children = &state->children[block->id];
+  for (size_t i = 0; i < children->length; i++)
+    rename_block(state, children->blocks[i]);
+
+  for (size_t i = 0; i < n_defined; i++)
+    state->stack_lengths[defined[i]]--;
+  free(defined);
+}
+
+void ir_construct_ssa(ir_function_t* function)
+{
+  block_list_t* frontiers = dominance_frontiers(function);
+  insert_phis(function, frontiers);
+  destroy_block_lists(frontiers, function->n_blocks);
+
+  size_t n_variables = function->n_variables;
+  rename_state_t state = {
+      .function = function,
+      .children = dominator_tree_children(function),
+      .stacks = calloc(n_variables, sizeof(ir_operand_t*)),
+      .stack_lengths = calloc(n_variables, sizeof(size_t)),
+      .stack_capacities = calloc(n_variables, sizeof(size_t)),
+  };
+
+  // Parameters start out with the value they were passed in, which stays in their original vreg.
+  // Local variables are always initialized in the entry block, but start as 0 to be safe
+  size_t n_parameters = FUNC_PARAM_COUNT(function->symbol);
+  for (size_t i = 0; i < n_variables; i++)
+    push_definition(&state, i, i < n_parameters ? IR_VREG(i) : IR_CONST(0));
+
+  rename_block(&state, function->blocks[0]);
+
+  for (size_t i = 0; i < n_variables; i++)
+    free(state.stacks[i]);
+  free(state.stacks);
+  free(state.stack_lengths);
+  free(state.stack_capacities);
+  destroy_block_lists(state.children, function->n_blocks);
+}
+
+/* Leaving SSA form */
+
+static _Thread_local int split_block_counter = 0;
+
+// Splits every edge from a block with several successors, to a block with phis.
+// Moves for the phis can then be placed at the end of the predecessor,
+// without affecting the other paths out of it
+static void split_critical_edges(ir_function_t* function)
+{
+  for (size_t i = 0; i < function->n_blocks; i++)
+  {
+    ir_block_t* block = function->blocks[i];
+    if (block->n_instructions == 0 || block->instructions[0].opcode != IR_PHI)
+      continue;
+
+    ir_instruction_t* phi = &block->instructions[0];
+    for (size_t j = 0; j < phi->n_args; j++)
+    {
+      ir_block_t* predecessor = phi->incoming[j];
+      ir_instruction_t* terminator = ir_block_terminator(predecessor);
+      if (terminator->opcode != IR_BRANCH)
+        continue;
+
+      // Place the new block right before the target, so it can fall through to it
+      ir_block_t* split = ir_new_block("split%d", ++split_block_counter);
+      ir_append_instruction(split, (ir_instruction_t){.opcode = IR_JUMP, .targets = {block}});
+      ir_insert_block(function, split, block->id);
+      i++;
+
+      for (size_t t = 0; t < 2; t++)
+        if (terminator->targets[t] == block)
+          terminator->targets[t] = split;
+
+      for (size_t k = 0; k < block->n_instructions && block->instructions[k].opcode == IR_PHI;
+           k++)
+        for (size_t a = 0; a < block->instructions[k].n_args; a++)
+          if (block->instructions[k].incoming[a] == predecessor)
+            block->instructions[k].incoming[a] = split;
+    }
+  }
+}
+
+// A move that is part of a parallel copy, where all sources are read before any dst is written
+typedef struct
+{
+  ir_operand_t dst;
+  ir_operand_t src;
+} parallel_move_t;
+
+static bool same_operand(ir_operand_t a, ir_operand_t b)
+{
+  return a.kind == b.kind && a.value == b.value;
+}
+
+// Appends the parallel moves to the block, before its terminator, as a sequence of moves.
+// When the moves form a cycle, a temporary vreg is used to break it
+static void sequentialize_moves(
+    ir_function_t* function, ir_block_t* block, parallel_move_t* moves, size_t n_moves)
+{
+  // Take out the terminator, to put it back at the end
+  ir_instruction_t terminator = block->instructions[--block->n_instructions];
+
+  while (n_moves > 0)
+  {
+    // Find a move whose dst is not read by any of the remaining moves
+    size_t ready = n_moves;
+    for (size_t i = 0; i < n_moves && ready == n_moves; i++)
+    {
+      bool blocked = false;
+      for (size_t j = 0; j < n_moves && !blocked; j++)
+        blocked = j != i && same_operand(moves[j].src, moves[i].dst);
+      if (!blocked)
+        ready = i;
+    }
+
+    if (ready == n_moves)
+    {
+      // Every dst is read by another move. Save one of them in a temporary
+      ir_operand_t temporary = ir_new_vreg(function, -1);
+      ir_append_instruction(
+          block, (ir_instruction_t){.opcode = IR_MOVE, .dst = temporary, .a = moves[0].dst});
+      for (size_t j = 0; j < n_moves; j++)
+        if (same_operand(moves[j].src, moves[0].dst))
+          moves[j].src = temporary;
+      continue;
+    }
+
+    if (!same_operand(moves[ready].dst, moves[ready].src))
+      ir_append_instruction(
+          block,
+          (ir_instruction_t){.opcode = IR_MOVE, .dst = moves[ready].dst, .a = moves[ready].src});
+    moves[ready] = moves[--n_moves];
+  }
+
+  ir_append_instruction(block, terminator);
+}
+
+void ir_destruct_ssa(ir_function_t* function)
+{
+  split_critical_edges(function);
+
+  for (size_t i = 0; i < function->n_blocks; i++)
+  {
+    ir_block_t* block = function->blocks[i];
+    size_t n_phis = 0;
+    while (n_phis < block->n_instructions && block->instructions[n_phis].opcode == IR_PHI)
+      n_phis++;
+    if (n_phis == 0)
+      continue;
+
+    // All phis of the block happen at the same time, so they become one parallel copy per edge
+    ir_instruction_t* first = &block->instructions[0];
+    parallel_move_t* moves = malloc(n_phis * sizeof(parallel_move_t));
+    for (size_t j = 0; j < first->n_args; j++)
+    {
+      ir_block_t* predecessor = first->incoming[j];
+      for (size_t k = 0; k < n_phis; k++)
+      {
+        ir_instruction_t* phi = &block->instructions[k];
+        // The phis of a block always list their predecessors in the same order
+        assert(phi->incoming[j] == predecessor);
+        moves[k] = (parallel_move_t){.dst = phi->dst, .src = phi->args[j]};
+      }
+      sequentialize_moves(function, predecessor, moves, n_phis);
+    }
+    free(moves);
+
+    for (size_t k = 0; k < n_phis; k++)
+      ir_destroy_instruction(&block->instructions[k]);
+    block->n_instructions -= n_phis;
+    memmove(&block->instructions[0],
+            &block->instructions[n_phis],
+            block->n_instructions * sizeof(ir_instruction_t));
+  }
+}
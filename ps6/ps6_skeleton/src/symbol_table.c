@@ -14,7 +14,10 @@ symbol_table_t* symbol_table_init(void)
   *result = (symbol_table_t){.symbols = NULL,
                              .n_symbols = 0,
                              .capacity = 0,
-                             .hashmap = symbol_hashmap_init()};
+                             .hashmap = symbol_hashmap_init(),
+                             .of_type = {NULL},
+                             .n_of_type = {0},
+                             .of_type_capacity = {0}};
   return result;
 }
 
@@ -25,6 +28,13 @@ insert_result_t symbol_table_insert(symbol_table_t* table, struct symbol* symbol
   if (symbol_hashmap_insert(table->hashmap, symbol) == INSERT_COLLISION)
     return INSERT_COLLISION;
 
+  symbol_table_append(table, symbol);
+  return INSERT_OK;
+}
+
+// Adds a symbol to the symbol table only
+void symbol_table_append(symbol_table_t* table, struct symbol* symbol)
+{
   // If the table is full, resize the list
   if (table->n_symbols + 1 >= table->capacity)
   {
@@ -32,11 +42,19 @@ insert_result_t symbol_table_insert(symbol_table_t* table, struct symbol* symbol
     table->symbols = realloc(table->symbols, table->capacity * sizeof(symbol_t*));
   }
 
+  // Only the list of the symbol's own type grows
+  symtype_t type = symbol->type;
+  if (table->n_of_type[type] == table->of_type_capacity[type])
+  {
+    table->of_type_capacity[type] = table->of_type_capacity[type] * 2 + 8;
+    table->of_type[type] =
+        realloc(table->of_type[type], table->of_type_capacity[type] * sizeof(symbol_t*));
+  }
+
+  table->of_type[type][table->n_of_type[type]++] = symbol;
   table->symbols[table->n_symbols] = symbol;
   symbol->sequence_number = table->n_symbols;
   table->n_symbols++;
-
-  return INSERT_OK;
 }
 
 // Destroys the given symbol table, its hashmap, and all the symbols it owns
@@ -45,119 +63,130 @@ void symbol_table_destroy(symbol_table_t* table)
   for (int i = 0; i < table->n_symbols; i++)
     free(table->symbols[i]);
   free(table->symbols);
+  for (size_t i = 0; i < SYMBOL_TYPE_COUNT; i++)
+    free(table->of_type[i]);
   symbol_hashmap_destroy(table->hashmap);
   free(table);
 }
 
 // ==================== Hashmap code ====================
 
+// The hashmap uses open addressing with Robin Hood probing.
+// An entry is placed in the first free bucket at or after its home bucket, given by its hash.
+// When inserting, an entry that is further from its home bucket than the entry occupying a bucket
+// takes the bucket, and the occupant moves on instead. This keeps all entries close to their
+// home bucket, and lets lookups stop as soon as they are further from home than the occupant.
+//
+// The number of buckets is always a power of two, so the home bucket is the hash masked.
+// Every bucket stores the hash of its entry, so probes rarely need to look at the symbol itself
+
+// Never fill more than 3/4 of the buckets
+#define MAX_LOAD_NUMERATOR 3
+#define MAX_LOAD_DENOMINATOR 4
+#define MIN_BUCKETS 8
+
 // Initializes a hashmap with 0 buckets. Will be resized upon first insertion
 symbol_hashmap_t* symbol_hashmap_init()
 {
   symbol_hashmap_t* result = malloc(sizeof(symbol_hashmap_t));
-  *result = (symbol_hashmap_t){.buckets = NULL, .n_buckets = 0, .n_entries = 0, .backup = NULL};
+  *result = (symbol_hashmap_t){.buckets = NULL, .n_buckets = 0, .n_entries = 0};
   return result;
 }
 
-// Calculates a naive 64-bit hash of the given string
-static uint64_t hash_string(const char* string)
+// How many buckets past its home bucket the entry with the given hash is, when in bucket
+static size_t probe_distance(symbol_hashmap_t* hashmap, uint64_t hash, size_t bucket)
+{
+  return (bucket - (hash & (hashmap->n_buckets - 1))) & (hashmap->n_buckets - 1);
+}
+
+// Places the entry using Robin Hood probing. The entry must not be in the hashmap already
+static void symbol_hashmap_place(symbol_hashmap_t* hashmap, symbol_hashmap_bucket_t entry)
 {
-  assert(string != NULL);
-  uint64_t hash = 31;
-  for (const char* c = string; *c != '\0'; c++)
-    hash = hash * 257 + *c;
-  return hash;
+  size_t mask = hashmap->n_buckets - 1;
+  size_t bucket = entry.hash & mask;
+  size_t distance = 0;
+  while (hashmap->buckets[bucket].symbol != NULL)
+  {
+    size_t occupant_distance = probe_distance(hashmap, hashmap->buckets[bucket].hash, bucket);
+    if (occupant_distance < distance)
+    {
+      symbol_hashmap_bucket_t occupant = hashmap->buckets[bucket];
+      hashmap->buckets[bucket] = entry;
+      entry = occupant;
+      distance = occupant_distance;
+    }
+    bucket = (bucket + 1) & mask;
+    distance++;
+  }
+  hashmap->buckets[bucket] = entry;
+  hashmap->n_entries++;
 }
 
-// Allocates a larger list of buckets, and inserts all hashmap entries again
+// Allocates a larger list of buckets, and places all hashmap entries again.
+// The hashes are stored in the buckets, so nothing needs to be hashed again
 static void symbol_hashmap_resize(symbol_hashmap_t* hashmap, size_t new_capacity)
 {
-  symbol_t** old_buckets = hashmap->buckets;
+  symbol_hashmap_bucket_t* old_buckets = hashmap->buckets;
   size_t old_capacity = hashmap->n_buckets;
 
-  // Use calloc, since it initalizes the memory to 0, aka NULL entries
-  hashmap->buckets = calloc(new_capacity, sizeof(symbol_t*));
+  // Use calloc, since it initalizes the memory to 0, aka empty buckets
+  hashmap->buckets = calloc(new_capacity, sizeof(symbol_hashmap_bucket_t));
   hashmap->n_buckets = new_capacity;
   hashmap->n_entries = 0;
 
-  // Now re-insert all entries from the old buckets
-  for (int i = 0; i < old_capacity; i++)
+  for (size_t i = 0; i < old_capacity; i++)
   {
-    if (old_buckets[i] != NULL)
-      symbol_hashmap_insert(hashmap, old_buckets[i]);
+    if (old_buckets[i].symbol != NULL)
+      symbol_hashmap_place(hashmap, old_buckets[i]);
   }
 
   free(old_buckets);
 }
 
-// Performs insertion into the hashmap.
-// The hashmap uses open addressing, with up to one entry per bucket.
-// If our first choice of bucket is full, we look at the next bucket, until we find room.
-static insert_result_t symbol_hashmap_insert(symbol_hashmap_t* hashmap, symbol_t* symbol)
+// Returns the bucket holding the symbol with the given name and hash, or NULL
+static symbol_hashmap_bucket_t* symbol_hashmap_find(symbol_hashmap_t* hashmap,
+                                                    atom_t name,
+                                                    uint64_t hash)
 {
-  // Make sure that the fill ratio of the hashmap never exeeds 1/2
-  int new_size = hashmap->n_entries + 1;
-  if (new_size * 2 > hashmap->n_buckets)
-    symbol_hashmap_resize(hashmap, hashmap->n_buckets * 2 + 8);
-
-  // Now calculate the position of the new entry
-  uint64_t hash = hash_string(symbol->name);
-  size_t bucket = hash % hashmap->n_buckets;
+  if (hashmap->n_buckets == 0)
+    return NULL;
 
-  // Iterate until we find an empty bucket
-  while (hashmap->buckets[bucket] != NULL)
+  size_t mask = hashmap->n_buckets - 1;
+  size_t bucket = hash & mask;
+  for (size_t distance = 0;; distance++)
   {
-    // Check if the existing entry is a name collision
-    if (strcmp(hashmap->buckets[bucket]->name, symbol->name) == 0)
-      return INSERT_COLLISION; // An entry with the same name already exists
-    // Go to the next bucket
-    bucket = (bucket + 1) % hashmap->n_buckets;
+    symbol_hashmap_bucket_t* entry = &hashmap->buckets[bucket];
+    // Reaching an empty bucket, or an entry closer to its home than we are, means the name
+    // would have been placed earlier if it were in the hashmap
+    if (entry->symbol == NULL || probe_distance(hashmap, entry->hash, bucket) < distance)
+      return NULL;
+    if (entry->hash == hash && entry->symbol->name == name)
+      return entry;
+    bucket = (bucket + 1) & mask;
   }
-
-  // We found an emoty bucket, insert the symbol here
-  hashmap->buckets[bucket] = symbol;
-  hashmap->n_entries++;
-  return INSERT_OK; // We successfully inserted a new symbol
 }
 
-// Performs lookup in the hashmap.
-// Hashes the given string, and checks if the resulting bucket contains the item.
-// Since the hashmap uses open addressing, the entry can also be in the next bucket,
-// so we iterate until we either find the item, or find an empty bucket.
-//
-// If the key isn't found in this hashmap, but we have a backup, lookup continues there.
-// Otherwise, NULL is returned.
-symbol_t* symbol_hashmap_lookup(symbol_hashmap_t* hashmap, const char* name)
+// Performs insertion into the hashmap, unless the name is already in it
+static insert_result_t symbol_hashmap_insert(symbol_hashmap_t* hashmap, symbol_t* symbol)
 {
-  uint64_t hash = hash_string(name);
+  uint64_t hash = atom_hash(symbol->name);
+  if (symbol_hashmap_find(hashmap, symbol->name, hash) != NULL)
+    return INSERT_COLLISION; // An entry with the same name already exists
 
-  // Loop through the linked list of hashmaps and backup hashmaps
-  while (hashmap != NULL)
-  {
-    // Skip any hashmaps with 0 buckets
-    if (hashmap->n_buckets == 0)
-    {
-      hashmap = hashmap->backup;
-      continue;
-    }
-
-    size_t bucket = hash % hashmap->n_buckets;
-    while (hashmap->buckets[bucket] != NULL)
-    {
-      // Check if the entry in the bucket has a matching name
-      if (strcmp(hashmap->buckets[bucket]->name, name) == 0)
-        return hashmap->buckets[bucket];
-
-      // Otherwise keep iterating until we find a hit, or an empty bucket
-      bucket = (bucket + 1) % hashmap->n_buckets;
-    }
+  // Make sure that the fill ratio of the hashmap never exceeds the maximum
+  if ((hashmap->n_entries + 1) * MAX_LOAD_DENOMINATOR > hashmap->n_buckets * MAX_LOAD_NUMERATOR)
+    symbol_hashmap_resize(hashmap,
+                          hashmap->n_buckets == 0 ? MIN_BUCKETS : hashmap->n_buckets * 2);
 
-    // No entry with the required name existed in the hashmap, so go to the backup
-    hashmap = hashmap->backup;
-  }
+  symbol_hashmap_place(hashmap, (symbol_hashmap_bucket_t){.hash = hash, .symbol = symbol});
+  return INSERT_OK; // We successfully inserted a new symbol
+}
 
-  // The entry was never found, and we are all out of backups
-  return NULL;
+// Performs lookup in the hashmap. If the key isn't found, NULL is returned.
+symbol_t* symbol_hashmap_lookup(symbol_hashmap_t* hashmap, atom_t name)
+{
+  symbol_hashmap_bucket_t* entry = symbol_hashmap_find(hashmap, name, atom_hash(name));
+  return entry == NULL ? NULL : entry->symbol;
 }
 
 void symbol_hashmap_destroy(symbol_hashmap_t* hashmap)
@@ -6,18 +6,41 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// The types of symbols. Declared here, as symbol tables keep the symbols of each type apart too
+typedef enum
+{
+  SYMBOL_GLOBAL_VAR,
+  SYMBOL_GLOBAL_ARRAY,
+  SYMBOL_FUNCTION,
+  SYMBOL_PARAMETER,
+  SYMBOL_LOCAL_VAR,
+  SYMBOL_LOCAL_ARRAY,
+  SYMBOL_TYPE_COUNT
+} symtype_t;
+
 // We use hashmaps to make lookups quick.
 // The entries are symbols, using the name of the symbol as the key.
+// Names are atoms, so they are compared as pointers, using the hash stored in the atom.
 // The hashmap logic is already implemented in symbol_table.c
 // NOTE that this hashmap does not support removing entries.
+//
+// Nested scopes do not use hashmaps. Local symbols are appended to the table of their function,
+// and symbols.c binds each name to the symbol it refers to in a flat stack of scopes, undoing
+// the bindings of a scope when it is left
+
+// A bucket holds one entry, or none if symbol is NULL.
+// The hash of the entry's name is kept next to it, to avoid looking up the name when probing
+typedef struct
+{
+  uint64_t hash;
+  struct symbol* symbol;
+} symbol_hashmap_bucket_t;
+
 typedef struct symbol_hashmap
 {
-  struct symbol** buckets; // A bucket may contain 0 or 1 entries
-  size_t n_buckets;
+  symbol_hashmap_bucket_t* buckets;
+  size_t n_buckets; // Always 0 or a power of two
   size_t n_entries;
-
-  // If a key is not found, the lookup function will consult this as a backup
-  struct symbol_hashmap* backup;
 } symbol_hashmap_t;
 
 // A dynamically sized list of symbols, including a hashmap for fast lookups
@@ -28,6 +51,13 @@ typedef struct symbol_table
   size_t n_symbols;
   size_t capacity;
   symbol_hashmap_t* hashmap;
+
+  // The symbols of each type, indexed by symtype_t, in the order they were added.
+  // Passes looking for one type of symbol, such as all functions or all local variables,
+  // go through these instead of every symbol. Each list has a capacity of its own
+  struct symbol** of_type[SYMBOL_TYPE_COUNT];
+  size_t n_of_type[SYMBOL_TYPE_COUNT];
+  size_t of_type_capacity[SYMBOL_TYPE_COUNT];
 } symbol_table_t;
 
 typedef enum
@@ -40,13 +70,18 @@ typedef enum
 symbol_table_t* symbol_table_init(void);
 
 // Tries to insert the given symbol into the symbol table.
-// If the topmost hashmap already contains a symbol with the same name,
+// If the table's hashmap already contains a symbol with the same name,
 // INSERT_COLLISION is returned, otherwise the result is INSERT_OK.
 //
 // The symbol table takes ownership of the symbol, and assigns it a sequence number.
 // DO NOT change the symbol's name after insertion.
 insert_result_t symbol_table_insert(symbol_table_t* table, struct symbol* symbol);
 
+// Adds the symbol to the symbol table, without entering it into the hashmap.
+// Used for symbols whose names only need to be unique within a part of the table.
+// The symbol table takes ownership of the symbol, and assigns it a sequence number.
+void symbol_table_append(symbol_table_t* table, struct symbol* symbol);
+
 // Destroys the given symbol table, its hashmap, and all the symbols it owns
 void symbol_table_destroy(symbol_table_t* table);
 
@@ -54,9 +89,8 @@ void symbol_table_destroy(symbol_table_t* table);
 symbol_hashmap_t* symbol_hashmap_init(void);
 
 // Looks for a symbol in the symbol hashmap, matching the given name.
-// If no symbol is found, the hashmap's backup hashmap is checked.
-// If the name can't be found in the backup chain either, NULL is returned.
-struct symbol* symbol_hashmap_lookup(symbol_hashmap_t* hashmap, const char* name);
+// If no symbol is found, NULL is returned.
+struct symbol* symbol_hashmap_lookup(symbol_hashmap_t* hashmap, atom_t name);
 
 // Frees the memory used by the hashmap
 void symbol_hashmap_destroy(symbol_hashmap_t* hashmap);
@@ -1,11 +1,15 @@
 #include <vslc.h>
 
 // Declaration of global symbol table
-symbol_table_t* global_symbols;
+_Thread_local symbol_table_t* global_symbols;
 
 // Declarations of helper functions defined further down in this file
 static void find_globals(void);
+static void bind_globals(void);
+static void bind_function(symbol_t* function, bool simplify);
 static void bind_names(symbol_table_t* local_symbols, node_t* root);
+static visit_order_t bind_names_enter(node_t* node, node_t* parent, void* context);
+static node_t* bind_names_leave(node_t* node, node_t* parent, void* context);
 static void print_symbol_table(symbol_table_t* table, int nesting);
 static void destroy_symbol_tables(void);
 
@@ -18,19 +22,30 @@ static void destroy_string_list(void);
 // Creates a global symbol table, and local symbol tables for each function.
 // All usages of symbols are bound to their symbol table entries.
 // All strings are entered into the string_list
-void create_tables(void)
+static void create_tables_of_functions(bool simplify)
 {
   // Create a global symbol table, and make symbols for all globals
   find_globals();
+  bind_globals();
 
   // For all functions, we want to fill their local symbol tables,
   // and bind all names found in the function body
-  for (size_t i = 0; i < global_symbols->n_symbols; i++)
-  {
-    symbol_t* symbol = global_symbols->symbols[i];
-    if (symbol->type == SYMBOL_FUNCTION)
-      bind_names(symbol->function_symtable, symbol->node->children[2]);
-  }
+  for (size_t i = 0; i < global_symbols->n_of_type[SYMBOL_FUNCTION]; i++)
+    bind_function(global_symbols->of_type[SYMBOL_FUNCTION][i], simplify);
+}
+
+void create_tables(void)
+{
+  create_tables_of_functions(false);
+}
+
+// Does the same as constant_fold_syntax_tree(), remove_unreachable_code_syntax_tree() and
+// create_tables(), but traverses each function body only once.
+// The global declarations are folded first, since array lengths are not part of any function
+void simplify_and_create_tables(void)
+{
+  constant_fold_global_declarations();
+  create_tables_of_functions(true);
 }
 
 // Prints the global symbol table, and the local symbol tables for each function.
@@ -45,6 +60,17 @@ void print_tables(void)
   print_syntax_tree();
 }
 
+size_t symbol_count(void)
+{
+  if (global_symbols == NULL)
+    return 0;
+
+  size_t count = global_symbols->n_symbols;
+  for (size_t i = 0; i < global_symbols->n_of_type[SYMBOL_FUNCTION]; i++)
+    count += global_symbols->of_type[SYMBOL_FUNCTION][i]->function_symtable->n_symbols;
+  return count;
+}
+
 // Cleans up all memory owned by symbol tables and the global string list
 void destroy_tables(void)
 {
@@ -72,22 +98,23 @@ static void find_globals(void)
 {
   global_symbols = symbol_table_init();
 
-  for (size_t i = 0; i < root->n_children; i++)
+  node_t* globals = node_get(root);
+  for (size_t i = 0; i < globals->n_children; i++)
   {
-    node_t* node = root->children[i];
+    node_t* node = node_child(globals, i);
     if (node->type == GLOBAL_DECLARATION)
     {
-      node_t* global_variable_list = node->children[0];
+      node_t* global_variable_list = node_child(node, 0);
       for (size_t j = 0; j < global_variable_list->n_children; j++)
       {
-        node_t* var = global_variable_list->children[j];
-        char* name;
+        node_t* var = node_child(global_variable_list, j);
+        atom_t name;
         symtype_t symtype;
 
         // The global variable list can both contain arrays and normal variables.
         if (var->type == ARRAY_INDEXING)
         {
-          name = var->children[0]->data.identifier;
+          name = node_child(var, 0)->data.identifier;
           symtype = SYMBOL_GLOBAL_ARRAY;
         }
         else
@@ -101,7 +128,7 @@ static void find_globals(void)
             global_symbols,
             .name = name,
             .type = symtype,
-            .node = var,
+            .node = node_id(var),
             .function_symtable = NULL);
       }
     }
@@ -110,25 +137,23 @@ static void find_globals(void)
       // Functions have their own local symbol table. We make it now, and add the function
       // parameters
       symbol_table_t* function_symtable = symbol_table_init();
-      // We let the global hashmap be the backup of the local scope
-      function_symtable->hashmap->backup = global_symbols->hashmap;
 
-      node_t* parameters = node->children[1];
+      node_t* parameters = node_child(node, 1);
       for (int j = 0; j < parameters->n_children; j++)
       {
         CREATE_AND_INSERT_SYMBOL(
             function_symtable,
-            .name = parameters->children[j]->data.identifier,
+            .name = node_child(parameters, j)->data.identifier,
             .type = SYMBOL_PARAMETER,
-            .node = parameters->children[j],
+            .node = node_id(node_child(parameters, j)),
             .function_symtable = NULL);
       }
 
       CREATE_AND_INSERT_SYMBOL(
           global_symbols,
-          .name = node->children[0]->data.identifier,
+          .name = node_child(node, 0)->data.identifier,
           .type = SYMBOL_FUNCTION,
-          .node = node,
+          .node = node_id(node),
           .function_symtable = function_symtable);
     }
     else
@@ -138,33 +163,135 @@ static void find_globals(void)
   }
 }
 
-// Creates a new empty hashmap for the symbol table, using the outer scope's hashmap as backup
+// Every name points to the symbol it currently refers to, through atom_binding().
+// Entering a scope changes the bindings of the names declared in it, and the previous
+// bindings are kept in the undo log below. Leaving a scope restores them again.
+// Looking up a name is thus a single load, no matter how deeply scopes are nested
+typedef struct
+{
+  atom_t name;
+  symbol_t* previous;
+} undo_entry_t;
+
+static _Thread_local undo_entry_t* undo_log;
+static _Thread_local size_t undo_log_len;
+static _Thread_local size_t undo_log_capacity;
+
+// A scope remembers where its entries in the undo log start,
+// and the sequence number of the first local variable declared in it
+typedef struct
+{
+  size_t undo_log_start;
+  size_t first_symbol;
+} scope_t;
+
+// The scopes we are currently inside, innermost last
+static _Thread_local scope_t* scopes;
+static _Thread_local size_t scopes_len;
+static _Thread_local size_t scopes_capacity;
+
 static void push_local_scope(symbol_table_t* table)
 {
-  symbol_hashmap_t* hashmap = symbol_hashmap_init();
-  hashmap->backup = table->hashmap;
-  table->hashmap = hashmap;
+  if (scopes_len + 1 >= scopes_capacity)
+  {
+    scopes_capacity = scopes_capacity * 2 + 8;
+    scopes = realloc(scopes, scopes_capacity * sizeof(scope_t));
+  }
+  scopes[scopes_len++] =
+      (scope_t){.undo_log_start = undo_log_len, .first_symbol = table->n_symbols};
 }
 
-// Destroys the hashmap, and replaces it with the outer scope's hashmap
-static void pop_local_scope(symbol_table_t* table)
+// Makes the name refer to the symbol, until the current scope is popped
+static void bind_in_scope(symbol_t* symbol)
 {
-  symbol_hashmap_t* hashmap = table->hashmap;
-  table->hashmap = hashmap->backup;
-  symbol_hashmap_destroy(hashmap);
+  if (undo_log_len + 1 >= undo_log_capacity)
+  {
+    undo_log_capacity = undo_log_capacity * 2 + 8;
+    undo_log = realloc(undo_log, undo_log_capacity * sizeof(undo_entry_t));
+  }
+
+  symbol_t** binding = atom_binding(symbol->name);
+  undo_log[undo_log_len++] = (undo_entry_t){.name = symbol->name, .previous = *binding};
+  *binding = symbol;
 }
 
-// A recursive function that traverses the body of a function, and:
-//  - Adds variable declarations to the function's local symbol table.
-//  - Pushes and pops local variable scopes when entering and leaving blocks.
-//  - Binds all IDENTIFIER nodes that are not declarations, to the symbol it references.
-//  - Moves STRING_LITERAL nodes' data into the global string list,
-//    and replaces the node with a STRING_LIST_REFERENCE node.
-//    Overwrites the node's data.string_list_index field with with string list index
-static void bind_names(symbol_table_t* local_symbols, node_t* node)
+// Restores the bindings of all names declared since the innermost scope was pushed, newest first
+static void pop_local_scope(void)
 {
+  scope_t scope = scopes[--scopes_len];
+  while (undo_log_len > scope.undo_log_start)
+  {
+    undo_entry_t* entry = &undo_log[--undo_log_len];
+    *atom_binding(entry->name) = entry->previous;
+  }
+}
+
+// Global symbols are visible in all functions, and are never unbound
+static void bind_globals(void)
+{
+  for (size_t i = 0; i < global_symbols->n_symbols; i++)
+    *atom_binding(global_symbols->symbols[i]->name) = global_symbols->symbols[i];
+}
+
+// Binds the parameters of the function in a scope of their own, and binds the function body.
+// If simplify is set, the body is simplified as part of the same traversal
+static void bind_function(symbol_t* function, bool simplify)
+{
+  symbol_table_t* local_symbols = function->function_symtable;
+  push_local_scope(local_symbols);
+  for (size_t i = 0; i < local_symbols->n_symbols; i++)
+    bind_in_scope(local_symbols->symbols[i]);
+
+  if (simplify)
+    simplify_function_body(function->node, bind_names_enter, bind_names_leave, local_symbols);
+  else
+    bind_names(local_symbols, node_child(node_get(function->node), 2));
+  pop_local_scope();
+}
+
+// Adds a local variable or array to the function's symbol table, and binds its name in the
+// innermost scope. The local variables of a scope are added right after each other, so the name is
+// already declared in this scope if it refers to one of the symbols added since the scope was pushed
+static void declare_local_variable(symbol_table_t* local_symbols, node_t* node)
+{
+  atom_t name = node->type == ARRAY_INDEXING ? node_child(node, 0)->data.identifier
+                                             : node->data.identifier;
+  symbol_t* existing = *atom_binding(name);
+  if (existing != NULL &&
+      (existing->type == SYMBOL_LOCAL_VAR || existing->type == SYMBOL_LOCAL_ARRAY) &&
+      existing->function_symtable == local_symbols &&
+      existing->sequence_number >= scopes[scopes_len - 1].first_symbol)
+  {
+    fprintf(stderr, "error: symbol '%s' already defined\n", name);
+    exit(EXIT_FAILURE);
+  }
+
+  symbol_t* symbol = malloc(sizeof(symbol_t));
+  *symbol = (symbol_t){
+      .name = name,
+      .type = node->type == ARRAY_INDEXING ? SYMBOL_LOCAL_ARRAY : SYMBOL_LOCAL_VAR,
+      .node = node_id(node),
+      .function_symtable = local_symbols,
+  };
+  symbol_table_append(local_symbols, symbol);
+  bind_in_scope(symbol);
+  if (node->type == ARRAY_INDEXING)
+    node_child(node, 0)->symbol = symbol;
+}
+
+// Blocks with two children start with a list of declarations
+static bool is_declaration_list(node_t* node, node_t* parent)
+{
+  return parent != NULL && parent->type == BLOCK && parent->n_children == 2 &&
+         node == node_child(parent, 0);
+}
+
+// Called for every node in the function body, with the function's local symbol table as context
+static visit_order_t bind_names_enter(node_t* node, node_t* parent, void* context)
+{
+  symbol_table_t* local_symbols = context;
   if (node == NULL)
-    return;
+    return SKIP_CHILDREN;
 
   switch (node->type)
   {
@@ -172,47 +299,44 @@ static void bind_names(symbol_table_t* local_symbols, node_t* node)
   // Either way, we wish to associate it with its symbol
   case IDENTIFIER:
   {
-    symbol_t* symbol = symbol_hashmap_lookup(local_symbols->hashmap, node->data.identifier);
+    symbol_t* symbol = *atom_binding(node->data.identifier);
     if (symbol == NULL)
     {
-      fprintf(stderr, "error: unrecognized symbol '%s'\n", (char*)node->data.identifier);
+      fprintf(stderr, "error: unrecognized symbol '%s'\n", node->data.identifier);
       exit(EXIT_FAILURE);
     }
     node->symbol = symbol;
-    break;
+    return SKIP_CHILDREN;
   }
 
   // Blocks may contain a list of declarations. In such cases, a scope gets pushed, the declarations
-  // get added, and the name binding continues in the body
+  // get added, and the name binding continues in the body.
+  // If the block only contains statements, and no declaration list, no need to push a scope
   case BLOCK:
     if (node->n_children == 2)
     {
       push_local_scope(local_symbols);
       // Iterate through all declarations in the delcaration list
-      node_t* decl_list = node->children[0];
+      node_t* decl_list = node_child(node, 0);
       for (int i = 0; i < decl_list->n_children; i++)
       {
-        // Each declaration can have one or more IDENTIFIER nodes
-        node_t* declaration = decl_list->children[i];
+        // Each declaration can have one or more IDENTIFIER or ARRAY_INDEXING nodes. The length
+        // of an array is bound before the array is declared, so it can use the names outside
+        node_t* declaration = node_child(decl_list, i);
         for (int j = 0; j < declaration->n_children; j++)
         {
-          CREATE_AND_INSERT_SYMBOL(
-              local_symbols,
-              .name = declaration->children[j]->data.identifier,
-              .type = SYMBOL_LOCAL_VAR,
-              .node = declaration->children[j],
-              .function_symtable = local_symbols);
+          node_t* variable = node_child(declaration, j);
+          if (variable->type == ARRAY_INDEXING)
+            bind_names(local_symbols, node_child(variable, 1));
+          declare_local_variable(local_symbols, variable);
         }
       }
-      bind_names(local_symbols, node->children[1]);
-      pop_local_scope(local_symbols);
     }
-    else
-    {
-      // If the block only contains statements, and no declaration list, no need to push a scope
-      bind_names(local_symbols, node->children[0]);
-    }
-    break;
+    return VISIT_CHILDREN;
+
+  // The declarations have already been added when entering the block
+  case LIST:
+    return is_declaration_list(node, parent) ? SKIP_CHILDREN : VISIT_CHILDREN;
 
   // Strings get inserted into the global string list
   // The STRING_LITERAL node gets replaced by a STRING_LIST_REFERENCE node
@@ -221,17 +345,35 @@ static void bind_names(symbol_table_t* local_symbols, node_t* node)
     size_t position = add_string(node->data.string_literal);
     node->type = STRING_LIST_REFERENCE;
     node->data.string_list_index = position;
-    break;
+    return SKIP_CHILDREN;
   }
 
-  // For all other nodes, recurse through its children
+  // For all other nodes, visit its children
   default:
-    for (int i = 0; i < node->n_children; i++)
-      bind_names(local_symbols, node->children[i]);
-    break;
+    return VISIT_CHILDREN;
   }
 }
 
+// Pops the scope of blocks with declarations
+static node_t* bind_names_leave(node_t* node, node_t* parent, void* context)
+{
+  if (node != NULL && node->type == BLOCK && node->n_children == 2)
+    pop_local_scope();
+  return node;
+}
+
+// Traverses the body of a function, and:
+//  - Adds variable declarations to the function's local symbol table.
+//  - Pushes and pops local variable scopes when entering and leaving blocks.
+//  - Binds all IDENTIFIER nodes that are not declarations, to the symbol it references.
+//  - Moves STRING_LITERAL nodes' data into the global string list,
+//    and replaces the node with a STRING_LIST_REFERENCE node.
+//    Overwrites the node's data.string_list_index field with with string list index
+static void bind_names(symbol_table_t* local_symbols, node_t* node)
+{
+  traverse_syntax_tree(node, bind_names_enter, bind_names_leave, local_symbols);
+}
+
 // Prints the given symbol table, with sequence number, symbol names and types.
 // When printing function symbols, its local symbol table is recursively printed, with indentation.
 static void print_symbol_table(symbol_table_t* table, int nesting)
@@ -257,31 +399,83 @@ static void print_symbol_table(symbol_table_t* table, int nesting)
 // Frees up the memory used by the global symbol table, all local symbol tables, and their symbols
 static void destroy_symbol_tables(void)
 {
-  // First destory all local symbol tables, by looking for functions among the globals
-  for (int i = 0; i < global_symbols->n_symbols; i++)
-  {
-    if (global_symbols->symbols[i]->type == SYMBOL_FUNCTION)
-      symbol_table_destroy(global_symbols->symbols[i]->function_symtable);
-  }
+  // First destory all local symbol tables, which belong to the functions among the globals
+  for (size_t i = 0; i < global_symbols->n_of_type[SYMBOL_FUNCTION]; i++)
+    symbol_table_destroy(global_symbols->of_type[SYMBOL_FUNCTION][i]->function_symtable);
   // Then destroy the global symbol table
   symbol_table_destroy(global_symbols);
+  global_symbols = NULL;
+  free(undo_log);
+  undo_log = NULL;
+  undo_log_len = undo_log_capacity = 0;
+  free(scopes);
+  scopes = NULL;
+  scopes_len = scopes_capacity = 0;
 }
 
 // Declaration of global string list
-char** string_list;
-size_t string_list_len;
-static size_t string_list_capacity;
+_Thread_local char** string_list;
+_Thread_local size_t string_list_len;
+static _Thread_local size_t string_list_capacity;
+
+// The positions of the strings in the string list, in a hash table using open addressing.
+// The number of buckets is always a power of two, and at most half of them are used.
+// Empty buckets are SIZE_MAX
+static _Thread_local size_t* string_buckets;
+static _Thread_local size_t n_string_buckets;
+
+// The 64-bit FNV-1a hash of the string
+static uint64_t hash_string(const char* string)
+{
+  uint64_t hash = 14695981039346656037u;
+  for (const char* c = string; *c != '\0'; c++)
+  {
+    hash ^= (unsigned char)*c;
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
+
+// Returns the bucket holding the string, or the empty bucket where it belongs
+static size_t find_string_bucket(const char* string)
+{
+  size_t bucket = hash_string(string) & (n_string_buckets - 1);
+  while (string_buckets[bucket] != SIZE_MAX &&
+         strcmp(string_list[string_buckets[bucket]], string) != 0)
+    bucket = (bucket + 1) & (n_string_buckets - 1);
+  return bucket;
+}
+
+// Doubles the number of buckets, and places all strings again
+static void grow_string_buckets(void)
+{
+  free(string_buckets);
+  n_string_buckets = n_string_buckets == 0 ? 64 : n_string_buckets * 2;
+  string_buckets = malloc(n_string_buckets * sizeof(size_t));
+  for (size_t i = 0; i < n_string_buckets; i++)
+    string_buckets[i] = SIZE_MAX;
+  for (size_t i = 0; i < string_list_len; i++)
+    string_buckets[find_string_bucket(string_list[i])] = i;
+}
 
 // Adds the given string to the global string list, resizing if needed.
-// Takes ownership of the string, and returns its position in the string list.
+// Strings that are already in the list are not added again, so every literal with the same
+// text shares one position. Returns its position in the string list.
 static size_t add_string(char* string)
 {
+  if ((string_list_len + 1) * 2 > n_string_buckets)
+    grow_string_buckets();
+  size_t bucket = find_string_bucket(string);
+  if (string_buckets[bucket] != SIZE_MAX)
+    return string_buckets[bucket];
+
   if (string_list_len + 1 >= string_list_capacity)
   {
     string_list_capacity = string_list_capacity * 2 + 8;
     string_list = realloc(string_list, string_list_capacity * sizeof(char*));
   }
   string_list[string_list_len] = string;
+  string_buckets[bucket] = string_list_len;
   return string_list_len++;
 }
 
@@ -292,10 +486,13 @@ static void print_string_list(void)
     printf("%ld: %s\n", i, string_list[i]);
 }
 
-// Frees all strings in the global string list, and the string list itself
+// Frees the global string list. The strings themselves belong to the syntax tree
 static void destroy_string_list(void)
 {
-  for (int i = 0; i < string_list_len; i++)
-    free(string_list[i]);
   free(string_list);
+  string_list = NULL;
+  string_list_len = string_list_capacity = 0;
+  free(string_buckets);
+  string_buckets = NULL;
+  n_string_buckets = 0;
 }
@@ -4,29 +4,21 @@
 #include "symbol_table.h"
 #include <stddef.h>
 
-typedef enum
-{
-  SYMBOL_GLOBAL_VAR,
-  SYMBOL_GLOBAL_ARRAY,
-  SYMBOL_FUNCTION,
-  SYMBOL_PARAMETER,
-  SYMBOL_LOCAL_VAR,
-} symtype_t;
-
 // Use as a normal array, to get the name of a symbol type: SYMBOL_TYPE_NAMES[symbol->type]
 #define SYMBOL_TYPE_NAMES                                  \
   ((const char*[]){[SYMBOL_GLOBAL_VAR] = "GLOBAL_VAR",     \
                    [SYMBOL_GLOBAL_ARRAY] = "GLOBAL_ARRAY", \
                    [SYMBOL_FUNCTION] = "FUNCTION",         \
                    [SYMBOL_PARAMETER] = "PARAMETER",       \
-                   [SYMBOL_LOCAL_VAR] = "LOCAL_VAR"})
+                   [SYMBOL_LOCAL_VAR] = "LOCAL_VAR",       \
+                   [SYMBOL_LOCAL_ARRAY] = "LOCAL_ARRAY"})
 
 // Struct representing the definition of a symbol
 typedef struct symbol
 {
-  char* name;             // Symbol name ( not owned )
+  atom_t name;            // Symbol name, an interned string
   symtype_t type;         // Symbol type
-  node_t* node;           // The AST node that defined this symbol ( not owned )
+  node_id_t node;         // The AST node that defined this symbol
   size_t sequence_number; // Sequence number in the symbol table this symbol belongs to
 
   // Global variables and arrays have function_symtable = NULL
@@ -35,22 +27,41 @@ typedef struct symbol
   struct symbol_table* function_symtable;
 } symbol_t;
 
+// Takes in a symbol of type SYMBOL_FUNCTION, and returns how many parameters the function takes
+#define FUNC_PARAM_COUNT(func) (node_child(node_get((func)->node), 1)->n_children)
+
+// Takes in a symbol of type SYMBOL_GLOBAL_ARRAY or SYMBOL_LOCAL_ARRAY, and returns the node giving
+// its length. Global arrays always have a NUMBER_LITERAL, while the length of a local array can be
+// any expression, which is evaluated when the declaration is reached
+#define ARRAY_LENGTH_NODE(array) (node_child(node_get((array)->node), 1))
+
+// Returns true for local arrays whose length is only known when the declaration is reached
+#define IS_DYNAMIC_ARRAY(array) \
+  ((array)->type == SYMBOL_LOCAL_ARRAY && ARRAY_LENGTH_NODE(array)->type != NUMBER_LITERAL)
+
 // Global symbol table, which contains and owns all global symbols.
 // All function symbols in the global symbol table have pointers to their own local symbol table.
-extern symbol_table_t* global_symbols;
+extern _Thread_local symbol_table_t* global_symbols;
 
-// Global string list, owns all contained strings
-extern char** string_list;
-extern size_t string_list_len;
+// Global string list. The strings are the ones from the syntax tree, and are not owned by the list
+extern _Thread_local char** string_list;
+extern _Thread_local size_t string_list_len;
 
 // Traverses the abstract syntax tree and creates symbol tables, both global and local.
 // Places strings in the string_list, and turns STRING_LITERAL nodes into STRING_LIST_REFERENCEs.
 void create_tables(void);
 
+// Does constant folding, removes unreachable code and creates the symbol tables, all in one
+// traversal of each function. Gives the same result as doing each of them on their own
+void simplify_and_create_tables(void);
+
 // Outputs all global and local symbol tables, and the string list.
 // Lastly outputs the abstract syntax tree with references to symbols
 void print_tables(void);
 
+// Returns how many symbols there are in the global and all local symbol tables
+size_t symbol_count(void);
+
 // Clean up all memory owned by symbol tables
 void destroy_tables(void);
 
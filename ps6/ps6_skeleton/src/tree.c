@@ -1,60 +1,233 @@
 #include "vslc.h"
 
 // Global root for abstract syntax tree
-node_t* root;
+_Thread_local node_id_t root;
 
 // Declarations of helper functions defined further down in this file
-static void node_print(node_t* node, int nesting);
+static void node_print(node_t* node);
 static node_t* constant_fold_subtree(node_t* node);
 static bool remove_unreachable_code(node_t* node);
-static void destroy_subtree(node_t* discard);
+static bool is_statement_list(node_t* node, node_t* parent);
+static void add_final_return(node_id_t function);
+
+// The list of all nodes, and the shared list of child IDs.
+// Both only grow, so nodes that are detached from the tree, and lists of children that have
+// been moved to make room for more children, are left unused until the end
+_Thread_local node_t* syntax_tree_nodes;
+static _Thread_local size_t n_nodes;
+static _Thread_local size_t nodes_capacity;
+
+_Thread_local node_id_t* syntax_tree_child_ids;
+static _Thread_local size_t n_child_ids;
+static _Thread_local size_t child_ids_capacity;
+
+// While removing unreachable code, we keep track of which statements interrupt execution,
+// indexed by node ID. Only statements that have been left by the traversal have a valid entry
+static _Thread_local bool* interrupts;
+static _Thread_local size_t interrupts_len;
+
+// While parsing, the elements of the lists that are not finished yet are kept on a stack, and
+// each LIST node is only created once its list is, with room for exactly its elements.
+// The parser finishes a list before it continues the list around it, so the elements of the
+// list being built are always at the top of the stack
+static _Thread_local node_id_t* list_elements;
+static _Thread_local size_t n_list_elements;
+static _Thread_local size_t list_elements_capacity;
+
+// Strings in the syntax tree are handed out in order from large chunks, called the arena.
+// Allocating is then just moving a pointer forward, and all strings are freed by freeing the
+// chunks
+#define ARENA_CHUNK_SIZE ((size_t)1 << 16)
+
+typedef struct arena_chunk
+{
+  struct arena_chunk* previous; // The chunk that was filled up before this one
+  size_t used;
+  size_t size;
+  _Alignas(max_align_t) char data[];
+} arena_chunk_t;
+
+// The chunk currently being allocated from
+static _Thread_local arena_chunk_t* arena;
+
+// Returns size bytes of uninitialized memory from the arena
+static void* arena_allocate(size_t size)
+{
+  if (arena == NULL || arena->used + size > arena->size)
+  {
+    size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+    arena_chunk_t* chunk = malloc(sizeof(arena_chunk_t) + chunk_size);
+    *chunk = (arena_chunk_t){.previous = arena, .used = 0, .size = chunk_size};
+    arena = chunk;
+  }
+  void* result = &arena->data[arena->used];
+  arena->used += size;
+  return result;
+}
+
+char* node_strdup(const char* string)
+{
+  size_t length = strlen(string);
+  char* copy = arena_allocate(length + 1);
+  memcpy(copy, string, length + 1);
+  return copy;
+}
+
+// Reserves room for count child IDs at the end of the list of child IDs.
+// Returns the index of the first one
+static uint32_t allocate_child_ids(size_t count)
+{
+  if (n_child_ids + count > child_ids_capacity)
+  {
+    while (n_child_ids + count > child_ids_capacity)
+      child_ids_capacity = child_ids_capacity * 2 + 64;
+    syntax_tree_child_ids =
+        realloc(syntax_tree_child_ids, child_ids_capacity * sizeof(node_id_t));
+  }
+  uint32_t first = n_child_ids;
+  n_child_ids += count;
+  return first;
+}
 
 // Initialize a node with the given type and children
-node_t* node_create(node_type_t type, size_t n_children, ...)
+node_id_t node_create(node_type_t type, size_t n_children, ...)
 {
-  node_t* result = malloc(sizeof(node_t));
+  // The first node is never used, so that no node gets the ID 0
+  if (n_nodes == 0)
+    n_nodes = 1;
+
+  if (n_nodes >= nodes_capacity)
+  {
+    nodes_capacity = nodes_capacity * 2 + 64;
+    syntax_tree_nodes = realloc(syntax_tree_nodes, nodes_capacity * sizeof(node_t));
+  }
+  node_id_t id = n_nodes++;
 
   // Initialize every field in the struct
+  node_t* result = &syntax_tree_nodes[id];
   *result = (node_t){
       .type = type,
       .n_children = n_children,
-      .children = malloc(n_children * sizeof(node_t*)),
+      .first_child = allocate_child_ids(n_children),
+      .children_capacity = n_children,
       .symbol = NULL,
   };
 
-  // Read each child node from the va_list
+  // Read the ID of each child node from the va_list
   va_list child_list;
   va_start(child_list, n_children);
   for (size_t i = 0; i < n_children; i++)
   {
-    result->children[i] = va_arg(child_list, node_t*);
+    syntax_tree_child_ids[result->first_child + i] = va_arg(child_list, node_id_t);
   }
   va_end(child_list);
 
-  return result;
+  return id;
 }
 
 // Append an element to the given LIST node, returns the list node
-node_t* append_to_list_node(node_t* list_node, node_t* element)
+node_id_t append_to_list_node(node_id_t list_id, node_id_t element)
 {
+  node_t* list_node = node_get(list_id);
   assert(list_node->type == LIST);
 
-  // Calculate the minimum size of the new allocation
-  size_t min_allocation_size = list_node->n_children + 1;
-
-  // Round up to the next power of two
-  size_t new_allocation_size = 1;
-  while (new_allocation_size < min_allocation_size)
-    new_allocation_size *= 2;
-
-  // Resize the allocation
-  list_node->children = realloc(list_node->children, new_allocation_size * sizeof(node_t*));
+  // When the list is full, it needs to grow. If it is at the end of the child IDs, it grows in
+  // place. Otherwise it is moved to the end, with room for twice as many children.
+  // The old range of child IDs stays unused
+  if (list_node->n_children == list_node->children_capacity)
+  {
+    size_t new_capacity = list_node->children_capacity * 2 + 2;
+    if (list_node->first_child + list_node->children_capacity == n_child_ids)
+      allocate_child_ids(new_capacity - list_node->children_capacity);
+    else
+    {
+      uint32_t first_child = allocate_child_ids(new_capacity);
+      memcpy(&syntax_tree_child_ids[first_child],
+             &syntax_tree_child_ids[list_node->first_child],
+             list_node->n_children * sizeof(node_id_t));
+      list_node->first_child = first_child;
+    }
+    list_node->children_capacity = new_capacity;
+  }
 
   // Insert the new element and increase child count by 1
-  list_node->children[list_node->n_children] = element;
+  syntax_tree_child_ids[list_node->first_child + list_node->n_children] = element;
   list_node->n_children++;
 
-  return list_node;
+  return list_id;
+}
+
+// One node being visited by traverse_syntax_tree()
+typedef struct
+{
+  node_id_t* slot;    // Where the node is stored, so that it can be replaced when leaving it
+  node_t* parent;     // NULL for the root of the traversal
+  size_t next_child;  // How many of the node's children have been visited
+  visit_order_t order;
+} traversal_frame_t;
+
+// Most traversals are shallow, so the stack starts out on the C stack
+#define TRAVERSAL_INITIAL_FRAMES 64
+
+node_t* traverse_syntax_tree(node_t* node, node_enter_t enter, node_leave_t leave, void* context)
+{
+  traversal_frame_t initial_frames[TRAVERSAL_INITIAL_FRAMES];
+  traversal_frame_t* frames = initial_frames;
+  size_t capacity = TRAVERSAL_INITIAL_FRAMES;
+  size_t n_frames = 0;
+
+  node_id_t result = node_id(node);
+  node_id_t* slot = &result;
+  node_t* parent = NULL;
+  while (true)
+  {
+    // Enter the node in slot, and place it on the stack
+    if (n_frames == capacity)
+    {
+      capacity *= 2;
+      if (frames == initial_frames)
+      {
+        frames = malloc(capacity * sizeof(traversal_frame_t));
+        memcpy(frames, initial_frames, sizeof(initial_frames));
+      }
+      else
+        frames = realloc(frames, capacity * sizeof(traversal_frame_t));
+    }
+    visit_order_t order =
+        enter == NULL ? VISIT_CHILDREN : enter(node_get(*slot), parent, context);
+    frames[n_frames++] =
+        (traversal_frame_t){.slot = slot, .parent = parent, .next_child = 0, .order = order};
+
+    // Leave nodes until one of them has a child left to visit, which is entered next
+    slot = NULL;
+    while (n_frames > 0 && slot == NULL)
+    {
+      traversal_frame_t* frame = &frames[n_frames - 1];
+      node_t* current = node_get(*frame->slot);
+      if (current != NULL && frame->order != SKIP_CHILDREN &&
+          frame->next_child < current->n_children)
+      {
+        size_t index = frame->next_child++;
+        if (frame->order == VISIT_CHILDREN_REVERSED)
+          index = current->n_children - 1 - index;
+        slot = &syntax_tree_child_ids[current->first_child + index];
+        parent = current;
+      }
+      else
+      {
+        if (leave != NULL)
+          *frame->slot = node_id(leave(current, frame->parent, context));
+        n_frames--;
+      }
+    }
+
+    if (n_frames == 0)
+      break;
+  }
+
+  if (frames != initial_frames)
+    free(frames);
+  return node_get(result);
 }
 
 // Outputs the entire syntax tree to the terminal
@@ -62,67 +235,140 @@ void print_syntax_tree(void)
 {
   // If the environment variable GRAPHVIZ_OUTPUT is set, print a GraphViz graph in the dot format
   if (getenv("GRAPHVIZ_OUTPUT") != NULL)
-    graphviz_node_print(root);
+    graphviz_node_print(node_get(root));
   else
-    node_print(root, 0);
+    node_print(node_get(root));
 }
 
 // Performs constant folding and removes unconditional conditional branches
 void constant_fold_syntax_tree(void)
 {
-  root = constant_fold_subtree(root);
+  root = node_id(constant_fold_subtree(node_get(root)));
 }
 
 // Removes code that is never reached due to return and break statements.
 // Also ensures execution never reaches the end of a function without reaching a return statement.
 void remove_unreachable_code_syntax_tree(void)
 {
-  for (size_t i = 0; i < root->n_children; i++)
+  for (size_t i = 0; i < node_get(root)->n_children; i++)
   {
-    node_t* child = root->children[i];
+    node_t* child = node_child(node_get(root), i);
     if (child->type != FUNCTION)
       continue;
 
-    node_t* function_body = child->children[2];
+    if (!remove_unreachable_code(node_child(child, 2)))
+      add_final_return(node_id(child));
+  }
+}
 
-    bool has_return = remove_unreachable_code(function_body);
+// Does constant folding on the global declarations, which are not part of any function
+void constant_fold_global_declarations(void)
+{
+  for (size_t i = 0; i < node_get(root)->n_children; i++)
+  {
+    node_t* child = node_child(node_get(root), i);
+    if (child->type == GLOBAL_DECLARATION)
+      constant_fold_subtree(child);
+  }
+}
 
-    // If the function body is not guaranteed to call return, we wrap it in a BLOCK like so:
-    // {
-    //   original_function_body
-    //   return 0
-    // }
-    if (!has_return)
-    {
-      node_t* zero_node = node_create(NUMBER_LITERAL, 0);
-      zero_node->data.number_literal = 0;
-      node_t* return_node = node_create(RETURN_STATEMENT, 1, zero_node);
-      node_t* statement_list = node_create(LIST, 2, function_body, return_node);
-      node_t* new_function_body = node_create(BLOCK, 1, statement_list);
-      child->children[2] = new_function_body;
-    }
+// Counts every node created, except the unused node NO_NODE
+size_t syntax_tree_node_count(void)
+{
+  // The node list starts with the unused node NO_NODE
+  return n_nodes == 0 ? 0 : n_nodes - 1;
+}
+
+node_id_t begin_list(node_id_t first_element)
+{
+  node_id_t start = n_list_elements;
+  push_list_element(first_element);
+  return start;
+}
+
+void push_list_element(node_id_t element)
+{
+  if (n_list_elements == list_elements_capacity)
+  {
+    list_elements_capacity = list_elements_capacity * 2 + 64;
+    list_elements = realloc(list_elements, list_elements_capacity * sizeof(node_id_t));
+  }
+  list_elements[n_list_elements++] = element;
+}
+
+node_id_t finish_list(node_id_t start)
+{
+  assert(start <= n_list_elements);
+  size_t n_elements = n_list_elements - start;
+  node_id_t list = node_create(LIST, 0);
+  uint32_t first_child = allocate_child_ids(n_elements);
+  memcpy(&syntax_tree_child_ids[first_child], &list_elements[start],
+         n_elements * sizeof(node_id_t));
+
+  node_t* list_node = node_get(list);
+  list_node->first_child = first_child;
+  list_node->n_children = list_node->children_capacity = n_elements;
+  n_list_elements = start;
+
+  // The outermost list is the whole program, so the stack is not needed after it
+  if (n_list_elements == 0)
+  {
+    free(list_elements);
+    list_elements = NULL;
+    list_elements_capacity = 0;
   }
+  return list;
 }
 
-// Frees all memory held by the syntax tree
+void allocate_syntax_tree(size_t count, size_t n_children)
+{
+  destroy_syntax_tree();
+  n_nodes = nodes_capacity = count;
+  syntax_tree_nodes = malloc(count * sizeof(node_t));
+  n_child_ids = child_ids_capacity = n_children;
+  syntax_tree_child_ids = malloc(n_children * sizeof(node_id_t));
+}
+
+// Frees all memory held by the syntax tree: the nodes, the child IDs and the arena of strings
 void destroy_syntax_tree(void)
 {
-  destroy_subtree(root);
-  root = NULL;
+  free(syntax_tree_nodes);
+  syntax_tree_nodes = NULL;
+  n_nodes = nodes_capacity = 0;
+  free(syntax_tree_child_ids);
+  syntax_tree_child_ids = NULL;
+  n_child_ids = child_ids_capacity = 0;
+
+  while (arena != NULL)
+  {
+    arena_chunk_t* previous = arena->previous;
+    free(arena);
+    arena = previous;
+  }
+  root = NO_NODE;
+
+  free(interrupts);
+  interrupts = NULL;
+  interrupts_len = 0;
+
+  free(list_elements);
+  list_elements = NULL;
+  n_list_elements = list_elements_capacity = 0;
 }
 
 // The rest of this file contains private helper functions used by the above functions
 
-// Prints out the given node and all its children recursively
-static void node_print(node_t* node, int nesting)
+// Prints out a single node, indented by how deep the node is in the syntax tree
+static visit_order_t print_node_enter(node_t* node, node_t* parent, void* context)
 {
-  // Indent the line based on how deep the node is in the syntax tree
-  printf("%*s", nesting, "");
+  int* nesting = context;
+  printf("%*s", *nesting, "");
+  (*nesting)++;
 
   if (node == NULL)
   {
     printf("(NULL)\n");
-    return;
+    return SKIP_CHILDREN;
   }
 
   printf("%s", NODE_TYPE_NAMES[node->type]);
@@ -157,101 +403,323 @@ static void node_print(node_t* node, int nesting)
 
   putchar('\n');
 
-  // Recursively print children, with some more indentation
-  for (size_t i = 0; i < node->n_children; i++)
-    node_print(node->children[i], nesting + 1);
+  // The children are printed next, with some more indentation
+  return VISIT_CHILDREN;
 }
 
-// Constant folds the given OPERATOR node, if all children are NUMBER_LITERAL
-static node_t* constant_fold_operator(node_t* node)
+static node_t* print_node_leave(node_t* node, node_t* parent, void* context)
 {
-  assert(node->type == OPERATOR);
+  int* nesting = context;
+  (*nesting)--;
+  return node;
+}
 
-  // Check that all operands are NUMBER_LITERALs
-  for (size_t i = 0; i < node->n_children; i++)
-    if (node->children[i]->type != NUMBER_LITERAL)
-      return node;
+// Prints out the given node and all its children
+static void node_print(node_t* node)
+{
+  int nesting = 0;
+  traverse_syntax_tree(node, print_node_enter, print_node_leave, &nesting);
+}
 
-  const char* op = node->data.operator;
+// Turns the node into a NUMBER_LITERAL with the given value, dropping all its children
+static node_t* replace_with_number(node_t* node, int64_t value)
+{
+  node->type = NUMBER_LITERAL;
+  node->data.number_literal = value;
+  node->n_children = 0;
+  return node;
+}
 
-  // This is where we store the result of the constant fold
-  int64_t result;
+// Returns the child at the given index, which takes the place of the node in the tree
+static node_t* replace_with_child(node_t* node, size_t index)
+{
+  return node_child(node, index);
+}
 
-  if (node->n_children == 1)
+// Returns true if the node is a NUMBER_LITERAL with the given value
+static bool is_number(node_t* node, int64_t value)
+{
+  return node->type == NUMBER_LITERAL && node->data.number_literal == value;
+}
+
+// Looks for function calls, stopping the search once one is found
+static visit_order_t find_call_enter(node_t* node, node_t* parent, void* context)
+{
+  bool* found = context;
+  if (node != NULL && node->type == FUNCTION_CALL)
+    *found = true;
+  return *found ? SKIP_CHILDREN : VISIT_CHILDREN;
+}
+
+// Returns true if evaluating the expression can have side effects, which is only the case for
+// function calls. Such expressions must be evaluated even when their value is not needed
+static bool has_side_effects(node_t* node)
+{
+  bool found = false;
+  traverse_syntax_tree(node, find_call_enter, NULL, &found);
+  return found;
+}
+
+// Returns true if the two expressions always give the same value, when evaluated right after
+// one another. Symbols are not bound yet, but identifiers in the same expression share scope
+static bool same_node(node_t* a, node_t* b)
+{
+  if (a->type != b->type || a->n_children != b->n_children)
+    return false;
+
+  switch (a->type)
+  {
+  case NUMBER_LITERAL:
+    return a->data.number_literal == b->data.number_literal;
+  case IDENTIFIER:
+    return a->data.identifier == b->data.identifier;
+  case OPERATOR:
+    return strcmp(a->data.operator, b->data.operator) == 0;
+  case ARRAY_INDEXING:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Compares the two trees node by node. The pairs of nodes left to compare are kept on a stack
+static bool same_expression(node_t* a, node_t* b)
+{
+  size_t capacity = 16;
+  size_t n_pairs = 0;
+  node_t** pairs = malloc(capacity * 2 * sizeof(node_t*));
+  pairs[n_pairs * 2] = a;
+  pairs[n_pairs * 2 + 1] = b;
+  n_pairs++;
+
+  bool same = true;
+  while (same && n_pairs > 0)
+  {
+    n_pairs--;
+    a = pairs[n_pairs * 2];
+    b = pairs[n_pairs * 2 + 1];
+    same = same_node(a, b);
+    if (!same)
+      break;
+
+    if (n_pairs + a->n_children > capacity)
+    {
+      capacity = (n_pairs + a->n_children) * 2;
+      pairs = realloc(pairs, capacity * 2 * sizeof(node_t*));
+    }
+    for (size_t i = 0; i < a->n_children; i++)
+    {
+      pairs[n_pairs * 2] = node_child(a, i);
+      pairs[n_pairs * 2 + 1] = node_child(b, i);
+      n_pairs++;
+    }
+  }
+
+  free(pairs);
+  return same;
+}
+
+// Does the calculation of the operator on constant operands, wrapping around on overflow.
+// Returns false if the result is not known at compile time, such as when dividing by 0
+static bool evaluate_operator(const char* op, size_t n_operands, int64_t lhs, int64_t rhs,
+                              int64_t* result)
+{
+  if (n_operands == 1)
   {
-    int64_t operand = node->children[0]->data.number_literal;
     if (strcmp(op, "-") == 0)
-      result = -operand;
+      *result = (int64_t)(0 - (uint64_t)lhs);
     else if (strcmp(op, "!") == 0)
-      result = !operand;
+      *result = !lhs;
     else
       assert(false && "Unknown unary operator");
+    return true;
   }
-  else if (node->n_children == 2)
-  {
-    int64_t lhs = node->children[0]->data.number_literal;
-    int64_t rhs = node->children[1]->data.number_literal;
-    if (strcmp(op, "==") == 0)
-      result = lhs == rhs;
-    else if (strcmp(op, "!=") == 0)
-      result = lhs != rhs;
-    else if (strcmp(op, "<") == 0)
-      result = lhs < rhs;
-    else if (strcmp(op, "<=") == 0)
-      result = lhs <= rhs;
-    else if (strcmp(op, ">") == 0)
-      result = lhs > rhs;
-    else if (strcmp(op, ">=") == 0)
-      result = lhs >= rhs;
-    else if (strcmp(op, "+") == 0)
-      result = lhs + rhs;
-    else if (strcmp(op, "-") == 0)
-      result = lhs - rhs;
-    else if (strcmp(op, "*") == 0)
-      result = lhs * rhs;
-    else if (strcmp(op, "/") == 0)
-      result = lhs / rhs;
-    else
-      assert(false && "Unknown unary operator");
+
+  if (strcmp(op, "==") == 0)
+    *result = lhs == rhs;
+  else if (strcmp(op, "!=") == 0)
+    *result = lhs != rhs;
+  else if (strcmp(op, "<") == 0)
+    *result = lhs < rhs;
+  else if (strcmp(op, "<=") == 0)
+    *result = lhs <= rhs;
+  else if (strcmp(op, ">") == 0)
+    *result = lhs > rhs;
+  else if (strcmp(op, ">=") == 0)
+    *result = lhs >= rhs;
+  else if (strcmp(op, "+") == 0)
+    *result = (int64_t)((uint64_t)lhs + (uint64_t)rhs);
+  else if (strcmp(op, "-") == 0)
+    *result = (int64_t)((uint64_t)lhs - (uint64_t)rhs);
+  else if (strcmp(op, "*") == 0)
+    *result = (int64_t)((uint64_t)lhs * (uint64_t)rhs);
+  else if (strcmp(op, "/") == 0)
+  {
+    // These divisions crash at runtime, so leave them for the program to do
+    if (rhs == 0 || (lhs == INT64_MIN && rhs == -1))
+      return false;
+    *result = lhs / rhs;
   }
+  else
+    assert(false && "Unknown binary operator");
+  return true;
+}
 
-  // Free all children, turn the node into a NUMBER_LITERAL
-  for (size_t i = 0; i < node->n_children; i++)
-    destroy_subtree(node->children[i]);
+// Turns the binary OPERATOR node into a unary minus of its child at the given index
+static node_t* replace_with_negation(node_t* node, size_t index)
+{
+  node_set_child(node, 0, node_child(node, index));
+  node->n_children = 1;
+  node->data.operator= "-";
+  return node;
+}
+
+// Simplifies an OPERATOR node where some operands are not constant, using algebraic rules:
+//   x + 0, x - 0, x * 1 and x / 1 become x
+//   x * 0 and x - x become 0, and comparing x to itself becomes 0 or 1
+//   0 - x, x * -1 and x / -1 become -x, and -(-x) becomes x
+//   x - c becomes x + (-c), and constants are moved to the right of + and *
+//   (x + c1) + c2 and (x * c1) * c2 combine the constants
+// Operands are only removed if they have no side effects.
+// Strength reduction of multiplication and division happens later, in the optimizer
+static node_t* simplify_operator(node_t* node)
+{
+  const char* op = node->data.operator;
+
+  if (node->n_children == 1)
+  {
+    node_t* operand = node_child(node, 0);
+    if (strcmp(op, "-") == 0 && operand->type == OPERATOR && operand->n_children == 1 &&
+        strcmp(operand->data.operator, "-") == 0)
+      return replace_with_child(operand, 0);
+    return node;
+  }
+
+  // Place constants on the right side of commutative operators.
+  // Constants have no side effects, so the order of evaluation is not changed
+  bool commutative = strcmp(op, "+") == 0 || strcmp(op, "*") == 0;
+  if (commutative && node_child(node, 0)->type == NUMBER_LITERAL)
+  {
+    node_t* swap = node_child(node, 0);
+    node_set_child(node, 0, node_child(node, 1));
+    node_set_child(node, 1, swap);
+  }
+
+  node_t* lhs = node_child(node, 0);
+  node_t* rhs = node_child(node, 1);
+  bool rhs_constant = rhs->type == NUMBER_LITERAL;
+  int64_t constant = rhs_constant ? rhs->data.number_literal : 0;
+
+  if (strcmp(op, "-") == 0)
+  {
+    if (is_number(lhs, 0))
+      return replace_with_negation(node, 1);
+    if (same_expression(lhs, rhs) && !has_side_effects(lhs))
+      return replace_with_number(node, 0);
+    if (!rhs_constant)
+      return node;
+
+    // x - c is the same as x + (-c), with wrap around
+    rhs->data.number_literal = (int64_t)(0 - (uint64_t)constant);
+    node->data.operator= "+";
+    return simplify_operator(node);
+  }
+
+  if (strcmp(op, "+") == 0 && rhs_constant)
+  {
+    if (constant == 0)
+      return replace_with_child(node, 0);
+
+    if (lhs->type == OPERATOR && lhs->n_children == 2 && strcmp(lhs->data.operator, "+") == 0 &&
+        node_child(lhs, 1)->type == NUMBER_LITERAL)
+    {
+      node_child(lhs, 1)->data.number_literal =
+          (int64_t)((uint64_t)node_child(lhs, 1)->data.number_literal + (uint64_t)constant);
+      return simplify_operator(replace_with_child(node, 0));
+    }
+    return node;
+  }
+
+  if (strcmp(op, "*") == 0 && rhs_constant)
+  {
+    if (constant == 1)
+      return replace_with_child(node, 0);
+    if (constant == 0 && !has_side_effects(lhs))
+      return replace_with_number(node, 0);
+    if (constant == -1)
+      return replace_with_negation(node, 0);
+
+    if (lhs->type == OPERATOR && lhs->n_children == 2 && strcmp(lhs->data.operator, "*") == 0 &&
+        node_child(lhs, 1)->type == NUMBER_LITERAL)
+    {
+      node_child(lhs, 1)->data.number_literal =
+          (int64_t)((uint64_t)node_child(lhs, 1)->data.number_literal * (uint64_t)constant);
+      return simplify_operator(replace_with_child(node, 0));
+    }
+    return node;
+  }
+
+  // x / -1 is not -x, since INT64_MIN / -1 crashes the program, like evaluate_operator() leaves
+  // it to do at runtime
+  if (strcmp(op, "/") == 0 && rhs_constant)
+  {
+    if (constant == 1)
+      return replace_with_child(node, 0);
+    return node;
+  }
+
+  // Comparisons of an expression with itself
+  if (same_expression(lhs, rhs) && !has_side_effects(lhs))
+  {
+    if (strcmp(op, "==") == 0 || strcmp(op, "<=") == 0 || strcmp(op, ">=") == 0)
+      return replace_with_number(node, 1);
+    if (strcmp(op, "!=") == 0 || strcmp(op, "<") == 0 || strcmp(op, ">") == 0)
+      return replace_with_number(node, 0);
+  }
 
-  node->type = NUMBER_LITERAL;
-  node->data.number_literal = result;
-  node->n_children = 0;
   return node;
 }
 
+// Constant folds the given OPERATOR node, if all children are NUMBER_LITERAL.
+// Otherwise, the operator is simplified as much as possible
+static node_t* constant_fold_operator(node_t* node)
+{
+  assert(node->type == OPERATOR);
+
+  // Check that all operands are NUMBER_LITERALs
+  for (size_t i = 0; i < node->n_children; i++)
+    if (node_child(node, i)->type != NUMBER_LITERAL)
+      return simplify_operator(node);
+
+  int64_t lhs = node_child(node, 0)->data.number_literal;
+  int64_t rhs = node->n_children == 2 ? node_child(node, 1)->data.number_literal : 0;
+  int64_t result;
+  if (!evaluate_operator(node->data.operator, node->n_children, lhs, rhs, &result))
+    return node;
+
+  // Free all children, turn the node into a NUMBER_LITERAL
+  return replace_with_number(node, result);
+}
+
 // If the condition of the given if node is a NUMBER_LITERAL, the if is replaced by the taken
 // branch. If the if condition is false, and the if has no else-body, NULL is returned.
+// Lists of statements drop such NULLs when they are left, see compact_statement_list()
 static node_t* constant_fold_if(node_t* node)
 {
   assert(node->type == IF_STATEMENT);
 
-  if (node->children[0]->type != NUMBER_LITERAL)
+  if (node_child(node, 0)->type != NUMBER_LITERAL)
     return node;
-  bool condition = node->children[0]->data.number_literal;
+  bool condition = node_child(node, 0)->data.number_literal;
 
-  // Detatch the node we want to return from the IF_STATEMENT-node
+  // The node that takes the place of the IF_STATEMENT-node
   node_t* result = NULL;
 
   if (condition)
-  {
-    result = node->children[1];
-    node->children[1] = NULL;
-  }
+    result = node_child(node, 1);
   else if (node->n_children == 3)
-  {
-    result = node->children[2];
-    node->children[2] = NULL;
-  }
+    result = node_child(node, 2);
   // If condition is false and the if has no else-body, we just let result be NULL
-
-  // Destory everything that is still attached to the IF_STATEMENT-node
-  destroy_subtree(node);
   return result;
 }
 
@@ -262,31 +730,47 @@ static node_t* constant_fold_while(node_t* node)
 {
   assert(node->type == WHILE_STATEMENT);
 
-  if (node->children[0]->type != NUMBER_LITERAL)
+  if (node_child(node, 0)->type != NUMBER_LITERAL)
     return node;
 
-  bool condition = node->children[0]->data.number_literal;
+  bool condition = node_child(node, 0)->data.number_literal;
   if (condition)
     return node;
-
-  destroy_subtree(node);
   return NULL;
 }
 
-// Does constant folding on the subtreee rooted at the given node.
-// Returns the root of the new subtree.
-// Any node that is detached from the tree by this operation must be freed, to avoid memory leaks.
-static node_t* constant_fold_subtree(node_t* node)
+// Moves the statements of the list that are kept to the front of its children, in one sweep.
+// NULLs left by removed statements are dropped, and if interrupted is given, so is everything
+// after the first statement that interrupts execution. Returns true if there is such a statement
+static bool compact_statement_list(node_t* list, bool (*interrupted)(node_t*))
+{
+  node_id_t* children = &syntax_tree_child_ids[list->first_child];
+  size_t n_kept = 0;
+  bool interrupts_list = false;
+  for (size_t i = 0; i < list->n_children && !interrupts_list; i++)
+  {
+    if (children[i] == NO_NODE)
+      continue;
+    children[n_kept++] = children[i];
+    interrupts_list = interrupted != NULL && interrupted(node_get(children[i]));
+  }
+  list->n_children = n_kept;
+  return interrupts_list;
+}
+
+// Does constant folding on a node, once constant folding has been done on all its children.
+// Returns the node taking its place in the tree
+static node_t* constant_fold_leave(node_t* node, node_t* parent, void* context)
 {
   if (node == NULL)
     return node;
 
-  // First do constant folding on all child nodes
-  for (size_t i = 0; i < node->n_children; i++)
-    node->children[i] = constant_fold_subtree(node->children[i]);
-
   switch (node->type)
   {
+  case LIST:
+    if (is_statement_list(node, parent))
+      compact_statement_list(node, NULL);
+    return node;
   case OPERATOR:
     return constant_fold_operator(node);
   case IF_STATEMENT:
@@ -298,108 +782,240 @@ static node_t* constant_fold_subtree(node_t* node)
   }
 }
 
-// Operates on the statement given as node, and any sub-statements it may have.
-// Returns true if execution of the given statement is guaranteed to interrupt execution
-// through either a return statement or a break statement.
-// When node is a BLOCK, any statements that come after such an interrupting statement are removed.
-static bool remove_unreachable_code(node_t* node)
+// Does constant folding on the subtreee rooted at the given node, from the bottom up.
+// Returns the root of the new subtree.
+// Nodes that are detached from the tree by this operation stay in the arena until the end.
+static node_t* constant_fold_subtree(node_t* node)
+{
+  return traverse_syntax_tree(node, NULL, constant_fold_leave, NULL);
+}
+
+// Makes room for an entry for every node that exists
+static void reserve_interrupts(void)
+{
+  if (interrupts_len >= n_nodes)
+    return;
+  interrupts = realloc(interrupts, n_nodes * sizeof(bool));
+  memset(&interrupts[interrupts_len], 0, (n_nodes - interrupts_len) * sizeof(bool));
+  interrupts_len = n_nodes;
+}
+
+static bool statement_interrupts(node_t* node)
+{
+  return node != NULL && interrupts[node_id(node)];
+}
+
+// The list of statements in a BLOCK is always the last child node
+static bool is_statement_list(node_t* node, node_t* parent)
+{
+  return parent != NULL && parent->type == BLOCK &&
+         node == node_child(parent, parent->n_children - 1);
+}
+
+// Only statements that contain other statements need to be looked into
+static visit_order_t unreachable_code_enter(node_t* node, node_t* parent, void* context)
 {
   if (node == NULL)
-    return false;
+    return SKIP_CHILDREN;
 
+  switch (node->type)
+  {
+  case BLOCK:
+  case IF_STATEMENT:
+  case WHILE_STATEMENT:
+    return VISIT_CHILDREN;
+  case LIST:
+    return is_statement_list(node, parent) ? VISIT_CHILDREN : SKIP_CHILDREN;
+  default:
+    return SKIP_CHILDREN;
+  }
+}
+
+// Finds out if the statement interrupts execution, once all its sub-statements are done.
+// When node is a list of statements, any statements that come after an interrupting statement
+// are removed
+static node_t* unreachable_code_leave(node_t* node, node_t* parent, void* context)
+{
+  if (node == NULL)
+    return node;
+
+  bool result = false;
   switch (node->type)
   {
   case RETURN_STATEMENT:
   case BREAK_STATEMENT:
-    return true;
+    result = true;
+    break;
   case IF_STATEMENT:
-  {
-    if (node->n_children == 2)
-    {
-      // If the if only has a then-statement, it can not terminate execution
-      remove_unreachable_code(node->children[1]);
-      return false;
-    }
-    else
-    {
-      // If both the then-statement and the else-statement are interrupted
-      // we know that the if itself is interrupting as well
-      bool then_interrupts = remove_unreachable_code(node->children[1]);
-      bool else_interrupts = remove_unreachable_code(node->children[2]);
-      return then_interrupts && else_interrupts;
-    }
-  }
+    // If the if only has a then-statement, it can not terminate execution.
+    // If both the then-statement and the else-statement are interrupted
+    // we know that the if itself is interrupting as well
+    result = node->n_children == 3 && statement_interrupts(node_child(node, 1)) &&
+             statement_interrupts(node_child(node, 2));
+    break;
   case WHILE_STATEMENT:
-  {
     // Even if the body of the while contains interrupting statements,
     // that is not a guarantee that the code after the while is unreachable.
     // The while may never be entered, for example, or the interrupting statement may be BREAK.
-    remove_unreachable_code(node->children[1]);
-    return false;
-  }
+    result = false;
+    break;
   case BLOCK:
-  {
-    // The list of statements in a BLOCK is always the last child node
-    node_t* statement_list = node->children[node->n_children - 1];
-
-    for (size_t i = 0; i < statement_list->n_children; i++)
-    {
-      node_t* child_statement = statement_list->children[i];
-      bool interrupting = remove_unreachable_code(child_statement);
+    result = statement_interrupts(node_child(node, node->n_children - 1));
+    break;
+  case LIST:
+    if (!is_statement_list(node, parent))
+      break;
+    // If we have an interrupting statement, the rest of the statement list is removed
+    result = compact_statement_list(node, statement_interrupts);
+    break;
+  default:
+    break;
+  }
 
-      // If we have an interrupting statement, the rest of the statement list should be freed
-      if (interrupting)
-      {
+  interrupts[node_id(node)] = result;
+  return node;
+}
 
-        // free all statements that come after i
-        for (size_t j = i + 1; j < statement_list->n_children; j++)
-          destroy_subtree(statement_list->children[j]);
+// Operates on the statement given as node, and any sub-statements it may have.
+// Returns true if execution of the given statement is guaranteed to interrupt execution
+// through either a return statement or a break statement.
+// When node is a BLOCK, any statements that come after such an interrupting statement are removed.
+static bool remove_unreachable_code(node_t* node)
+{
+  reserve_interrupts();
+  traverse_syntax_tree(node, unreachable_code_enter, unreachable_code_leave, NULL);
+  return statement_interrupts(node);
+}
 
-        // Truncate the list of statements
-        statement_list->n_children = i + 1;
-        return true;
-      }
-    }
+// If the function body is not guaranteed to call return, "return 0" is appended to the
+// statements of its BLOCK. A body that is a single statement is wrapped in a BLOCK like so:
+// {
+//   original_function_body
+//   return 0
+// }
+// Creating nodes may move all nodes, so only node IDs are kept while doing so
+static void add_final_return(node_id_t function)
+{
+  node_id_t function_body = syntax_tree_child_ids[node_get(function)->first_child + 2];
+  node_id_t zero_node = node_create(NUMBER_LITERAL, 0);
+  node_get(zero_node)->data.number_literal = 0;
+  node_id_t return_node = node_create(RETURN_STATEMENT, 1, zero_node);
 
-    // If we get here, none of the statements in the block are interrupting.
-    return false;
+  node_t* body = node_get(function_body);
+  if (body != NULL && body->type == BLOCK)
+  {
+    append_to_list_node(syntax_tree_child_ids[body->first_child + body->n_children - 1],
+                        return_node);
+    return;
   }
-  default:
+  node_id_t statement_list = node_create(LIST, 2, function_body, return_node);
+  node_id_t new_function_body = node_create(BLOCK, 1, statement_list);
+  syntax_tree_child_ids[node_get(function)->first_child + 2] = new_function_body;
+}
+
+// When constant folding, removing unreachable code and some other pass are done in the same
+// traversal, the statements in the lists we are currently inside are kept track of, innermost last.
+// Once a statement in a list interrupts execution, the rest of the list is skipped
+typedef struct
+{
+  node_t* list;
+  bool interrupted;
+} statement_list_state_t;
+
+typedef struct
+{
+  node_enter_t enter;
+  node_leave_t leave;
+  void* context;
+
+  statement_list_state_t* lists;
+  size_t n_lists;
+  size_t lists_capacity;
+} simplify_state_t;
+
+// Returns true if the node is never executed, because of the part of the tree that has already
+// been simplified. Such nodes are removed without being looked at:
+//  - Branches of an if that are not taken, when the condition is constant
+//  - The body of a while loop which has 0 as its condition
+//  - Statements after an interrupting statement
+static bool is_removed_statement(node_t* node, node_t* parent, simplify_state_t* state)
+{
+  if (parent == NULL)
     return false;
+
+  node_t* condition = node_child(parent, 0);
+  if (parent->type == IF_STATEMENT && node != condition && condition->type == NUMBER_LITERAL)
+  {
+    size_t taken = condition->data.number_literal ? 1 : 2;
+    return taken >= parent->n_children || node != node_child(parent, taken);
   }
+  if (parent->type == WHILE_STATEMENT && node != condition && is_number(condition, 0))
+    return true;
+
+  return state->n_lists > 0 && state->lists[state->n_lists - 1].list == parent &&
+         state->lists[state->n_lists - 1].interrupted;
 }
 
-// Frees the memory owned by the given node, but does not touch its children
-static void node_finalize(node_t* discard)
+static visit_order_t simplify_enter(node_t* node, node_t* parent, void* context)
 {
-  if (discard == NULL)
-    return;
+  simplify_state_t* state = context;
+  if (is_removed_statement(node, parent, state))
+    return SKIP_CHILDREN;
 
-  // Only free data if the data field is owned by the node
-  switch (discard->type)
+  visit_order_t order = state->enter == NULL ? VISIT_CHILDREN : state->enter(node, parent, state->context);
+  if (node != NULL && node->type == LIST && is_statement_list(node, parent))
   {
-  case IDENTIFIER:
-    free(discard->data.identifier);
-    break;
-  case STRING_LITERAL:
-    free(discard->data.string_literal);
-    break;
-  default:
-    break;
+    if (state->n_lists == state->lists_capacity)
+    {
+      state->lists_capacity = state->lists_capacity * 2 + 8;
+      state->lists = realloc(state->lists, state->lists_capacity * sizeof(statement_list_state_t));
+    }
+    state->lists[state->n_lists++] = (statement_list_state_t){.list = node, .interrupted = false};
   }
-  free(discard->children);
-  free(discard);
+
+  // Constant folding needs to see all children, unless the other pass is sure there is
+  // nothing in them, like in identifiers
+  return order == SKIP_CHILDREN ? SKIP_CHILDREN : VISIT_CHILDREN;
 }
 
-// Recursively frees the memory owned by the given node, and all its children
-static void destroy_subtree(node_t* discard)
+static node_t* simplify_leave(node_t* node, node_t* parent, void* context)
 {
-  if (discard == NULL)
-    return;
+  simplify_state_t* state = context;
+  if (is_removed_statement(node, parent, state))
+    return node;
+
+  if (state->leave != NULL)
+    node = state->leave(node, parent, state->context);
+  if (state->n_lists > 0 && state->lists[state->n_lists - 1].list == node)
+    state->n_lists--;
+
+  node_t* result = constant_fold_leave(node, parent, NULL);
+  unreachable_code_leave(result, parent, NULL);
+  if (state->n_lists > 0 && state->lists[state->n_lists - 1].list == parent &&
+      statement_interrupts(result))
+    state->lists[state->n_lists - 1].interrupted = true;
+  return result;
+}
+
+void simplify_function_body(node_id_t function, node_enter_t enter, node_leave_t leave, void* context)
+{
+  reserve_interrupts();
+  simplify_state_t state = {
+      .enter = enter,
+      .leave = leave,
+      .context = context,
+      .lists = NULL,
+      .n_lists = 0,
+      .lists_capacity = 0,
+  };
+
+  node_t* function_node = node_get(function);
+  node_t* body = traverse_syntax_tree(node_child(function_node, 2), simplify_enter, simplify_leave, &state);
+  node_set_child(function_node, 2, body);
+  free(state.lists);
 
-  for (size_t i = 0; i < discard->n_children; i++)
-    destroy_subtree(discard->children[i]);
-  node_finalize(discard);
+  if (!statement_interrupts(body))
+    add_final_return(function);
 }
 
 // Definition of the global string array NODE_TYPE_NAMES
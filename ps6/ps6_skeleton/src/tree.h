@@ -1,6 +1,7 @@
 #ifndef TREE_H
 #define TREE_H
 
+#include "atoms.h"
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -16,21 +17,30 @@ typedef enum
 // Array containing human-readable names for all node types
 extern const char* NODE_TYPE_NAMES[NODE_TYPE_COUNT];
 
-// This is the tree node structure for the abstract syntax tree
+// Nodes are identified by their position in the list of all nodes, see tree.c.
+// No node has the ID 0, so it is used to mean no node
+typedef uint32_t node_id_t;
+#define NO_NODE ((node_id_t)0)
+
+// This is the tree node structure for the abstract syntax tree.
+// All nodes are stored after each other in one list, and the children of a node are a range
+// of node IDs in another list shared by all nodes. None of them are freed on their own,
+// only all at once by destroy_syntax_tree()
 typedef struct node
 {
-  node_type_t type;
-  struct node** children; // An owned list of pointers to child nodes
-  size_t n_children;      // The length of the list of child nodes
+  uint8_t type;               // The node_type_t of the node, which fits in a byte
+  uint32_t n_children;        // The length of the list of child nodes
+  uint32_t first_child;       // Where the IDs of the child nodes start in syntax_tree_child_ids
+  uint32_t children_capacity; // The number of children there is room for in the list
 
   // At most one of the data fields can be used at once.
   // The node's type decides which field is active, if any
   union
   {
     const char* operator;     // pointer to constant string, such as "+". Not owned
-    char* identifier;         // owned heap allocation. The identifier as a string
+    atom_t identifier;        // The identifier as an interned string, see atoms.h
     int64_t number_literal;   // the literal integer value
-    char* string_literal;     // owned heap allocation. Includes the surrounding "quotation marks"
+    char* string_literal;     // Allocated in the arena. Includes the surrounding "quotation marks"
     size_t string_list_index; // position in global string list
   } data;
 
@@ -39,14 +49,83 @@ typedef struct node
   struct symbol* symbol;
 } node_t;
 
+// All nodes in the syntax tree, indexed by their ID.
+// Creating nodes can move the list, so a node_t pointer is only valid until the next node is
+// created. Nodes are only created while parsing and simplifying the tree, so after that
+// pointers to nodes stay valid. References kept from before then are node IDs
+extern _Thread_local node_t* syntax_tree_nodes;
+
+// The IDs of the children of all nodes, as ranges given by first_child and n_children
+extern _Thread_local node_id_t* syntax_tree_child_ids;
+
+// Returns the node with the given ID, or NULL for NO_NODE
+static inline node_t* node_get(node_id_t id)
+{
+  return id == NO_NODE ? NULL : &syntax_tree_nodes[id];
+}
+
+// Returns the ID of the node, or NO_NODE for NULL
+static inline node_id_t node_id(node_t* node)
+{
+  return node == NULL ? NO_NODE : (node_id_t)(node - syntax_tree_nodes);
+}
+
+// Returns the child at the given index, which may be NULL
+static inline node_t* node_child(node_t* node, size_t index)
+{
+  return node_get(syntax_tree_child_ids[node->first_child + index]);
+}
+
+// Replaces the child at the given index
+static inline void node_set_child(node_t* node, size_t index, node_t* child)
+{
+  syntax_tree_child_ids[node->first_child + index] = node_id(child);
+}
+
 // Global root for parse tree and abstract syntax tree
-extern node_t* root;
+extern _Thread_local node_id_t root;
 
-// The node creation function, used by the parser
-node_t* node_create(node_type_t type, size_t n_children, ...);
+// The node creation function, used by the parser. Takes the IDs of the children
+node_id_t node_create(node_type_t type, size_t n_children, ...);
 
 // Append an element to the given LIST node, returns the list node
-node_t* append_to_list_node(node_t* list_node, node_t* element);
+node_id_t append_to_list_node(node_id_t list_node, node_id_t element);
+
+// Lists are built by the parser without growing a LIST node for every element.
+// begin_list() starts a list with its first element, push_list_element() adds the next element
+// to the list being built, and finish_list() creates the LIST node of all of its elements.
+// The value begin_list() returns, and finish_list() takes, is where the list starts among the
+// elements not in a list yet, not a node ID
+node_id_t begin_list(node_id_t first_element);
+void push_list_element(node_id_t element);
+node_id_t finish_list(node_id_t start);
+
+// Returns a copy of the string allocated in the syntax tree's arena, used by the parser
+char* node_strdup(const char* string);
+
+// Returns how many nodes have been created, including nodes that are no longer in the tree
+size_t syntax_tree_node_count(void);
+
+// How traverse_syntax_tree() continues after entering a node
+typedef enum
+{
+  VISIT_CHILDREN,          // Visit the children from first to last
+  VISIT_CHILDREN_REVERSED, // Visit the children from last to first
+  SKIP_CHILDREN,           // Do not visit the children
+} visit_order_t;
+
+// Called when a node is reached, before any of its children. Decides if its children are visited
+typedef visit_order_t (*node_enter_t)(node_t* node, node_t* parent, void* context);
+
+// Called once all the visited children of the node are done.
+// Returns the node that takes its place in the parent, which is usually the node itself
+typedef node_t* (*node_leave_t)(node_t* node, node_t* parent, void* context);
+
+// Visits all nodes of the subtree depth first, calling enter and leave for every node.
+// Either of them may be NULL, and neither may create nodes. NULL children are passed to them as well, with parent being set.
+// The traversal keeps an explicit stack instead of recursing, so trees of any depth can be visited.
+// Returns the new root of the subtree, as returned by leave
+node_t* traverse_syntax_tree(node_t* node, node_enter_t enter, node_leave_t leave, void* context);
 
 // Outputs the entire syntax tree to the terminal
 void print_syntax_tree(void);
@@ -58,7 +137,21 @@ void constant_fold_syntax_tree(void);
 // Also ensures all functions return
 void remove_unreachable_code_syntax_tree(void);
 
-// Cleans up the entire syntax tree
+// Performs constant folding on the global declarations only
+void constant_fold_global_declarations(void);
+
+// Performs constant folding and removes unreachable code in the body of the function,
+// in a single traversal, and ensures the function returns.
+// The enter and leave functions of another pass are called for all nodes that are kept,
+// as part of the same traversal. Parts of the tree that get removed are never visited by it
+void simplify_function_body(node_id_t function, node_enter_t enter, node_leave_t leave,
+                            void* context);
+
+// Replaces the syntax tree with room for n_nodes nodes, counting NO_NODE, and n_child_ids child IDs,
+// all uninitialized. Used when loading a tree that was saved, see ast_file.c
+void allocate_syntax_tree(size_t n_nodes, size_t n_child_ids);
+
+// Cleans up the entire syntax tree, by freeing the whole arena at once
 void destroy_syntax_tree(void);
 
 // Special function used when syntax trees are output as graphviz graphs.
@@ -1,13 +1,98 @@
+// MAP_ANONYMOUS is not part of POSIX, but is found on all systems we run on
+#define _DEFAULT_SOURCE 1
+
 #include "vslc.h"
 
 #include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 static bool print_full_tree = false;
 static bool print_simplified_tree = false;
 static bool print_symbol_table_contents = false;
+static bool print_intermediate_representation = false;
 static bool print_generated_assembly = false;
+static bool print_pass_times = false;
+static const char* trace_filename = NULL;
+static const char* object_filename = NULL;
+static bool emit_ast = false; // Set by --emit-ast=bin
+
+// Set by --interpret, which runs the program in the bytecode interpreter instead of building the
+// IR and generating code
+static bool interpret_program = false;
+static bool compile_natively = true;
+static bool look_up_cache = false; // Set when -C is given and code is generated
+
+// The arguments given after --run or --interpret, starting with the option itself in place of the
+// program name
+static char** program_arguments = NULL;
+static int n_program_arguments = 0;
+
+// The input files given after the options, if any, and how many of them to compile at once
+static char** input_filenames = NULL;
+static size_t n_input_filenames = 0;
+static size_t n_jobs = 1;
+
+// Optional code generation features, declared in vslc.h
+bool feature_register_variables = false;
+bool feature_ssa = true;
+bool feature_peephole = true;
+bool feature_inline = true;
+bool feature_tail_calls = true;
+bool feature_omit_frame_pointer = true;
+bool feature_print_runtime = false;
+bool feature_fuse_passes = true;
+bool feature_cse = true;
+bool feature_loops = true;
+bool feature_bounds_check = false;
+bool feature_vectorize = true;
+bool feature_avx2 = false;
+bool feature_tiered = false;
+bool feature_dead_stores = true;
+bool feature_profile_generate = false;
+
+// Declared in vslc.h
+const char* profile_use_filename = NULL;
 
-static const char* usage = "Compiler for VSL. The input program is read from stdin."
+// Declared in vslc.h
+size_t codegen_threads = 1;
+
+// The features that can be enabled using -f<feature>
+static const struct
+{
+  const char* name;
+  bool* enabled;
+} features[] = {
+    {"register-variables", &feature_register_variables},
+    {"ssa", &feature_ssa},
+    {"peephole", &feature_peephole},
+    {"inline", &feature_inline},
+    {"tail-calls", &feature_tail_calls},
+    {"omit-frame-pointer", &feature_omit_frame_pointer},
+    {"print-runtime", &feature_print_runtime},
+    {"fuse-passes", &feature_fuse_passes},
+    {"cse", &feature_cse},
+    {"loops", &feature_loops},
+    {"bounds-check", &feature_bounds_check},
+    {"vectorize", &feature_vectorize},
+    {"avx2", &feature_avx2},
+    {"tiered", &feature_tiered},
+    {"dead-stores", &feature_dead_stores},
+    {"profile-generate", &feature_profile_generate},
+};
+
+static const char* usage = "Compiler for VSL. The input program is read from stdin,\n"
+                           "unless input files are given after the options. Each input file\n"
+                           "is then compiled into assembly, written to the file with .vsl\n"
+                           "replaced by .S\n"
                            "\n"
                            "Options:\n"
                            "\t -h \t Output this text and exit\n"
@@ -15,20 +100,157 @@ static const char* usage = "Compiler for VSL. The input program is read from std
                            "\t -T \t Output the abstract syntax tree after constant folding\n"
                            "\t    \t and removing unreachable code\n"
                            "\t -s \t Output the symbol table contents\n"
-                           "\t -c \t Compile and print assembly output\n";
+                           "\t -i \t Output the intermediate representation\n"
+                           "\t -c \t Compile and print assembly output\n"
+                           "\t -o <file> \t Compile into an ELF object file, assembled by the\n"
+                           "\t          \t compiler itself, which can be linked with gcc\n"
+                           "\t --run <args> \t Compile into memory, and run the program with the\n"
+                           "\t             \t remaining arguments. The exit value is printed to\n"
+                           "\t             \t stderr, and is the exit code of the compiler\n"
+                           "\t --interpret <args> \t The same as --run, but runs the program in\n"
+                           "\t                   \t an interpreter, without generating any code\n"
+                           "\t --emit-ast=bin \t Output the syntax tree to stdout in a binary file\n"
+                           "\t               \t once it is simplified and bound, with the symbol\n"
+                           "\t               \t tables. Given such a file as input, vslc loads\n"
+                           "\t               \t the tree from it instead of parsing the program\n"
+                           "\t -P \t Output the time spent in each pass to stderr, with the\n"
+                           "\t    \t number of nodes and symbols and the memory used after it\n"
+                           "\t -J <file> \t Write the same as -P to the file, as Chrome trace events\n"
+                           "\t -j <n> \t Compile up to n input files at once, on separate threads.\n"
+                           "\t       \t When reading from stdin, generate the functions on n threads\n"
+                           "\t -C <dir> \t Keep the assembly of each function in the directory, and\n"
+                           "\t         \t reuse it when the function and the functions, variables\n"
+                           "\t         \t and arrays it uses have not changed since. The functions\n"
+                           "\t         \t are then generated on one thread\n"
+                           "\n"
+                           "Features, enabled with -f<feature> and disabled with -fno-<feature>:\n"
+                           "\t register-variables \t Keep the most used local variables and\n"
+                           "\t                    \t parameters in callee saved registers\n"
+                           "\t ssa                \t Optimize in SSA form, with constant and copy\n"
+                           "\t                    \t propagation and dead code elimination (default)\n"
+                           "\t peephole           \t Rewrite patterns in the emitted assembly\n"
+                           "\t                    \t into fewer instructions (default)\n"
+                           "\t inline             \t Replace calls to small functions with the\n"
+                           "\t                    \t body of the function (default)\n"
+                           "\t tail-calls         \t Turn calls whose result is returned into\n"
+                           "\t                    \t jumps, reusing the stack frame (default)\n"
+                           "\t omit-frame-pointer \t Address the stack through %rsp in functions\n"
+                           "\t                    \t that make no calls, without using %rbp (default)\n"
+                           "\t print-runtime      \t Buffer printed output in a small runtime,\n"
+                           "\t                    \t which is only written out when main returns\n"
+                           "\t                    \t or the buffer is full\n"
+                           "\t fuse-passes        \t Do constant folding, unreachable code removal\n"
+                           "\t                    \t and name binding in one traversal (default)\n"
+                           "\t cse                \t Reuse operators computed earlier, and values\n"
+                           "\t                    \t loaded or stored earlier in a block, with -fssa\n"
+                           "\t                    \t (default)\n"
+                           "\t loops              \t Move invariant code out of loops, and turn\n"
+                           "\t                    \t multiplications of loop counters into\n"
+                           "\t                    \t additions, with -fssa. Test the condition of\n"
+                           "\t                    \t loops at the bottom (default)\n"
+                           "\t bounds-check       \t Exit with an error when an array index is\n"
+                           "\t                    \t out of bounds. Checks that can never fail are\n"
+                           "\t                    \t removed with -fssa, and counted by -P\n"
+                           "\t vectorize          \t Add or subtract the elements of arrays several at\n"
+                           "\t                    \t a time, in loops like a[i] = b[i] + c[i], with\n"
+                           "\t                    \t -fssa (default)\n"
+                           "\t avx2               \t Use 256-bit AVX2 instructions in vectorized\n"
+                           "\t                    \t loops instead of SSE2\n"
+                           "\t tiered             \t With --interpret, compile functions that are\n"
+                           "\t                    \t called often or loop a lot into machine code,\n"
+                           "\t                    \t which runs in place of the interpreter. Bounds\n"
+                           "\t                    \t are then checked like with -fbounds-check\n"
+                           "\t dead-stores        \t Remove assignments to variables that are\n"
+                           "\t                    \t never read before being assigned again, so\n"
+                           "\t                    \t unread variables get no stack slot (default)\n"
+                           "\t profile-generate   \t Count how often every block of the program\n"
+                           "\t                    \t runs, and write the counts to " PROFILE_FILENAME "\n"
+                           "\t                    \t when main returns\n"
+                           "\t profile-use=<file> \t Use the counts written by -fprofile-generate to\n"
+                           "\t                    \t lay out hot paths to fall through, inline hot\n"
+                           "\t                    \t calls, and keep the most used vregs and\n"
+                           "\t                    \t variables in registers\n";
+
+// Enables the feature with the given name, or disables it if the name starts with "no-".
+// Exits if there is no such feature
+static void enable_feature(const char* program, const char* name)
+{
+  bool enable = strncmp(name, "no-", 3) != 0;
+  const char* feature = enable ? name : name + 3;
+  for (size_t i = 0; i < sizeof(features) / sizeof(features[0]); i++)
+  {
+    if (strcmp(features[i].name, feature) == 0)
+    {
+      *features[i].enabled = enable;
+      return;
+    }
+  }
+  fprintf(stderr, "%s: unknown feature '%s'. See -h for help\n", program, name);
+  exit(EXIT_FAILURE);
+}
+
+// When compiling input files, only the assembly is output, so options printing anything else
+// are not allowed. Exits if any of them are given
+static void check_input_files_options(const char* program)
+{
+  if (print_full_tree || print_simplified_tree || print_symbol_table_contents ||
+      print_intermediate_representation || print_pass_times || trace_filename != NULL ||
+      object_filename != NULL || run_in_memory || interpret_program || emit_ast)
+  {
+    fprintf(stderr,
+            "%s: -t, -T, -s, -i, -P, -J, -o, --run, --interpret and --emit-ast can only be used "
+            "when reading from stdin\n",
+            program);
+    exit(EXIT_FAILURE);
+  }
+  print_generated_assembly = true;
+}
 
 // Command line option parsing
 static void options(int argc, char** argv)
 {
-  if (argc == 1)
+  // Everything after --run or --interpret belongs to the program, even arguments looking like
+  // options
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--interpret") == 0)
+    {
+      interpret_program = true;
+      compile_natively = false;
+      program_arguments = &argv[i];
+      n_program_arguments = argc - i;
+      argc = i;
+      break;
+    }
+    if (strcmp(argv[i], "--run") == 0)
+    {
+#ifdef __APPLE__
+      fprintf(stderr, "%s: --run loads ELF code, which macOS can not run\n", argv[0]);
+      exit(EXIT_FAILURE);
+#endif
+      run_in_memory = true;
+      print_generated_assembly = true; // The program is generated into memory instead
+      program_arguments = &argv[i];
+      n_program_arguments = argc - i;
+      argc = i;
+      break;
+    }
+  }
+
+  if (argc == 1 && !run_in_memory && !interpret_program)
   {
     fprintf(stderr, "%s: expected at last one option. See -h for help\n", argv[0]);
     exit(EXIT_FAILURE);
   }
 
+  static const struct option long_options[] = {
+      {"emit-ast", required_argument, NULL, 'A'},
+      {NULL, 0, NULL, 0},
+  };
+
   while (true)
   {
-    switch (getopt(argc, argv, "htTsc"))
+    switch (getopt_long(argc, argv, "htTsicPJ:j:f:o:C:", long_options, NULL))
     {
     default: // Unrecognized option
       fprintf(stderr, "%s: See -h for help\n", argv[0]);
@@ -45,42 +267,602 @@ static void options(int argc, char** argv)
     case 's':
       print_symbol_table_contents = true;
       break;
+    case 'i':
+      print_intermediate_representation = true;
+      break;
     case 'c':
       print_generated_assembly = true;
       break;
+    case 'o':
+#ifdef __APPLE__
+      fprintf(stderr, "%s: -o writes ELF objects, which macOS can not link\n", argv[0]);
+      exit(EXIT_FAILURE);
+#endif
+      if (run_in_memory)
+      {
+        fprintf(stderr, "%s: -o can not be used with --run\n", argv[0]);
+        exit(EXIT_FAILURE);
+      }
+      object_filename = optarg;
+      print_generated_assembly = true; // The object replaces the assembly
+      break;
+    case 'P':
+      print_pass_times = true;
+      break;
+    case 'J':
+      trace_filename = optarg;
+      break;
+    case 'j':
+      n_jobs = strtoul(optarg, NULL, 10);
+      if (n_jobs == 0)
+      {
+        fprintf(stderr, "%s: -j expects a positive number of jobs\n", argv[0]);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'f':
+      if (strncmp(optarg, "profile-use=", strlen("profile-use=")) == 0)
+        profile_use_filename = optarg + strlen("profile-use=");
+      else
+        enable_feature(argv[0], optarg);
+      break;
+    case 'C':
+      cache_directory = optarg;
+      break;
+    case 'A':
+      if (strcmp(optarg, "bin") != 0)
+      {
+        fprintf(stderr, "%s: unknown syntax tree format '%s', expected 'bin'\n", argv[0], optarg);
+        exit(EXIT_FAILURE);
+      }
+      emit_ast = true;
+      compile_natively = false;
+      break;
     case -1:
-      return; // Done parsing options
+      // The interpreter makes no IR or code to print
+      if (interpret_program &&
+          (print_intermediate_representation || print_generated_assembly || object_filename))
+      {
+        fprintf(stderr, "%s: -i, -c and -o can not be used with --interpret\n", argv[0]);
+        exit(EXIT_FAILURE);
+      }
+
+      // The syntax tree is the only output when it is written to stdout
+      if (emit_ast && (print_intermediate_representation || print_generated_assembly ||
+                       object_filename || run_in_memory || interpret_program))
+      {
+        fprintf(stderr, "%s: -i, -c, -o, --run and --interpret can not be used with --emit-ast\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+      }
+
+      if (interpret_program && feature_tiered)
+      {
+#ifdef __APPLE__
+        fprintf(stderr, "%s: -ftiered loads ELF code, which macOS can not run\n", argv[0]);
+        exit(EXIT_FAILURE);
+#endif
+        // The compiled code must behave like the interpreter, which always checks the bounds,
+        // and prints right away
+        feature_bounds_check = true;
+        feature_print_runtime = false;
+      }
+
+      // Done parsing options, the rest are input files
+      input_filenames = &argv[optind];
+      n_input_filenames = argc - optind;
+      if (n_input_filenames > 0)
+        check_input_files_options(argv[0]);
+      else
+        codegen_threads = n_jobs;
+
+      // Without generating code, nothing is stored in the cache, and the IR printed by -i should
+      // include all functions. The profile counters are numbered across all functions, so the
+      // code of one function can not be reused with -fprofile-generate
+      look_up_cache = cache_directory != NULL && compile_natively && print_generated_assembly &&
+                      !print_intermediate_representation && !feature_profile_generate;
+      if (!look_up_cache)
+        cache_directory = NULL;
+      return;
     }
   }
 }
 
-// Entry point
-int main(int argc, char** argv)
+// ===================== Pass manager =====================
+
+// A pass of the compiler. The pass only runs if its enabled flag is set, or if it has none.
+// After running, the output function is called if its output flag is set
+typedef struct
 {
-  options(argc, argv);
+  const char* name;
+  void (*run)(void);
+  bool* enabled;
+  bool* print_output;
+  void (*output)(void);
+} pass_t;
 
-  yyparse();       // Generated from grammar/bison, constructs syntax tree
-  yylex_destroy(); // Free buffers used by flex
+// The file the program is parsed from, or NULL for stdin
+static _Thread_local FILE* input_file;
 
-  // Operations in tree.c
-  if (print_full_tree)
-    print_syntax_tree();
+// An input file mapped into memory, followed by the two zero bytes flex needs at the end
+typedef struct
+{
+  char* text;
+  size_t length;      // The length of the file
+  size_t mapped_size; // The size of the whole mapping, a multiple of the page size
+} mapped_input_t;
 
-  constant_fold_syntax_tree();
-  remove_unreachable_code_syntax_tree();
+// Maps the whole input into memory, so the scanner can read it in place, without copying it
+// into buffers first. Only regular files can be mapped, so pipes give a mapping with no text
+static mapped_input_t map_input(FILE* input)
+{
+  mapped_input_t mapped = {.text = NULL};
+  int fd = fileno(input);
+  struct stat status;
+  if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode) || status.st_size == 0)
+    return mapped;
 
-  if (print_simplified_tree)
-    print_syntax_tree();
+  // The file is mapped over the start of a zeroed mapping that has room for the two zero bytes.
+  // Mapping the file alone would not do, since the bytes after it may be on a page past its end
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  mapped.length = status.st_size;
+  mapped.mapped_size = (mapped.length + 2 + page_size - 1) / page_size * page_size;
+  void* zeroes = mmap(NULL, mapped.mapped_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (zeroes == MAP_FAILED)
+    return (mapped_input_t){.text = NULL};
 
-  // Operations in symbols.c
-  create_tables();
-  if (print_symbol_table_contents)
-    print_tables();
+  // The scanner writes zero bytes into the text while scanning, so the pages are private copies
+  void* text = mmap(zeroes, mapped.length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0);
+  if (text == MAP_FAILED)
+  {
+    munmap(zeroes, mapped.mapped_size);
+    return (mapped_input_t){.text = NULL};
+  }
+  mapped.text = text;
+  return mapped;
+}
 
-  // Operations in generator.c
-  if (print_generated_assembly)
-    generate_program();
+// Reads all of the input into memory, for inputs that can not be mapped
+static char* read_input(FILE* input, size_t* length)
+{
+  size_t capacity = 4096;
+  char* text = malloc(capacity);
+  *length = 0;
+  size_t n;
+  while ((n = fread(text + *length, 1, capacity - *length, input)) > 0)
+  {
+    *length += n;
+    if (*length == capacity)
+    {
+      capacity *= 2;
+      text = realloc(text, capacity);
+    }
+  }
+  return text;
+}
+
+static void parse(void)
+{
+  FILE* input = input_file != NULL ? input_file : stdin;
+  mapped_input_t mapped = map_input(input);
 
+  // Syntax trees saved by --emit-ast=bin are loaded instead of parsed. No program text starts
+  // with the first byte of the file, so a pipe only needs to be read whole if it does
+  if (mapped.text != NULL && is_ast_file(mapped.text, mapped.length))
+  {
+    read_ast_file(mapped.text, mapped.length);
+    munmap(mapped.text, mapped.mapped_size);
+    return;
+  }
+  if (mapped.text == NULL)
+  {
+    int first = getc(input);
+    ungetc(first, input);
+    if (first == (unsigned char)AST_FILE_MAGIC[0])
+    {
+      size_t length;
+      char* data = read_input(input, &length);
+      if (!is_ast_file(data, length))
+      {
+        fprintf(stderr, "error: the input is not a program or a syntax tree file\n");
+        exit(EXIT_FAILURE);
+      }
+      read_ast_file(data, length);
+      free(data);
+      return;
+    }
+  }
+
+  yyscan_t scanner;
+  yylex_init(&scanner);
+  if (mapped.text != NULL)
+    yy_scan_buffer(mapped.text, mapped.length + 2, scanner);
+  else
+    yyset_in(input, scanner);
+
+  yyparse(scanner);       // Generated from grammar/bison, constructs syntax tree
+  yylex_destroy(scanner); // Free buffers used by flex
+
+  // Nothing refers to the text after parsing, as the syntax tree keeps copies of all strings
+  if (mapped.text != NULL)
+    munmap(mapped.text, mapped.mapped_size);
+}
+
+// With VSLC_FAST_EXIT, nothing is freed, as the operating system takes back all memory at exit
+// anyways. Freeing everything is still useful for finding leaks with the address sanitizer
+#ifdef VSLC_FAST_EXIT
+static bool free_memory = false;
+#else
+static bool free_memory = true;
+#endif
+
+static void teardown(void)
+{
+  destroy_ir();          // In ir.c
+  destroy_cache();       // In cache.c
   destroy_tables();      // In symbols.c
   destroy_syntax_tree(); // In tree.c
+  destroy_atoms();       // In atoms.c
+}
+
+enum
+{
+  PASS_PARSE,
+  PASS_CONSTANT_FOLD,
+  PASS_REMOVE_UNREACHABLE_CODE,
+  PASS_CREATE_TABLES,
+  PASS_WRITE_AST,
+  PASS_COMPILE_BYTECODE,
+  PASS_LOOKUP_CACHE,
+  PASS_CREATE_IR,
+  PASS_OPTIMIZE_IR,
+  PASS_GENERATE_PROGRAM,
+  PASS_TEARDOWN,
+  PASS_COUNT
+};
+
+// All passes, in the order they run
+static const pass_t passes[PASS_COUNT] = {
+    // Generated from grammar/bison and flex
+    [PASS_PARSE] = {"parse", parse, NULL, &print_full_tree, print_syntax_tree},
+    // Operations in tree.c
+    [PASS_CONSTANT_FOLD] = {"constant-fold", constant_fold_syntax_tree, NULL, NULL, NULL},
+    [PASS_REMOVE_UNREACHABLE_CODE] = {"remove-unreachable-code",
+                                      remove_unreachable_code_syntax_tree, NULL,
+                                      &print_simplified_tree, print_syntax_tree},
+    // Operations in symbols.c
+    [PASS_CREATE_TABLES] = {"create-tables", create_tables, NULL, &print_symbol_table_contents,
+                            print_tables},
+    // Operations in ast_file.c
+    [PASS_WRITE_AST] = {"write-ast", write_ast_file, &emit_ast, NULL, NULL},
+    // Operations in interpreter.c
+    [PASS_COMPILE_BYTECODE] = {"compile-bytecode", compile_bytecode, &interpret_program, NULL,
+                               NULL},
+    // Operations in cache.c
+    [PASS_LOOKUP_CACHE] = {"lookup-cache", lookup_cache, &look_up_cache, NULL, NULL},
+    // Operations in ir.c and optimize.c
+    [PASS_CREATE_IR] = {"create-ir", create_ir, &compile_natively, NULL, NULL},
+    [PASS_OPTIMIZE_IR] = {"optimize-ir", optimize_ir, &compile_natively,
+                          &print_intermediate_representation, print_ir},
+    // Operations in generator.c
+    [PASS_GENERATE_PROGRAM] = {"generate-program", generate_program, &print_generated_assembly,
+                               NULL, NULL},
+    [PASS_TEARDOWN] = {"teardown", teardown, &free_memory, NULL, NULL},
+};
+
+// Consecutive passes that can be replaced by a single pass doing the same work.
+// This is only done when none of the replaced passes, except the last one, print any output,
+// since the tree is never in the state between them
+static const struct
+{
+  size_t first;
+  size_t n_passes;
+  bool* enabled;
+  pass_t pass;
+} fusions[] = {
+    {PASS_CONSTANT_FOLD, 3, &feature_fuse_passes,
+     {"simplify-and-create-tables", simplify_and_create_tables, NULL,
+      &print_symbol_table_contents, print_tables}},
+};
+
+// The state of the compiler after a pass, as shown by -P and -J
+typedef struct
+{
+  const char* name;
+  double start;           // In seconds since the first pass started
+  double duration;        // In seconds
+  size_t n_nodes;         // Syntax tree nodes created so far
+  size_t n_symbols;       // Symbols in all symbol tables
+  long peak_rss;          // The most memory the process has had resident, in KiB
+  size_t heap_in_use;     // Bytes of the heap handed out by malloc, or 0 if unknown
+} pass_report_t;
+
+static _Thread_local pass_report_t* pass_reports;
+static _Thread_local size_t n_pass_reports;
+static _Thread_local size_t pass_reports_capacity;
+static _Thread_local double first_pass_start;
+
+static double seconds_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static long peak_rss_kib(void)
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss; // Already in KiB on Linux
+}
+
+// The heap statistics are an extension of glibc, so other C libraries report nothing.
+// Large allocations are mapped on their own, and are counted separately by glibc
+static size_t heap_in_use(void)
+{
+#ifdef __GLIBC__
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+// Records how long the pass took, and how much the compiler holds after it
+static void report_pass(const char* name, double start, double end)
+{
+  if (n_pass_reports + 1 >= pass_reports_capacity)
+  {
+    pass_reports_capacity = pass_reports_capacity * 2 + 8;
+    pass_reports = realloc(pass_reports, pass_reports_capacity * sizeof(pass_report_t));
+  }
+
+  pass_report_t* report = &pass_reports[n_pass_reports++];
+  *report = (pass_report_t){.name = name,
+                            .start = start - first_pass_start,
+                            .duration = end - start,
+                            .n_nodes = syntax_tree_node_count(),
+                            .n_symbols = symbol_count(),
+                            .peak_rss = peak_rss_kib(),
+                            .heap_in_use = heap_in_use()};
+
+  if (print_pass_times)
+    fprintf(stderr, "%-28s %10.3f ms %10zu %10zu %10ld KiB %10zu KiB\n", report->name,
+            report->duration * 1e3, report->n_nodes, report->n_symbols, report->peak_rss,
+            report->heap_in_use / 1024);
+}
+
+// Writes the pass reports as trace events, which chrome://tracing and Perfetto can show
+static void write_trace(const char* filename)
+{
+  FILE* file = fopen(filename, "w");
+  if (file == NULL)
+  {
+    fprintf(stderr, "error: could not open '%s' for writing the trace\n", filename);
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(file, "{\"traceEvents\": [\n");
+  for (size_t i = 0; i < n_pass_reports; i++)
+  {
+    pass_report_t* report = &pass_reports[i];
+    fprintf(file,
+            "  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": "
+            "%.3f, \"args\": {\"nodes\": %zu, \"symbols\": %zu, \"peak_rss_kib\": %ld, "
+            "\"heap_in_use_kib\": %zu}}%s\n",
+            report->name, report->start * 1e6, report->duration * 1e6, report->n_nodes,
+            report->n_symbols, report->peak_rss, report->heap_in_use / 1024,
+            i + 1 < n_pass_reports ? "," : "");
+  }
+  fprintf(file, "]}\n");
+  fclose(file);
+}
+
+static void run_pass(const pass_t* pass)
+{
+  if (pass->enabled != NULL && !*pass->enabled)
+    return;
+
+  double start = seconds_now();
+  pass->run();
+  report_pass(pass->name, start, seconds_now());
+
+  if (pass->print_output != NULL && *pass->print_output)
+    pass->output();
+}
+
+// Returns the fusion that can replace the passes starting at the given pass, or NULL
+static const pass_t* find_fusion(size_t first, size_t* n_passes)
+{
+  for (size_t i = 0; i < sizeof(fusions) / sizeof(fusions[0]); i++)
+  {
+    if (fusions[i].first != first || !*fusions[i].enabled)
+      continue;
+
+    bool prints_output = false;
+    for (size_t j = first; j + 1 < first + fusions[i].n_passes; j++)
+      if (passes[j].print_output != NULL && *passes[j].print_output)
+        prints_output = true;
+    if (prints_output)
+      continue;
+
+    *n_passes = fusions[i].n_passes;
+    return &fusions[i].pass;
+  }
+  return NULL;
+}
+
+static void run_passes(void)
+{
+  if (print_pass_times)
+    fprintf(stderr, "%-28s %13s %10s %10s %14s %14s\n", "pass", "time", "nodes", "symbols",
+            "peak RSS", "heap in use");
+
+  first_pass_start = seconds_now();
+  for (size_t i = 0; i < PASS_COUNT;)
+  {
+    // A loaded syntax tree is already simplified and bound, but can still be printed
+    if (i == PASS_CONSTANT_FOLD && syntax_tree_loaded)
+    {
+      if (print_simplified_tree)
+        print_syntax_tree();
+      if (print_symbol_table_contents)
+        print_tables();
+      i = PASS_CREATE_TABLES + 1;
+      continue;
+    }
+
+    size_t n_passes;
+    const pass_t* fused = find_fusion(i, &n_passes);
+    if (fused != NULL)
+    {
+      run_pass(fused);
+      i += n_passes;
+    }
+    else
+    {
+      run_pass(&passes[i]);
+      i++;
+    }
+  }
+
+  if (print_pass_times)
+    fprintf(stderr, "%-28s %10.3f ms\n", "total", (seconds_now() - first_pass_start) * 1e3);
+  if (print_pass_times && feature_bounds_check)
+    fprintf(stderr,
+            "bounds checks: %zu inserted, %zu removed, %zu moved out of loops, %zu left\n",
+            bounds_checks_inserted, bounds_checks_removed, bounds_checks_hoisted,
+            bounds_checks_left);
+  if (print_pass_times && look_up_cache)
+    fprintf(stderr, "cache: %zu functions reused, %zu generated\n", cache_hits, cache_misses);
+  if (trace_filename != NULL)
+    write_trace(trace_filename);
+  free(pass_reports);
+}
+
+// ===================== Compiling input files =====================
+
+// Compiles the input file into assembly, written to the same name with .vsl replaced by .S.
+// Runs on a new thread, so all _Thread_local compiler state starts out fresh
+static void* compile_file(void* argument)
+{
+  const char* filename = argument;
+  input_file = fopen(filename, "r");
+  if (input_file == NULL)
+  {
+    fprintf(stderr, "error: could not open '%s'\n", filename);
+    exit(EXIT_FAILURE);
+  }
+
+  size_t length = strlen(filename);
+  if (length > 4 && strcmp(&filename[length - 4], ".vsl") == 0)
+    length -= 4;
+  char* output_filename = malloc(length + 3);
+  memcpy(output_filename, filename, length);
+  strcpy(&output_filename[length], ".S");
+
+  assembly_output = fopen(output_filename, "w");
+  if (assembly_output == NULL)
+  {
+    fprintf(stderr, "error: could not open '%s' for writing\n", output_filename);
+    exit(EXIT_FAILURE);
+  }
+
+  run_passes();
+
+  fclose(assembly_output);
+  fclose(input_file);
+  free(output_filename);
+  return NULL;
+}
+
+// The next input file that no job has started compiling
+static atomic_size_t next_input_file;
+
+// One of the n_jobs jobs, which compiles input files until none are left
+static void* compile_files_job(void* argument)
+{
+  (void)argument;
+  while (true)
+  {
+    size_t index = atomic_fetch_add(&next_input_file, 1);
+    if (index >= n_input_filenames)
+      return NULL;
+
+    // Every file gets a thread of its own, instead of resetting the state left by the last one
+    pthread_t thread;
+    pthread_create(&thread, NULL, compile_file, input_filenames[index]);
+    pthread_join(thread, NULL);
+  }
+}
+
+static void compile_files(void)
+{
+  // The compiler state of each file is lost when its thread exits, so it must be freed
+  free_memory = true;
+
+  size_t n_threads = n_jobs < n_input_filenames ? n_jobs : n_input_filenames;
+  pthread_t* jobs = malloc(n_threads * sizeof(pthread_t));
+  for (size_t i = 0; i < n_threads; i++)
+    pthread_create(&jobs[i], NULL, compile_files_job, NULL);
+  for (size_t i = 0; i < n_threads; i++)
+    pthread_join(jobs[i], NULL);
+  free(jobs);
+}
+
+// Compiles stdin into the object file given by -o
+static void compile_object(void)
+{
+  object_output = fopen(object_filename, "wb");
+  if (object_output == NULL)
+  {
+    fprintf(stderr, "error: could not open '%s' for writing\n", object_filename);
+    exit(EXIT_FAILURE);
+  }
+  run_passes();
+  fclose(object_output);
+  object_output = NULL;
+}
+
+// Compiles stdin into memory, and runs it with the arguments after --run
+static int compile_and_run(void)
+{
+  run_passes();
+  int status = run_loaded_program(n_program_arguments, program_arguments);
+  fprintf(stderr, "exit value: %d\n", status);
+  return status;
+}
+
+// Compiles stdin into bytecode, and interprets it with the arguments after --interpret
+static int interpret(void)
+{
+  // With -ftiered, functions are compiled from the syntax tree and the symbol tables while the
+  // program runs, so they are only freed afterwards
+  bool teardown_after_running = free_memory && feature_tiered;
+  if (feature_tiered)
+    free_memory = false;
+
+  run_passes();
+  int status = run_bytecode(n_program_arguments, program_arguments);
+  if (teardown_after_running)
+    teardown();
+  fprintf(stderr, "exit value: %d\n", status);
+  return status;
+}
+
+// Entry point
+int main(int argc, char** argv)
+{
+  options(argc, argv);
+  if (n_input_filenames > 0)
+    compile_files();
+  else if (object_filename != NULL)
+    compile_object();
+  else if (run_in_memory)
+    return compile_and_run();
+  else if (interpret_program)
+    return interpret();
+  else
+    run_passes();
 }
@@ -8,19 +8,121 @@
 #include <stdlib.h>
 #include <string.h>
 
+// All state of a compilation, such as the syntax tree and the symbol tables, is kept in
+// _Thread_local variables. Each thread can then compile a program of its own, see vslc.c
+
+// Interned strings, used for all identifiers
+#include "atoms.h"
+
 // Definition of the tree node type, and functions for handling the parse tree
 #include "tree.h"
 
 // Definition of the symbol table, and functions for building it
 #include "symbols.h"
 
-// Function for generating machine code, in generator.c
+// Definition of the intermediate representation, and functions for building it
+#include "ir.h"
+
+// Optional code generation features, enabled from the command line with -f<feature>.
+// Defined in vslc.c
+extern bool feature_register_variables; // -fregister-variables
+extern bool feature_ssa;                // -fssa, enabled by default
+extern bool feature_peephole;           // -fpeephole, enabled by default
+extern bool feature_inline;             // -finline, enabled by default
+extern bool feature_tail_calls;         // -ftail-calls, enabled by default
+extern bool feature_omit_frame_pointer; // -fomit-frame-pointer, enabled by default
+extern bool feature_print_runtime;      // -fprint-runtime
+extern bool feature_fuse_passes;        // -ffuse-passes, enabled by default
+extern bool feature_cse;                // -fcse, enabled by default
+extern bool feature_loops;              // -floops, enabled by default
+extern bool feature_bounds_check;       // -fbounds-check
+extern bool feature_vectorize;          // -fvectorize, enabled by default
+extern bool feature_avx2;               // -favx2
+extern bool feature_tiered;             // -ftiered
+extern bool feature_dead_stores;        // -fdead-stores, enabled by default
+extern bool feature_profile_generate;   // -fprofile-generate
+
+// The profile given by -fprofile-use=<file>, or NULL. Defined in vslc.c
+extern const char* profile_use_filename;
+
+// Function for generating machine code from the IR, in generator.c
 void generate_program(void);
 
+// Generates and assembles the code of one function on its own, for -ftiered. In generator.c
+void generate_single_function(ir_function_t* function);
+
+// How many threads generate_program() generates functions on. Set by -j, defined in vslc.c
+extern size_t codegen_threads;
+
+// The file generate_program() writes the assembly to, or NULL for stdout. Defined in peephole.c
+extern _Thread_local FILE* assembly_output;
+
+// The file generate_program() writes an ELF relocatable object to instead of assembly, or NULL.
+// Set by -o, defined in assembler.c
+extern _Thread_local FILE* object_output;
+
+// Set by --run. generate_program() then loads the program into the memory of the compiler, and
+// run_loaded_program() runs its main function, returning the exit value. Defined in assembler.c
+extern bool run_in_memory;
+int run_loaded_program(int argc, char** argv);
+
+// Decodes a string literal in quotes, as found in string_list, with the escapes of the GNU
+// assembler. Returns a new string ending in a zero byte, and stores its length. In assembler.c
+char* decode_string_literal(const char* literal, size_t* length);
+
+// Used by --interpret instead of generating code. compile_bytecode() compiles the functions from
+// the bound syntax tree, and run_bytecode() runs the first one, returning the exit value and
+// freeing the bytecode. In interpreter.c
+void compile_bytecode(void);
+int run_bytecode(int argc, char** argv);
+
+// The simplified and bound syntax tree can be saved to a binary file with --emit-ast=bin, together
+// with the symbol tables and the string list. write_ast_file() writes it to stdout. When the input
+// is such a file, starting with AST_FILE_MAGIC, read_ast_file() loads it in place of parsing, and
+// sets syntax_tree_loaded, so the passes simplifying and binding the tree are skipped. Files whose
+// tree could not have been written by vslc are rejected with an error. In ast_file.c
+#define AST_FILE_MAGIC "\177VSLAST"
+void write_ast_file(void);
+bool is_ast_file(const char* data, size_t length);
+void read_ast_file(const char* data, size_t length);
+extern _Thread_local bool syntax_tree_loaded;
+
+// Set by -C. The assembly of each function is then kept in files in this directory, and reused
+// by later compilations of the same function. Defined in cache.c
+extern const char* cache_directory;
+
+// Hashes every function, and reads the cached assembly of those found in cache_directory.
+// Functions found in the cache are neither optimized nor generated, but have their assembly,
+// and the format strings it uses, returned by cached_assembly(). The format strings are
+// referred to as format0, format1 and so on in the assembly, in the order of the list.
+// Functions that are generated have their assembly given to store_in_cache() afterwards, in
+// the same form. In cache.c
+void lookup_cache(void);
+bool is_function_cached(symbol_t* function);
+const char* cached_assembly(symbol_t* function, char*** formats, size_t* n_formats);
+void store_in_cache(symbol_t* function, const char* assembly, char* const* formats,
+                    size_t n_formats);
+void destroy_cache(void);
+
+// How many functions lookup_cache() found in the cache, and how many it did not, shown by -P
+extern _Thread_local size_t cache_hits;
+extern _Thread_local size_t cache_misses;
+
+// The state of a scanner generated by flex, which the parser reads tokens from
+typedef void* yyscan_t;
+
 // The main driver function of the parser generated by bison
-int yyparse();
+int yyparse(yyscan_t scanner);
+
+// Functions for creating a scanner reading from the given file or from a buffer ending in two zero
+// bytes, and getting the last lexeme. Generated by flex
+int yylex_init(yyscan_t* scanner);
+void yyset_in(FILE* input, yyscan_t scanner);
+struct yy_buffer_state* yy_scan_buffer(char* base, size_t size, yyscan_t scanner);
+char* yyget_text(yyscan_t scanner);
+int yyget_lineno(yyscan_t scanner);
 
 // A "hidden" cleanup function in flex
-int yylex_destroy();
+int yylex_destroy(yyscan_t scanner);
 
 #endif // VSLC_H
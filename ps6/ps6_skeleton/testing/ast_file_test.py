@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+
+# Checks that vslc rejects syntax tree files that were corrupted after --emit-ast=bin wrote them,
+# instead of crashing or hanging on them.
+# The program in ast_file_test.vsl is written as a syntax tree file, which must compile to the
+# same assembly as the program does. Then every byte of the file is changed in a few ways, one
+# at a time, and each such file is compiled with -c. The compiler must either compile it, or
+# exit with an error message. Changing the first byte makes the file parsed as a program
+#
+# Usage: ast_file_test.py <path to vslc>
+
+import concurrent.futures
+import os
+import pathlib
+import subprocess
+import sys
+
+TIMEOUT = 10
+
+# What each byte is XOR-ed with, to make the corrupted files
+CORRUPTIONS = [0x01, 0x80, 0xFF]
+
+
+def compile_file(vslc: pathlib.Path, data: bytes) -> subprocess.CompletedProcess:
+    return subprocess.run(
+        [vslc, "-c"],
+        input=data,
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        timeout=TIMEOUT,
+    )
+
+
+def check_corruption(vslc: pathlib.Path, tree: bytes, offset: int, mask: int) -> str | None:
+    """Returns what went wrong when compiling the corrupted file, or None when nothing did"""
+    corrupted = bytearray(tree)
+    corrupted[offset] ^= mask
+    try:
+        result = compile_file(vslc, bytes(corrupted))
+    except subprocess.TimeoutExpired:
+        return f"byte {offset} ^ {mask:#04x}: timed out after {TIMEOUT} seconds"
+    if result.returncode < 0:
+        return f"byte {offset} ^ {mask:#04x}: killed by signal {-result.returncode}"
+    if result.returncode != 0 and not result.stderr:
+        return f"byte {offset} ^ {mask:#04x}: exited with {result.returncode} without a message"
+    return None
+
+
+def main():
+    if len(sys.argv) != 2:
+        print(f"Usage: {sys.argv[0]} <path to vslc>", file=sys.stderr)
+        sys.exit(1)
+    vslc = pathlib.Path(sys.argv[1]).resolve()
+    program = (pathlib.Path(__file__).parent / "ast_file_test.vsl").read_bytes()
+
+    tree = subprocess.run(
+        [vslc, "--emit-ast=bin"], input=program, stdout=subprocess.PIPE, check=True
+    ).stdout
+    expected = subprocess.run(
+        [vslc, "-c"], input=program, stdout=subprocess.PIPE, check=True
+    ).stdout
+    loaded = compile_file(vslc, tree)
+    if loaded.returncode != 0 or loaded.stdout != expected:
+        print("The syntax tree file does not compile to the same assembly as the program")
+        print(loaded.stderr.decode(errors="replace"))
+        sys.exit(1)
+
+    print(f"Compiling {len(tree) * len(CORRUPTIONS)} corrupted syntax tree files...")
+    with concurrent.futures.ThreadPoolExecutor(max_workers=os.cpu_count()) as pool:
+        futures = [
+            pool.submit(check_corruption, vslc, tree, offset, mask)
+            for offset in range(len(tree))
+            for mask in CORRUPTIONS
+        ]
+        failures = [failure for future in futures if (failure := future.result()) is not None]
+
+    for failure in failures:
+        print(failure)
+    print(f"{len(futures) - len(failures)}/{len(futures)} corrupted files handled")
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()